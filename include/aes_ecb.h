@@ -0,0 +1,21 @@
+/*
+	Bulk AES-128-ECB decryption on top of OpenSSL EVP
+*/
+#ifndef __AES_ECB_H
+#define __AES_ECB_H
+#include <stddef.h>
+
+#define AES_ECB_KEY_SIZE 16
+#define AES_ECB_BLOCK_SIZE 16
+
+/* Buffers at least twice this big are split across threads */
+#define AES_ECB_SPLIT_SIZE (4 * 1024 * 1024)
+
+struct aes_ecb;
+
+struct aes_ecb *aes_ecb_new(const unsigned char *key);
+int aes_ecb_set_key(struct aes_ecb *aes, const unsigned char *key);
+void aes_ecb_decrypt(struct aes_ecb *aes, const unsigned char *src, size_t len, unsigned char *dst);
+void aes_ecb_free(struct aes_ecb *aes);
+
+#endif
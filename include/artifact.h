@@ -0,0 +1,24 @@
+/*
+	Files handed from one extraction stage to the next
+	They stay in memory (memfd) unless --keep-intermediates is given, or
+	too many of them wait for a thread
+*/
+#ifndef __ARTIFACT_H
+#define __ARTIFACT_H
+#include "config.h"
+
+struct artifact {
+	char *path; // to write and open it: the file itself, or /proc/self/fd/N for a memfd
+	char *name; // the file it is, or would be, on disk
+	int fd; // the memfd, -1 for a file on disk
+	size_t held; // bytes counted against the memory budget while it waits on the pool
+	int spilled; // on disk only for lack of memory, removed once extracted
+};
+
+struct artifact *artifact_new(const char *name, struct config_opts_t *config_opts);
+struct artifact *artifact_file(const char *name);
+int artifact_save(struct artifact *artifact);
+void artifact_hold(struct artifact *artifact);
+void artifact_free(struct artifact *artifact);
+
+#endif
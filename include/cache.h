@@ -0,0 +1,17 @@
+/*
+	--cache: content-addressed store of extracted trees, so that the PAKs
+	and images already seen in an earlier firmware are linked, not extracted again
+*/
+#ifndef __CACHE_H
+#define __CACHE_H
+#include "mfile.h"
+#include "config.h"
+
+char *cache_key(MFILE *mf, const char *file_name, struct config_opts_t *config_opts);
+int cache_restore(const char *cache_dir, const char *key, const char *dest_dir);
+char *cache_stage(const char *cache_dir);
+int cache_commit(const char *cache_dir, const char *staging, const char *key);
+void cache_discard(const char *staging);
+int cache_unstage(const char *staging, const char *dest_dir);
+
+#endif
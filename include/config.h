@@ -8,9 +8,21 @@
 #ifndef CONFIG_H_
 #    define CONFIG_H_
 
+#    include <stddef.h>
+
 struct config_opts_t {
 	char *config_dir;
 	char *dest_dir;
+	size_t mmap_window; // EPK input is mapped this many bytes at a time, 0 = whole file
+	struct verify_job *verify; // --verify: PAKs go to the in-memory checks instead of disk
+	const char *pak_only; // --only: comma separated PAK names to extract, NULL for all
+	const char *pak_skip; // --skip: comma separated PAK names to leave out
+	const char *extract_path; // --extract: glob of the files to write, relative to the current layer, NULL for all
+	int keep_intermediates; // --keep-intermediates: the PAKs and decompressed files are written even if extracted further
+	const char *cache_dir; // --cache: trees extracted from nested files are kept here, by content, and linked when seen again
+	int in_place; // nested files are handled right away, not on the pool (a cache entry is being filled)
+	int *failed; // also set when a part of the extraction fails, to tell a cache entry from the rest of the job
+	struct epk2extract_job *job; // the epk2extract_file() call this file is part of, set by the library
 };
 
 #    define G_DIR_SEPARATOR_S "/"
@@ -1,6 +1,8 @@
 #ifndef __CRAMFS_H
 #define __CRAMFS_H
 
+#include "mfile.h"
+
 #define CRAMFS_MAGIC		0x28cd3d45
 										/* some random number */
 #define CRAMFS_SIGNATURE	"Compressed ROMFS"
@@ -55,7 +57,8 @@ int cramfs_uncompress_block(void *dst, int dstlen, void *src, int srclen);
 int cramfs_uncompress_init(void);
 int cramfs_uncompress_exit(void);
 
+int is_cramfs_image_mem(MFILE *file, char *endian);
 int is_cramfs_image(char const *imagefile, char *endian);
-int uncramfs(char const *dirname, char const *imagefile);
+int uncramfs(char const *dirname, char const *imagefile, const char *extract);
 
 #endif
@@ -10,6 +10,7 @@
 
 #    include <stdint.h>
 #    include <sys/stat.h>
+#    include "mfile.h"
 #    include <sys/types.h>
 #    include <stdio.h>
 #    include <epk.h>
@@ -54,6 +55,7 @@ struct pakHeader_t {
 };
 
 void extract_epk1_file(const char *epk_file, struct config_opts_t *config_opts);
+int isFileEPK1_mem(MFILE *file);
 int isFileEPK1(const char *epk_file);
 
 #endif /* EPK1_H_ */
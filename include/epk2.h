@@ -10,11 +10,14 @@
 
 #    include <stdint.h>
 #    include <sys/stat.h>
+#    include "mfile.h"
 #    include <sys/types.h>
 #    include <openssl/evp.h>
 #    include <openssl/pem.h>
 #    include <openssl/err.h>
 #    include <openssl/aes.h>
+#    include <openssl/rsa.h>
+#    include <openssl/sha.h>
 #    include "epk.h"
 #    include <stdbool.h>
 
@@ -99,10 +102,13 @@ struct pak2segmentHeader_t {
 
 /* main segment header */
 struct pak2segment_t {
-	struct pak2segmentHeader_t *header;
+	struct pak2segmentHeader_t *header; // in the current window of the input, see pak2_map
 	unsigned char *content;
-	int content_file_offset;
-	int content_len;
+	off_t header_file_offset;
+	off_t content_file_offset;
+	size_t content_len;
+	unsigned int signed_length;
+	int verified; // 0 = pending, 1 = verified, -1 = failed
 };
 
 /* main package header */
@@ -110,11 +116,16 @@ struct pak2_t {
 	struct pak2header_t *header;
 	unsigned int segment_count;
 	struct pak2segment_t **segments;
+	int selected; // by --only/--skip, the segments of other PAKs are never read
 };
 
 void extractEPK2file(const char *epk_file, struct config_opts_t *config_opts);
 void extractEPK3file(const char *epk_file, struct config_opts_t *config_opts);
+int extractEPKstream(const char *epk_file, struct config_opts_t *config_opts);
+unsigned int API_SWU_VerifyImagePrefix(EVP_PKEY *key, unsigned char *image, unsigned int minSize, unsigned int maxSize, unsigned int nthreads);
+int isFileEPK2_mem(MFILE *file);
 int isFileEPK2(const char *epk_file);
+int isFileEPK3_mem(MFILE *file);
 int isFileEPK3(const char *epk_file);
 
 #endif /* EPK2_H_ */
@@ -0,0 +1,51 @@
+/*
+	libepk2extract: extraction of a firmware file and everything nested in it,
+	in-process. The epk2extract command line tool is a client of it
+*/
+#ifndef __EPK2EXTRACT_H
+#define __EPK2EXTRACT_H
+#include "config.h"
+
+/* epk2extract_file() results, also the exit codes of --batch */
+enum epk2extract_status {
+	EPK2EXTRACT_OK = 0,
+	EPK2EXTRACT_FAILED, // an extractor gave up (bad signature, missing key, corrupt data, I/O error)
+	EPK2EXTRACT_UNSUPPORTED // the input is in no known format
+};
+
+/* A file was extracted as format, or written as a result of its own (format NULL) */
+typedef void (*epk2extract_artifact_cb)(void *user, const char *name, const char *format);
+/* The PAK name, done-th of the total PAKs of a firmware file (0 if not known yet), was extracted */
+typedef void (*epk2extract_progress_cb)(void *user, const char *name, unsigned int done, unsigned int total);
+/* A file queued with epk2extract_submit() was extracted (or checked), status is what epk2extract_file() returned */
+typedef void (*epk2extract_done_cb)(void *arg, const char *file, int status);
+
+struct epk2extract_settings {
+	unsigned int jobs; // threads shared by the calls, for the nested files and the submitted inputs, 0 or 1 to handle them in place
+	unsigned int verify_threads; // > 0 to only check the input (--verify), on that many threads
+	/* called from the extracting threads, may be NULL */
+	epk2extract_artifact_cb artifact;
+	epk2extract_progress_cb progress;
+	void *user;
+};
+
+struct epk2extract;
+
+/*
+ * config_opts is copied. Without a dest_dir, the files go next to each input
+ * A context can extract several files at once, from different threads
+ */
+struct epk2extract *epk2extract_new(const struct config_opts_t *config_opts, const struct epk2extract_settings *settings);
+int epk2extract_file(struct epk2extract *ctx, const char *file);
+/*
+ * Extracts a file on the context's threads, then calls done from there (or
+ * in place, without them). At most jobs files are extracted at once, until
+ * one of them is done this waits. Not to be called from done
+ */
+void epk2extract_submit(struct epk2extract *ctx, const char *file, epk2extract_done_cb done, void *arg);
+/* Waits until the files submitted so far are done */
+void epk2extract_wait(struct epk2extract *ctx);
+const char *epk2extract_strerror(int status);
+void epk2extract_free(struct epk2extract *ctx);
+
+#endif
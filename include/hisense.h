@@ -29,7 +29,9 @@ struct hipkg_pad {
 	uint8_t padding[28];
 };
 
+int is_hisense_mem(MFILE *mf);
 MFILE *is_hisense(const char *pkgfile);
+int is_ext4_lzhs_mem(MFILE *mf);
 MFILE *is_ext4_lzhs(const char *pkg);
 void extract_hisense(MFILE *pkg, struct config_opts_t *config_opts);
 void extract_ext4_lzhs(MFILE *mf, const char *dest_file);
@@ -208,7 +208,7 @@ enum {
 extern "C" {
 #endif
 
-int jffs2extract(char *infile, char *outdir, char *inendian);
+int jffs2extract(char *infile, char *outdir, char *inendian, const char *pattern);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,53 @@
+/*
+	Key ring: the PEM and AES keys of config_dir, loaded once per process,
+	plus an on-disk cache of which key worked for which firmware
+*/
+#ifndef __KEYRING_H
+#define __KEYRING_H
+#include <pthread.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+#define KEYRING_AES_KEY_SIZE 16
+#define KEYRING_CACHE_FILE "key_cache.txt"
+
+enum keyring_type {
+	KEYRING_PEM = 0,
+	KEYRING_AES
+};
+
+struct keyring_pem {
+	char *name; // file name in config_dir
+	EVP_PKEY *key;
+};
+
+struct keyring_aes {
+	unsigned char key[KEYRING_AES_KEY_SIZE];
+	char *label; // the AES.key line, comment included
+};
+
+/* fingerprint -> key that worked for it */
+struct keyring_hit {
+	enum keyring_type type;
+	char *fingerprint;
+	unsigned int index;
+};
+
+struct keyring {
+	char *config_dir;
+	struct keyring_pem *pems;
+	unsigned int npems;
+	struct keyring_aes *aes;
+	unsigned int naes;
+
+	struct keyring_hit *hits; // most recent last
+	unsigned int nhits;
+	off_t cache_read; // bytes of the cache file loaded, what follows was appended since
+	pthread_mutex_t lock;
+};
+
+struct keyring *keyring_get(const char *config_dir);
+unsigned int keyring_order(struct keyring *kr, enum keyring_type type, const char **fingerprints, unsigned int nfingerprints, unsigned int *order);
+void keyring_hit(struct keyring *kr, enum keyring_type type, const char **fingerprints, unsigned int nfingerprints, unsigned int index);
+
+#endif
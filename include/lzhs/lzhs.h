@@ -16,25 +16,67 @@ struct lzhs_header {
 #define F             34
 #define THRESHOLD     2
 
+/* for the hash chain match finder */
+#define LZHS_HASH_BITS 15
+#define LZHS_HASH_SIZE (1 << LZHS_HASH_BITS)
+
+/* encoder levels, 0 selects the original binary tree encoder */
+#define LZHS_LEVEL_MIN 1
+#define LZHS_LEVEL_MAX 9
+#define LZHS_LEVEL_DEFAULT 6
+
+/* worst case size of an encoded file (every byte a 13 bit literal, plus padding) */
+#define LZHS_ENCODE_BOUND(size) (sizeof(struct lzhs_header) + ((size_t)(size) + 8) * 2 + 16)
+
+/* chunked ext4 images (see extract_ext4_lzhs) */
+#define LZHS_EXT4_CHUNK_DEFAULT 0x100000
+#define LZHS_EXT4_MAX_CHUNKS 255
+
 /*for Huffman */
 typedef struct __attribute__ ((__packed__)) {
 	uint32_t code;
 	uint32_t len;
 } t_code;
 
+/* codec state, one per concurrent encode/decode */
+struct lzhs_ctx {
+	/* LZSS */
+	unsigned long int textsize, codesize;
+	uint8_t text_buf[N + F - 1];
+	int32_t match_length, match_position, lson[N + 1], rson[N + 257], dad[N + 1];
+	int32_t hash_head[LZHS_HASH_SIZE], hash_prev[N];
+	/* Huffman */
+	uint32_t preno, precode;
+};
+
+struct lzhs_ctx *lzhs_ctx_new(void);
+void lzhs_ctx_free(struct lzhs_ctx *ctx);
+
+void unlzss_ctx(struct lzhs_ctx *ctx, cursor_t *in, cursor_t *out);
 void unlzss(cursor_t *in, cursor_t *out);
+size_t unlzss_mem(cursor_t *in, cursor_t *out);
 void unhuff(cursor_t *in, cursor_t *out);
+size_t unlzhs_ctx(struct lzhs_ctx *ctx, cursor_t *in, cursor_t *out, uint8_t *out_checksum);
+size_t lzhs_pack_ctx(struct lzhs_ctx *ctx, const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size, int level);
 
 MFILE *is_lzhs(const char *filename);
 bool _is_lzhs_mem(struct lzhs_header *header);
 bool is_lzhs_mem(MFILE *file, off_t offset);
 
+void lzss_ctx(struct lzhs_ctx *ctx, FILE * infile, FILE * outfile, unsigned long int *p_textsize, unsigned long int *p_codesize);
+void huff_ctx(struct lzhs_ctx *ctx, FILE * in, FILE * out, unsigned long int *p_textsize, unsigned long int *p_codesize);
 void lzss(FILE * infile, FILE * outfile, unsigned long int *p_textsize, unsigned long int *p_codesize);
 void huff(FILE * in, FILE * out, unsigned long int *p_textsize, unsigned long int *p_codesize);
 
 int extract_lzhs(MFILE *in_file);
+size_t lzhs_decode_mem(struct lzhs_ctx *ctx, struct lzhs_header *header, size_t in_size, uint8_t *out_bytes, uint8_t *out_checksum);
+cursor_t *lzhs_decode_ctx(struct lzhs_ctx *ctx, MFILE *in_file, off_t offset, const char *out_path, uint8_t *out_checksum);
 cursor_t *lzhs_decode(MFILE *in_file, off_t offset, const char *out_path, uint8_t *out_checksum);
+void lzhs_encode_ctx(struct lzhs_ctx *ctx, const char *infile, const char *outfile);
 void lzhs_encode(const char *infile, const char *outfile);
-void scan_lzhs(const char *filename, int extract);
+size_t lzhs_encode_mem(struct lzhs_ctx *ctx, const uint8_t *data, size_t size, uint8_t *out, size_t out_size, int level);
+int lzhs_encode_file(const char *infile, const char *outfile, int level);
+int lzhs_encode_ext4(const char *infile, const char *outfile, int level, size_t chunk_size);
+void scan_lzhs(const char *filename, int extract, unsigned int nthreads, const char *list_path);
 
 #endif
@@ -1,5 +1,8 @@
 #ifndef __LZO_LG_H
 #define __LZO_LG_H
+#include "mfile.h"
+int check_lzo_header_mem(MFILE *file);
 int check_lzo_header(const char *name);
 int lzo_unpack(const char *in_name, const char *out_name);
+int lzo_unpack_mem(const unsigned char *in, size_t in_size, unsigned char **out, size_t *out_size);
 #endif //__LZO_LG_H
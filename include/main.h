@@ -1,5 +1,8 @@
 #ifndef __MAIN_H
 #define __MAIN_H
 #include "config.h"
+struct artifact;
 int handle_file(const char *file, struct config_opts_t *config_opts);
+int handle_artifact(struct artifact *artifact, struct config_opts_t *config_opts);
+void report_progress(struct config_opts_t *config_opts, const char *name, unsigned int done, unsigned int total);
 #endif //__MAIN_H
@@ -19,6 +19,7 @@
 
 void extract_mtk_1bl(MFILE *in, const char *outname);
 void split_mtk_tz(MFILE *tz, const char *destdir);
+int is_mtk_boot_mem(MFILE *file);
 MFILE *is_mtk_boot(const char *filename);
 int is_elf_mem(Elf32_Ehdr * header);
 MFILE *is_elf(const char *filename);
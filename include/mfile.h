@@ -20,7 +20,7 @@
 /* Gets the file handler (for mfopen) */
 #define mfh(mfile) mfile->fh
 /* Gets the file offset */
-#define moff(mfile, ptr) (off_t)((uintptr_t)ptr - (uintptr_t)(mfile->pMem))
+#define moff(mfile, ptr) ((off_t)((uintptr_t)ptr - (uintptr_t)(mfile->pMem)) + mfile->pOff)
 
 #define mwriteat(mfile, off, ptr, size) \
 	memcpy( \
@@ -55,6 +55,8 @@ typedef struct {
 	int prot;
 	struct stat statBuf;
 	void *pMem;
+	off_t pOff; // file offset of pMem, not 0 for windows only
+	size_t window; // minimum window size, 0 if the whole file is mapped
 } MFILE;
 
 MFILE *mfile_new();
@@ -64,6 +66,9 @@ void *mfile_map_private(MFILE *file, size_t size);
 
 MFILE *mopen(const char *path, int oflags);
 MFILE *mopen_private(const char *path, int oflags);
+MFILE *mopen_window(const char *path, int oflags, size_t window);
+
+void *mfile_window(MFILE *file, off_t offset, size_t size);
 
 MFILE *mfopen(const char *path, const char *mode);
 MFILE *mfopen_private(const char *path, const char *mode);
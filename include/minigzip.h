@@ -77,6 +77,7 @@ int gz_compress_mmap(FILE * in, gzFile out);
 void gz_uncompress(gzFile in, FILE * out);
 void file_compress(char *file, char *mode);
 void file_uncompress(char *infile, char *outfile);
+char *gz_origname(char *infile, char *path);
 char *file_uncompress_origname(char *infile, char *path);
 
 #endif /* MINIGZIP_H */
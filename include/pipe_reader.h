@@ -0,0 +1,20 @@
+/*
+	Forward-only reader for pipes and stdin, read ahead on its own thread
+*/
+#ifndef __PIPE_READER_H
+#define __PIPE_READER_H
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Bytes read ahead of the consumer */
+#define PIPE_READER_AHEAD (8 * 1024 * 1024)
+
+struct pipe_reader;
+
+int is_pipe(const char *path);
+struct pipe_reader *pipe_reader_open(const char *path);
+void *pipe_reader_data(struct pipe_reader *r, off_t offset, size_t size);
+off_t pipe_reader_offset(struct pipe_reader *r);
+void pipe_reader_close(struct pipe_reader *r);
+
+#endif
@@ -27,6 +27,7 @@
 extern int exit_on_error;
 
 extern void prep_exit();
+extern void job_exit(int status) __attribute__((noreturn)); /* util.h */
 extern void progressbar_error(char *fmt, ...);
 extern void progressbar_info(char *fmt, ...);
 
@@ -70,7 +71,7 @@ extern void progressbar_info(char *fmt, ...);
 #    define EXIT_MKSQUASHFS() \
 		do {\
 			prep_exit();\
-			exit(1);\
+			job_exit(1);\
 		} while(0)
 
 #    define BAD_ERROR(s, args...) \
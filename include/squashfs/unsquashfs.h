@@ -36,6 +36,7 @@
 #    include <string.h>
 #    include <sys/mman.h>
 #    include <utime.h>
+#    include "mfile.h"
 #    include <pwd.h>
 #    include <grp.h>
 #    include <time.h>
@@ -220,20 +221,65 @@ struct pathnames {
 };
 #    define PATHS_ALLOC_SIZE 10
 
-/* globals */
-extern struct super_block sBlk;
-extern squashfs_operations s_ops;
-extern int swap;
-extern char *inode_table, *directory_table;
-extern struct hash_table_entry *inode_table_hash[65536], *directory_table_hash[65536];
-extern unsigned int *uid_table, *guid_table;
-extern pthread_mutex_t screen_mutex;
-extern int progress_enabled;
-extern int inode_number;
+/*
+ * The state of one unsquashfs() call, shared by the reader, inflator, writer
+ * and progress threads it starts. Several calls can run side by side, each
+ * thread works on the call it was started for, uctx
+ */
+struct unsquashfs_ctx {
+	int fd;
+	struct super_block sBlk;
+	squashfs_operations s_ops;
+	struct compressor *comp;
+	int swap;
+	unsigned int block_size;
+	unsigned int block_log;
+	int root_process;
+
+	/* the metadata, read before the files are written */
+	char *inode_table, *directory_table;
+	struct hash_table_entry *inode_table_hash[65536], *directory_table_hash[65536];
+	unsigned int *uid_table, *guid_table;	/* 1.x to 3.x */
+	unsigned int *id_table;	/* 4.0 */
+	void *fragment_table;	/* entries of the image's version */
+	struct inode inode;	/* the one s_ops.read_inode() returns */
+	char **created_inode;
+	int inode_number;
+	char *pathname;	/* being written, see update_info() */
+
+	/* see read_xattrs.c and unsquashfs_xattr.c */
+	struct hash_entry *xattr_hash_table[65536];
+	struct squashfs_xattr_id *xattr_ids;
+	void *xattrs;
+	long long xattr_table_start;
+	int nonsuper_error, ignore_xattrs, nospace_error;
+
+	/* the threads, and what they pass each other */
+	pthread_t *thread;
+	int nthreads;
+	struct cache *fragment_cache, *data_cache;
+	struct queue *to_reader, *to_inflate, *to_writer, *from_writer;
+	pthread_mutex_t open_mutex;
+	pthread_cond_t open_empty;
+	int open_unlimited, open_count;
+	int lseek_broken;
+	char *zero_data;
+	long long total_bytes_written;
+	int failed;	/* a helper thread gave up */
+
+	/* what was written, and the progress bar */
+	int file_count, dir_count, sym_count, dev_count, fifo_count;
+	unsigned int total_blocks, total_files, total_inodes, cur_blocks;
+	pthread_mutex_t screen_mutex;
+	int progress_enabled;
+	int columns;
+	int rotate;
+	int tty;
+	long long previous;
+};
+
+extern __thread struct unsquashfs_ctx *uctx;
 extern int lookup_type[];
-extern int fd;
-extern struct queue *to_reader, *to_inflate, *to_writer;
-extern struct cache *fragment_cache, *data_cache;
 
 /* unsquashfs.c */
 extern int lookup_entry(struct hash_table_entry **, long long);
@@ -241,10 +287,13 @@ extern int read_fs_bytes(int fd, long long, int, void *);
 extern int read_block(int, long long, long long *, int, void *);
 extern void enable_progress_bar();
 extern void disable_progress_bar();
+extern void queue_free(struct queue *);
 extern void dump_queue(struct queue *);
+extern void cache_free(struct cache *);
 extern void dump_cache(struct cache *);
+extern int is_squashfs_mem(MFILE *file);
 extern int is_squashfs(char *filename);
-extern int unsquashfs(char *squashfs, char *dest);
+extern int unsquashfs(char *squashfs, char *dest, const char *extract);
 
 /* unsquash-1.c */
 extern void read_block_list_1(unsigned int *, char *, int);
@@ -74,6 +74,7 @@ extern void restore_xattrs();
 extern unsigned int xattr_bytes, total_xattr_bytes;
 extern void write_xattr(char *, unsigned int);
 extern int read_xattrs_from_disk(int, struct squashfs_super_block *);
+extern void free_xattrs();
 extern struct xattr_list *get_xattr(int, unsigned int *, int);
 extern void free_xattr(struct xattr_list *, int);
 #    else
@@ -110,6 +111,9 @@ static inline int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBl
 		return SQUASHFS_INVALID_BLK;
 }
 
+static inline void free_xattrs() {
+}
+
 static inline struct xattr_list *get_xattr(int i, unsigned int *count, int j) {
 	return NULL;
 }
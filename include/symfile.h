@@ -31,6 +31,7 @@
 
 #    include <stdint.h>
 #    include <unistd.h>
+#    include "mfile.h"
 
 struct sym_entry {
 	uint32_t addr;
@@ -51,8 +52,9 @@ struct sym_table {
 	char *sym_name;
 };
 
-extern struct sym_table sym_table;
+extern __thread struct sym_table sym_table;
 
+int is_symfile_mem(MFILE *file);
 int symfile_load(const char *sym_fname);
 uint32_t symfile_addr_by_name(const char *name);
 const char *symfile_name_by_addr(uint32_t addr);
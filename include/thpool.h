@@ -0,0 +1,30 @@
+/*
+	A minimal pthread work distributor
+*/
+#ifndef __THPOOL_H
+#define __THPOOL_H
+
+/*
+ * Work callback, invoked once for every item index
+ * worker is the index (0..nthreads-1) of the calling thread, to look up per-thread state
+ */
+typedef void (*thpool_work_t)(void *arg, unsigned int worker, unsigned int index);
+
+unsigned int thpool_ncpus(void);
+int thpool_for(unsigned int count, unsigned int nthreads, thpool_work_t work, void *arg);
+
+/*
+ * Task callback for the work-stealing pool
+ * Tasks may submit more tasks to the pool they run on
+ */
+typedef void (*thpool_task_t)(void *arg);
+
+struct thpool;
+
+struct thpool *thpool_new(unsigned int nthreads);
+int thpool_submit(struct thpool *pool, thpool_task_t task, void *arg);
+void thpool_wait(struct thpool *pool);
+int thpool_help(struct thpool *pool);
+void thpool_free(struct thpool *pool);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+	--trace: spans of the extraction stages, written as a Chrome trace
+	(chrome://tracing, ui.perfetto.dev) with a per-stage summary
+	When tracing is off a span costs a test of trace_enabled
+*/
+#ifndef __TRACE_H
+#define __TRACE_H
+#include <stdint.h>
+
+enum trace_stage {
+	TRACE_PROBE,
+	TRACE_VERIFY,
+	TRACE_DECRYPT,
+	TRACE_LZHS,
+	TRACE_LZO,
+	TRACE_LZ4,
+	TRACE_GZIP,
+	TRACE_SQUASHFS,
+	TRACE_SQUASHFS_INFLATE,
+	TRACE_SQUASHFS_WRITE,
+	TRACE_CRAMFS,
+	TRACE_JFFS2,
+	TRACE_WRITE,
+	TRACE_STAGES
+};
+
+struct trace_span {
+	enum trace_stage stage;
+	const char *name; // copied when the span ends, may be NULL
+	uint64_t start; // 0 if tracing was off when it began
+};
+
+extern int trace_enabled;
+
+int trace_open(const char *file);
+void trace_flush(void);
+void trace_close(void);
+
+void trace_span_begin(struct trace_span *span, enum trace_stage stage, const char *name);
+void trace_span_end(struct trace_span *span, uint64_t bytes_in, uint64_t bytes_out);
+
+static inline void trace_begin(struct trace_span *span, enum trace_stage stage, const char *name){
+	span->start = 0;
+	if(trace_enabled)
+		trace_span_begin(span, stage, name);
+}
+
+static inline void trace_end(struct trace_span *span, uint64_t bytes_in, uint64_t bytes_out){
+	if(span->start != 0)
+		trace_span_end(span, bytes_in, bytes_out);
+}
+
+#endif
@@ -3,10 +3,30 @@
 #include <stddef.h>
 #include <elf.h>
 #include <stdlib.h>
+#include <setjmp.h>
 #include "mfile.h"
+#include "config.h"
 
 #define err_exit(fmt, ...) \
-	exit(err_ret(fmt, ##__VA_ARGS__))
+	job_exit(err_ret(fmt, ##__VA_ARGS__))
+
+/*
+ * What a job has to release if it gives up: worker threads to join, files to
+ * close. Lives in the frame that pushed it, which pops it before returning
+ */
+struct job_cleanup {
+	void (*run)(void *arg);
+	void *arg;
+	jmp_buf *jmp; // the job_catch() frame it was pushed under
+	struct job_cleanup *next;
+};
+
+/* path_glob_match() results, by increasing strength */
+enum {
+	PATH_GLOB_NONE = 0,
+	PATH_GLOB_PARENT,
+	PATH_GLOB_MATCH
+};
 
 char *my_basename(const char *path);
 char *my_dirname(const char *path);
@@ -14,18 +34,33 @@ void getch(void);
 void hexdump(void *pAddressIn, long lSize);
 void rmrf(const char *path);
 int err_ret(const char *format, ...);
+jmp_buf *job_catch(jmp_buf *jmp);
+void job_exit(int status) __attribute__((noreturn));
+void job_push_cleanup(struct job_cleanup *cleanup, void (*run)(void *arg), void *arg);
+void job_pop_cleanup(struct job_cleanup *cleanup);
 
 char *remove_ext(const char *mystr);
 char *get_ext(const char *mystr);
 void createFolder(const char *directory);
+int path_glob_match(const char *pattern, const char *path);
+int pak_selected(struct config_opts_t *config_opts, const unsigned char *name, size_t size);
+const char *pak_extract_path(const char *pattern);
+int is_lz4_mem(MFILE *file);
 MFILE *is_lz4(const char *lz4file);
+int is_nfsb_mem(MFILE *file);
 MFILE *is_nfsb(const char *filename);
 void unnfsb(const char *filename, const char *extractedFile);
+int is_gzip_mem(MFILE *file);
 int is_gzip(const char *filename);
+int is_jffs2_mem(MFILE *file);
 int is_jffs2(const char *filename);
+int isSTRfile_mem(MFILE *file);
 int isSTRfile(const char *filename);
 int isdatetime(char *datetime);
+int isPartPakfile_mem(MFILE *file);
+int detect_partpak_model(MFILE *file);
 int isPartPakfile(const char *filename);
+int is_kernel_mem(MFILE *file);
 int is_kernel(const char *image_file);
 void extract_kernel(const char *image_file, const char *destination_file);
 
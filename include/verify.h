@@ -0,0 +1,27 @@
+/*
+	--verify: integrity checks of every container layer, done in memory
+	without writing anything
+*/
+#ifndef __VERIFY_H
+#define __VERIFY_H
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/* Decrypted PAKs held in memory before the EPK reader waits for the checks to catch up */
+#define VERIFY_POOL_SIZE (512 * 1024 * 1024)
+
+/* Nested layers checked at most, against self-referencing images */
+#define VERIFY_MAX_DEPTH 8
+
+struct verify_job;
+
+struct verify_job *verify_new(unsigned int nthreads, size_t pool_size);
+void verify_report(struct verify_job *job, const char *name, int ok, const char *fmt, ...);
+uint8_t *verify_alloc(struct verify_job *job, size_t size);
+void verify_free(struct verify_job *job, uint8_t *data, size_t size);
+void verify_submit(struct verify_job *job, const char *name, uint8_t *data, size_t size);
+int verify_file(const char *path, struct config_opts_t *config_opts);
+unsigned int verify_finish(struct verify_job *job);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+	Bulk AES-128-ECB decryption on top of OpenSSL EVP
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <openssl/evp.h>
+
+#include "aes_ecb.h"
+#include "thpool.h"
+#include "util.h"
+
+/* EVP takes int lengths, stay well below INT_MAX per call */
+#define AES_ECB_MAX_UPDATE (1 << 30)
+
+struct aes_ecb {
+	unsigned char key[AES_ECB_KEY_SIZE];
+	EVP_CIPHER_CTX *ctx;
+
+	/* per thread contexts for split buffers, created on first use */
+	unsigned int nthreads;
+	EVP_CIPHER_CTX **thread_ctx;
+	int thread_keyed; // thread contexts hold the current key
+};
+
+struct aes_ecb_job {
+	struct aes_ecb *aes;
+	const unsigned char *src;
+	unsigned char *dst;
+	size_t len; // whole blocks only
+	size_t chunk;
+};
+
+static EVP_CIPHER_CTX *aes_ecb_ctx_new(const unsigned char *key){
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(ctx == NULL)
+		return NULL;
+	if(EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL) != 1){
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+	// ECB on whole blocks, nothing to hold back for padding
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+	return ctx;
+}
+
+static void aes_ecb_update(EVP_CIPHER_CTX *ctx, const unsigned char *src, size_t len, unsigned char *dst){
+	while(len > 0){
+		int n = (len > AES_ECB_MAX_UPDATE) ? AES_ECB_MAX_UPDATE : (int)len;
+		int outl = 0;
+		if(EVP_DecryptUpdate(ctx, dst, &outl, src, n) != 1 || outl != n)
+			err_exit("AES decryption failed\n");
+		src += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+/*
+ * Creates a decryption context for key (AES_ECB_KEY_SIZE bytes)
+ */
+struct aes_ecb *aes_ecb_new(const unsigned char *key){
+	struct aes_ecb *aes = calloc(1, sizeof(*aes));
+	if(aes == NULL)
+		return NULL;
+	memcpy(aes->key, key, sizeof(aes->key));
+	aes->ctx = aes_ecb_ctx_new(key);
+	if(aes->ctx == NULL){
+		free(aes);
+		return NULL;
+	}
+	return aes;
+}
+
+/*
+ * Switches the context to another key, keeping the allocated state
+ */
+int aes_ecb_set_key(struct aes_ecb *aes, const unsigned char *key){
+	memcpy(aes->key, key, sizeof(aes->key));
+	aes->thread_keyed = 0;
+	if(EVP_DecryptInit_ex(aes->ctx, NULL, NULL, key, NULL) != 1)
+		return -1;
+	return 0;
+}
+
+static void aes_ecb_decrypt_chunk(void *arg, unsigned int worker, unsigned int index){
+	struct aes_ecb_job *job = (struct aes_ecb_job *)arg;
+	size_t off = (size_t)index * job->chunk;
+	size_t len = job->len - off;
+	if(len > job->chunk)
+		len = job->chunk;
+	aes_ecb_update(job->aes->thread_ctx[worker], job->src + off, len, job->dst + off);
+}
+
+static int aes_ecb_threads_init(struct aes_ecb *aes){
+	unsigned int i;
+	if(aes->thread_ctx == NULL){
+		aes->nthreads = thpool_ncpus();
+		aes->thread_ctx = calloc(aes->nthreads, sizeof(*aes->thread_ctx));
+		if(aes->thread_ctx == NULL)
+			return -1;
+	}
+	if(aes->thread_keyed)
+		return 0;
+	for(i=0; i<aes->nthreads; i++){
+		if(aes->thread_ctx[i] == NULL)
+			aes->thread_ctx[i] = aes_ecb_ctx_new(aes->key);
+		else if(EVP_DecryptInit_ex(aes->thread_ctx[i], NULL, NULL, aes->key, NULL) != 1)
+			return -1;
+		if(aes->thread_ctx[i] == NULL)
+			return -1;
+	}
+	aes->thread_keyed = 1;
+	return 0;
+}
+
+/*
+ * Decrypts len bytes from src to dst (which may be the same buffer)
+ * Whole blocks are decrypted, a trailing partial block is copied as is
+ */
+void aes_ecb_decrypt(struct aes_ecb *aes, const unsigned char *src, size_t len, unsigned char *dst){
+	size_t blocks_len = len & ~(size_t)(AES_ECB_BLOCK_SIZE - 1);
+
+	if(blocks_len >= 2 * AES_ECB_SPLIT_SIZE && thpool_ncpus() > 1 && aes_ecb_threads_init(aes) == 0){
+		struct aes_ecb_job job = {
+			.aes = aes,
+			.src = src,
+			.dst = dst,
+			.len = blocks_len
+		};
+		// one chunk per thread, but no smaller than AES_ECB_SPLIT_SIZE
+		job.chunk = (blocks_len / aes->nthreads + AES_ECB_BLOCK_SIZE - 1) & ~(size_t)(AES_ECB_BLOCK_SIZE - 1);
+		if(job.chunk < AES_ECB_SPLIT_SIZE)
+			job.chunk = AES_ECB_SPLIT_SIZE;
+		unsigned int count = (blocks_len + job.chunk - 1) / job.chunk;
+		thpool_for(count, aes->nthreads, aes_ecb_decrypt_chunk, &job);
+	} else {
+		aes_ecb_update(aes->ctx, src, blocks_len, dst);
+	}
+
+	if(len != blocks_len)
+		memmove(dst + blocks_len, src + blocks_len, len - blocks_len);
+}
+
+void aes_ecb_free(struct aes_ecb *aes){
+	unsigned int i;
+	if(aes == NULL)
+		return;
+	for(i=0; i<aes->nthreads; i++){
+		if(aes->thread_ctx[i] != NULL)
+			EVP_CIPHER_CTX_free(aes->thread_ctx[i]);
+	}
+	free(aes->thread_ctx);
+	EVP_CIPHER_CTX_free(aes->ctx);
+	OPENSSL_cleanse(aes->key, sizeof(aes->key));
+	free(aes);
+}
@@ -0,0 +1,151 @@
+/*
+	Files handed from one extraction stage to the next
+	They stay in memory (memfd) unless --keep-intermediates is given, or
+	too many of them wait for a thread
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "artifact.h"
+#include "util.h"
+#include "trace.h"
+
+/*
+ * With -j, artifacts wait on the pool for a thread, and the memfds of the
+ * waiting ones are limited to a quarter of the RAM. Past that they go to disk
+ */
+static size_t artifact_mem_held;
+static size_t artifact_mem_budget;
+static pthread_once_t artifact_budget_once = PTHREAD_ONCE_INIT;
+
+static void artifact_budget_init(void) {
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && page_size > 0)
+		artifact_mem_budget = (size_t)pages * page_size / 4;
+	else
+		artifact_mem_budget = (size_t)512 * 1024 * 1024;
+}
+
+static int artifact_mem_full(size_t size) {
+	pthread_once(&artifact_budget_once, artifact_budget_init);
+	return __atomic_load_n(&artifact_mem_held, __ATOMIC_RELAXED) + size > artifact_mem_budget;
+}
+
+/*
+ * Creates an artifact that will be written by a decoder, then handed to the next stage
+ * Falls back to a file on disk with --keep-intermediates, where memfd isn't available,
+ * or while the memory budget is used up. Unless kept, that file is removed once extracted
+ */
+struct artifact *artifact_new(const char *name, struct config_opts_t *config_opts) {
+	struct artifact *artifact = calloc(1, sizeof(*artifact));
+	artifact->name = strdup(name);
+	artifact->fd = -1;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	if (!config_opts->keep_intermediates && !artifact_mem_full(0)) {
+		char *base = my_basename(name);
+		artifact->fd = memfd_create(base, MFD_CLOEXEC);
+		free(base);
+		if (artifact->fd >= 0)
+			asprintf(&artifact->path, "/proc/self/fd/%d", artifact->fd);
+	}
+#endif
+	if (artifact->path == NULL) {
+		artifact->path = strdup(name);
+		artifact->spilled = !config_opts->keep_intermediates;
+	}
+	return artifact;
+}
+
+/*
+ * Wraps a file that is already on disk
+ */
+struct artifact *artifact_file(const char *name) {
+	struct artifact *artifact = calloc(1, sizeof(*artifact));
+	artifact->name = strdup(name);
+	artifact->path = strdup(name);
+	artifact->fd = -1;
+	return artifact;
+}
+
+/*
+ * Writes an in-memory artifact to its name on disk, for the stages that have no further one
+ * Returns 0 on success
+ */
+int artifact_save(struct artifact *artifact) {
+	if (artifact->fd < 0) {
+		// the result of its own, it stays
+		artifact->spilled = 0;
+		return 0;
+	}
+
+	int out = open(artifact->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		printf("Cannot open %s for writing (%s)\n", artifact->name, strerror(errno));
+		return -1;
+	}
+
+	char buf[64 * 1024];
+	off_t offset = 0;
+	ssize_t nread;
+	int result = 0;
+	struct trace_span span;
+	trace_begin(&span, TRACE_WRITE, artifact->name);
+	while ((nread = pread(artifact->fd, buf, sizeof(buf), offset)) > 0) {
+		ssize_t nwritten = write(out, buf, nread);
+		if (nwritten != nread) {
+			// a short write is a full disk
+			printf("Cannot write %s (%s)\n", artifact->name, strerror((nwritten < 0) ? errno : ENOSPC));
+			result = -1;
+			break;
+		}
+		offset += nread;
+	}
+	close(out);
+	trace_end(&span, offset, offset);
+	return result;
+}
+
+/*
+ * Counts an in-memory artifact against the budget while it waits on the pool,
+ * or moves it to disk if that would go over
+ */
+void artifact_hold(struct artifact *artifact) {
+	struct stat st;
+	if (artifact->fd < 0 || fstat(artifact->fd, &st) < 0)
+		return;
+	if (!artifact_mem_full(st.st_size)) {
+		artifact->held = st.st_size;
+		__atomic_add_fetch(&artifact_mem_held, artifact->held, __ATOMIC_RELAXED);
+		return;
+	}
+	if (artifact_save(artifact) < 0) {
+		// it stays in memory, over the budget
+		unlink(artifact->name);
+		return;
+	}
+	close(artifact->fd);
+	artifact->fd = -1;
+	free(artifact->path);
+	artifact->path = strdup(artifact->name);
+	artifact->spilled = 1;
+}
+
+void artifact_free(struct artifact *artifact) {
+	if (artifact->held > 0)
+		__atomic_sub_fetch(&artifact_mem_held, artifact->held, __ATOMIC_RELAXED);
+	if (artifact->spilled)
+		unlink(artifact->name);
+	if (artifact->fd >= 0)
+		close(artifact->fd);
+	free(artifact->path);
+	free(artifact->name);
+	free(artifact);
+}
@@ -0,0 +1,221 @@
+/*
+	--cache: content-addressed store of extracted trees
+	<cache_dir>/<key>/ holds what the extraction of a nested file wrote to its
+	destination directory, the key being the SHA-256 of the file's content,
+	its name and the options that change the output
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include <openssl/evp.h>
+
+#include "cache.h"
+#include "util.h"
+
+static void cache_digest_str(EVP_MD_CTX *ctx, const char *str){
+	if(str == NULL)
+		str = "";
+	// with its terminator, so that "ab","c" and "a","bc" differ
+	EVP_DigestUpdate(ctx, str, strlen(str) + 1);
+}
+
+/*
+ * Returns the key of a nested file, or NULL if it can't be cached
+ */
+char *cache_key(MFILE *mf, const char *file_name, struct config_opts_t *config_opts){
+	if(msize(mf) == 0 || mdata(mf, void) == NULL)
+		return NULL;
+
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0, i;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(ctx, mdata(mf, void), msize(mf));
+	// the outputs are named after the file, and depend on these options
+	cache_digest_str(ctx, file_name);
+	cache_digest_str(ctx, config_opts->extract_path);
+	cache_digest_str(ctx, config_opts->pak_only);
+	cache_digest_str(ctx, config_opts->pak_skip);
+	cache_digest_str(ctx, config_opts->keep_intermediates ? "keep" : NULL);
+	EVP_DigestFinal_ex(ctx, md, &mdlen);
+	EVP_MD_CTX_destroy(ctx);
+
+	char *key = calloc(1, mdlen * 2 + 1);
+	for(i=0; i<mdlen; i++)
+		sprintf(&key[i * 2], "%02x", md[i]);
+	return key;
+}
+
+/*
+ * Copies src to dst, with a reflink if the filesystem has them (btrfs, xfs)
+ * reflink != 0 gives up with -1 if it doesn't, so a hard link can be tried instead
+ */
+static int cache_copy_file(const char *src, const char *dst, mode_t mode, int reflink){
+	int in = open(src, O_RDONLY);
+	if(in < 0)
+		return -1;
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode & 07777);
+	if(out < 0){
+		close(in);
+		return -1;
+	}
+
+	int result = 0;
+#ifdef FICLONE
+	result = ioctl(out, FICLONE, in);
+#else
+	result = -1;
+#endif
+	if(result == 0 || reflink){
+		close(in);
+		close(out);
+		if(result < 0)
+			unlink(dst);
+		return result;
+	}
+
+	result = 0;
+	char buf[64 * 1024];
+	ssize_t n;
+	while((n = read(in, buf, sizeof(buf))) > 0){
+		if(write(out, buf, n) != n){
+			result = -1;
+			break;
+		}
+	}
+	if(n < 0)
+		result = -1;
+	close(in);
+	close(out);
+	return result;
+}
+
+/*
+ * Recreates the tree src in dst: directories and symlinks are made again,
+ * files are reflinked, or else hard linked, or else copied
+ */
+static int cache_link_tree(const char *src, const char *dst){
+	DIR *dir = opendir(src);
+	if(dir == NULL)
+		return -1;
+	if(mkdir(dst, 0755) < 0 && errno != EEXIST){
+		closedir(dir);
+		return -1;
+	}
+
+	int result = 0;
+	struct dirent *ent;
+	while(result == 0 && (ent = readdir(dir)) != NULL){
+		if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		char *from, *to;
+		asprintf(&from, "%s/%s", src, ent->d_name);
+		asprintf(&to, "%s/%s", dst, ent->d_name);
+
+		struct stat st;
+		if(lstat(from, &st) < 0){
+			result = -1;
+		} else if(S_ISDIR(st.st_mode)){
+			result = cache_link_tree(from, to);
+			chmod(to, st.st_mode & 07777);
+		} else if(S_ISLNK(st.st_mode)){
+			char target[PATH_MAX];
+			ssize_t len = readlink(from, target, sizeof(target) - 1);
+			if(len < 0){
+				result = -1;
+			} else {
+				target[len] = '\0';
+				unlink(to);
+				result = symlink(target, to);
+			}
+		} else if(S_ISREG(st.st_mode)){
+			// the extraction would have overwritten it too
+			unlink(to);
+			// a hard link shares the inode with the cache, a reflink only the blocks
+			if(cache_copy_file(from, to, st.st_mode, 1) < 0 && link(from, to) < 0)
+				result = cache_copy_file(from, to, st.st_mode, 0);
+		}
+		// device nodes and FIFOs are only made by extractions run as root, and are left out
+		free(from);
+		free(to);
+	}
+	closedir(dir);
+	return result;
+}
+
+/*
+ * Links the cached extraction of key into dest_dir
+ * Returns 0 on a hit, -1 if key is not in the cache
+ */
+int cache_restore(const char *cache_dir, const char *key, const char *dest_dir){
+	char *entry;
+	asprintf(&entry, "%s/%s", cache_dir, key);
+
+	struct stat st;
+	int result = -1;
+	if(stat(entry, &st) == 0 && S_ISDIR(st.st_mode)){
+		result = cache_link_tree(entry, dest_dir);
+		if(result < 0)
+			printf("Cannot link the cached %s into %s (%s)\n", entry, dest_dir, strerror(errno));
+	}
+	free(entry);
+	return result;
+}
+
+/*
+ * Makes a staging directory in the cache, to extract a nested file into
+ */
+char *cache_stage(const char *cache_dir){
+	createFolder(cache_dir);
+	char *staging;
+	asprintf(&staging, "%s/.staging-XXXXXX", cache_dir);
+	if(mkdtemp(staging) == NULL){
+		printf("Cannot create a directory in %s (%s)\n", cache_dir, strerror(errno));
+		free(staging);
+		return NULL;
+	}
+	return staging;
+}
+
+/*
+ * Makes a finished staging directory the cache entry of key
+ * If another extraction stored the same key first, its entry is kept
+ */
+int cache_commit(const char *cache_dir, const char *staging, const char *key){
+	char *entry;
+	asprintf(&entry, "%s/%s", cache_dir, key);
+	int result = rename(staging, entry);
+	if(result < 0 && (errno == EEXIST || errno == ENOTEMPTY)){
+		cache_discard(staging);
+		result = 0;
+	}
+	free(entry);
+	return result;
+}
+
+void cache_discard(const char *staging){
+	rmrf(staging);
+}
+
+/*
+ * Moves what a failed extraction left in a staging directory to dest_dir,
+ * without making it a cache entry
+ */
+int cache_unstage(const char *staging, const char *dest_dir){
+	int result = cache_link_tree(staging, dest_dir);
+	if(result < 0)
+		printf("Cannot link %s into %s (%s)\n", staging, dest_dir, strerror(errno));
+	cache_discard(staging);
+	return result;
+}
@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include "util.h"
 
 #define BUFFERSIZE	16384
 #define MAXFILES	4096
@@ -37,7 +38,7 @@ int cramswap(char *sinfile, char *soutfile) {
 	/*if ( argc != 3 )
 	   {
 	   fprintf(stderr, "Usage: %s <in> <out>\n", argv[0]);
-	   exit(1);
+	   job_exit(1);
 	   } */
 
 	if ((infile = open(sinfile, O_RDONLY)) < 0) {
@@ -46,12 +47,12 @@ int cramswap(char *sinfile, char *soutfile) {
 	}
 	if ((outfile = open(soutfile, O_RDWR | O_TRUNC | O_CREAT, 0644)) < 0) {
 		perror("while trying to open image output file");
-		exit(1);
+		job_exit(1);
 	}
 
 	if (read(infile, &superblock_in, sizeof(superblock_in)) != sizeof(superblock_in)) {
 		perror("while trying to read superblock");
-		exit(1);
+		job_exit(1);
 	}
 
 	/* Detect endianness of host */
@@ -70,7 +71,7 @@ int cramswap(char *sinfile, char *soutfile) {
 		file_is_le = !(host_is_le);
 	} else {
 		fprintf(stderr, "cramfs magic not detected\n");
-		exit(1);
+		job_exit(1);
 	}
 
 	if (file_is_le)
@@ -108,25 +109,25 @@ int cramswap(char *sinfile, char *soutfile) {
 	   don't support v1. */
 	if ((flags & 0x1) == 0) {
 		fprintf(stderr, "Error: Not cramfs version 2!\n");
-		exit(1);
+		job_exit(1);
 	}
 
 	/* This should be done later */
 	if (flags & 0x100) {
 		fprintf(stderr, "Error: Filesystem contains holes (not supported yet)\n");
-		exit(1);
+		job_exit(1);
 	}
 
 	/* Do we really need this? */
 	if (flags & 0x400) {
 		fprintf(stderr, "Error: Filesystem has shifted root fs flag (not supported)\n");
-		exit(1);
+		job_exit(1);
 	}
 
 	/* Something else? */
 	if (flags & 0xFFFFFFFC) {
 		fprintf(stderr, "Error: Filesystem has unknown/unsupported flag set!\n");
-		exit(1);
+		job_exit(1);
 	}
 
 	/* Get Filecounter (which is number of file entries plus 1 (for the root inode) */
@@ -139,7 +140,7 @@ int cramswap(char *sinfile, char *soutfile) {
 	fileoffset = (unsigned int *)malloc(filecnt * sizeof(*fileoffset));
 	if (fileoffset == NULL) {
 		perror("fileoffset malloc error");
-		exit(1);
+		job_exit(1);
 	}
 
 	filesize = (unsigned int *)malloc(filecnt * sizeof(*filesize));
@@ -147,7 +148,7 @@ int cramswap(char *sinfile, char *soutfile) {
 		free(fileoffset);
 		fileoffset = NULL;
 		perror("filesize malloc error");
-		exit(1);
+		job_exit(1);
 	}
 
 	/* Set filepos (in words) */
@@ -161,7 +162,7 @@ int cramswap(char *sinfile, char *soutfile) {
 		/* Read and swap file inode */
 		if (read(infile, &inode_in, sizeof(inode_in)) != sizeof(inode_in)) {
 			perror("while trying to read directory entry");
-			exit(1);
+			job_exit(1);
 		}
 
 		/* Swap the inode. */
@@ -213,7 +214,7 @@ int cramswap(char *sinfile, char *soutfile) {
 		/* Copy filename */
 		if (read(infile, &buffer, inode.namelen << 2) != inode.namelen << 2) {
 			perror("while trying to read filename");
-			exit(1);
+			job_exit(1);
 		}
 		write(outfile, &buffer, inode.namelen << 2);
 
@@ -254,7 +255,7 @@ int cramswap(char *sinfile, char *soutfile) {
 		if (fileoffset[file] != filepos) {
 			/* Not found */
 			fprintf(stderr, "Did not find the file which starts at word %x, aborting...\n", filepos);
-			exit(1);
+			job_exit(1);
 		}
 
 		/* Reduce file counter for each file which starts here (as said, can be more
@@ -296,7 +297,7 @@ int cramswap(char *sinfile, char *soutfile) {
 
 			if (read(infile, &buffer, readbytes) != readbytes) {
 				perror("while trying to read file data");
-				exit(1);
+				job_exit(1);
 			}
 			write(outfile, &buffer, readbytes);
 
@@ -29,6 +29,8 @@
 #include "cramfs.h"
 
 #include "os_byteswap.h"
+#include "util.h"
+#include "trace.h"
 
 #define PAGE_CACHE_SIZE (4096)
 
@@ -38,7 +40,11 @@ static unsigned long blksize = PAGE_CACHE_SIZE;
 static char *opt_devfile = NULL;
 static char *opt_idsfile = NULL;
 
-static int DIR_GID = 0;
+// the state of an extraction is per thread, several can run at once
+static __thread int DIR_GID = 0;
+
+// Glob of the files to extract, NULL for all (see path_glob_match)
+static __thread const char *opt_extract = NULL;
 
 void do_file_entry(const u8 * base, const char *dir, const char *path, const char *name, int namelen, const struct cramfs_inode *inode);
 
@@ -81,11 +87,12 @@ void uncompress_data(const u8 * base, const u8 * data, u32 size, u8 * dstdata) {
 
 ///////////////////////////////////////////////////////////////////////////////
 
-int stats_totalsize;
-int stats_totalcsize;
-int stats_count;
-int stats_compresses;
-int stats_expands;
+static __thread int stats_totalsize;
+static __thread int stats_totalcsize;
+static __thread int stats_count;
+static __thread int stats_compresses;
+static __thread int stats_expands;
+static __thread unsigned long long stats_written; // bytes of the files written, for the trace
 
 void clearstats() {
 	stats_totalsize = 0;
@@ -246,6 +253,9 @@ void do_file(const u8 * base, u32 offset, u32 size, const char *path, const char
 		perror("create");
 		return;
 	};
+	// the process umask is left alone, the image modes are set as they are
+	if (fchmod(fd, mode & 07777) == -1)
+		perror(path);
 
 	if (ftruncate(fd, size) == -1) {
 		perror("ftruncate");
@@ -265,6 +275,7 @@ void do_file(const u8 * base, u32 offset, u32 size, const char *path, const char
 	} else {
 		uncompress_data(base, base + offset, size, file_data);
 	}
+	stats_written += size;
 
 	munmap(file_data, size);
 	close(fd);
@@ -280,7 +291,7 @@ void do_directory(const u8 * base, u32 offset, u32 size, const char *path, const
 		return;
 	}
 	// Make the local directory
-	if (mkdir(path, mode) == -1) {
+	if (mkdir(path, mode) == -1 || chmod(path, mode & 07777) == -1) {
 		perror(path);
 		return;
 	}
@@ -304,7 +315,7 @@ void do_symlink(const u8 * base, u32 offset, u32 size, const char *path, const c
 	// Make local copy
 	if (symlink((const char *)link_contents, path) == -1) {
 		perror(path);
-		exit(1);
+		job_exit(1);
 	}
 }
 
@@ -321,7 +332,7 @@ void do_chrdev(const u8 * base, u32 offset, u32 size, const char *path, const ch
 	}
 	// Make local copy
 	if (geteuid() == 0) {
-		if (mknod(path, S_IFCHR | mode, size) == -1)
+		if (mknod(path, S_IFCHR | mode, size) == -1 || chmod(path, mode & 07777) == -1)
 			perror(path);
 	} else if (opt_devfile) {
 		char dfp[1024];
@@ -358,7 +369,7 @@ void do_blkdev(const u8 * base, u32 offset, u32 size, const char *path, const ch
 	}
 	// Make local copy
 	if (geteuid() == 0) {
-		if (mknod(path, S_IFBLK | mode, size) == -1)
+		if (mknod(path, S_IFBLK | mode, size) == -1 || chmod(path, mode & 07777) == -1)
 			perror(path);
 	} else if (opt_devfile) {
 		char dfp[1024];
@@ -391,7 +402,7 @@ void do_fifo(const u8 * base, u32 offset, u32 size, const char *path, const char
 	}
 	// Make local copy
 	if (geteuid() == 0) {
-		if (mknod(path, S_IFIFO | mode, 0) == -1)
+		if (mknod(path, S_IFIFO | mode, 0) == -1 || chmod(path, mode & 07777) == -1)
 			perror(path);
 	} else if (opt_devfile) {
 		char dfp[1024];
@@ -428,10 +439,21 @@ void do_unknown(const u8 * base, u32 offset, u32 size, const char *path, const c
 	printf("<UNKNOWN TYPE>   %s", name);
 }
 
+// How an entry of the directory at path matches the --extract glob
+static int entry_match(const char *path, const char *name, int namelen) {
+	if (opt_extract == NULL)
+		return PATH_GLOB_MATCH;
+
+	char pname[strlen(path) + namelen + 2];
+	sprintf(pname, "%s/%.*s", path, namelen, name);
+	return path_glob_match(opt_extract, pname);
+}
+
 void process_directory(const u8 * base, const char *dir, u32 offset, u32 size, const char *path) {
 	struct cramfs_inode *de;
 	char *name;
 	int namelen;
+	int match;
 	u32 current = offset;
 	u32 dirend = offset + size;
 
@@ -453,7 +475,10 @@ void process_directory(const u8 * base, const char *dir, u32 offset, u32 size, c
 			namelen--;
 		}
 
-		do_file_entry(base, dir, path, name, namelen, de);
+		// Directories are made on the way to the matching files
+		match = entry_match(path, name, namelen);
+		if (match == PATH_GLOB_MATCH || (match == PATH_GLOB_PARENT && S_ISDIR(de->mode)))
+			do_file_entry(base, dir, path, name, namelen, de);
 
 		current = nextoffset;
 	}
@@ -477,7 +502,8 @@ void process_directory(const u8 * base, const char *dir, u32 offset, u32 size, c
 			namelen--;
 		}
 
-		do_dir_entry(base, dir, path, name, namelen, de);
+		if (entry_match(path, name, namelen) != PATH_GLOB_NONE)
+			do_dir_entry(base, dir, path, name, namelen, de);
 
 		current = nextoffset;
 	}
@@ -613,6 +639,20 @@ void do_dir_entry(const u8 * base, const char *dir, const char *path, const char
 }
 
 ///////////////////////////////////////////////////////////////////////////////
+static int cramfs_check_super(struct cramfs_super const *sb, char *endian) {
+	int cram_magic = CRAMFS_MAGIC;
+	if (!memcmp(endian, "be", 2))
+		SWAP(cram_magic);
+	// Check cramfs magic number and signature
+	return (cram_magic == sb->magic || (memcmp(endian, "be", 2) && 0 == memcmp(sb->signature, CRAMFS_SIGNATURE, sizeof(sb->signature))));
+}
+
+int is_cramfs_image_mem(MFILE *file, char *endian) {
+	if (msize(file) < sizeof(struct cramfs_super))
+		return 0;
+	return cramfs_check_super(mdata(file, struct cramfs_super), endian);
+}
+
 int is_cramfs_image(char const *imagefile, char *endian) {
 	struct stat st;
 	int fd, result;
@@ -623,25 +663,24 @@ int is_cramfs_image(char const *imagefile, char *endian) {
 	// Check the image file
 	if (stat(imagefile, &st) == -1) {
 		perror(imagefile);
-		exit(1);
+		job_exit(1);
 	}
 	// Map the cramfs image
 	fd = open(imagefile, O_RDONLY);
+	if (fd == -1) {
+		perror(imagefile);
+		job_exit(1);
+	}
 	fslen_ub = st.st_size;
 	rom_image = mmap(0, fslen_ub, PROT_READ, MAP_SHARED, fd, 0);
 	if (rom_image == MAP_FAILED) {
 		perror("Mapping cramfs file");
-		exit(1);
+		close(fd);
+		job_exit(1);
 	}
 
 	sb = (struct cramfs_super const *)(rom_image);
-	int cram_magic = CRAMFS_MAGIC;
-	if (!memcmp(endian, "be", 2))
-		SWAP(cram_magic);
-	result = 0;
-	// Check cramfs magic number and signature
-	if (cram_magic == sb->magic || (memcmp(endian, "be", 2) && 0 == memcmp(sb->signature, CRAMFS_SIGNATURE, sizeof(sb->signature))))
-		result = 1;
+	result = cramfs_check_super(sb, endian);
 
 	munmap(rom_image, fslen_ub);
 	close(fd);
@@ -649,49 +688,71 @@ int is_cramfs_image(char const *imagefile, char *endian) {
 	return result;
 }
 
-int uncramfs(char const *dirname, char const *imagefile) {
+/* The mapped image, unmapped if the extraction gives up */
+struct cramfs_image {
+	int fd;
+	u8 const *data;
+	size_t size;
+};
+
+static void cramfs_image_cleanup(void *arg) {
+	struct cramfs_image *image = (struct cramfs_image *)arg;
+	munmap((void *)image->data, image->size);
+	close(image->fd);
+}
+
+// Only the files matching extract are written, all of them if it's NULL
+int uncramfs(char const *dirname, char const *imagefile, const char *extract) {
 
 	struct stat st;
-	int fd;
-	size_t fslen_ub;
-	u8 const *rom_image;
+	struct cramfs_image image;
 	struct cramfs_super const *sb;
 
 	// Check the directory
 	if (access(dirname, W_OK) == -1) {
 		if (errno != ENOENT) {
 			perror(dirname);
-			exit(1);
+			job_exit(1);
 		}
 	}
-	// Check the image file
-	if (stat(imagefile, &st) == -1) {
+	// Map the cramfs image
+	image.fd = open(imagefile, O_RDONLY);
+	if (image.fd == -1 || fstat(image.fd, &st) == -1) {
 		perror(imagefile);
-		exit(1);
+		if (image.fd != -1)
+			close(image.fd);
+		job_exit(1);
 	}
-	// Map the cramfs image
-	fd = open(imagefile, O_RDONLY);
-	fslen_ub = st.st_size;
-	rom_image = mmap(0, fslen_ub, PROT_READ, MAP_SHARED, fd, 0);
-	if (rom_image == MAP_FAILED) {
+	image.size = st.st_size;
+	image.data = mmap(0, image.size, PROT_READ, MAP_SHARED, image.fd, 0);
+	if (image.data == MAP_FAILED) {
 		perror("Mapping cramfs file");
-		exit(1);
+		close(image.fd);
+		job_exit(1);
 	}
+	struct job_cleanup image_cleanup;
+	job_push_cleanup(&image_cleanup, cramfs_image_cleanup, &image);
 
-	sb = (struct cramfs_super const *)(rom_image);
+	sb = (struct cramfs_super const *)(image.data);
 	// Check cramfs magic number and signature
 	if (CRAMFS_MAGIC != sb->magic || 0 != memcmp(sb->signature, CRAMFS_SIGNATURE, sizeof(sb->signature))) {
 		fprintf(stderr, "The image file doesn't have cramfs signatures\n");
-		exit(1);
+		job_exit(1);
 	}
-	// Set umask to 0 to let the image modes shine through
-	umask(0);
 
 	clearstats();
+	stats_written = 0;
+	DIR_GID = 0;
+	opt_extract = extract;
 
 	// Start doing...
-	do_file_entry(rom_image, dirname, "", "", 0, &sb->root);
-	do_dir_entry(rom_image, dirname, "", "", 0, &sb->root);
-
+	struct trace_span span;
+	trace_begin(&span, TRACE_CRAMFS, imagefile);
+	do_file_entry(image.data, dirname, "", "", 0, &sb->root);
+	do_dir_entry(image.data, dirname, "", "", 0, &sb->root);
+	trace_end(&span, image.size, stats_written);
+
+	job_pop_cleanup(&image_cleanup);
+	cramfs_image_cleanup(&image);
 	return 0;
 }
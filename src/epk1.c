@@ -3,21 +3,25 @@
 #include <fcntl.h>
 #include <errno.h>
 
-#include "main.h" //for handle_file
+#include "main.h" //for handle_artifact
+#include "artifact.h"
 #include "epk1.h"
 #include "os_byteswap.h"
 #include "util.h"
+#include "trace.h"
+
+int isFileEPK1_mem(MFILE *file) {
+	return msize(file) >= 4 && !memcmp(mdata(file, uint8_t), "epak", 4);
+}
 
 int isFileEPK1(const char *epk_file) {
-	FILE *file = fopen(epk_file, "rb");
+	MFILE *file = mopen(epk_file, O_RDONLY);
 	if (file == NULL) {
 		err_exit("Can't open file %s\n\n", epk_file);
 	}
-	char magic[4];
-	if (fread(&magic, 1, 4, file) != 4)
-		return 0;
-	fclose(file);
-	return !memcmp(&magic, "epak", 4);
+	int result = isFileEPK1_mem(file);
+	mclose(file);
+	return result;
 }
 
 void printHeaderInfo(struct epk1Header_t *epakHeader) {
@@ -35,55 +39,99 @@ void printNewHeaderInfo(struct epk1NewHeader_t *epakHeader) {
 }
 
 void constructVerString(char *fw_version, struct epk1Header_t *epakHeader) {
-	sprintf(fw_version, "%02x.%02x.%02x-%s", epakHeader->fwVer[2], epakHeader->fwVer[1], epakHeader->fwVer[0], epakHeader->otaID);
+	sprintf(fw_version, "%02x.%02x.%02x-%.32s", epakHeader->fwVer[2], epakHeader->fwVer[1], epakHeader->fwVer[0], epakHeader->otaID);
 }
 
 void constructNewVerString(char *fw_version, struct epk1NewHeader_t *epakHeader) {
-	sprintf(fw_version, "%02x.%02x.%02x-%s", epakHeader->fwVer[2], epakHeader->fwVer[1], epakHeader->fwVer[0], epakHeader->otaID);
+	sprintf(fw_version, "%02x.%02x.%02x-%.32s", epakHeader->fwVer[2], epakHeader->fwVer[1], epakHeader->fwVer[0], epakHeader->otaID);
+}
+
+/*
+ * Gets size bytes of the input at offset, the previous pointers are invalid afterwards
+ */
+static void *epk1_data(MFILE *file, off_t offset, size_t size) {
+	void *data = mfile_window(file, offset, size);
+	if (data == NULL)
+		err_exit("\nCannot mmap input file at 0x%jx (%s). Aborting\n\n", (intmax_t)offset, strerror(errno));
+	return data;
+}
+
+static void mfile_cleanup(void *arg) {
+	mclose((MFILE *)arg);
+}
+
+static void artifact_cleanup(void *arg) {
+	artifact_free((struct artifact *)arg);
+}
+
+static void stream_cleanup(void *arg) {
+	fclose((FILE *)arg);
+}
+
+/*
+ * Writes a PAK, straight from the input mapping, and hands it to the next stage
+ */
+static void epk1_write_pak(MFILE *file, off_t offset, size_t size, const char *filename, struct config_opts_t *pak_opts) {
+	struct trace_span span;
+	struct job_cleanup pak_cleanup, out_cleanup;
+	struct artifact *pak = artifact_new(filename, pak_opts);
+	job_push_cleanup(&pak_cleanup, artifact_cleanup, pak);
+	trace_begin(&span, TRACE_WRITE, filename);
+	FILE *outfile = fopen(pak->path, "wb");
+	if (outfile == NULL)
+		err_exit("Cannot open %s for writing (%s)\n", filename, strerror(errno));
+	job_push_cleanup(&out_cleanup, stream_cleanup, outfile);
+	if (fwrite(epk1_data(file, offset, size), 1, size, outfile) != size)
+		err_exit("Cannot write %s (%s)\n", filename, strerror(errno));
+	job_pop_cleanup(&out_cleanup);
+	// a PAK that can't be written is freed by its cleanup
+	if (fclose(outfile) != 0)
+		err_exit("Cannot write %s (%s)\n", filename, strerror(errno));
+	trace_end(&span, size, size);
+	job_pop_cleanup(&pak_cleanup);
+	handle_artifact(pak, pak_opts);
 }
 
 void extract_epk1_file(const char *epk_file, struct config_opts_t *config_opts) {
-	int file;
-	if (!(file = open(epk_file, O_RDONLY))) {
+	struct job_cleanup in_cleanup;
+	MFILE *file = mopen_window(epk_file, O_RDONLY, config_opts->mmap_window);
+	if (file == NULL) {
 		err_exit("\nCan't open file %s\n\n", epk_file);
 	}
-	struct stat statbuf;
-	if (fstat(file, &statbuf) < 0) {
-		err_exit("\nfstat error\n\n");
-	}
-	int fileLength = statbuf.st_size;
-	printf("File size: %d bytes\n", fileLength);
-	void *buffer;
-	if ((buffer = mmap(0, fileLength, PROT_READ, MAP_SHARED, file, 0)) == MAP_FAILED) {
-		err_exit("\nCannot mmap input file (%s). Aborting\n\n", strerror(errno));
-	}
-	char verString[12];
+	job_push_cleanup(&in_cleanup, mfile_cleanup, file);
+	off_t fileLength = msize(file);
+	printf("File size: %jd bytes\n", (intmax_t)fileLength);
+	char verString[48]; // version and otaID
 	int index;
-	uint32_t pakcount = ((struct epk1Header_t *)buffer)->pakCount;
+	// the PAKs go to a version subfolder, the caller's options are left alone
+	struct config_opts_t pak_opts = *config_opts;
+	pak_opts.extract_path = pak_extract_path(config_opts->extract_path);
+	uint32_t pakcount = ((struct epk1Header_t *)epk1_data(file, 0, sizeof(struct epk1Header_t)))->pakCount;
 	if (pakcount >> 8 != 0) {
 		SWAP(pakcount);
 		printf("\nFirmware type is EPK1 Big Endian...\n");
 		unsigned char *header = malloc(sizeof(struct epk1BEHeader_t));	//allocate space for header
-		memcpy(header, buffer, sizeof(struct epk1BEHeader_t));	//copy header to buffer
+		memcpy(header, epk1_data(file, 0, sizeof(struct epk1BEHeader_t)), sizeof(struct epk1BEHeader_t));	//copy header to buffer
 		struct epk1BEHeader_t *epakHeader = (struct epk1BEHeader_t *)header;	//make struct from buffer
 		SWAP(epakHeader->fileSize);
 		SWAP(epakHeader->pakCount);
 		SWAP(epakHeader->offset);
 
-		uint32_t *fwVer = buffer + epakHeader->offset - 4;
-		printf("\nFirmware otaID: %s\n", (char *)(buffer + epakHeader->offset + 8));
+		uint32_t fwVer[1];
+		memcpy(fwVer, epk1_data(file, epakHeader->offset - 4, sizeof(fwVer)), sizeof(fwVer));
+		printf("\nFirmware otaID: %.32s\n", (char *)epk1_data(file, epakHeader->offset + 8, 32));
 		printf("Firmware version: %02x.%02x.%02x.%02x\n", (fwVer[0] >> (8 * 0)) & 0xff, (fwVer[0] >> (8 * 1)) & 0xff, (fwVer[0] >> (8 * 2)) & 0xff, (fwVer[0] >> (8 * 3)) & 0xff);
 		printf("PAK count: %d\n", epakHeader->pakCount);
 		printf("PAKs total size: %d\n", epakHeader->fileSize);
 
 		sprintf(verString, "%02x.%02x.%02x", (fwVer[0] >> (8 * 1)) & 0xff, (fwVer[0] >> (8 * 2)) & 0xff, (fwVer[0] >> (8 * 3)) & 0xff);
-		sprintf(config_opts->dest_dir, "%s/%s", config_opts->dest_dir, verString);
-		createFolder(config_opts->dest_dir);
+		asprintf(&pak_opts.dest_dir, "%s/%s", config_opts->dest_dir, verString);
+		createFolder(pak_opts.dest_dir);
 
-		unsigned long int offset = 0xC;
+		off_t offset = 0xC;
 		for (index = 0; index < epakHeader->pakCount; index++) {
 			struct pakRec_t *pakRecord = malloc(sizeof(struct pakRec_t));	//allocate space for header
-			memcpy(pakRecord, buffer + offset, sizeof(struct pakRec_t));	//copy pakRecord to buffer
+			memcpy(pakRecord, epk1_data(file, offset, sizeof(struct pakRec_t)), sizeof(struct pakRec_t));	//copy pakRecord to buffer
 
 			if (pakRecord->offset == 0) {
 				offset += 8;
@@ -94,19 +142,23 @@ void extract_epk1_file(const char *epk_file, struct config_opts_t *config_opts)
 			SWAP(pakRecord->offset);
 			SWAP(pakRecord->size);
 			unsigned char *pheader = malloc(sizeof(struct pakHeader_t));
-			memcpy(pheader, (buffer + pakRecord->offset), sizeof(struct pakHeader_t));
+			memcpy(pheader, epk1_data(file, pakRecord->offset, sizeof(struct pakHeader_t)), sizeof(struct pakHeader_t));
 			struct pakHeader_t *pakHeader = (struct pakHeader_t *)pheader;
 			SWAP(pakHeader->pakSize);
-			pakHeader = (struct pakHeader_t *)(buffer + pakRecord->offset);
 			char pakName[5] = "";
 			sprintf(pakName, "%.*s", 4, pakHeader->pakName);
 			char filename[255] = "";
-			sprintf(filename, "%s/%s.pak", config_opts->dest_dir, pakName);
-			printf("\n#%u/%u saving PAK (name='%s', platform='%s', offset=0x%x, size='%d') to file %s\n", index + 1, epakHeader->pakCount, pakName, pakHeader->platform, pakRecord->offset, pakRecord->size, filename);
-			FILE *outfile = fopen(((const char *)filename), "wb");
-			fwrite(pakHeader->pakName + sizeof(struct pakHeader_t), 1, pakRecord->size - 132, outfile);
-			fclose(outfile);
-			handle_file(filename, config_opts);
+			sprintf(filename, "%s/%s.pak", pak_opts.dest_dir, pakName);
+			if (!pak_selected(config_opts, pakHeader->pakName, sizeof(pakHeader->pakName))) {
+				printf("\n#%u/%u skipping PAK (%s)\n", index + 1, epakHeader->pakCount, pakName);
+				free(pakRecord);
+				free(pheader);
+				offset += 8;
+				continue;
+			}
+			printf("\n#%u/%u saving PAK (name='%s', platform='%.15s', offset=0x%x, size='%d') to file %s\n", index + 1, epakHeader->pakCount, pakName, pakHeader->platform, pakRecord->offset, pakRecord->size, filename);
+			epk1_write_pak(file, (off_t)pakRecord->offset + sizeof(struct pakHeader_t), pakRecord->size - 132, filename, &pak_opts);
+			report_progress(config_opts, pakName, index + 1, epakHeader->pakCount);
 			free(pakRecord);
 			free(pheader);
 			offset += 8;
@@ -114,47 +166,56 @@ void extract_epk1_file(const char *epk_file, struct config_opts_t *config_opts)
 		free(header);
 	} else if (pakcount < 21) {	// old EPK1 header
 		printf("\nFirmware type is EPK1...\n");
-		struct epk1Header_t *epakHeader = (struct epk1Header_t *)buffer;
+		struct epk1Header_t *epakHeader = malloc(sizeof(struct epk1Header_t));
+		memcpy(epakHeader, epk1_data(file, 0, sizeof(struct epk1Header_t)), sizeof(struct epk1Header_t));
 		printHeaderInfo(epakHeader);
 		constructVerString(verString, epakHeader);
-		sprintf(config_opts->dest_dir, "%s/%s", config_opts->dest_dir, verString);
-		createFolder(config_opts->dest_dir);
+		asprintf(&pak_opts.dest_dir, "%s/%s", config_opts->dest_dir, verString);
+		createFolder(pak_opts.dest_dir);
 		for (index = 0; index < epakHeader->pakCount; index++) {
 			struct pakRec_t pakRecord = epakHeader->pakRecs[index];
-			struct pakHeader_t *pakHeader;
-			pakHeader = (struct pakHeader_t *)(buffer + pakRecord.offset);
+			struct pakHeader_t pakHeader;
+			memcpy(&pakHeader, epk1_data(file, pakRecord.offset, sizeof(pakHeader)), sizeof(pakHeader));
 			char pakName[5] = "";
-			sprintf(pakName, "%.*s", 4, pakHeader->pakName);
+			sprintf(pakName, "%.*s", 4, pakHeader.pakName);
 			char filename[255] = "";
-			sprintf(filename, "%s/%s.pak", config_opts->dest_dir, pakName);
-			printf("\n#%u/%u saving PAK (name='%s', platform='%s', offset=0x%x, size='%d') to file %s\n", index + 1, epakHeader->pakCount, pakName, pakHeader->platform, pakRecord.offset, pakRecord.size, filename);
-			FILE *outfile = fopen(((const char *)filename), "wb");
-			fwrite(pakHeader->pakName + sizeof(struct pakHeader_t), 1, pakRecord.size - 132, outfile);
-			fclose(outfile);
-			handle_file(filename, config_opts);
+			sprintf(filename, "%s/%s.pak", pak_opts.dest_dir, pakName);
+			if (!pak_selected(config_opts, pakHeader.pakName, sizeof(pakHeader.pakName))) {
+				printf("\n#%u/%u skipping PAK (%s)\n", index + 1, epakHeader->pakCount, pakName);
+				continue;
+			}
+			printf("\n#%u/%u saving PAK (name='%s', platform='%.15s', offset=0x%x, size='%d') to file %s\n", index + 1, epakHeader->pakCount, pakName, pakHeader.platform, pakRecord.offset, pakRecord.size, filename);
+			epk1_write_pak(file, (off_t)pakRecord.offset + sizeof(struct pakHeader_t), pakRecord.size - 132, filename, &pak_opts);
+			report_progress(config_opts, pakName, index + 1, epakHeader->pakCount);
 		}
+		free(epakHeader);
 	} else {					// new EPK1 header
 		printf("\nFirmware type is EPK1(new)...\n");
-		struct epk1NewHeader_t *epakHeader = (struct epk1NewHeader_t *)(buffer);
+		struct epk1NewHeader_t *epakHeader = malloc(sizeof(struct epk1NewHeader_t));
+		memcpy(epakHeader, epk1_data(file, 0, sizeof(struct epk1NewHeader_t)), sizeof(struct epk1NewHeader_t));
 		printNewHeaderInfo(epakHeader);
 		constructNewVerString(verString, epakHeader);
-		sprintf(config_opts->dest_dir, "%s/%s", config_opts->dest_dir, verString);
-		createFolder(config_opts->dest_dir);
+		asprintf(&pak_opts.dest_dir, "%s/%s", config_opts->dest_dir, verString);
+		createFolder(pak_opts.dest_dir);
 		for (index = 0; index < epakHeader->pakCount; index++) {
 			struct pakRec_t pakRecord = epakHeader->pakRecs[index];
-			struct pakHeader_t *pakHeader = (struct pakHeader_t *)(buffer + pakRecord.offset);
+			struct pakHeader_t pakHeader;
+			memcpy(&pakHeader, epk1_data(file, pakRecord.offset, sizeof(pakHeader)), sizeof(pakHeader));
 			char pakName[5] = "";
-			sprintf(pakName, "%.*s", 4, pakHeader->pakName);
+			sprintf(pakName, "%.*s", 4, pakHeader.pakName);
 			char filename[255] = "";
-			sprintf(filename, "%s/%s.pak", config_opts->dest_dir, pakName);
-			printf("\n#%u/%u saving PAK (name='%s', platform='%s', offset=0x%x, size='%d') to file %s\n", index + 1, epakHeader->pakCount, pakName, pakHeader->platform, pakRecord.offset, pakRecord.size, filename);
-			FILE *outfile = fopen(((const char *)filename), "wb");
-			fwrite(pakHeader->pakName + sizeof(struct pakHeader_t), 1, pakHeader->pakSize + 4, outfile);
-			fclose(outfile);
-			handle_file(filename, config_opts);
+			sprintf(filename, "%s/%s.pak", pak_opts.dest_dir, pakName);
+			if (!pak_selected(config_opts, pakHeader.pakName, sizeof(pakHeader.pakName))) {
+				printf("\n#%u/%u skipping PAK (%s)\n", index + 1, epakHeader->pakCount, pakName);
+				continue;
+			}
+			printf("\n#%u/%u saving PAK (name='%s', platform='%.15s', offset=0x%x, size='%d') to file %s\n", index + 1, epakHeader->pakCount, pakName, pakHeader.platform, pakRecord.offset, pakRecord.size, filename);
+			epk1_write_pak(file, (off_t)pakRecord.offset + sizeof(struct pakHeader_t), (size_t)pakHeader.pakSize + 4, filename, &pak_opts);
+			report_progress(config_opts, pakName, index + 1, epakHeader->pakCount);
 		}
+		free(epakHeader);
 	}
-	if (munmap(buffer, fileLength) == -1)
-		printf("Error un-mmapping the file");
-	close(file);
+	job_pop_cleanup(&in_cleanup);
+	mclose(file);
+	free(pak_opts.dest_dir);
 }
@@ -1,316 +1,838 @@
 #include <unistd.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <fcntl.h>
-#include <dirent.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <zlib.h>
 
-#include "main.h" //for handle_file
+#include "main.h" //for handle_artifact
+#include "artifact.h"
 #include "epk2.h"
 #include "crc.h"
 #include "util.h"
+#include "aes_ecb.h"
+#include "thpool.h"
+#include "keyring.h"
+#include "pipe_reader.h"
+#include "verify.h"
+#include "trace.h"
 
-EVP_PKEY *_gpPubKey;
-AES_KEY _gdKeyImage, _geKeyImage;
 const char EPK2_MAGIC[] = "EPK2";
 const char EPK3_MAGIC[] = "EPK3";
 int fileLength;
-unsigned char aes_key[16];
-
-void SWU_CryptoInit_PEM(char *configuration_dir, char *pem_file) {
-	OpenSSL_add_all_digests();
-	ERR_load_CRYPTO_strings();
-	char pem_file_name[1024] = "";
-	strcat(pem_file_name, configuration_dir);
-	strcat(pem_file_name, "/");
-	strcat(pem_file_name, pem_file);
-	FILE *pubKeyFile = fopen(pem_file_name, "r");
-	if (pubKeyFile == NULL) {
-		printf("Error: Can't open PEM file %s\n\n", pem_file);
-		exit(1);
-	}
-	EVP_PKEY *gpPubKey = PEM_read_PUBKEY(pubKeyFile, NULL, NULL, NULL);
-	_gpPubKey = gpPubKey;
-	if (_gpPubKey == NULL) {
-		printf("Error: Can't read PEM signature from file %s\n\n", pem_file);
-		fclose(pubKeyFile);
-		exit(1);
-	}
-	fclose(pubKeyFile);
-	ERR_clear_error();
-}
-
-void SWU_CryptoInit_AES(const unsigned char *AES_KEY) {
-	int size = SIGNATURE_SIZE;
-	AES_set_decrypt_key(AES_KEY, size, &_gdKeyImage);
-	AES_set_encrypt_key(AES_KEY, size, &_geKeyImage);
-}
-
-int API_SWU_VerifyImage(unsigned char *image, unsigned int imageSize) {
-	unsigned char md_value[0x40];
+
+/* The keys an EPK is read with, one set per extraction so that several can run side by side */
+struct swu_keys {
+	EVP_PKEY *pub; // the PEM key that verified the header, owned by the keyring
+	struct aes_ecb *aes; // decryption context, reused for every segment
+};
+
+void SWU_CryptoInit_AES(struct swu_keys *keys, const unsigned char *AES_KEY) {
+	if (keys->aes == NULL)
+		keys->aes = aes_ecb_new(AES_KEY);
+	else if (aes_ecb_set_key(keys->aes, AES_KEY) < 0)
+		err_exit("Cannot set AES key\n");
+	if (keys->aes == NULL)
+		err_exit("Cannot create AES context\n");
+}
+
+int API_SWU_VerifyImage(EVP_PKEY *key, unsigned char *image, unsigned int imageSize) {
+	unsigned char md_value[EVP_MAX_MD_SIZE];
 	unsigned int md_len = 0;
-	EVP_MD_CTX ctx1, ctx2;
-	EVP_DigestInit(&ctx1, EVP_get_digestbyname("sha1"));
-	EVP_DigestUpdate(&ctx1, image + SIGNATURE_SIZE, imageSize - SIGNATURE_SIZE);
-	EVP_DigestFinal(&ctx1, (unsigned char *)&md_value, &md_len);
-	EVP_DigestInit(&ctx2, EVP_sha1());
-	EVP_DigestUpdate(&ctx2, &md_value, md_len);
+	EVP_MD_CTX *ctx1 = EVP_MD_CTX_new();
+	EVP_MD_CTX *ctx2 = EVP_MD_CTX_new();
+	if (ctx1 == NULL || ctx2 == NULL)
+		err_exit("Cannot create digest context\n");
+	EVP_DigestInit(ctx1, EVP_sha1());
+	EVP_DigestUpdate(ctx1, image + SIGNATURE_SIZE, imageSize - SIGNATURE_SIZE);
+	EVP_DigestFinal(ctx1, md_value, &md_len);
+	EVP_DigestInit(ctx2, EVP_sha1());
+	EVP_DigestUpdate(ctx2, md_value, md_len);
 	int result = 0;
-	if (EVP_VerifyFinal(&ctx2, image, SIGNATURE_SIZE, _gpPubKey) == 1)
+	if (EVP_VerifyFinal(ctx2, image, SIGNATURE_SIZE, key) == 1)
 		result = 1;
-	EVP_MD_CTX_cleanup(&ctx1);
-	EVP_MD_CTX_cleanup(&ctx2);
+	EVP_MD_CTX_free(ctx1);
+	EVP_MD_CTX_free(ctx2);
 	return result;
 }
 
-void decryptImage(unsigned char *srcaddr, unsigned int len, unsigned char *dstaddr) {
-	unsigned int remaining = len;
-	unsigned int decrypted = 0;
-	while (remaining >= AES_BLOCK_SIZE) {
-		AES_decrypt(srcaddr, dstaddr, &_gdKeyImage);
-		srcaddr += AES_BLOCK_SIZE;
-		dstaddr += AES_BLOCK_SIZE;
-		remaining -= AES_BLOCK_SIZE;
-		decrypted++;
-	}
-	if (remaining != 0) {
-		decrypted = decrypted * AES_BLOCK_SIZE;
-		memcpy(dstaddr, srcaddr, remaining);
+/* DER DigestInfo prefixes for SHA-1, with and without NULL parameters */
+static const unsigned char sha1_digest_info[] = {
+	0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e, 0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14
+};
+static const unsigned char sha1_digest_info_short[] = {
+	0x30, 0x1f, 0x30, 0x07, 0x06, 0x05, 0x2b, 0x0e, 0x03, 0x02, 0x1a, 0x04, 0x14
+};
+
+/*
+ * Recovers the signed digest, SHA1(SHA1(data)), from an image signature
+ * Returns 0 on success, 1 if the signature wasn't made with this key,
+ * -1 if the key is not one the digest can be recovered with
+ */
+static int SWU_RecoverDigest(EVP_PKEY *key, const unsigned char *signature, unsigned char *digest) {
+	if (EVP_PKEY_base_id(key) != EVP_PKEY_RSA || EVP_PKEY_size(key) != SIGNATURE_SIZE)
+		return -1;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+	if (ctx == NULL)
+		return -1;
+	// no signature digest is set: both DigestInfo encodings are checked below
+	if (EVP_PKEY_verify_recover_init(ctx) <= 0 || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0) {
+		EVP_PKEY_CTX_free(ctx);
+		return -1;
 	}
+
+	unsigned char decrypted[SIGNATURE_SIZE];
+	size_t dlen = sizeof(decrypted);
+	int len = -1;
+	if (EVP_PKEY_verify_recover(ctx, decrypted, &dlen, signature, SIGNATURE_SIZE) > 0)
+		len = dlen;
+	EVP_PKEY_CTX_free(ctx);
+
+	const unsigned char *prefix = NULL;
+	if (len == sizeof(sha1_digest_info) + SHA_DIGEST_LENGTH)
+		prefix = sha1_digest_info;
+	else if (len == sizeof(sha1_digest_info_short) + SHA_DIGEST_LENGTH)
+		prefix = sha1_digest_info_short;
+	// bad padding or DigestInfo: no size can verify with this key
+	if (prefix == NULL || memcmp(decrypted, prefix, len - SHA_DIGEST_LENGTH))
+		return 1;
+
+	memcpy(digest, decrypted + len - SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH);
+	return 0;
 }
 
-void printPAKinfo(struct pak2_t *pak) {
-	printf("\nPAK '%.4s' contains %d segment(s):\n", pak->header->name, pak->segment_count);
-	int index = 0;
-	for (index = 0; index < pak->segment_count; index++) {
-		struct pak2segment_t *PAKsegment = pak->segments[index];
-		int headerSize = sizeof(struct pak2segmentHeader_t);
-		unsigned char *decrypted = calloc(1, headerSize);
-		decryptImage(PAKsegment->header->signature, headerSize, decrypted);
-		//hexdump(decrypted, headerSize);
-		struct pak2segmentHeader_t *decryptedSegmentHeader = (struct pak2segmentHeader_t *)decrypted;
-		printf("  segment #%u (name='%.4s', version='%02x.%02x.%02x.%02x', platform='%s', offset='0x%x', size='%u bytes', ", index + 1, pak->header->name, decryptedSegmentHeader->version[3], decryptedSegmentHeader->version[2], decryptedSegmentHeader->version[1], decryptedSegmentHeader->version[0], decryptedSegmentHeader->platform, PAKsegment->content_file_offset, PAKsegment->content_len);
-		switch ((build_type_t) decryptedSegmentHeader->devmode) {
-		case RELEASE:
-			printf("build=RELEASE");
-			break;
-		case DEBUG:
-			printf("build=DEBUG");
-			break;
-		case TEST:
-			printf("build=TEST");
+#define SIG_SEARCH_MIN_RANGE 0x10000 // signed lengths checked per task, at least
+
+struct sig_search_job {
+	const unsigned char *data; // signed data, after the signature
+	unsigned int min_len; // of the signed data
+	unsigned int max_len;
+	unsigned int range;
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	unsigned int *found; // per task, longest matching length + 1 (0 = none)
+};
+
+/*
+ * Streams SHA-1 over the data once, finalizing a snapshot of the context at every length in the range
+ */
+static void sig_search_range(void *arg, unsigned int worker, unsigned int index) {
+	struct sig_search_job *job = (struct sig_search_job *)arg;
+	unsigned int len = job->min_len + index * job->range;
+	unsigned int last = job->max_len;
+	if (last - len >= job->range)
+		last = len + job->range - 1;
+
+	unsigned char md[SHA_DIGEST_LENGTH], md2[SHA_DIGEST_LENGTH];
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	EVP_MD_CTX *snap = EVP_MD_CTX_new();
+	if (ctx == NULL || snap == NULL)
+		err_exit("Cannot create digest context\n");
+	EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+	EVP_DigestUpdate(ctx, job->data, len);
+	while (1) {
+		EVP_MD_CTX_copy_ex(snap, ctx);
+		EVP_DigestFinal_ex(snap, md, NULL);
+		EVP_Digest(md, sizeof(md), md2, NULL, EVP_sha1(), NULL);
+		if (!memcmp(md2, job->digest, sizeof(md2)))
+			job->found[index] = len + 1;
+		if (len == last)
 			break;
-		default:
-			printf("build=UNKNOWN 0x%x\n", decryptedSegmentHeader->devmode);
+		EVP_DigestUpdate(ctx, job->data + len, 1);
+		len++;
+	}
+	EVP_MD_CTX_free(snap);
+	EVP_MD_CTX_free(ctx);
+}
+
+/*
+ * Finds the longest imageSize in [minSize, maxSize] (signature included) for which image verifies
+ * The expected digest is recovered from the signature once, then the data is hashed in one pass
+ * (split across up to nthreads threads) instead of once per candidate size
+ * Returns the verified size, or 0 if none
+ */
+unsigned int API_SWU_VerifyImagePrefix(EVP_PKEY *key, unsigned char *image, unsigned int minSize, unsigned int maxSize, unsigned int nthreads) {
+	if (minSize <= SIGNATURE_SIZE)
+		minSize = SIGNATURE_SIZE + 1;
+	if (maxSize < minSize)
+		return 0;
+
+	struct sig_search_job job = {
+		.data = image + SIGNATURE_SIZE,
+		.min_len = minSize - SIGNATURE_SIZE,
+		.max_len = maxSize - SIGNATURE_SIZE
+	};
+	int recovered = SWU_RecoverDigest(key, image, job.digest);
+	if (recovered > 0)
+		return 0;
+	if (recovered < 0) {
+		// not an RSA key we can recover from, try every size
+		unsigned int size;
+		for (size = maxSize; size >= minSize; size--) {
+			if (API_SWU_VerifyImage(key, image, size))
+				return size;
 		}
-		printf(")\n");
-		free(decrypted);
+		return 0;
+	}
+
+	unsigned int total = job.max_len - job.min_len + 1;
+	if (nthreads < 1)
+		nthreads = 1;
+	job.range = total / nthreads + 1;
+	if (job.range < SIG_SEARCH_MIN_RANGE)
+		job.range = SIG_SEARCH_MIN_RANGE;
+	unsigned int count = (total - 1) / job.range + 1;
+	job.found = calloc(count, sizeof(*job.found));
+
+	unsigned int i, size = 0;
+	if (thpool_for(count, nthreads, sig_search_range, &job) < 0) {
+		for (i = 0; i < count; i++)
+			sig_search_range(&job, 0, i);
 	}
+
+	for (i = 0; i < count; i++) {
+		if (job.found[i] != 0)
+			size = job.found[i] - 1 + SIGNATURE_SIZE;
+	}
+	free(job.found);
+	return size;
 }
 
-void SelectAESkey(struct pak2_t *pak, struct config_opts_t *config_opts) {
-	char key_file_name[1024] = "";
-	strcat(key_file_name, config_opts->config_dir);
-	strcat(key_file_name, "/");
-	strcat(key_file_name, "AES.key");
-	FILE *fp = fopen(key_file_name, "r");
-	if (fp == NULL) {
-		printf("\nError: Cannot open AES.key file.\n\n");
-		exit(1);
+/*
+ * Decrypts the whole blocks of srcaddr in one go (split across threads when big)
+ * A trailing partial block is copied as is
+ */
+void decryptImage(struct swu_keys *keys, unsigned char *srcaddr, unsigned int len, unsigned char *dstaddr) {
+	struct trace_span span;
+	trace_begin(&span, TRACE_DECRYPT, NULL);
+	aes_ecb_decrypt(keys->aes, srcaddr, len, dstaddr);
+	trace_end(&span, len, len);
+}
+
+/*
+ * Key cache fingerprints: "hdr:" + SHA-1 of the header signature (one per firmware)
+ * and "ota:" + otaID (one per firmware family)
+ */
+#define KEY_FINGERPRINT_SIZE 48
+
+static void SWU_HeaderFingerprint(const unsigned char *signature, char *fingerprint) {
+	unsigned char md[SHA_DIGEST_LENGTH];
+	int i;
+	SHA1(signature, SIGNATURE_SIZE, md);
+	strcpy(fingerprint, "hdr:");
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+		sprintf(&fingerprint[4 + 2 * i], "%02x", md[i]);
+}
+
+static void SWU_OtaFingerprint(const unsigned char *otaID, char *fingerprint) {
+	char *p;
+	snprintf(fingerprint, KEY_FINGERPRINT_SIZE, "ota:%.32s", otaID);
+	// the cache file is tab separated
+	for (p = fingerprint; *p; p++) {
+		if (*p < ' ')
+			*p = '_';
 	}
+}
 
-	int headerSize = sizeof(struct pak2segmentHeader_t);
-	unsigned char decrypted[headerSize];
-	char *line = NULL;
-	size_t len, count;
-	ssize_t read;
-
-	while ((read = getline(&line, &len, fp)) != -1) {
-		char *pos = line;
-		for (count = 0; count < sizeof(aes_key) / sizeof(aes_key[0]); count++) {
-			sscanf(pos, "%2hhx", &aes_key[count]);
-			pos += 2 * sizeof(char);
+/*
+ * Tries the PEM keys, the ones that worked for this firmware before first
+ * Returns the signed length of image, 0 if no key verifies it, and the key in index
+ */
+static unsigned int SWU_SelectPEM(struct keyring *kr, struct swu_keys *keys, unsigned char *image, unsigned int maxSize, const char **fingerprints, unsigned int nfingerprints, int *index) {
+	unsigned int *order = calloc(kr->npems + 1, sizeof(*order));
+	unsigned int count = keyring_order(kr, KEYRING_PEM, fingerprints, nfingerprints, order);
+	unsigned int i, size = 0;
+
+	for (i = 0; i < count && size == 0; i++) {
+		struct keyring_pem *pem = &kr->pems[order[i]];
+		printf("Trying RSA key: %s... ", pem->name);
+		keys->pub = pem->key;
+		size = API_SWU_VerifyImagePrefix(keys->pub, image, SIGNATURE_SIZE + 1, maxSize, thpool_ncpus());
+		if (size != 0) {
+			printf("Success!\nDigital signature of the firmware is OK. Signed bytes: %d\n\n", size - SIGNATURE_SIZE);
+			keyring_hit(kr, KEYRING_PEM, fingerprints, nfingerprints, order[i]);
+			*index = order[i];
+		} else {
+			printf("Failed\n");
+		}
+	}
+	free(order);
+	return size;
+}
+
+/*
+ * Loads the AES keys in cache order until try_key accepts one
+ * Returns the key index, -1 if none worked
+ */
+static int SWU_SelectAES(struct keyring *kr, struct swu_keys *keys, const char **fingerprints, unsigned int nfingerprints, const char *purpose, int (*try_key)(struct swu_keys *keys, void *arg), void *arg) {
+	unsigned int *order = calloc(kr->naes + 1, sizeof(*order));
+	unsigned int count = keyring_order(kr, KEYRING_AES, fingerprints, nfingerprints, order);
+	unsigned int i;
+	int found = -1;
+
+	for (i = 0; i < count && found < 0; i++) {
+		struct keyring_aes *key = &kr->aes[order[i]];
+		SWU_CryptoInit_AES(keys, key->key);
+		if (purpose == NULL) {
+			printf("Trying AES key (%s) ", key->label);
+		} else {
+			size_t j;
+			printf("Trying AES key (");
+			for (j = 0; j < sizeof(key->key); j++)
+				printf("%02X", key->key[j]);
+			printf(") for %s...", purpose);
 		}
-		SWU_CryptoInit_AES(aes_key);
-		printf("Trying AES key (");
-		int i;
-		for (i = 0; i < 16; i++)
-			printf("%02X", aes_key[i]);
-		printf(") for PAK segment decryption...");
-		struct pak2segment_t *PAKsegment = pak->segments[0];
-		decryptImage(PAKsegment->header->signature, headerSize, (unsigned char *)&decrypted);
-		struct pak2segmentHeader_t *decryptedSegmentHeader = (struct pak2segmentHeader_t *)(&decrypted);
-		if (!memcmp(decryptedSegmentHeader->pakMagic, "MPAK", 4)) {
+		if (try_key(keys, arg)) {
 			printf("Success!\n");
-			fclose(fp);
-			if (line)
-				free(line);
-			return;
+			keyring_hit(kr, KEYRING_AES, fingerprints, nfingerprints, order[i]);
+			found = order[i];
 		} else {
 			printf("Failed\n");
 		}
 	}
-	fclose(fp);
-	if (line)
-		free(line);
-	err_exit("\nFATAL: Can't decrypt PAK. Probably it's decrypted with an unknown key. Aborting now. Sorry.\n\n");
+	free(order);
+	return found;
+}
+
+struct header_decrypt {
+	unsigned char *src;
+	unsigned char *dst;
+	unsigned int size;
+	const unsigned char *magic_field; // in dst
+	const char *magic;
+};
+
+static int SWU_TryHeaderKey(struct swu_keys *keys, void *arg) {
+	struct header_decrypt *hdr = (struct header_decrypt *)arg;
+	decryptImage(keys, hdr->src, hdr->size, hdr->dst);
+	return !memcmp(hdr->magic_field, hdr->magic, 4);
+}
+
+static void printPAKsegmentInfo(struct swu_keys *keys, struct pak2_t *pak, int index) {
+	struct pak2segment_t *PAKsegment = pak->segments[index];
+	int headerSize = sizeof(struct pak2segmentHeader_t);
+	unsigned char *decrypted = calloc(1, headerSize);
+	decryptImage(keys, PAKsegment->header->signature, headerSize, decrypted);
+	//hexdump(decrypted, headerSize);
+	struct pak2segmentHeader_t *decryptedSegmentHeader = (struct pak2segmentHeader_t *)decrypted;
+	printf("  segment #%u (name='%.4s', version='%02x.%02x.%02x.%02x', platform='%s', offset='0x%jx', size='%zu bytes', ", index + 1, pak->header->name, decryptedSegmentHeader->version[3], decryptedSegmentHeader->version[2], decryptedSegmentHeader->version[1], decryptedSegmentHeader->version[0], decryptedSegmentHeader->platform, (intmax_t)PAKsegment->content_file_offset, PAKsegment->content_len);
+	switch ((build_type_t) decryptedSegmentHeader->devmode) {
+	case RELEASE:
+		printf("build=RELEASE");
+		break;
+	case DEBUG:
+		printf("build=DEBUG");
+		break;
+	case TEST:
+		printf("build=TEST");
+		break;
+	default:
+		printf("build=UNKNOWN 0x%x\n", decryptedSegmentHeader->devmode);
+	}
+	printf(")\n");
+	free(decrypted);
+}
+
+void printPAKinfo(struct swu_keys *keys, struct pak2_t *pak) {
+	printf("\nPAK '%.4s' contains %d segment(s):\n", pak->header->name, pak->segment_count);
+	int index = 0;
+	for (index = 0; index < pak->segment_count; index++)
+		printPAKsegmentInfo(keys, pak, index);
+}
+
+static int SWU_TryPAKKey(struct swu_keys *keys, void *arg) {
+	struct pak2_t *pak = (struct pak2_t *)arg;
+	unsigned char decrypted[sizeof(struct pak2segmentHeader_t)];
+	struct pak2segment_t *PAKsegment = pak->segments[0];
+	decryptImage(keys, PAKsegment->header->signature, sizeof(decrypted), decrypted);
+	struct pak2segmentHeader_t *decryptedSegmentHeader = (struct pak2segmentHeader_t *)decrypted;
+	return !memcmp(decryptedSegmentHeader->pakMagic, "MPAK", 4);
+}
+
+void SelectAESkey(struct swu_keys *keys, struct pak2_t *pak, struct keyring *kr, const char *ota_fingerprint) {
+	if (kr->naes == 0) {
+		printf("\nError: Cannot open AES.key file.\n\n");
+		job_exit(1);
+	}
+	if (SWU_SelectAES(kr, keys, &ota_fingerprint, 1, "PAK segment decryption", SWU_TryPAKKey, pak) < 0)
+		err_exit("\nFATAL: Can't decrypt PAK. Probably it's decrypted with an unknown key. Aborting now. Sorry.\n\n");
+}
+
+/*
+ * Decrypts the PAK segments straight from the input mapping into the mapped output file
+ */
+/* Background verification of the PAK segments */
+struct pak2_verify_job {
+	EVP_PKEY *key;
+	struct thpool *pool;
+	struct pak2_verify_task *tasks;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // signaled whenever a segment is done
+};
+
+struct pak2_verify_task {
+	struct pak2_verify_job *job;
+	struct pak2segment_t *segment;
+	const unsigned char *name;
+	unsigned int number;
+};
+
+/*
+ * Verifies one segment, falling back to a signed length search like the serial scan did
+ * The search uses up to nthreads threads, 1 from the verify pool which already has one per CPU
+ * Returns 1 if verified
+ */
+static int pak2_verify(EVP_PKEY *key, struct pak2segment_t *PAKsegment, const unsigned char *name, unsigned int number, unsigned int nthreads) {
+	unsigned int signed_length = PAKsegment->signed_length;
+
+	int verified = API_SWU_VerifyImage(key, PAKsegment->header->signature, signed_length);
+	if (verified != 1) {
+		printf("Verification of the PAK '%.4s' segment #%u failed (size=0x%X). Trying to fallback...\n", name, number, signed_length);
+		// the segment must at least hold its header
+		signed_length = API_SWU_VerifyImagePrefix(key, PAKsegment->header->signature, sizeof(struct pak2segmentHeader_t), signed_length, nthreads);
+		verified = (signed_length != 0);
+		if (verified) {
+			printf("Successfully verified with size: 0x%X\n", signed_length);
+			PAKsegment->content_len = signed_length - sizeof(struct pak2segmentHeader_t);
+		}
+	}
+	return verified;
 }
 
-int writePAKsegment(struct pak2_t *pak, const char *filename) {
-	int length = 0;
-	FILE *outfile = fopen(((const char *)filename), "w");
+/* Verifies a segment, on the pool. If that gives up, the segment didn't verify */
+static void pak2_verify_segment(void *arg) {
+	struct pak2_verify_task *task = (struct pak2_verify_task *)arg;
+	struct pak2segment_t *PAKsegment = task->segment;
+	jmp_buf jmp;
+	jmp_buf *prev = job_catch(&jmp);
+	volatile int verified = 0;
+	if (setjmp(jmp) == 0)
+		verified = pak2_verify(task->job->key, PAKsegment, task->name, task->number, 1);
+	job_catch(prev);
+
+	pthread_mutex_lock(&task->job->lock);
+	PAKsegment->verified = (verified) ? 1 : -1;
+	pthread_cond_broadcast(&task->job->cond);
+	pthread_mutex_unlock(&task->job->lock);
+}
+
+/*
+ * Queues the verification of every segment of the first count PAKs, if selected
+ * The key's first RSA operation already happened on this thread, when verifying the firmware header
+ */
+static void pak2_verify_start(struct pak2_verify_job *job, EVP_PKEY *key, struct pak2_t **pakArray, int count) {
+	int i;
+	unsigned int j, ntasks = 0;
+
+	job->key = key;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+	for (i = 0; i < count; i++)
+		if (pakArray[i]->selected)
+			ntasks += pakArray[i]->segment_count;
+	job->tasks = calloc(ntasks, sizeof(struct pak2_verify_task));
+	job->pool = thpool_new(thpool_ncpus());
+
+	struct pak2_verify_task *task = job->tasks;
+	for (i = 0; i < count; i++) {
+		if (!pakArray[i]->selected)
+			continue;
+		for (j = 0; j < pakArray[i]->segment_count; j++, task++) {
+			task->job = job;
+			task->segment = pakArray[i]->segments[j];
+			task->name = pakArray[i]->header->name;
+			task->number = j + 1;
+			if (job->pool == NULL || thpool_submit(job->pool, pak2_verify_segment, task) < 0)
+				pak2_verify_segment(task);
+		}
+	}
+}
+
+/*
+ * Waits for the segments of a PAK to be verified
+ * Returns 1 if they all verified, 0 otherwise
+ */
+static int pak2_verify_wait(struct pak2_verify_job *job, struct pak2_t *pak) {
+	unsigned int i;
+	int result = 1;
+	pthread_mutex_lock(&job->lock);
+	for (i = 0; i < pak->segment_count; i++) {
+		while (pak->segments[i]->verified == 0)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (pak->segments[i]->verified < 0)
+			result = 0;
+	}
+	pthread_mutex_unlock(&job->lock);
+	return result;
+}
+
+static void pak2_verify_finish(struct pak2_verify_job *job) {
+	if (job->pool != NULL) {
+		thpool_wait(job->pool);
+		thpool_free(job->pool);
+	}
+	free(job->tasks);
+	pthread_cond_destroy(&job->cond);
+	pthread_mutex_destroy(&job->lock);
+}
+
+/* EPK input: a mapped file, or a pipe read front to back */
+struct epk_input {
+	MFILE *file;
+	struct pipe_reader *pipe;
+	off_t size; // INT64_MAX for pipes, their size is only known at the end
+};
+
+static struct epk_input *epk_input_open(const char *path, struct config_opts_t *config_opts) {
+	struct epk_input *in = calloc(1, sizeof(*in));
+	if (is_pipe(path)) {
+		in->pipe = pipe_reader_open(path);
+		in->size = INT64_MAX;
+	} else {
+		in->file = mopen_window(path, O_RDONLY, config_opts->mmap_window);
+		if (in->file != NULL)
+			in->size = msize(in->file);
+	}
+	if (in->file == NULL && in->pipe == NULL)
+		err_exit("\nCan't open file %s\n\n", path);
+	return in;
+}
+
+static void epk_input_close(struct epk_input *in) {
+	if (in->pipe != NULL)
+		pipe_reader_close(in->pipe);
+	else
+		mclose(in->file);
+	free(in);
+}
+
+/* Job cleanups, for an extraction that gives up halfway */
+static void epk_input_cleanup(void *arg) {
+	epk_input_close((struct epk_input *)arg);
+}
+
+static void pak2_verify_cleanup(void *arg) {
+	// the verifying threads read the input, they are done before it's closed
+	pak2_verify_finish((struct pak2_verify_job *)arg);
+}
+
+static void artifact_cleanup(void *arg) {
+	artifact_free((struct artifact *)arg);
+}
+
+static void stream_cleanup(void *arg) {
+	fclose((FILE *)arg);
+}
+
+static void mfile_cleanup(void *arg) {
+	mclose((MFILE *)arg);
+}
+
+static void swu_keys_cleanup(void *arg) {
+	aes_ecb_free(((struct swu_keys *)arg)->aes);
+}
+
+/*
+ * Gets size bytes of the input at offset, the previous pointers are invalid afterwards
+ * Pipes can't seek back, offsets must grow from one call to the next
+ */
+static unsigned char *epk2_data(struct epk_input *in, off_t offset, size_t size) {
+	unsigned char *data;
+	if (in->pipe != NULL) {
+		data = pipe_reader_data(in->pipe, offset, size);
+		if (data == NULL)
+			err_exit("\nInput ended before 0x%jx. Aborting\n\n", (intmax_t)(offset + size));
+	} else {
+		data = mfile_window(in->file, offset, size);
+		if (data == NULL)
+			err_exit("\nCannot mmap input file at 0x%jx. Aborting\n\n", (intmax_t)offset);
+	}
+	return data;
+}
+
+static void pak2_map_segment(struct epk_input *in, struct pak2segment_t *PAKsegment) {
+	off_t end = PAKsegment->header_file_offset + PAKsegment->signed_length;
+	if (end > in->size)
+		end = in->size;
+	PAKsegment->header = (struct pak2segmentHeader_t *)epk2_data(in, PAKsegment->header_file_offset, end - PAKsegment->header_file_offset);
+	PAKsegment->content = PAKsegment->header->signature + sizeof(struct pak2segmentHeader_t);
+}
+
+/*
+ * Points the segments of a PAK into the input, mapping them all in one window
+ */
+static void pak2_map(struct epk_input *in, struct pak2_t *pak) {
+	struct pak2segment_t *first = pak->segments[0];
+	struct pak2segment_t *last = pak->segments[pak->segment_count - 1];
+	off_t end = last->header_file_offset + last->signed_length;
+	if (end > in->size)
+		end = in->size;
+
+	unsigned char *data = epk2_data(in, first->header_file_offset, end - first->header_file_offset);
+	unsigned int i;
+	for (i = 0; i < pak->segment_count; i++) {
+		struct pak2segment_t *PAKsegment = pak->segments[i];
+		PAKsegment->header = (struct pak2segmentHeader_t *)(data + (PAKsegment->header_file_offset - first->header_file_offset));
+		PAKsegment->content = PAKsegment->header->signature + sizeof(struct pak2segmentHeader_t);
+	}
+}
+
+size_t writePAKsegment(struct swu_keys *keys, struct pak2_t *pak, const char *filename) {
+	size_t length = 0;
 	int index;
+	for (index = 0; index < pak->segment_count; index++)
+		length += pak->segments[index]->content_len;
+
+	MFILE *outfile = mfopen(filename, "w+");
+	if (outfile == NULL)
+		err_exit("Cannot open %s for writing\n", filename);
+	if (length > 0 && mfile_map(outfile, length) == NULL)
+		err_exit("Cannot map %s for writing\n", filename);
+
+	unsigned char *decrypted = mdata(outfile, unsigned char);
 	for (index = 0; index < pak->segment_count; index++) {
 		struct pak2segment_t *PAKsegment = pak->segments[index];
-		int content_len = PAKsegment->content_len;
-		unsigned char *decrypted = malloc(content_len);
-		memset(decrypted, 0xFF, content_len);
-		decryptImage(PAKsegment->content, content_len, decrypted);
-		fwrite(decrypted, 1, content_len, outfile);
-		length += content_len;
-		free(decrypted);
-	}
-	fclose(outfile);
+		decryptImage(keys, PAKsegment->content, PAKsegment->content_len, decrypted);
+		decrypted += PAKsegment->content_len;
+	}
+	mclose(outfile);
 	return length;
 }
 
-int isFileEPK2(const char *epk_file) {
-	FILE *file = fopen(epk_file, "rb");
-	if (file == NULL) {
-		err_exit("Can't open file %s\n\n", epk_file);
+/*
+ * --verify: checks the CRC32 of a decrypted segment, when its header has one
+ */
+static void pak2_check_crc(struct swu_keys *keys, struct verify_job *job, const char *name, unsigned int number, struct pak2segment_t *PAKsegment, const unsigned char *decrypted) {
+	struct pak2segmentHeader_t header;
+	decryptImage(keys, PAKsegment->header->signature, sizeof(header), (unsigned char *)&header);
+	if (header.segmentCrc32 == 0)
+		return;
+	uint32_t crc = crc32(0, decrypted, PAKsegment->content_len);
+	verify_report(job, name, crc == header.segmentCrc32, "segment #%u CRC32 0x%08X (expected 0x%08X)", number, crc, header.segmentCrc32);
+}
+
+/*
+ * --verify: reports the segment signatures, then decrypts the PAK in memory,
+ * checks the segment CRCs and queues the checks of its contents
+ */
+static void pak2_verify_layers(struct swu_keys *keys, struct verify_job *job, struct pak2_t *pak) {
+	char name[5];
+	sprintf(name, "%.4s", pak->header->name);
+	size_t length = 0;
+	int index, verified = 1;
+	for (index = 0; index < pak->segment_count; index++) {
+		struct pak2segment_t *PAKsegment = pak->segments[index];
+		verify_report(job, name, PAKsegment->verified > 0, "segment #%u RSA signature", index + 1);
+		if (PAKsegment->verified < 0)
+			verified = 0;
+		length += PAKsegment->content_len;
 	}
-	size_t headerSize = 0x650 + SIGNATURE_SIZE;
-	unsigned char buffer[headerSize];
-	if (fread(&buffer, 1, headerSize, file) != headerSize)
-		return 0;
-	fclose(file);
+	if (!verified)
+		return;
+
+	uint8_t *data = verify_alloc(job, length);
+	uint8_t *decrypted = data;
+	for (index = 0; index < pak->segment_count; index++) {
+		struct pak2segment_t *PAKsegment = pak->segments[index];
+		decryptImage(keys, PAKsegment->content, PAKsegment->content_len, decrypted);
+		pak2_check_crc(keys, job, name, index + 1, PAKsegment, decrypted);
+		decrypted += PAKsegment->content_len;
+	}
+	verify_submit(job, name, data, length);
+}
+
+/*
+ * Writes a PAK one segment at a time, read from a pipe or a windowed mapping (-m):
+ * each segment is mapped, verified, decrypted and appended to the output in turn,
+ * so only one segment of the PAK is in memory. A pipe reads the next one ahead
+ * With --verify (job not NULL), the output is an in-memory copy for the layer checks
+ * Returns 1 if all the segments verified, 0 otherwise
+ */
+static int pak2_stream(struct swu_keys *keys, struct epk_input *in, struct pak2_t *pak, const char *filename, struct verify_job *job) {
+	FILE *outfile = NULL;
+	uint8_t *data = NULL;
+	uint8_t *scratch = NULL; // the segments of a mapped file are decrypted here, the mapping is read only
+	size_t length = 0, done = 0, max_len = 0;
+	int index, result = 1;
+	char name[5];
+	struct trace_span span;
+	struct job_cleanup out_cleanup, scratch_cleanup;
+	sprintf(name, "%.4s", pak->header->name);
+
+	for (index = 0; index < pak->segment_count; index++) {
+		length += pak->segments[index]->content_len;
+		if (pak->segments[index]->content_len > max_len)
+			max_len = pak->segments[index]->content_len;
+	}
+	if (job != NULL) {
+		data = verify_alloc(job, length);
+	} else {
+		outfile = fopen(filename, "wb");
+		if (outfile == NULL)
+			err_exit("Cannot open %s for writing\n", filename);
+		job_push_cleanup(&out_cleanup, stream_cleanup, outfile);
+		if (in->pipe == NULL && (scratch = malloc(max_len)) == NULL)
+			err_exit("Cannot allocate 0x%zx bytes to decrypt PAK %s\n", max_len, name);
+		job_push_cleanup(&scratch_cleanup, free, scratch);
+	}
+
+	printf("\nPAK '%.4s' contains %d segment(s):\n", pak->header->name, pak->segment_count);
+	for (index = 0; index < pak->segment_count; index++) {
+		struct pak2segment_t *PAKsegment = pak->segments[index];
+		pak2_map_segment(in, PAKsegment);
+		int verified = pak2_verify(keys->pub, PAKsegment, pak->header->name, index + 1, thpool_ncpus());
+		if (job != NULL)
+			verify_report(job, name, verified, "segment #%u RSA signature", index + 1);
+		if (!verified) {
+			result = 0;
+			// keep going when verifying, to report the other segments
+			if (job == NULL)
+				break;
+			continue;
+		}
+		printPAKsegmentInfo(keys, pak, index);
+		unsigned char *decrypted = (job != NULL) ? data + done : (scratch != NULL) ? scratch : PAKsegment->content;
+		decryptImage(keys, PAKsegment->content, PAKsegment->content_len, decrypted);
+		if (job != NULL) {
+			pak2_check_crc(keys, job, name, index + 1, PAKsegment, decrypted);
+			done += PAKsegment->content_len;
+		} else {
+			trace_begin(&span, TRACE_WRITE, filename);
+			if (fwrite(decrypted, 1, PAKsegment->content_len, outfile) != PAKsegment->content_len)
+				err_exit("Cannot write %s (%s)\n", filename, strerror(errno));
+			trace_end(&span, PAKsegment->content_len, PAKsegment->content_len);
+		}
+	}
+
+	if (job == NULL) {
+		job_pop_cleanup(&scratch_cleanup);
+		job_pop_cleanup(&out_cleanup);
+		free(scratch);
+		if (fclose(outfile) != 0)
+			err_exit("Cannot write %s (%s)\n", filename, strerror(errno));
+	} else if (result) {
+		// a fallback may have verified a shorter segment
+		memset(data + done, 0x00, length - done);
+		verify_submit(job, name, data, length);
+	} else {
+		verify_free(job, data, length);
+	}
+	return result;
+}
+
+#define EPK2_PROBE_SIZE (0x650 + SIGNATURE_SIZE)
+#define EPK3_PROBE_SIZE 0x6BD
+
+static int is_epk2_header(const uint8_t *buffer) {
 	int result = !memcmp(&buffer[0x8C], EPK2_MAGIC, 4);	//old EPK2
 	if (!result)
 		result = (buffer[0x630 + SIGNATURE_SIZE] == 0 && buffer[0x638 + SIGNATURE_SIZE] == 0x2E && buffer[0x63D + SIGNATURE_SIZE] == 0x2E);	//new EPK2
 	return result;
 }
 
-int isFileEPK3(const char *epk_file) {
-	FILE *file = fopen(epk_file, "rb");
-	if (!file)
-		err_exit("Can't open file %s\n\n", epk_file);
-	size_t headerSize = 0x6BD;
-	unsigned char buffer[headerSize];
-	if (fread(&buffer, 1, headerSize, file) != headerSize)
+int isFileEPK2_mem(MFILE *file) {
+	if (msize(file) < EPK2_PROBE_SIZE)
 		return 0;
-	fclose(file);
+	return is_epk2_header(mdata(file, uint8_t));
+}
+
+int isFileEPK2(const char *epk_file) {
+	MFILE *file = mopen(epk_file, O_RDONLY);
+	if (file == NULL) {
+		err_exit("Can't open file %s\n\n", epk_file);
+	}
+	int result = isFileEPK2_mem(file);
+	mclose(file);
+	return result;
+}
+
+static int is_epk3_header(const uint8_t *buffer) {
 	int result = (buffer[0x6B0] == 0 && buffer[0x6B5] == 0x2E && buffer[0x6B7] == 0x2E);
 	//if (!result) result = (buffer[0x6B0] == 0 && buffer[0x6B8] == 0x2E && buffer[0x6BD] == 0x2E);
 	return result;
 }
 
-void extractEPK3file(const char *epk_file, struct config_opts_t *config_opts) {
-	int file;
-	if (!(file = open(epk_file, O_RDONLY))) {
-		err_exit("\nCan't open file %s\n\n", epk_file);
-	}
+int isFileEPK3_mem(MFILE *file) {
+	if (msize(file) < EPK3_PROBE_SIZE)
+		return 0;
+	return is_epk3_header(mdata(file, uint8_t));
+}
 
-	struct stat statbuf;
-	if (fstat(file, &statbuf) < 0) {
-		err_exit("\nfstat error\n\n");
-	}
+int isFileEPK3(const char *epk_file) {
+	MFILE *file = mopen(epk_file, O_RDONLY);
+	if (!file)
+		err_exit("Can't open file %s\n\n", epk_file);
+	int result = isFileEPK3_mem(file);
+	mclose(file);
+	return result;
+}
 
-	int fileLength = statbuf.st_size;
-	printf("File size: %d bytes\n", fileLength);
-	void *buffer;
-	if ((buffer = mmap(0, fileLength, PROT_READ, MAP_SHARED, file, 0)) == MAP_FAILED) {
-		err_exit("\nCannot mmap input file. Aborting\n\n");
-	}
+static void print_input_size(struct epk_input *in) {
+	if (in->pipe != NULL)
+		printf("File size: unknown, reading from a pipe\n");
+	else
+		printf("File size: %jd bytes\n", (intmax_t)in->size);
+}
 
-	printf("\nVerifying digital signature of EPK3 firmware header...\n");
-	int verified = 0;
-	DIR *dirFile = opendir(config_opts->config_dir);
-	if (dirFile) {
-		struct dirent *hFile;
-		while ((hFile = readdir(dirFile)) != NULL) {
-			if (!strcmp(hFile->d_name, ".") || !strcmp(hFile->d_name, "..") || hFile->d_name[0] == '.')
-				continue;
-			if (strstr(hFile->d_name, ".pem") || strstr(hFile->d_name, ".PEM")) {
-				printf("Trying RSA key: %s... ", hFile->d_name);
-				SWU_CryptoInit_PEM(config_opts->config_dir, hFile->d_name);
-				int size = 0x6B4;
-				while (size > SIGNATURE_SIZE) {
-					verified = API_SWU_VerifyImage(buffer, size);
-					if (verified) {
-						printf("Success!\nDigital signature of the firmware is OK. Signed bytes: %d\n\n", size - SIGNATURE_SIZE);
-						break;
-					}
-					size -= 1;
-				}
-				if (!verified)
-					printf("Failed\n");
-			}
-			if (verified)
-				break;
-		}
-		closedir(dirFile);
+/*
+ * Extracts an EPK3, the input is closed when done
+ */
+static void extractEPK3(struct epk_input *in, struct config_opts_t *config_opts) {
+	struct swu_keys keys = { NULL, NULL };
+	struct job_cleanup in_cleanup, keys_cleanup, info_cleanup;
+	job_push_cleanup(&in_cleanup, epk_input_cleanup, in);
+	job_push_cleanup(&keys_cleanup, swu_keys_cleanup, &keys);
+	print_input_size(in);
+	unsigned char *buffer = epk2_data(in, 0, 0x6B4);
+
+	struct keyring *kr = keyring_get(config_opts->config_dir);
+	char hdr_fingerprint[KEY_FINGERPRINT_SIZE], ota_fingerprint[KEY_FINGERPRINT_SIZE] = "";
+	const char *fingerprints[] = { hdr_fingerprint, ota_fingerprint };
+	unsigned int nfingerprints = 1;
+	SWU_HeaderFingerprint(buffer, hdr_fingerprint);
+	if (!memcmp(((struct epk3header_t *)buffer)->EPK3magic, EPK3_MAGIC, 4)) {
+		SWU_OtaFingerprint(((struct epk3header_t *)buffer)->otaID, ota_fingerprint);
+		nfingerprints = 2;
 	}
 
-	if (!verified) {
+	printf("\nVerifying digital signature of EPK3 firmware header...\n");
+	int pem_index = -1;
+	if (SWU_SelectPEM(kr, &keys, buffer, 0x6B4, fingerprints, nfingerprints, &pem_index) == 0) {
 		printf("Cannot verify firmware's digital signature (maybe you don't have proper PEM file). Aborting.\n\n");
-		if (munmap(buffer, fileLength) == -1)
-			printf("Error un-mmapping the file\n\n");
-		close(file);
 		err_exit("");
 	}
 
 	int headerSize = 0x6B4;
 	struct epk3header_t *fwInfo = malloc(headerSize);
+	job_push_cleanup(&info_cleanup, free, fwInfo);
 	memcpy(fwInfo, buffer, headerSize);
+	int aes_index = -1;
 	if (memcmp(fwInfo->EPK3magic, EPK3_MAGIC, 4)) {
 		printf("Trying to decrypt EPK3 header...\n");
-		int uncrypted = 0;
-		char key_file_name[1024] = "";
-		strcat(key_file_name, config_opts->config_dir);
-		strcat(key_file_name, "/");
-		strcat(key_file_name, "AES.key");
-		FILE *fp = fopen(key_file_name, "r");
-		if (fp == NULL) {
+		if (kr->naes == 0) {
 			printf("\nError: Cannot open AES.key file.\n\n");
-			if (munmap(buffer, fileLength) == -1)
-				printf("Error un-mmapping the file\n\n");
-			close(file);
-			free(fwInfo);
 			err_exit("");
 		}
-		char *line = NULL;
-		size_t len = 0;
-		ssize_t read;
-		size_t count = 0;
-
-		while ((read = getline(&line, &len, fp)) != -1) {
-			char *pos = line;
-			for (count = 0; count < sizeof(aes_key) / sizeof(aes_key[0]); count++) {
-				sscanf(pos, "%2hhx", &aes_key[count]);
-				pos += 2 * sizeof(char);
-			}
-			SWU_CryptoInit_AES(aes_key);
-			printf("Trying AES key (%s) ", strtok(line, "\n\r"));
-			decryptImage(buffer + SIGNATURE_SIZE, headerSize - SIGNATURE_SIZE, (unsigned char *)fwInfo + SIGNATURE_SIZE);
-			if (!memcmp(fwInfo->EPK3magic, EPK3_MAGIC, 4)) {
-				printf("Success!\n");
-				//hexdump((unsigned char*)fwInfo+SIGNATURE_SIZE, headerSize-SIGNATURE_SIZE);
-				uncrypted = 1;
-				break;
-			} else {
-				printf("Failed\n");
-			}
-		}
-		fclose(fp);
-		if (line)
-			free(line);
-		if (!uncrypted) {
+		struct header_decrypt hdr = {
+			.src = buffer + SIGNATURE_SIZE,
+			.dst = (unsigned char *)fwInfo + SIGNATURE_SIZE,
+			.size = headerSize - SIGNATURE_SIZE,
+			.magic_field = fwInfo->EPK3magic,
+			.magic = EPK3_MAGIC
+		};
+		aes_index = SWU_SelectAES(kr, &keys, fingerprints, 1, NULL, SWU_TryHeaderKey, &hdr);
+		if (aes_index < 0) {
 			printf("\nFATAL: Cannot decrypt EPK3 header (proper AES key is missing). Aborting now. Sorry.\n\n");
-			if (munmap(buffer, fileLength) == -1)
-				printf("Error un-mmapping the file");
-			close(file);
-			free(fwInfo);
 			err_exit("");
 		}
 	}
+	// now that the otaID is known, remember the keys for the whole family
+	SWU_OtaFingerprint(fwInfo->otaID, ota_fingerprint);
+	keyring_hit(kr, KEYRING_PEM, fingerprints, 2, pem_index);
+	if (aes_index >= 0)
+		keyring_hit(kr, KEYRING_AES, fingerprints, 2, aes_index);
+	if (config_opts->verify != NULL)
+		verify_report(config_opts->verify, "EPK3 header", 1, "RSA signature");
 
 	printf("\nFirmware info\n");
 	printf("-------------\n");
@@ -322,169 +844,199 @@ void extractEPK3file(const char *epk_file, struct config_opts_t *config_opts) {
 
 	// Decrypting packageInfo
 	struct pak3_t *packageInfo = malloc(fwInfo->packageInfoSize);
-	decryptImage(buffer + SIGNATURE_SIZE + 0x654 + SIGNATURE_SIZE, fwInfo->packageInfoSize, (unsigned char *)packageInfo);
+	decryptImage(&keys, epk2_data(in, SIGNATURE_SIZE + 0x654 + SIGNATURE_SIZE, fwInfo->packageInfoSize), fwInfo->packageInfoSize, (unsigned char *)packageInfo);
 
 	int i;
-	FILE *outfile;
 	struct pak3segmentHeader_t segment;
 	const char *pak_type_name;
-	char name[4];
+	char name[sizeof(segment.name) + 1];
 
 	char fwVersion[1024];
 	memset(&fwVersion, 0x0, sizeof(fwVersion));
 	sprintf(fwVersion, "%02x.%02x.%02x.%02x-%s", fwInfo->fwVersion[3], fwInfo->fwVersion[2], fwInfo->fwVersion[1], fwInfo->fwVersion[0], fwInfo->otaID);
 
-	sprintf(config_opts->dest_dir, "%s/%s", config_opts->dest_dir, fwVersion);
-	createFolder(config_opts->dest_dir);
+	// the PAKs go to a version subfolder, the caller's options are left alone
+	struct config_opts_t pak_opts = *config_opts;
+	asprintf(&pak_opts.dest_dir, "%s/%s", config_opts->dest_dir, fwVersion);
+	pak_opts.extract_path = pak_extract_path(config_opts->extract_path);
+	if (config_opts->verify == NULL)
+		createFolder(pak_opts.dest_dir);
 
-	long unsigned int offset = SIGNATURE_SIZE + 0x654 + SIGNATURE_SIZE + fwInfo->packageInfoSize;
+	int windowed = (in->pipe != NULL) || (in->file->window != 0);
+	off_t offset = SIGNATURE_SIZE + 0x654 + SIGNATURE_SIZE + fwInfo->packageInfoSize;
 	for (i = 0; i < packageInfo->numOfSegments; i++) {
-		long unsigned int size = 0;
+		size_t size = 0;
 		memcpy(&segment, (unsigned char *)&packageInfo->segment + sizeof(segment) * i, sizeof(segment));
 		printf("\nPAK '%s' contains %d segment(s), size %d bytes:\n", segment.name, segment.totalSegments, segment.pakSize);
 
 		char filename[1024] = "";
-		sprintf(name, "%s", segment.name);
-		sprintf(filename, "%s/%s.pak", config_opts->dest_dir, name);
-		printf("Saving partition (%s) to file %s\n", name, filename);
-		outfile = fopen(filename, "w");
+		sprintf(name, "%.*s", (int)sizeof(segment.name), segment.name);
+		sprintf(filename, "%s/%s.pak", pak_opts.dest_dir, name);
 
-		int index = 0, realSegmentSize;
+		int index = 0;
+		unsigned int realSegmentSize;
+
+		// size the output once, the segments are decrypted straight into it
+		size_t pakSize = 0;
+		for (index = 0; index < segment.totalSegments; index++) {
+			realSegmentSize = segment.segmentSize;
+			if (pakSize + realSegmentSize > segment.pakSize)
+				realSegmentSize = segment.pakSize - pakSize;
+			pakSize += realSegmentSize;
+		}
+
+		// an unselected PAK is stepped over without reading it
+		if (!pak_selected(config_opts, segment.name, sizeof(segment.name))) {
+			printf("Skipping partition (%s)\n", name);
+			offset += pakSize + (off_t)segment.totalSegments * SIGNATURE_SIZE;
+			i += index - 1;
+			continue;
+		}
+		if (config_opts->verify == NULL)
+			printf("Saving partition (%s) to file %s\n", name, filename);
+
+		// with --verify the PAK is only decrypted in memory, for the layer checks
+		// in windowed mode, and from a pipe, each segment is decrypted and appended to the output in turn
+		MFILE *outfile = NULL;
+		FILE *outstream = NULL;
+		struct artifact *pak = NULL;
+		unsigned char *decrypted = NULL, *scratch = NULL;
+		struct job_cleanup pak_cleanup, out_cleanup, scratch_cleanup;
+		if (config_opts->verify != NULL) {
+			decrypted = verify_alloc(config_opts->verify, pakSize);
+		} else if (windowed) {
+			pak = artifact_new(filename, &pak_opts);
+			job_push_cleanup(&pak_cleanup, artifact_cleanup, pak);
+			outstream = fopen(pak->path, "wb");
+			if (outstream == NULL)
+				err_exit("Cannot open %s for writing\n", filename);
+			job_push_cleanup(&out_cleanup, stream_cleanup, outstream);
+			if ((scratch = malloc(segment.segmentSize)) == NULL)
+				err_exit("Cannot allocate 0x%x bytes to decrypt PAK %s\n", segment.segmentSize, name);
+			job_push_cleanup(&scratch_cleanup, free, scratch);
+		} else {
+			pak = artifact_new(filename, &pak_opts);
+			job_push_cleanup(&pak_cleanup, artifact_cleanup, pak);
+			outfile = mfopen(pak->path, "w+");
+			if (outfile == NULL)
+				err_exit("Cannot open %s for writing\n", filename);
+			job_push_cleanup(&out_cleanup, mfile_cleanup, outfile);
+			if (pakSize > 0 && mfile_map(outfile, pakSize) == NULL)
+				err_exit("Cannot map %s for writing\n", filename);
+			decrypted = mdata(outfile, unsigned char);
+		}
 
 		for (index = 0; index < segment.totalSegments; index++) {
 			realSegmentSize = segment.segmentSize;
 			if (size + realSegmentSize > segment.pakSize)
 				realSegmentSize = segment.pakSize - size;
 
-			printf("  segment #%u (name='%s', version='%02x.%02x.%02x.%02x', offset='0x%lx', size='%u bytes')\n", index + 1, segment.name, segment.unknown1[3], segment.unknown1[2], segment.unknown1[1], segment.unknown1[0], offset + SIGNATURE_SIZE, realSegmentSize);
+			printf("  segment #%u (name='%s', version='%02x.%02x.%02x.%02x', offset='0x%jx', size='%u bytes')\n", index + 1, segment.name, segment.unknown1[3], segment.unknown1[2], segment.unknown1[1], segment.unknown1[0], (intmax_t)(offset + SIGNATURE_SIZE), realSegmentSize);
 
-			unsigned char *decrypted = calloc(1, realSegmentSize);
-			decryptImage(buffer + offset + SIGNATURE_SIZE, realSegmentSize, decrypted);
-			fwrite(decrypted, 1, realSegmentSize, outfile);
-			free(decrypted);
+			unsigned char *out = (scratch != NULL) ? scratch : decrypted + size;
+			decryptImage(&keys, epk2_data(in, offset + SIGNATURE_SIZE, realSegmentSize), realSegmentSize, out);
+			if (outstream != NULL) {
+				struct trace_span span;
+				trace_begin(&span, TRACE_WRITE, filename);
+				if (fwrite(out, 1, realSegmentSize, outstream) != realSegmentSize)
+					err_exit("Cannot write %s (%s)\n", filename, strerror(errno));
+				trace_end(&span, realSegmentSize, realSegmentSize);
+			}
 			size += realSegmentSize;
 			offset += realSegmentSize + SIGNATURE_SIZE;
 		}
-		fclose(outfile);
-		handle_file(filename, config_opts);
+		if (config_opts->verify != NULL) {
+			verify_submit(config_opts->verify, name, decrypted, pakSize);
+		} else {
+			if (scratch != NULL)
+				job_pop_cleanup(&scratch_cleanup);
+			job_pop_cleanup(&out_cleanup);
+			free(scratch);
+			// a PAK that can't be written is freed by its cleanup
+			if (outstream != NULL && fclose(outstream) != 0)
+				err_exit("Cannot write %s (%s)\n", filename, strerror(errno));
+			if (outfile != NULL)
+				mclose(outfile);
+			job_pop_cleanup(&pak_cleanup);
+			handle_artifact(pak, &pak_opts);
+		}
 		i += index - 1;
+		report_progress(config_opts, name, i + 1, packageInfo->numOfSegments);
 	}
 
-	if (munmap(buffer, fileLength) == -1)
-		printf("Error un-mmapping the file");
-	close(file);
+	job_pop_cleanup(&info_cleanup);
+	job_pop_cleanup(&keys_cleanup);
+	job_pop_cleanup(&in_cleanup);
+	epk_input_close(in);
+	aes_ecb_free(keys.aes);
 	free(fwInfo);
+	free(pak_opts.dest_dir);
 }
 
-void extractEPK2file(const char *epk_file, struct config_opts_t *config_opts) {
-	int file;
-	if (!(file = open(epk_file, O_RDONLY))) {
-		err_exit("\nCan't open file %s\n\n", epk_file);
-	}
+void extractEPK3file(const char *epk_file, struct config_opts_t *config_opts) {
+	extractEPK3(epk_input_open(epk_file, config_opts), config_opts);
+}
 
-	struct stat statbuf;
-	if (fstat(file, &statbuf) < 0) {
-		err_exit("\nfstat error\n\n");
-	}
+/*
+ * Extracts an EPK2, the input is closed when done
+ */
+static void extractEPK2(struct epk_input *in, struct config_opts_t *config_opts) {
+	off_t fileLength = in->size;
+	struct swu_keys keys = { NULL, NULL };
+	struct job_cleanup in_cleanup, keys_cleanup, info_cleanup, verify_cleanup, pak_cleanup;
+	job_push_cleanup(&in_cleanup, epk_input_cleanup, in);
+	job_push_cleanup(&keys_cleanup, swu_keys_cleanup, &keys);
+	print_input_size(in);
+	unsigned char *buffer = epk2_data(in, 0, SIGNATURE_SIZE + 0x634);
 
-	int fileLength = statbuf.st_size;
-	printf("File size: %d bytes\n", fileLength);
-	void *buffer;
-	if ((buffer = mmap(0, fileLength, PROT_READ, MAP_SHARED, file, 0)) == MAP_FAILED) {
-		err_exit("\nCannot mmap input file. Aborting\n\n");
+	struct keyring *kr = keyring_get(config_opts->config_dir);
+	char hdr_fingerprint[KEY_FINGERPRINT_SIZE], ota_fingerprint[KEY_FINGERPRINT_SIZE] = "";
+	const char *fingerprints[] = { hdr_fingerprint, ota_fingerprint };
+	unsigned int nfingerprints = 1;
+	SWU_HeaderFingerprint(buffer, hdr_fingerprint);
+	if (!memcmp(((struct epk2header_t *)buffer)->EPK2magic, EPK2_MAGIC, 4)) {
+		SWU_OtaFingerprint(((struct epk2header_t *)buffer)->otaID, ota_fingerprint);
+		nfingerprints = 2;
 	}
 
 	printf("\nVerifying digital signature of EPK2 firmware header...\n");
-	int verified = 0;
-	DIR *dirFile = opendir(config_opts->config_dir);
-	if (dirFile) {
-		struct dirent *hFile;
-		while ((hFile = readdir(dirFile)) != NULL) {
-			if (!strcmp(hFile->d_name, ".") || !strcmp(hFile->d_name, "..") || hFile->d_name[0] == '.')
-				continue;
-			if (strstr(hFile->d_name, ".pem") || strstr(hFile->d_name, ".PEM")) {
-				printf("Trying RSA key: %s... ", hFile->d_name);
-				SWU_CryptoInit_PEM(config_opts->config_dir, hFile->d_name);
-				int size = SIGNATURE_SIZE + 0x634;
-				while (size > SIGNATURE_SIZE) {
-					verified = API_SWU_VerifyImage(buffer, size);
-					if (verified) {
-						printf("Success!\nDigital signature of the firmware is OK. Signed bytes: %d\n\n", size - SIGNATURE_SIZE);
-						break;
-					}
-					size -= 1;
-				}
-				if (!verified)
-					printf("Failed\n");
-			}
-			if (verified)
-				break;
-		}
-		closedir(dirFile);
-	}
-
-	if (!verified) {
+	int pem_index = -1;
+	if (SWU_SelectPEM(kr, &keys, buffer, SIGNATURE_SIZE + 0x634, fingerprints, nfingerprints, &pem_index) == 0) {
 		printf("Cannot verify firmware's digital signature (maybe you don't have proper PEM file). Aborting.\n\n");
-		if (munmap(buffer, fileLength) == -1)
-			printf("Error un-mmapping the file\n\n");
-		close(file);
 		err_exit("");
 	}
 
 	int headerSize = 0x5B4 + SIGNATURE_SIZE;
 	struct epk2header_t *fwInfo = malloc(headerSize);
+	job_push_cleanup(&info_cleanup, free, fwInfo);
 	memcpy(fwInfo, buffer, headerSize);
+	int aes_index = -1;
 	if (memcmp(fwInfo->EPK2magic, EPK2_MAGIC, 4)) {
 		printf("EPK2 header is encrypted. Trying to decrypt...\n");
-		int uncrypted = 0;
-		char key_file_name[1024] = "";
-		strcat(key_file_name, config_opts->config_dir);
-		strcat(key_file_name, "/");
-		strcat(key_file_name, "AES.key");
-		FILE *fp = fopen(key_file_name, "r");
-		if (fp == NULL) {
+		if (kr->naes == 0) {
 			printf("\nError: Cannot open AES.key file.\n\n");
-			if (munmap(buffer, fileLength) == -1)
-				printf("Error un-mmapping the file\n\n");
-			close(file);
-			free(fwInfo);
 			err_exit("");
 		}
-		char *line = NULL;
-		size_t len = 0;
-		ssize_t read;
-		size_t count = 0;
-
-		while ((read = getline(&line, &len, fp)) != -1) {
-			char *pos = line;
-			for (count = 0; count < sizeof(aes_key) / sizeof(aes_key[0]); count++) {
-				sscanf(pos, "%2hhx", &aes_key[count]);
-				pos += 2 * sizeof(char);
-			}
-			SWU_CryptoInit_AES(aes_key);
-			printf("Trying AES key (%s) ", strtok(line, "\n\r"));
-			decryptImage(buffer + SIGNATURE_SIZE, headerSize - SIGNATURE_SIZE, (unsigned char *)fwInfo + SIGNATURE_SIZE);
-			//printf("\n"); hexdump((unsigned char*)fwInfo+SIGNATURE_SIZE, headerSize-SIGNATURE_SIZE);
-			if (!memcmp(fwInfo->EPK2magic, EPK2_MAGIC, 4)) {
-				printf("Success!\n");
-				uncrypted = 1;
-				break;
-			} else {
-				printf("Failed\n");
-			}
-		}
-		fclose(fp);
-		if (line)
-			free(line);
-		if (!uncrypted) {
+		struct header_decrypt hdr = {
+			.src = buffer + SIGNATURE_SIZE,
+			.dst = (unsigned char *)fwInfo + SIGNATURE_SIZE,
+			.size = headerSize - SIGNATURE_SIZE,
+			.magic_field = fwInfo->EPK2magic,
+			.magic = EPK2_MAGIC
+		};
+		aes_index = SWU_SelectAES(kr, &keys, fingerprints, 1, NULL, SWU_TryHeaderKey, &hdr);
+		if (aes_index < 0) {
 			printf("\nFATAL: Cannot decrypt EPK2 header (proper AES key is missing). Aborting now. Sorry.\n\n");
-			if (munmap(buffer, fileLength) == -1)
-				printf("Error un-mmapping the file");
-			close(file);
-			free(fwInfo);
 			err_exit("");
 		}
 	}
+	// now that the otaID is known, remember the keys for the whole family
+	SWU_OtaFingerprint(fwInfo->otaID, ota_fingerprint);
+	keyring_hit(kr, KEYRING_PEM, fingerprints, 2, pem_index);
+	if (aes_index >= 0)
+		keyring_hit(kr, KEYRING_AES, fingerprints, 2, aes_index);
+	if (config_opts->verify != NULL)
+		verify_report(config_opts->verify, "EPK2 header", 1, "RSA signature");
 
 	printf("\nFirmware info\n");
 	printf("-------------\n");
@@ -495,22 +1047,20 @@ void extractEPK2file(const char *epk_file, struct config_opts_t *config_opts) {
 	printf("PAKs total size: %d\n", fwInfo->fileSize);
 	printf("Header length: %d\n\n", fwInfo->headerLength);
 
-	struct epk2header_t *fwFile = (struct epk2header_t *)buffer;
 	struct pak2_t **pakArray = malloc((fwInfo->pakCount) * sizeof(struct pak2_t *));
 	if (fileLength < fwInfo->fileSize)
 		printf("\n!!!WARNING: Real file size is shorter than file size listed in the header. Number of extracted PAKs will be lowered to filesize...\n");
 
 	printf("\nScanning EPK2 firmware...\n");
-	// Scan PAK segments
-	unsigned char *epk2headerOffset = fwFile->signature;
+	// Scan PAK segments, by file offset: only the segment being written is mapped in windowed mode
 	unsigned char *pak2headerOffset = fwInfo->signature + sizeof(struct epk2header_t);
-	struct pak2segmentHeader_t *pak2segmentHeader = (struct pak2segmentHeader_t *)((fwFile->epakMagic) + (fwInfo->headerLength));
+	off_t pak2segmentHeaderOffset = offsetof(struct epk2header_t, epakMagic) + fwInfo->headerLength;
 
 	// Contains added lengths of signature data
-	unsigned int signature_sum = sizeof(fwFile->signature) + sizeof(pak2segmentHeader->signature);
-	unsigned int pak2segmentHeaderSignatureLength = sizeof(pak2segmentHeader->signature);
+	unsigned int signature_sum = sizeof(fwInfo->signature) + SIGNATURE_SIZE;
+	unsigned int pak2segmentHeaderSignatureLength = SIGNATURE_SIZE;
 	int count = 0;
-	int next_pak_length = fwInfo->fileSize;
+	off_t next_pak_length = fwInfo->fileSize;
 
 	while (count < fwInfo->pakCount) {
 		struct pak2header_t *pakHeader = (struct pak2header_t *)(pak2headerOffset);
@@ -519,48 +1069,28 @@ void extractEPK2file(const char *epk_file, struct config_opts_t *config_opts) {
 		pak->header = pakHeader;
 		pak->segment_count = 0;
 		pak->segments = NULL;
-		int verified = 0;
-		struct pak2segmentHeader_t *next_pak_offset = (struct pak2segmentHeader_t *)
-			(epk2headerOffset + pakHeader->nextPAKfileOffset + signature_sum);
-		unsigned int distance_between_paks = (next_pak_offset->name) - (pak2segmentHeader->name);
+		pak->selected = pak_selected(config_opts, pakHeader->name, sizeof(pakHeader->name));
+		bool is_next_segment_needed = true;
+		off_t next_pak_offset = (off_t)pakHeader->nextPAKfileOffset + signature_sum;
+		off_t distance_between_paks = next_pak_offset - pak2segmentHeaderOffset;
 
 		// Last contained PAK...
 		if (count == (fwInfo->pakCount - 1))
 			distance_between_paks = next_pak_length + pak2segmentHeaderSignatureLength;
 		unsigned int max_distance = pakHeader->maxPAKsegmentSize + sizeof(struct pak2segmentHeader_t);
-		while (!verified) {
-			unsigned int PAKsegment_length = distance_between_paks;
-			bool is_next_segment_needed = false;
-			if (PAKsegment_length > max_distance) {
+		while (is_next_segment_needed) {
+			unsigned int PAKsegment_length;
+			is_next_segment_needed = false;
+			if (distance_between_paks > max_distance) {
 				PAKsegment_length = max_distance;
 				is_next_segment_needed = true;
+			} else {
+				PAKsegment_length = distance_between_paks;
 			}
-			unsigned int signed_length = next_pak_length;
-			if (signed_length > max_distance) {
-				signed_length = max_distance;
-			}
+			unsigned int signed_length = (next_pak_length > max_distance) ? max_distance : next_pak_length;
 			if (count == 0)
 				signed_length = PAKsegment_length;
 
-			if (!verified && (verified = API_SWU_VerifyImage(pak2segmentHeader->signature, signed_length)) != 1) {
-				printf("Verification of the PAK segment #%u failed (size=0x%X). Trying to fallback...\n", pak->segment_count + 1, signed_length);
-				while (((verified = API_SWU_VerifyImage(pak2segmentHeader->signature, signed_length)) != 1) && (signed_length > 0))
-					signed_length--;
-				if (verified)
-					printf("Successfully verified with size: 0x%X\n", signed_length);
-				else {
-					printf("Fallback failed. Sorry, aborting now.\n\n");
-					if (munmap(buffer, fileLength) == -1)
-						printf("Error un-mmapping the file\n\n");
-					close(file);
-					free(fwInfo);
-					int i;
-					for (i = 0; i < count; ++i)
-						free(pakArray[i]);
-					free(pakArray);
-					err_exit("");
-				}
-			}
 			// Sum signature lengths
 			signature_sum += pak2segmentHeaderSignatureLength;
 			unsigned int PAKsegment_content_length = (PAKsegment_length - pak2segmentHeaderSignatureLength);
@@ -568,21 +1098,23 @@ void extractEPK2file(const char *epk_file, struct config_opts_t *config_opts) {
 			if (is_next_segment_needed) {
 				distance_between_paks -= PAKsegment_content_length;
 				next_pak_length -= PAKsegment_content_length;
-				verified = 0;
 			} else
 				next_pak_length = pakHeader->nextPAKlength + pak2segmentHeaderSignatureLength;
 
 			pak->segment_count++;
 			pak->segments = realloc(pak->segments, pak->segment_count * sizeof(struct pak2segment_t *));
 			struct pak2segment_t *PAKsegment = malloc(sizeof(struct pak2segment_t));
-			PAKsegment->header = pak2segmentHeader;
-			PAKsegment->content = pak2segmentHeader->signature + sizeof(struct pak2segmentHeader_t);
-			PAKsegment->content_file_offset = PAKsegment->content - epk2headerOffset;
+			PAKsegment->header = NULL;
+			PAKsegment->content = NULL;
+			PAKsegment->header_file_offset = pak2segmentHeaderOffset;
+			PAKsegment->content_file_offset = pak2segmentHeaderOffset + sizeof(struct pak2segmentHeader_t);
 			PAKsegment->content_len = signed_length - sizeof(struct pak2segmentHeader_t);
+			PAKsegment->signed_length = signed_length;
+			PAKsegment->verified = 0;
 			pak->segments[pak->segment_count - 1] = PAKsegment;
 
-			// Move pointer to the next pak segment offset
-			pak2segmentHeader = (struct pak2segmentHeader_t *)(pak2segmentHeader->signature + PAKsegment_length);
+			// Move to the next pak segment offset
+			pak2segmentHeaderOffset += PAKsegment_length;
 		}
 		pak2headerOffset += sizeof(struct pak2header_t);
 		count++;
@@ -593,38 +1125,133 @@ void extractEPK2file(const char *epk_file, struct config_opts_t *config_opts) {
 	}
 
 	int last_index = count - 1;
+	int index;
 
-	struct pak2_t *last_pak = pakArray[last_index];
-	int PAKsegment_index = last_pak->segment_count - 1;
+	// the AES key is picked on the first PAK that gets extracted
+	int first_selected = 0;
+	while (first_selected < count && !pakArray[first_selected]->selected)
+		first_selected++;
 
-	struct pak2segment_t *last_PAKsegment = last_pak->segments[PAKsegment_index];
-	int last_extracted_file_offset = (last_PAKsegment->content_file_offset + last_PAKsegment->content_len);
-	printf("Last extracted file offset: %d\n\n", last_extracted_file_offset);
+	// Verify the segments in the background, the PAKs are written as soon as theirs are done
+	// In windowed mode, and from a pipe, each segment is mapped, verified and written in turn
+	int windowed = (in->pipe != NULL) || (in->file->window != 0);
+	struct pak2_verify_job verify_job;
+	if (!windowed) {
+		for (index = 0; index < count; index++)
+			if (pakArray[index]->selected)
+				pak2_map(in, pakArray[index]);
+		pak2_verify_start(&verify_job, keys.pub, pakArray, count);
+		job_push_cleanup(&verify_cleanup, pak2_verify_cleanup, &verify_job);
+	}
 
 	char fwVersion[1024];
 	memset(&fwVersion, 0x0, sizeof(fwVersion));
 	sprintf(fwVersion, "%02x.%02x.%02x.%02x-%s", fwInfo->fwVersion[3], fwInfo->fwVersion[2], fwInfo->fwVersion[1], fwInfo->fwVersion[0], fwInfo->otaID);
-	sprintf(config_opts->dest_dir, "%s/%s", config_opts->dest_dir, fwVersion);
-	createFolder(config_opts->dest_dir);
+	// the PAKs go to a version subfolder, the caller's options are left alone
+	struct config_opts_t pak_opts = *config_opts;
+	asprintf(&pak_opts.dest_dir, "%s/%s", config_opts->dest_dir, fwVersion);
+	pak_opts.extract_path = pak_extract_path(config_opts->extract_path);
+	if (config_opts->verify == NULL)
+		createFolder(pak_opts.dest_dir);
 
-	SelectAESkey(pakArray[0], config_opts);
+	if (first_selected == count) {
+		printf("No PAK selected by --only/--skip/--extract\n");
+	} else if (windowed) {
+		pak2_map_segment(in, pakArray[first_selected]->segments[0]);
+		SelectAESkey(&keys, pakArray[first_selected], kr, ota_fingerprint);
+	} else {
+		pak2_map(in, pakArray[first_selected]);
+		SelectAESkey(&keys, pakArray[first_selected], kr, ota_fingerprint);
+	}
 
-	int index;
 	for (index = 0; index < last_index + 1; index++) {
-		printPAKinfo(pakArray[index]);
 		const char *pak_type_name;
 		char filename[1024] = "";
-		char name[4];
+		char name[5];
 		sprintf(name, "%.4s", pakArray[index]->header->name);
-		sprintf(filename, "%s/%.4s.pak", config_opts->dest_dir, name);
-		printf("#%u/%u saving PAK (%s) to file %s\n", index + 1, fwInfo->pakCount, name, filename);
-		int length = writePAKsegment(pakArray[index], filename);
+		sprintf(filename, "%s/%.4s.pak", pak_opts.dest_dir, name);
+
+		// the scan already knows where the next PAK starts, this one is never read
+		if (!pakArray[index]->selected) {
+			printf("#%u/%u skipping PAK (%s)\n", index + 1, fwInfo->pakCount, name);
+			free(pakArray[index]);
+			continue;
+		}
+
+		// the PAK is handed to the next stage in memory, unless --keep-intermediates
+		struct artifact *pak = NULL;
+		if (config_opts->verify == NULL) {
+			pak = artifact_new(filename, &pak_opts);
+			job_push_cleanup(&pak_cleanup, artifact_cleanup, pak);
+		}
+
+		if (windowed) {
+			if (config_opts->verify == NULL)
+				printf("#%u/%u saving PAK (%s) to file %s\n", index + 1, fwInfo->pakCount, name, filename);
+			// --verify reports the failed segments and goes on with the next PAK
+			if (!pak2_stream(&keys, in, pakArray[index], pak != NULL ? pak->path : NULL, config_opts->verify) && config_opts->verify == NULL) {
+				printf("Fallback failed. Sorry, aborting now.\n\n");
+				err_exit("");
+			}
+		} else {
+			if (!pak2_verify_wait(&verify_job, pakArray[index]) && config_opts->verify == NULL) {
+				printf("Fallback failed. Sorry, aborting now.\n\n");
+				err_exit("");
+			}
+			printPAKinfo(&keys, pakArray[index]);
+			if (config_opts->verify != NULL) {
+				pak2_verify_layers(&keys, config_opts->verify, pakArray[index]);
+			} else {
+				printf("#%u/%u saving PAK (%s) to file %s\n", index + 1, fwInfo->pakCount, name, filename);
+				writePAKsegment(&keys, pakArray[index], pak->path);
+			}
+		}
+		if (index == last_index) {
+			struct pak2segment_t *last_PAKsegment = pakArray[index]->segments[pakArray[index]->segment_count - 1];
+			off_t last_extracted_file_offset = (last_PAKsegment->content_file_offset + last_PAKsegment->content_len);
+			printf("Last extracted file offset: %jd\n\n", (intmax_t)last_extracted_file_offset);
+		}
 		free(pakArray[index]);
-		handle_file(filename, config_opts);
+		if (pak != NULL) {
+			job_pop_cleanup(&pak_cleanup);
+			handle_artifact(pak, &pak_opts);
+		}
+		report_progress(config_opts, name, index + 1, fwInfo->pakCount);
+	}
+	if (!windowed) {
+		job_pop_cleanup(&verify_cleanup);
+		pak2_verify_finish(&verify_job);
 	}
-	if (munmap(buffer, fileLength) == -1)
-		printf("Error un-mmapping the file");
-	close(file);
+	job_pop_cleanup(&info_cleanup);
+	job_pop_cleanup(&keys_cleanup);
+	job_pop_cleanup(&in_cleanup);
+	epk_input_close(in);
+	aes_ecb_free(keys.aes);
 	free(fwInfo);
 	free(pakArray);
+	free(pak_opts.dest_dir);
+}
+
+void extractEPK2file(const char *epk_file, struct config_opts_t *config_opts) {
+	extractEPK2(epk_input_open(epk_file, config_opts), config_opts);
+}
+
+/*
+ * Extracts an EPK2 or EPK3 from a pipe or stdin, without storing the image first
+ * Returns EXIT_FAILURE if the stream is neither
+ */
+int extractEPKstream(const char *epk_file, struct config_opts_t *config_opts) {
+	struct epk_input *in = epk_input_open(epk_file, config_opts);
+	size_t probeSize = (EPK2_PROBE_SIZE > EPK3_PROBE_SIZE) ? EPK2_PROBE_SIZE : EPK3_PROBE_SIZE;
+	uint8_t *buffer = (in->pipe != NULL) ? pipe_reader_data(in->pipe, 0, probeSize) : NULL;
+
+	if (buffer != NULL && is_epk2_header(buffer)) {
+		extractEPK2(in, config_opts);
+	} else if (buffer != NULL && is_epk3_header(buffer)) {
+		extractEPK3(in, config_opts);
+	} else {
+		epk_input_close(in);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
 }
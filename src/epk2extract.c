@@ -0,0 +1,791 @@
+/*
+	libepk2extract: probes the input, extracts it with the matching format,
+	and hands every file found inside to the same steps
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+
+#include "config.h"
+#include "mfile.h"
+
+#include "epk1.h"		/* EPK v1 */
+#include "epk2.h"		/* EPK v2 and v3 */
+#include "hisense.h"	/* Hisense DTV */
+#include "cramfs/cramfs.h"	/* CRAMFS */
+#include "cramfs/cramfsswap.h"
+#include "lz4/lz4.h"	/* LZ4 */
+#include "lzo/lzo.h"	/* LZO */
+#include "lzhs/lzhs.h"	/* LZHS */
+#include "jffs2/jffs2.h"	/* JFFS2 */
+#include "squashfs/unsquashfs.h"	/* SQUASHFS */
+#include "minigzip.h"	/* GZIP */
+#include "symfile.h"	/* SYM */
+#include "tsfile.h"		/* STR and PIF */
+#include "mediatek.h"	/* MTK Boot */
+#include "u-boot/partinfo.h"	/* PARTINFO */
+#include "util.h"
+#include "thpool.h"
+#include "pipe_reader.h"
+#include "verify.h"
+#include "artifact.h"
+#include "cache.h"
+#include "trace.h"
+#include "main.h"
+#include "epk2extract.h"
+
+struct epk2extract {
+	struct config_opts_t config_opts;
+	struct epk2extract_settings settings;
+	struct thpool *pool; // shared by the calls (jobs > 1)
+	unsigned int running; // submitted files not done yet
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // a submitted file is done
+};
+
+/* An epk2extract_file() call, shared by the input and the files nested in it */
+struct epk2extract_job {
+	const struct epk2extract *ctx;
+	struct thpool *pool; // nested files (jobs > 1), NULL to handle them in place
+	int status;
+	unsigned int pending; // nested files queued on the pool, not handled yet
+	pthread_mutex_t lock;
+	pthread_cond_t done; // pending dropped to 0
+};
+
+/* A file queued by epk2extract_submit() */
+struct input_task {
+	struct epk2extract *ctx;
+	char *file;
+	epk2extract_done_cb done;
+	void *arg;
+};
+
+/* A nested file with its own copy of the options */
+struct file_task {
+	struct artifact *artifact;
+	struct config_opts_t config_opts;
+};
+
+/* The file being identified. All probes look at the same read-only mapping */
+struct probe_file {
+	MFILE *mf;
+	char *file; // to open it, /proc/self/fd/N when it's in memory
+	const char *name; // to show it, the file it is on disk or would be with --keep-intermediates
+	char *file_name;
+	char *file_base;
+};
+
+struct file_format {
+	const char *name;
+	/* returns nonzero if the file is in this format */
+	int (*probe)(struct probe_file *pf);
+	void (*extract)(struct probe_file *pf, struct config_opts_t *config_opts);
+};
+
+static int probe_epk1(struct probe_file *pf) {
+	return isFileEPK1_mem(pf->mf);
+}
+
+static void extract_epk1(struct probe_file *pf, struct config_opts_t *config_opts) {
+	extract_epk1_file(pf->file, config_opts);
+}
+
+static int probe_epk2(struct probe_file *pf) {
+	return isFileEPK2_mem(pf->mf);
+}
+
+static void extract_epk2(struct probe_file *pf, struct config_opts_t *config_opts) {
+	extractEPK2file(pf->file, config_opts);
+}
+
+static int probe_epk3(struct probe_file *pf) {
+	return isFileEPK3_mem(pf->mf);
+}
+
+static void extract_epk3(struct probe_file *pf, struct config_opts_t *config_opts) {
+	extractEPK3file(pf->file, config_opts);
+}
+
+static int probe_hisense(struct probe_file *pf) {
+	return is_hisense_mem(pf->mf);
+}
+
+static void extract_hisense_pkg(struct probe_file *pf, struct config_opts_t *config_opts) {
+	extract_hisense(pf->mf, config_opts);
+}
+
+static int probe_ext4_lzhs(struct probe_file *pf) {
+	return is_ext4_lzhs_mem(pf->mf);
+}
+
+static void extract_ext4_lzhs_img(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.ext4", config_opts->dest_dir, pf->file_name);
+	extract_ext4_lzhs(pf->mf, dest_file);
+	free(dest_file);
+}
+
+static int probe_lz4(struct probe_file *pf) {
+	return is_lz4_mem(pf->mf);
+}
+
+static void extract_lz4(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.unlz4", config_opts->dest_dir, pf->file_name);
+	printf("UnLZ4 file to: %s\n", dest_file);
+	struct artifact *out = artifact_new(dest_file, config_opts);
+	if (!LZ4_decode_file(pf->file, out->path))
+		handle_artifact(out, config_opts);
+	else
+		artifact_free(out);
+	free(dest_file);
+}
+
+static int probe_lzo(struct probe_file *pf) {
+	return check_lzo_header_mem(pf->mf);
+}
+
+static void extract_lzo(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	if (!strcmp(pf->file_name, "logo.pak"))
+		asprintf(&dest_file, "%s/%s.bmp", config_opts->dest_dir, pf->file_name);
+	else
+		asprintf(&dest_file, "%s/%s.unlzo", config_opts->dest_dir, pf->file_name);
+	printf("UnLZO file to: %s\n", dest_file);
+	struct artifact *out = artifact_new(dest_file, config_opts);
+	if (!lzo_unpack(pf->file, out->path))
+		handle_artifact(out, config_opts);
+	else
+		artifact_free(out);
+	free(dest_file);
+}
+
+static int probe_nfsb(struct probe_file *pf) {
+	return is_nfsb_mem(pf->mf);
+}
+
+static void extract_nfsb(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.unnfsb", config_opts->dest_dir, pf->file_name);
+	printf("UnNFSB file to: %s\n", dest_file);
+	struct artifact *out = artifact_new(dest_file, config_opts);
+	unnfsb(pf->file, out->path);
+	handle_artifact(out, config_opts);
+	free(dest_file);
+}
+
+static int probe_squashfs(struct probe_file *pf) {
+	return is_squashfs_mem(pf->mf);
+}
+
+static void extract_squashfs(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.unsquashfs", config_opts->dest_dir, pf->file_name);
+	printf("UnSQUASHFS file to: %s\n", dest_file);
+	rmrf(dest_file);
+	unsquashfs(pf->file, dest_file, config_opts->extract_path);
+	free(dest_file);
+}
+
+static int probe_gzip(struct probe_file *pf) {
+	return is_gzip_mem(pf->mf);
+}
+
+static void extract_gzip(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_dir, *dest_file;
+	asprintf(&dest_dir, "%s/", config_opts->dest_dir);
+	printf("UnGZIP %s to folder %s\n", pf->name, dest_dir);
+	dest_file = gz_origname(pf->file, dest_dir);
+	if (dest_file == NULL)
+		asprintf(&dest_file, "%s%s.ungz", dest_dir, pf->file_name);
+	struct artifact *out = artifact_new(dest_file, config_opts);
+	file_uncompress(pf->file, out->path);
+	handle_artifact(out, config_opts);
+	free(dest_file);
+	free(dest_dir);
+}
+
+static int probe_mtk_boot(struct probe_file *pf) {
+	return is_mtk_boot_mem(pf->mf);
+}
+
+static void extract_mtk_boot(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/mtk_1bl.bin", config_opts->dest_dir);
+
+	printf("[MTK] Extracting 1BL to mtk_1bl.bin...\n");
+	extract_mtk_1bl(pf->mf, dest_file);
+
+	printf("[MTK] Extracting embedded LZHS files...\n");
+	extract_lzhs(pf->mf);
+	free(dest_file);
+}
+
+static int probe_cramfs_be(struct probe_file *pf) {
+	return is_cramfs_image_mem(pf->mf, "be");
+}
+
+static void extract_cramfs_be(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.cramswap", config_opts->dest_dir, pf->file_name);
+	printf("Swapping cramfs endian for file %s\n", pf->name);
+	struct artifact *out = artifact_new(dest_file, config_opts);
+	cramswap(pf->file, out->path);
+	handle_artifact(out, config_opts);
+	free(dest_file);
+}
+
+static int probe_cramfs_le(struct probe_file *pf) {
+	return is_cramfs_image_mem(pf->mf, "le");
+}
+
+static void extract_cramfs_le(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.uncramfs", config_opts->dest_dir, pf->file_name);
+	printf("UnCRAMFS %s to folder %s\n", pf->name, dest_file);
+	rmrf(dest_file);
+	uncramfs(dest_file, pf->file, config_opts->extract_path);
+	free(dest_file);
+}
+
+static int probe_kernel(struct probe_file *pf) {
+	return is_kernel_mem(pf->mf);
+}
+
+static void extract_uimage(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.unpaked", config_opts->dest_dir, pf->file_name);
+	printf("Extracting boot image (kernel) to: %s\n", dest_file);
+	struct artifact *out = artifact_new(dest_file, config_opts);
+	extract_kernel(pf->file, out->path);
+	handle_artifact(out, config_opts);
+	free(dest_file);
+}
+
+static int probe_partinfo(struct probe_file *pf) {
+	return isPartPakfile_mem(pf->mf);
+}
+
+static void extract_partinfo(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	// the probe leaves the model globals dump_partinfo uses alone, they are per thread
+	if (!detect_partpak_model(pf->mf))
+		return;
+	asprintf(&dest_file, "%s/%s.txt", config_opts->dest_dir, pf->file_base);
+	printf("Saving partition info to: %s\n", dest_file);
+	dump_partinfo(pf->file, dest_file);
+	free(dest_file);
+}
+
+static int probe_jffs2(struct probe_file *pf) {
+	return is_jffs2_mem(pf->mf);
+}
+
+static void extract_jffs2(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.unjffs2", config_opts->dest_dir, pf->file_name);
+	printf("UnJFFS2 file %s to folder %s\n", pf->name, dest_file);
+	rmrf(dest_file);
+	jffs2extract(pf->file, dest_file, "1234", config_opts->extract_path);
+	free(dest_file);
+}
+
+static int probe_str(struct probe_file *pf) {
+	return isSTRfile_mem(pf->mf);
+}
+
+static void extract_str(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.ts", config_opts->dest_dir, pf->file_name);
+	setKey();
+	printf("\nConverting %s file to TS: %s\n", pf->name, dest_file);
+	convertSTR2TS(pf->file, dest_file, 0);
+	free(dest_file);
+}
+
+static int probe_pif(struct probe_file *pf) {
+	size_t len = strlen(pf->name);
+	return len >= 3 && !memcmp(&pf->name[len - 3], "PIF", 3);
+}
+
+static void extract_pif(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.ts", config_opts->dest_dir, pf->file_name);
+	setKey();
+	printf("\nProcessing PIF file: %s\n", pf->name);
+	processPIF(pf->file, dest_file);
+	free(dest_file);
+}
+
+static int probe_sym(struct probe_file *pf) {
+	return is_symfile_mem(pf->mf);
+}
+
+static void extract_sym(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	// symfile_load keeps the symbols in per thread globals for symfile_write_idc
+	if (symfile_load(pf->file) != 0) {
+		printf("Cannot load SYM file %s\n", pf->name);
+		return;
+	}
+	asprintf(&dest_file, "%s/%s.idc", config_opts->dest_dir, pf->file_name);
+	printf("Converting SYM file to IDC script: %s\n", dest_file);
+	symfile_write_idc(dest_file);
+	free(dest_file);
+}
+
+static int probe_lzhs(struct probe_file *pf) {
+	return is_lzhs_mem(pf->mf, 0);
+}
+
+static void extract_lzhs_file(struct probe_file *pf, struct config_opts_t *config_opts) {
+	char *dest_file;
+	asprintf(&dest_file, "%s/%s.unlzhs", config_opts->dest_dir, pf->file_name);
+	printf("UnLZHS %s to %s\n", pf->name, dest_file);
+	lzhs_decode(pf->mf, 0, dest_file, NULL);
+	free(dest_file);
+}
+
+static int probe_mtk_tz(struct probe_file *pf) {
+	return (
+		!strcmp(pf->file_name, "tzfw.pak") &&
+		msize(pf->mf) >= sizeof(Elf32_Ehdr) &&
+		is_elf_mem(mdata(pf->mf, Elf32_Ehdr))
+	);
+}
+
+static void extract_mtk_tz(struct probe_file *pf, struct config_opts_t *config_opts) {
+	printf("Splitting mtk tzfw...\n");
+	split_mtk_tz(pf->mf, config_opts->dest_dir);
+}
+
+/*
+ * Known formats, probed in order until one matches
+ * Probes only look at the shared mapping, each at a few fixed offsets, so
+ * the cost is the same whatever the order. The order is the one of
+ * specificity instead: the formats with a full magic come first, the weak
+ * checks (JFFS2's 2 bytes, STR's sync bytes, LZHS' header sanity) last,
+ * so that they don't claim a file another format recognizes
+ */
+static const struct file_format file_formats[] = {
+	{ "EPK1", probe_epk1, extract_epk1 },
+	{ "EPK2", probe_epk2, extract_epk2 },
+	{ "EPK3", probe_epk3, extract_epk3 },
+	{ "Hisense", probe_hisense, extract_hisense_pkg },
+	{ "ext4 LZHS", probe_ext4_lzhs, extract_ext4_lzhs_img },
+	{ "LZ4", probe_lz4, extract_lz4 },
+	{ "LZO", probe_lzo, extract_lzo },
+	{ "NFSB", probe_nfsb, extract_nfsb },
+	{ "SQUASHFS", probe_squashfs, extract_squashfs },
+	{ "GZIP", probe_gzip, extract_gzip },
+	{ "MTK boot", probe_mtk_boot, extract_mtk_boot },
+	{ "CRAMFS BE", probe_cramfs_be, extract_cramfs_be },
+	{ "CRAMFS LE", probe_cramfs_le, extract_cramfs_le },
+	{ "uImage", probe_kernel, extract_uimage },
+	{ "partinfo", probe_partinfo, extract_partinfo },
+	{ "JFFS2", probe_jffs2, extract_jffs2 },
+	{ "STR", probe_str, extract_str },
+	{ "PIF", probe_pif, extract_pif },
+	{ "SYM", probe_sym, extract_sym },
+	{ "LZHS", probe_lzhs, extract_lzhs_file },
+	{ "MTK TZFW", probe_mtk_tz, extract_mtk_tz },
+	{ NULL, NULL, NULL }
+};
+
+static void job_failed(struct epk2extract_job *job) {
+	pthread_mutex_lock(&job->lock);
+	job->status = EPK2EXTRACT_FAILED;
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void extract_failed(struct config_opts_t *config_opts) {
+	job_failed(config_opts->job);
+	if (config_opts->failed != NULL)
+		*config_opts->failed = 1;
+}
+
+/*
+ * --cache: links the tree extracted from this file before, if there is one
+ * Otherwise the file is extracted into a staging directory of the cache,
+ * with what it contains handled in place, which becomes its entry
+ */
+static void extract_cached(const struct file_format *fmt, struct probe_file *pf, struct config_opts_t *config_opts) {
+	const char *cache_dir = config_opts->cache_dir;
+	char *key = cache_key(pf->mf, pf->file_name, config_opts);
+	if (key == NULL) {
+		fmt->extract(pf, config_opts);
+		return;
+	}
+	if (cache_restore(cache_dir, key, config_opts->dest_dir) == 0) {
+		printf("Cache hit for %s, linked %s/%s\n", pf->name, cache_dir, key);
+		free(key);
+		return;
+	}
+
+	char *staging = cache_stage(cache_dir);
+	if (staging == NULL) {
+		fmt->extract(pf, config_opts);
+		free(key);
+		return;
+	}
+
+	// the rest of the job runs on, its failures don't make this entry partial
+	int failed = 0;
+	struct config_opts_t stage_opts = *config_opts;
+	stage_opts.dest_dir = staging;
+	stage_opts.cache_dir = NULL;
+	stage_opts.in_place = 1;
+	stage_opts.failed = &failed;
+
+	jmp_buf jmp;
+	jmp_buf *prev = job_catch(&jmp);
+	volatile int unwound = 1;
+	if (setjmp(jmp) == 0) {
+		fmt->extract(pf, &stage_opts);
+		unwound = 0;
+	}
+	job_catch(prev);
+
+	// a partial tree must not be found by the next run, but is still extracted
+	if (unwound || failed) {
+		if (cache_unstage(staging, config_opts->dest_dir) < 0)
+			extract_failed(config_opts);
+		free(staging);
+		free(key);
+		if (unwound)
+			job_exit(EXIT_FAILURE);
+		return;
+	}
+
+	if (cache_commit(cache_dir, staging, key) < 0) {
+		printf("Cannot store %s in the cache (%s)\n", pf->name, strerror(errno));
+		if (cache_unstage(staging, config_opts->dest_dir) < 0)
+			extract_failed(config_opts);
+	} else if (cache_restore(cache_dir, key, config_opts->dest_dir) == 0) {
+		printf("Cached %s as %s/%s\n", pf->name, cache_dir, key);
+	} else {
+		extract_failed(config_opts);
+	}
+	free(staging);
+	free(key);
+}
+
+static void report_artifact(struct config_opts_t *config_opts, const char *name, const char *format) {
+	const struct epk2extract_settings *settings = &config_opts->job->ctx->settings;
+	if (settings->artifact != NULL)
+		settings->artifact(settings->user, name, format);
+}
+
+/*
+ * Reports that done of the total parts (PAKs) of a firmware file are extracted
+ */
+void report_progress(struct config_opts_t *config_opts, const char *name, unsigned int done, unsigned int total) {
+	if (config_opts->job == NULL)
+		return;
+	const struct epk2extract_settings *settings = &config_opts->job->ctx->settings;
+	if (settings->progress != NULL)
+		settings->progress(settings->user, name, done, total);
+}
+
+/*
+ * Extracts a file with the first format that matches
+ * A nested file that no format matches is a result of its own, and gets written to disk
+ * The artifact is freed
+ */
+static void artifact_cleanup(void *arg) {
+	artifact_free((struct artifact *)arg);
+}
+
+static void mfile_cleanup(void *arg) {
+	mclose((MFILE *)arg);
+}
+
+static int process_file(struct artifact *artifact, struct config_opts_t *config_opts, int nested) {
+	// if the extraction gives up, the memfd and the mapping are released
+	struct job_cleanup in_cleanup, mf_cleanup;
+	job_push_cleanup(&in_cleanup, artifact_cleanup, artifact);
+	struct probe_file pf = {
+		.mf = mopen(artifact->path, O_RDONLY),
+		.file = artifact->path,
+		.name = artifact->name,
+		.file_name = my_basename(artifact->name),
+	};
+	if (pf.mf == NULL) {
+		err_exit("Can't open file %s\n\n", artifact->name);
+	}
+	job_push_cleanup(&mf_cleanup, mfile_cleanup, pf.mf);
+	pf.file_base = remove_ext(pf.file_name);
+
+	int result = EXIT_FAILURE;
+	const struct file_format *fmt;
+	struct trace_span span;
+	trace_begin(&span, TRACE_PROBE, artifact->name);
+	for (fmt = file_formats; fmt->name != NULL; fmt++) {
+		if (fmt->probe(&pf))
+			break;
+	}
+	trace_end(&span, msize(pf.mf), 0);
+
+	if (fmt->name != NULL) {
+		if (nested && config_opts->cache_dir != NULL && config_opts->verify == NULL)
+			extract_cached(fmt, &pf, config_opts);
+		else
+			fmt->extract(&pf, config_opts);
+		report_artifact(config_opts, artifact->name, fmt->name);
+		result = EXIT_SUCCESS;
+	}
+
+	job_pop_cleanup(&mf_cleanup);
+	job_pop_cleanup(&in_cleanup);
+	mclose(pf.mf);
+	if (result == EXIT_FAILURE && nested) {
+		artifact_save(artifact);
+		report_artifact(config_opts, artifact->name, NULL);
+	}
+	free(pf.file_name);
+	free(pf.file_base);
+	artifact_free(artifact);
+	return result;
+}
+
+/*
+ * Handles a nested file on the pool. A failure only ends this file, and is
+ * reported in the status of the job
+ */
+static void file_task_run(void *arg) {
+	struct file_task *task = (struct file_task *)arg;
+	struct epk2extract_job *job = task->config_opts.job;
+	jmp_buf jmp;
+	jmp_buf *prev = job_catch(&jmp);
+	if (setjmp(jmp) == 0)
+		process_file(task->artifact, &task->config_opts, 1);
+	else
+		job_failed(job);
+	job_catch(prev);
+	free(task->config_opts.dest_dir);
+	free(task);
+
+	pthread_mutex_lock(&job->lock);
+	if (--job->pending == 0)
+		pthread_cond_broadcast(&job->done);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Waits for the nested files of the job still on the pool
+ * On a worker of the pool (a submitted input), it handles queued files meanwhile
+ */
+static void job_wait(struct epk2extract_job *job) {
+	pthread_mutex_lock(&job->lock);
+	while (job->pending > 0) {
+		pthread_mutex_unlock(&job->lock);
+		int helped = thpool_help(job->pool);
+		pthread_mutex_lock(&job->lock);
+		if (!helped && job->pending > 0)
+			pthread_cond_wait(&job->done, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Handles a file found inside another one, and frees the artifact
+ * With -j, the file is queued on the pool with a private copy of the options,
+ * and EXIT_SUCCESS is returned right away
+ */
+int handle_artifact(struct artifact *artifact, struct config_opts_t *config_opts) {
+	struct thpool *pool = config_opts->job->pool;
+	if (pool == NULL || config_opts->in_place)
+		return process_file(artifact, config_opts, 1);
+
+	struct file_task *task = calloc(1, sizeof(*task));
+	if (task == NULL)
+		return process_file(artifact, config_opts, 1);
+
+	artifact_hold(artifact);
+	task->artifact = artifact;
+	task->config_opts = *config_opts;
+	task->config_opts.dest_dir = strdup(config_opts->dest_dir);
+	struct epk2extract_job *job = config_opts->job;
+	pthread_mutex_lock(&job->lock);
+	job->pending++;
+	pthread_mutex_unlock(&job->lock);
+	if (thpool_submit(pool, file_task_run, task) < 0) {
+		pthread_mutex_lock(&job->lock);
+		job->pending--;
+		pthread_mutex_unlock(&job->lock);
+		free(task->config_opts.dest_dir);
+		free(task);
+		return process_file(artifact, config_opts, 1);
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Handles a file on disk found inside another one
+ */
+int handle_file(const char *file, struct config_opts_t *config_opts) {
+	return handle_artifact(artifact_file(file), config_opts);
+}
+
+/*
+ * Extracts the input with the job set up
+ * Returns EXIT_FAILURE for an unsupported file
+ */
+static int extract_input(const char *file, struct config_opts_t *config_opts) {
+	struct epk2extract_job *job = config_opts->job;
+	const struct epk2extract_settings *settings = &job->ctx->settings;
+
+	if (settings->verify_threads > 0) {
+		// nothing is written, the layers are checked in memory
+		config_opts->verify = verify_new(settings->verify_threads, VERIFY_POOL_SIZE);
+		if (is_pipe(file))
+			return extractEPKstream(file, config_opts);
+		return verify_file(file, config_opts);
+	}
+
+	job->pool = job->ctx->pool;
+	if (job->pool != NULL)
+		printf("Extracting on %u threads\n", settings->jobs);
+
+	// the input itself is handled here, the files found inside it go to the pool
+	// pipes can't be mapped, only EPK2 and EPK3 are extracted from them, as they're read
+	if (is_pipe(file))
+		return extractEPKstream(file, config_opts);
+	return process_file(artifact_file(file), config_opts, 0);
+}
+
+struct epk2extract *epk2extract_new(const struct config_opts_t *config_opts, const struct epk2extract_settings *settings) {
+	struct epk2extract *ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	ctx->config_opts = *config_opts;
+	ctx->config_opts.config_dir = strdup(config_opts->config_dir);
+	ctx->config_opts.dest_dir = (config_opts->dest_dir != NULL) ? strdup(config_opts->dest_dir) : NULL;
+	ctx->config_opts.cache_dir = (config_opts->cache_dir != NULL) ? strdup(config_opts->cache_dir) : NULL;
+	ctx->config_opts.in_place = 0;
+	ctx->config_opts.failed = NULL;
+	ctx->config_opts.verify = NULL;
+	ctx->config_opts.job = NULL;
+	if (settings != NULL)
+		ctx->settings = *settings;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
+	if (ctx->settings.jobs > 1)
+		ctx->pool = thpool_new(ctx->settings.jobs);
+	return ctx;
+}
+
+/*
+ * Extracts (or checks) a file and everything nested in it
+ * Without a dest_dir in the options, the files go next to the input
+ */
+int epk2extract_file(struct epk2extract *ctx, const char *file) {
+	struct epk2extract_job job = {
+		.ctx = ctx,
+		.status = EPK2EXTRACT_OK,
+	};
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.done, NULL);
+
+	struct config_opts_t config_opts = ctx->config_opts;
+	config_opts.job = &job;
+	config_opts.dest_dir = (ctx->config_opts.dest_dir != NULL) ? strdup(ctx->config_opts.dest_dir) : my_dirname(file);
+
+	jmp_buf jmp;
+	jmp_buf *prev = job_catch(&jmp);
+	volatile int result = EXIT_SUCCESS;
+	if (setjmp(jmp) == 0)
+		result = extract_input(file, &config_opts);
+	else
+		job_failed(&job);
+	job_catch(prev);
+
+	// the checks and nested files still running finish, failed or not
+	if (config_opts.verify != NULL && verify_finish(config_opts.verify) > 0)
+		job_failed(&job);
+	job_wait(&job);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.done);
+	free(config_opts.dest_dir);
+
+	if (job.status == EPK2EXTRACT_OK && result == EXIT_FAILURE)
+		return EPK2EXTRACT_UNSUPPORTED;
+	return job.status;
+}
+
+static void input_task_run(void *arg) {
+	struct input_task *task = (struct input_task *)arg;
+	struct epk2extract *ctx = task->ctx;
+	task->done(task->arg, task->file, epk2extract_file(ctx, task->file));
+	free(task->file);
+	free(task);
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->running--;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void epk2extract_submit(struct epk2extract *ctx, const char *file, epk2extract_done_cb done, void *arg) {
+	struct input_task *task = NULL;
+	if (ctx->pool != NULL)
+		task = calloc(1, sizeof(*task));
+	if (task == NULL) {
+		done(arg, file, epk2extract_file(ctx, file));
+		return;
+	}
+	task->ctx = ctx;
+	task->file = strdup(file);
+	task->done = done;
+	task->arg = arg;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->running >= ctx->settings.jobs)
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	ctx->running++;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (thpool_submit(ctx->pool, input_task_run, task) < 0) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->running--;
+		pthread_mutex_unlock(&ctx->lock);
+		free(task->file);
+		free(task);
+		done(arg, file, epk2extract_file(ctx, file));
+	}
+}
+
+void epk2extract_wait(struct epk2extract *ctx) {
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->running > 0)
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+const char *epk2extract_strerror(int status) {
+	switch (status) {
+	case EPK2EXTRACT_OK:
+		return "ok";
+	case EPK2EXTRACT_UNSUPPORTED:
+		return "unsupported";
+	default:
+		return "failed";
+	}
+}
+
+void epk2extract_free(struct epk2extract *ctx) {
+	thpool_free(ctx->pool);
+	pthread_mutex_destroy(&ctx->lock);
+	pthread_cond_destroy(&ctx->cond);
+	free(ctx->config_opts.config_dir);
+	free(ctx->config_opts.dest_dir);
+	free((char *)ctx->config_opts.cache_dir);
+	free(ctx);
+}
@@ -2,52 +2,63 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
 
-#include "main.h" //for handle_file
+#include "main.h" //for handle_artifact
+#include "artifact.h"
 #include "mfile.h"
 #include "hisense.h"
 #include "lzhs/lzhs.h"
+#include "thpool.h"
 #include "util.h"
 
-MFILE *is_hisense(const char *pkgfile){
-	MFILE *mf = mopen(pkgfile, O_RDONLY);
-	if(!mf){
-		err_exit("Cannot open file %s\n", pkgfile);
-	}
-	
+int is_hisense_mem(MFILE *mf){
+	if(msize(mf) < UPG_HEADER_SIZE + sizeof(struct hipkg) + 5)
+		return 0;
+
 	uint8_t *data = mdata(mf, uint8_t);
 	data = &data[UPG_HEADER_SIZE];
 
 	/* First pak doesn't have OTA ID fields */
 	struct hipkg *cfig = (struct hipkg *)data;
-	if(
-		(!strcmp(cfig->pakName, "cfig")) &&
+	/* Checking for END may be desirable */
+	return (
+		(!strncmp(cfig->pakName, "cfig", sizeof(cfig->pakName))) &&
 		(!strncmp(cfig->data, "START", 5))
-	){
-		/* Checking for END may be desirable */
-		return mf;
-	}
-	mclose(mf);
-	return NULL;
+	);
 }
 
-MFILE *is_ext4_lzhs(const char *pkg){
-	MFILE *mf = mopen(pkg, O_RDONLY);
+MFILE *is_hisense(const char *pkgfile){
+	MFILE *mf = mopen(pkgfile, O_RDONLY);
 	if(!mf){
-		err_exit("Cannot open file %s\n", pkg);
+		err_exit("Cannot open file %s\n", pkgfile);
 	}
+	if(is_hisense_mem(mf))
+		return mf;
 
-	uint8_t *data = mdata(mf, uint8_t);
+	mclose(mf);
+	return NULL;
+}
 
-	if(
-		msize(mf) > (HISENSE_EXT_LZHS_OFFSET + sizeof(struct lzhs_header)) &&
+int is_ext4_lzhs_mem(MFILE *mf){
+	uint8_t *data = mdata(mf, uint8_t);
+	return (
+		msize(mf) > (HISENSE_EXT_LZHS_OFFSET + 2 * sizeof(struct lzhs_header)) &&
 		is_lzhs_mem(mf, HISENSE_EXT_LZHS_OFFSET) &&
 		is_lzhs_mem(mf, HISENSE_EXT_LZHS_OFFSET + sizeof(struct lzhs_header)) &&
 		// first LZHS header contains number of block in checksum
 		((struct lzhs_header *)&data[HISENSE_EXT_LZHS_OFFSET])->checksum != 0x00
-	){
-		return mf;
+	);
+}
+
+MFILE *is_ext4_lzhs(const char *pkg){
+	MFILE *mf = mopen(pkg, O_RDONLY);
+	if(!mf){
+		err_exit("Cannot open file %s\n", pkg);
 	}
+	if(is_ext4_lzhs_mem(mf))
+		return mf;
 
 	mclose(mf);
 	return NULL;
@@ -60,47 +71,113 @@ MFILE *is_ext4_lzhs(const char *pkg){
  * The second header contains the actual data, and its checksum indicates the chunks number (at least for the first one).
  * The othr checksum purposes are unknown, as well as where the actual checksum of the data is
  */
+struct ext4_lzhs_chunk {
+	struct lzhs_header *main_hdr;
+	struct lzhs_header *seg_hdr;
+	size_t in_size; //bytes available from seg_hdr
+	off_t out_offset;
+};
+
+struct ext4_lzhs_job {
+	struct ext4_lzhs_chunk *chunks;
+	struct lzhs_ctx **ctx;
+	uint8_t *out;
+	uint segNo;
+	int failed;
+};
+
+static void ext4_lzhs_decode_chunk(void *arg, unsigned int worker, unsigned int index){
+	struct ext4_lzhs_job *job = (struct ext4_lzhs_job *)arg;
+	struct ext4_lzhs_chunk *chunk = &job->chunks[index];
+	struct lzhs_header *seg_hdr = chunk->seg_hdr;
+
+	size_t out_size = lzhs_decode_mem(job->ctx[worker], seg_hdr, chunk->in_size, job->out + chunk->out_offset, NULL);
+
+	printf(" segment #%u/%u (compressed='%u bytes', uncompressed='%u bytes')\n",
+		chunk->main_hdr->checksum, job->segNo,
+		seg_hdr->compressedSize, seg_hdr->uncompressedSize);
+	if(out_size != seg_hdr->uncompressedSize){
+		printf("[LZHS] WARNING: segment #%u size mismatch (got %zu, expected %u)!!\n",
+			chunk->main_hdr->checksum, out_size, seg_hdr->uncompressedSize);
+		job->failed = 1;
+	}
+}
+
+/*
+ * Chunks are independent, so they are located first, then decoded in parallel
+ * straight into their final position of the (presized) output file
+ */
 void extract_ext4_lzhs(MFILE *mf, const char *dest_file){
 	uint8_t *data = mdata(mf, uint8_t) + HISENSE_EXT_LZHS_OFFSET;
-	
-	FILE *out_file = fopen(dest_file, "w+");
-	if(!out_file){
-		err_exit("Cannot open %s for writing\n", dest_file);
-	}
 
-	uint8_t checksum_sums = 0;
+	struct ext4_lzhs_chunk *chunks = NULL;
+	off_t out_size = 0;
 	uint i=0, segNo=0;
-	for(i=0; moff(mf, data) < msize(mf); i++){
-		struct lzhs_header *main_hdr = (struct lzhs_header *)data; 
+	for(i=0; moff(mf, data) + 2 * sizeof(struct lzhs_header) <= msize(mf); i++){
+		struct lzhs_header *main_hdr = (struct lzhs_header *)data;
 		data += sizeof(*main_hdr);
 		struct lzhs_header *seg_hdr = (struct lzhs_header *)data;
 
 		if(i == 0){
 			segNo = seg_hdr->checksum;
-		} else if(i > segNo){
+		} else if(i > segNo || !_is_lzhs_mem(seg_hdr)){
 			break;
 		}
-		printf(" segment #%u/%u (compressed='%u bytes', uncompressed='%u bytes')\n",
-			main_hdr->checksum, segNo,
-			seg_hdr->compressedSize, seg_hdr->uncompressedSize);
-
-		uint8_t out_checksum;
-		cursor_t *out_cur = lzhs_decode(mf, moff(mf, data), NULL, &out_checksum);
-		if(out_cur == NULL || (intptr_t)out_cur < 0){
-			err_exit("LZHS decode failed\n");
-		}
 
-		fwrite(out_cur->ptr, out_cur->size, 1, out_file);
-		free(out_cur);
+		chunks = realloc(chunks, (i + 1) * sizeof(*chunks));
+		chunks[i].main_hdr = main_hdr;
+		chunks[i].seg_hdr = seg_hdr;
+		chunks[i].in_size = msize(mf) - moff(mf, seg_hdr);
+		chunks[i].out_offset = out_size;
+		out_size += seg_hdr->uncompressedSize;
 
 		data += (
 			sizeof(*seg_hdr) +
 			seg_hdr->compressedSize +
 			16 - (seg_hdr->compressedSize % 16)
 		);
-		seg_hdr = (struct lzhs_header *)data;
 	}
-	fclose(out_file);
+
+	MFILE *out_file = mfopen(dest_file, "w+");
+	if(!out_file){
+		err_exit("Cannot open %s for writing\n", dest_file);
+	}
+	if(out_size == 0){
+		mclose(out_file);
+		free(chunks);
+		return;
+	}
+	if(mfile_map(out_file, out_size) == NULL){
+		err_exit("Cannot map %s for writing\n", dest_file);
+	}
+
+	uint nthreads = thpool_ncpus();
+	printf("Decoding %u segments (%jd bytes) on %u threads\n", i, (intmax_t)out_size, nthreads);
+
+	struct ext4_lzhs_job job = {
+		.chunks = chunks,
+		.ctx = calloc(nthreads, sizeof(struct lzhs_ctx *)),
+		.out = mdata(out_file, uint8_t),
+		.segNo = segNo,
+		.failed = 0
+	};
+	uint t;
+	for(t=0; t<nthreads; t++){
+		job.ctx[t] = lzhs_ctx_new();
+	}
+
+	thpool_for(i, nthreads, ext4_lzhs_decode_chunk, &job);
+
+	for(t=0; t<nthreads; t++){
+		lzhs_ctx_free(job.ctx[t]);
+	}
+	free(job.ctx);
+	free(chunks);
+	mclose(out_file);
+
+	if(job.failed){
+		err_exit("LZHS decode failed\n");
+	}
 }
 
 void extract_hisense(MFILE *mf, struct config_opts_t *config_opts){
@@ -110,6 +187,10 @@ void extract_hisense(MFILE *mf, struct config_opts_t *config_opts){
 	char *file_base = remove_ext(file_name);
 
 	off_t i = UPG_HEADER_SIZE;
+
+	// the PAKs after the first go to an otaID subfolder, the caller's options are left alone
+	struct config_opts_t pak_opts = *config_opts;
+	pak_opts.dest_dir = strdup(config_opts->dest_dir);
 	
 	int pakNo;
 	for(pakNo=0; i < msize(mf); pakNo++){
@@ -133,8 +214,9 @@ void extract_hisense(MFILE *mf, struct config_opts_t *config_opts){
 		if(!strncmp(ext->platform, HISENSE_MTK_MAGIC, strlen(HISENSE_MTK_MAGIC))){
 			printf(", platform='%s', otaid='%s')\n", ext->platform, ext->otaID);
 			if(pakNo == 1){
-				sprintf(config_opts->dest_dir, "%s/%s", config_opts->dest_dir, ext->otaID);
-				createFolder(config_opts->dest_dir);
+				free(pak_opts.dest_dir);
+				asprintf(&pak_opts.dest_dir, "%s/%s", config_opts->dest_dir, ext->otaID);
+				createFolder(pak_opts.dest_dir);
 			}
 			pkgData += sizeof(*ext) + ext->otaID_len;
 			pkgSize -= sizeof(*ext) + ext->otaID_len;
@@ -148,31 +230,34 @@ void extract_hisense(MFILE *mf, struct config_opts_t *config_opts){
 			pkgSize -= sizeof(*pad);
 		}
 
-		asprintf(&dest_path, "%s/%s.pak", config_opts->dest_dir, pak->pakName);
+		asprintf(&dest_path, "%s/%s.pak", pak_opts.dest_dir, pak->pakName);
 
-		MFILE *out = mfopen(dest_path, "w+");
+		struct artifact *artifact = artifact_new(dest_path, &pak_opts);
+		MFILE *out = mfopen(artifact->path, "w+");
 		if(!out){
 			err_exit("Cannot open %s for writing\n", dest_path);
 		}
 
 		printf("Saving partition (%s) to file %s\n\n", pak->pakName, dest_path);
 
-		mfile_map(out, pkgSize);
+		if(mfile_map(out, pkgSize) == NULL){
+			err_exit("Cannot allocate %s (%s)\n", dest_path, strerror(errno));
+		}
 		memcpy(
 			mdata(out, void),
 			pkgData,
 			pkgSize
 		);
 		mclose(out);
-		handle_file(dest_path, config_opts);
+		handle_artifact(artifact, &pak_opts);
+		// the PAK count is only known at the end
+		report_progress(config_opts, pak->pakName, pakNo + 1, 0);
 		free(dest_path);
 
 		data += pak->size;
 	}
 
-	mclose(mf);
-	mf = NULL;
-
+	free(pak_opts.dest_dir);
 	free(file_name);
 	free(file_base);
 }
\ No newline at end of file
@@ -42,7 +42,13 @@ extern unsigned long crc32_no_comp(unsigned long crc, const unsigned char *buf,
 #include "jffs2/mini_inflate.h"
 #include "jffs2/jffs2.h"
 
-int swap_words;
+extern "C" {
+#include "util.h"
+#include "trace.h"
+}
+
+// the extraction runs start to finish on the calling thread, its state is per thread
+thread_local int swap_words;
 
 unsigned short fix16(unsigned short c) {
 	if (swap_words)
@@ -210,22 +216,26 @@ int do_uncompress(void *dst, int dstlen, void *src, int srclen, int type) {
 #include <list>
 #include <vector>
 
-std::map <int, std::string> inodes;
-std::map <int, int> node_type;
-std::map <int, std::list <int> > childs;
+thread_local std::map <int, std::string> inodes;
+thread_local std::map <int, int> node_type;
+thread_local std::map <int, std::list <int> > childs;
 
+// data is kept compressed, only the nodes of the extracted files get uncompressed
 struct nodedata_s {
 	unsigned char *data;
-	int size;
+	int csize, size;
+	int compr;
 	int offset;
 
 	int isize, gid, uid, mode;
 
-	nodedata_s(unsigned char *_data, int _size, int _offset, int _isize, int _gid, int _uid, int _mode) {
-		data = (unsigned char *)malloc(_size);
+	nodedata_s(unsigned char *_data, int _csize, int _size, int _compr, int _offset, int _isize, int _gid, int _uid, int _mode) {
+		data = (unsigned char *)malloc(_csize);
+		csize = _csize;
 		size = _size;
+		compr = _compr;
 		offset = _offset;
-		memcpy(data, _data, size);
+		memcpy(data, _data, csize);
 
 		isize = _isize;
 		gid = _gid;
@@ -233,7 +243,9 @@ struct nodedata_s {
 		mode = _mode;
 	} nodedata_s() {
 		data = 0;
+		csize = 0;
 		size = 0;
+		compr = 0;
 		offset = 0;
 
 		isize = 0;
@@ -243,15 +255,34 @@ struct nodedata_s {
 	}
 };
 
-std::map <int, std::map <int, struct nodedata_s> > nodedata;
-
-int whine = 0;
-std::string prefix;
-FILE *devtab;
+thread_local std::map <int, std::map <int, struct nodedata_s> > nodedata;
+
+thread_local int whine = 0;
+thread_local std::string prefix;
+thread_local FILE *devtab;
+thread_local const char *extract;
+thread_local unsigned long long written; // bytes of the files written, for the trace
+
+// forgets the nodes of the previous image extracted on this thread
+static void clear_nodes() {
+	for (std::map <int, std::map <int, struct nodedata_s> >::iterator i(nodedata.begin()); i != nodedata.end(); ++i)
+		for (std::map <int, struct nodedata_s>::iterator j(i->second.begin()); j != i->second.end(); ++j)
+			free(j->second.data);
+	nodedata.clear();
+	inodes.clear();
+	node_type.clear();
+	childs.clear();
+	whine = 0;
+}
 
 void do_list(int inode, std::string root = "") {
 	std::string pathname = prefix + root + inodes[inode];
 
+	// directories are made on the way to the matching files
+	int match = path_glob_match(extract, (root + inodes[inode]).c_str());
+	if (match == PATH_GLOB_NONE || (match == PATH_GLOB_PARENT && node_type[inode] != DT_DIR))
+		return;
+
 	std::map < int, struct nodedata_s >&data = nodedata[inode];
 
 	int max_size = 0, gid = 0, uid = 0, mode = 0755;
@@ -275,8 +306,14 @@ void do_list(int inode, std::string root = "") {
 		int offset = i->second.offset;
 		if (offset + size > max_size)
 			size = max_size - offset;
-		if (size > 0)
-			memcpy(merged_data + i->second.offset, i->second.data, i->second.size);
+		if (size <= 0)
+			continue;
+		unsigned char *uncomp = (unsigned char *)malloc(i->second.size);
+		if (do_uncompress(uncomp, i->second.size, i->second.data, i->second.csize, i->second.compr) != i->second.size)
+			printf("  ** data uncompress failed! (%s)\n", pathname.c_str());
+		else
+			memcpy(merged_data + offset, uncomp, size);
+		free(uncomp);
 	}
 
 	switch (node_type[inode]) {
@@ -294,6 +331,7 @@ void do_list(int inode, std::string root = "") {
 			else {
 				fwrite(merged_data, max_size, 1, f);
 				fclose(f);
+				written += max_size;
 			}
 			devtab_type = 'f';
 			break;
@@ -353,9 +391,11 @@ void do_list(int inode, std::string root = "") {
 		do_list(*i, root + inodes[inode].c_str() + "/");
 }
 
-extern "C" int jffs2extract(char *infile, char *outdir, char *inendian) {
+// Only the files matching pattern (see path_glob_match) are written, all of them if it's NULL
+extern "C" int jffs2extract(char *infile, char *outdir, char *inendian, const char *pattern) {
 	int errors = 0;
 	int verbose = 0;
+	struct trace_span span;
 
 	/*if (argc != 4)
 	   {
@@ -373,10 +413,13 @@ extern "C" int jffs2extract(char *infile, char *outdir, char *inendian) {
 	int endianess = atoi(inendian);
 	if ((endianess != BIG_ENDIAN) && (endianess != LITTLE_ENDIAN)) {
 		fprintf(stderr, "endianess must be %d (be) or %d (le)!\n", BIG_ENDIAN, LITTLE_ENDIAN);
+		fclose(fd);
 		return 2;
 	}
 
 	swap_words = endianess != BYTE_ORDER;
+	clear_nodes();
+	trace_begin(&span, TRACE_JFFS2, infile);
 
 	while (1) {
 		union jffs2_node_union node;
@@ -434,7 +477,7 @@ extern "C" int jffs2extract(char *infile, char *outdir, char *inendian) {
 				int uncompr_size = fix32(node.i.dsize);
 				if (verbose)
 					printf("  compr_size: %d, uncompr_size: %d\n", compr_size, uncompr_size);
-				unsigned char compr[compr_size], uncomp[uncompr_size];
+				unsigned char compr[compr_size];
 				fread(compr, compr_size, 1, fd);
 				if (crc32_no_comp(0, compr, compr_size) != fix32(node.i.data_crc)) {
 					errors++;
@@ -442,25 +485,7 @@ extern "C" int jffs2extract(char *infile, char *outdir, char *inendian) {
 				} else {
 					if (verbose)
 						printf("  data crc ok\n");
-					if (do_uncompress(uncomp, uncompr_size, compr, compr_size, node.i.compr) != uncompr_size) {
-						errors++;
-						printf("  ** data uncompress failed!\n");
-					} else {
-						nodedata[fix32(node.i.ino)][fix32(node.i.version)] = nodedata_s(uncomp, uncompr_size, fix32(node.i.offset), fix32(node.i.isize), fix32(node.i.gid), fix32(node.i.uid), fix32(node.i.mode));
-#if 0
-						int i;
-						for (i = 0; i < ((uncompr_size + 15) & ~15); ++i) {
-							if ((i & 15) == 0)
-								printf("%08x: ", fix32(node.i.offset) + i);
-							if (i < uncompr_size)
-								printf("%02x ", uncomp[i]);
-							else
-								printf("   ");
-							if ((i & 15) == 15)
-								printf("\n");
-						}
-#endif
-					}
+					nodedata[fix32(node.i.ino)][fix32(node.i.version)] = nodedata_s(compr, compr_size, uncompr_size, node.i.compr, fix32(node.i.offset), fix32(node.i.isize), fix32(node.i.gid), fix32(node.i.uid), fix32(node.i.mode));
 				}
 				break;
 			}
@@ -491,14 +516,20 @@ extern "C" int jffs2extract(char *infile, char *outdir, char *inendian) {
 			printf("there were errors, but some valid stuff was detected. continuing.\n");
 		else {
 			fprintf(stderr, "errors present and no valid data.\n");
+			fclose(fd);
 			return 2;
 		}
 	}
 	node_type[1] = DT_DIR;
 	prefix = outdir;
+	extract = pattern;
+	written = 0;
 	devtab = fopen((prefix + ".devtab").c_str(), "wb");
 	do_list(1);
 	fclose(devtab);
+	trace_end(&span, ftell(fd), written);
+	fclose(fd);
+	clear_nodes();
 
 	return 0;
 }
@@ -0,0 +1,306 @@
+/*
+	Key ring: the PEM and AES keys of config_dir, loaded once per process,
+	plus an on-disk cache of which key worked for which firmware
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+
+#include "keyring.h"
+
+static pthread_mutex_t keyring_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct keyring **keyrings = NULL;
+static unsigned int nkeyrings = 0;
+
+static const char *keyring_type_str[] = {
+	[KEYRING_PEM] = "pem",
+	[KEYRING_AES] = "aes"
+};
+
+static void keyring_load_pems(struct keyring *kr){
+	DIR *dir = opendir(kr->config_dir);
+	if(dir == NULL)
+		return;
+
+	struct dirent *ent;
+	while((ent = readdir(dir)) != NULL){
+		if(ent->d_name[0] == '.')
+			continue;
+		if(!strstr(ent->d_name, ".pem") && !strstr(ent->d_name, ".PEM"))
+			continue;
+
+		char *path;
+		asprintf(&path, "%s/%s", kr->config_dir, ent->d_name);
+		FILE *fp = fopen(path, "r");
+		free(path);
+		if(fp == NULL){
+			printf("Error: Can't open PEM file %s\n", ent->d_name);
+			continue;
+		}
+		EVP_PKEY *key = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+		fclose(fp);
+		if(key == NULL){
+			printf("Error: Can't read PEM signature from file %s\n", ent->d_name);
+			ERR_clear_error();
+			continue;
+		}
+
+		kr->pems = realloc(kr->pems, (kr->npems + 1) * sizeof(*kr->pems));
+		kr->pems[kr->npems].name = strdup(ent->d_name);
+		kr->pems[kr->npems].key = key;
+		kr->npems++;
+	}
+	closedir(dir);
+}
+
+/*
+ * Parses 32 hex digits at the start of line
+ */
+static int keyring_parse_aes(const char *line, unsigned char *key){
+	int i;
+	for(i=0; i<KEYRING_AES_KEY_SIZE; i++){
+		if(!isxdigit((unsigned char)line[2*i]) || !isxdigit((unsigned char)line[2*i + 1]))
+			return -1;
+		if(sscanf(&line[2*i], "%2hhx", &key[i]) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+static void keyring_load_aes(struct keyring *kr){
+	char *path;
+	asprintf(&path, "%s/AES.key", kr->config_dir);
+	FILE *fp = fopen(path, "r");
+	free(path);
+	if(fp == NULL)
+		return;
+
+	char *line = NULL;
+	size_t len = 0;
+	while(getline(&line, &len, fp) != -1){
+		unsigned char key[KEYRING_AES_KEY_SIZE];
+		if(keyring_parse_aes(line, key) < 0)
+			continue;
+		kr->aes = realloc(kr->aes, (kr->naes + 1) * sizeof(*kr->aes));
+		memcpy(kr->aes[kr->naes].key, key, sizeof(key));
+		kr->aes[kr->naes].label = strdup(strtok(line, "\n\r"));
+		kr->naes++;
+	}
+	free(line);
+	fclose(fp);
+}
+
+static int keyring_find(struct keyring *kr, enum keyring_type type, const char *value){
+	unsigned int i;
+	unsigned char key[KEYRING_AES_KEY_SIZE];
+
+	switch(type){
+	case KEYRING_PEM:
+		for(i=0; i<kr->npems; i++){
+			if(!strcmp(kr->pems[i].name, value))
+				return i;
+		}
+		break;
+	case KEYRING_AES:
+		if(keyring_parse_aes(value, key) < 0)
+			break;
+		for(i=0; i<kr->naes; i++){
+			if(!memcmp(kr->aes[i].key, key, sizeof(key)))
+				return i;
+		}
+		break;
+	}
+	return -1;
+}
+
+static void keyring_add_hit(struct keyring *kr, enum keyring_type type, const char *fingerprint, unsigned int index){
+	unsigned int i;
+	// keep one entry per fingerprint, the latest one last
+	for(i=0; i<kr->nhits; i++){
+		if(kr->hits[i].type == type && !strcmp(kr->hits[i].fingerprint, fingerprint)){
+			free(kr->hits[i].fingerprint);
+			memmove(&kr->hits[i], &kr->hits[i + 1], (kr->nhits - i - 1) * sizeof(*kr->hits));
+			kr->nhits--;
+			break;
+		}
+	}
+	kr->hits = realloc(kr->hits, (kr->nhits + 1) * sizeof(*kr->hits));
+	kr->hits[kr->nhits].type = type;
+	kr->hits[kr->nhits].fingerprint = strdup(fingerprint);
+	kr->hits[kr->nhits].index = index;
+	kr->nhits++;
+}
+
+/*
+ * Cache lines are "type<TAB>fingerprint<TAB>key", the key being a PEM file name or an AES key in hex
+ * The file is only appended to, later lines win, so only what was added since the last load is read
+ */
+static void keyring_load_cache(struct keyring *kr){
+	char *path;
+	asprintf(&path, "%s/%s", kr->config_dir, KEYRING_CACHE_FILE);
+	FILE *fp = fopen(path, "r");
+	free(path);
+	if(fp == NULL)
+		return;
+
+	struct stat st;
+	if(fstat(fileno(fp), &st) < 0 || st.st_size <= kr->cache_read || fseeko(fp, kr->cache_read, SEEK_SET) < 0){
+		fclose(fp);
+		return;
+	}
+
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t nread;
+	while((nread = getline(&line, &len, fp)) != -1){
+		// a line still being appended is read on the next load
+		if(line[nread - 1] != '\n')
+			break;
+		kr->cache_read += nread;
+
+		char *save = NULL;
+		char *type = strtok_r(line, "\t", &save);
+		char *fingerprint = strtok_r(NULL, "\t", &save);
+		char *value = strtok_r(NULL, "\n\r", &save);
+		if(type == NULL || fingerprint == NULL || value == NULL)
+			continue;
+
+		enum keyring_type t;
+		if(!strcmp(type, keyring_type_str[KEYRING_PEM]))
+			t = KEYRING_PEM;
+		else if(!strcmp(type, keyring_type_str[KEYRING_AES]))
+			t = KEYRING_AES;
+		else
+			continue;
+
+		int index = keyring_find(kr, t, value);
+		if(index >= 0)
+			keyring_add_hit(kr, t, fingerprint, index);
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Gets the key ring of config_dir, loading it on first use
+ */
+struct keyring *keyring_get(const char *config_dir){
+	unsigned int i;
+	struct keyring *kr = NULL;
+
+	pthread_mutex_lock(&keyring_lock);
+	for(i=0; i<nkeyrings; i++){
+		if(!strcmp(keyrings[i]->config_dir, config_dir)){
+			kr = keyrings[i];
+			goto exit;
+		}
+	}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	// done on first use since 1.1.0
+	OpenSSL_add_all_digests();
+	ERR_load_CRYPTO_strings();
+#endif
+
+	kr = calloc(1, sizeof(*kr));
+	kr->config_dir = strdup(config_dir);
+	pthread_mutex_init(&kr->lock, NULL);
+	keyring_load_pems(kr);
+	keyring_load_aes(kr);
+	keyring_load_cache(kr);
+
+	keyrings = realloc(keyrings, (nkeyrings + 1) * sizeof(*keyrings));
+	keyrings[nkeyrings++] = kr;
+
+	exit:
+		pthread_mutex_unlock(&keyring_lock);
+		return kr;
+}
+
+/*
+ * Fills order with the key indices to try, best first:
+ * the keys cached for the fingerprints (in the given order), then the keys
+ * that worked most recently for any firmware, then the rest in file order
+ * Returns the number of keys
+ */
+unsigned int keyring_order(struct keyring *kr, enum keyring_type type, const char **fingerprints, unsigned int nfingerprints, unsigned int *order){
+	unsigned int nkeys = (type == KEYRING_PEM) ? kr->npems : kr->naes;
+	unsigned int i, j, n = 0;
+	char *used = calloc(nkeys, 1);
+
+	pthread_mutex_lock(&kr->lock);
+	// what the other processes learned (--batch runs each firmware in its own)
+	keyring_load_cache(kr);
+	for(j=0; j<nfingerprints; j++){
+		for(i=0; i<kr->nhits; i++){
+			struct keyring_hit *hit = &kr->hits[i];
+			if(hit->type == type && !used[hit->index] && !strcmp(hit->fingerprint, fingerprints[j])){
+				used[hit->index] = 1;
+				order[n++] = hit->index;
+			}
+		}
+	}
+	for(i=kr->nhits; i-- > 0;){
+		struct keyring_hit *hit = &kr->hits[i];
+		if(hit->type == type && !used[hit->index]){
+			used[hit->index] = 1;
+			order[n++] = hit->index;
+		}
+	}
+	pthread_mutex_unlock(&kr->lock);
+
+	for(i=0; i<nkeys; i++){
+		if(!used[i])
+			order[n++] = i;
+	}
+	free(used);
+	return n;
+}
+
+/*
+ * Records that key index worked for the fingerprints, in memory and in the cache file
+ */
+void keyring_hit(struct keyring *kr, enum keyring_type type, const char **fingerprints, unsigned int nfingerprints, unsigned int index){
+	unsigned int i, j;
+	char value[2 * KEYRING_AES_KEY_SIZE + 1];
+
+	if(type == KEYRING_AES){
+		for(i=0; i<KEYRING_AES_KEY_SIZE; i++)
+			sprintf(&value[2*i], "%02X", kr->aes[index].key[i]);
+	}
+
+	pthread_mutex_lock(&kr->lock);
+	char *path;
+	asprintf(&path, "%s/%s", kr->config_dir, KEYRING_CACHE_FILE);
+	FILE *fp = NULL;
+
+	for(j=0; j<nfingerprints; j++){
+		int known = 0;
+		for(i=0; i<kr->nhits; i++){
+			struct keyring_hit *hit = &kr->hits[i];
+			if(hit->type == type && hit->index == index && !strcmp(hit->fingerprint, fingerprints[j]))
+				known = 1;
+		}
+		keyring_add_hit(kr, type, fingerprints[j], index);
+		if(known)
+			continue;
+
+		// the cache is best effort, config_dir may be read-only
+		if(fp == NULL && (fp = fopen(path, "a")) == NULL)
+			continue;
+		fprintf(fp, "%s\t%s\t%s\n", keyring_type_str[type], fingerprints[j],
+			(type == KEYRING_PEM) ? kr->pems[index].name : value
+		);
+	}
+	if(fp != NULL)
+		fclose(fp);
+	free(path);
+	pthread_mutex_unlock(&kr->lock);
+}
@@ -48,6 +48,7 @@
 #include "lz4.h"
 #include "lz4hc.h"
 #include "bench.h"
+#include "trace.h"
 
 //**************************************
 // Compiler functions
@@ -248,6 +249,7 @@ int LZ4_decode_file(const char *input_filename, const char *output_filename) {
 	FILE *finput;
 	FILE *foutput;
 	clock_t start, end;
+	struct trace_span span;
 	int r;
 
 	// Init
@@ -255,6 +257,7 @@ int LZ4_decode_file(const char *input_filename, const char *output_filename) {
 	r = get_fileHandle(input_filename, output_filename, &finput, &foutput);
 	if (r)
 		return r;
+	trace_begin(&span, TRACE_LZ4, input_filename);
 
 	// Check Archive Header
 	uselessRet = fread(chunkSize, 1, ARCHIVE_MAGICNUMBER_SIZE, finput);
@@ -320,6 +323,7 @@ int LZ4_decode_file(const char *input_filename, const char *output_filename) {
 
 	// Status
 	end = clock();
+	trace_end(&span, ftell(finput), filesize);
 	DISPLAY("Successfully decoded %llu bytes. ", (unsigned long long)filesize); {
 		double seconds = (double)(end - start) / CLOCKS_PER_SEC;
 		DISPLAY("Done in %.2f s ==> %.2f MB/s\n", seconds, (double)filesize / seconds / 1024 / 1024);
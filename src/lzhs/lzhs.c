@@ -1,51 +1,62 @@
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "lzhs/lzhs.h"
 #include "lzhs/tables.h"
 
-/* LZSS globals */
-static unsigned long int textsize = 0, codesize = 0;
-static uint8_t text_buf[N + F - 1];
-static int32_t match_length, match_position, lson[N + 1], rson[N + 257], dad[N + 1];
 /* Huffman decoding tables */
 static t_code(*huff_char)[1] = (void *)&char_table;
 static t_code(*huff_len)[1] = (void *)&len_table;
 static t_code(*huff_pos)[1] = (void *)&pos_table;
-/* Huffman globals */
-static uint32_t i, j, k, c, code = 0, len = 0, code_buf_ptr;
-static uint8_t code_buf[32], mask, bitno = 8;
-static uint32_t preno = 0, precode = 0;
+
+/*
+ * Huffman decoding lookup tables, indexed by the next LZHS_*_BITS of input.
+ * Each entry holds (symbol << 4) | code length
+ */
+#define LZHS_CHAR_BITS 13 // longest code in char_table/len_table
+#define LZHS_POS_BITS 6 // longest code in pos_table
+static uint16_t huff_char_lut[1 << LZHS_CHAR_BITS];
+static uint16_t huff_pos_lut[1 << LZHS_POS_BITS];
+static pthread_once_t huff_lut_once = PTHREAD_ONCE_INIT;
+
+/* MSB-first bit reservoir over the input cursor */
+struct huff_bits {
+	cursor_t *in;
+	uint64_t buf;
+	uint32_t avail;
+};
 
 ///////////// LZSS ALGO /////////////
-static void InitTree(void) {
+static void InitTree(struct lzhs_ctx *ctx) {
 	int i;
 	for (i = N + 1; i <= N + 256; i++)
-		rson[i] = N;
+		ctx->rson[i] = N;
 	for (i = 0; i < N; i++)
-		dad[i] = N;
+		ctx->dad[i] = N;
 }
 
-static void lazy_match(int r) {
+static void lazy_match(struct lzhs_ctx *ctx, int r) {
 	unsigned char *key;
 	int i, p, cmp = 1, tmp = 0;
 
-	if (match_length <= F - THRESHOLD) {
-		key = &text_buf[r + 1];
+	if (ctx->match_length <= F - THRESHOLD) {
+		key = &ctx->text_buf[r + 1];
 		p = key[0] + N + 1;
 		while (1) {
 			if (cmp >= 0) {
-				if (rson[p] != N)
-					p = rson[p];
+				if (ctx->rson[p] != N)
+					p = ctx->rson[p];
 				else
 					break;
 			} else {
-				if (lson[p] != N)
-					p = lson[p];
+				if (ctx->lson[p] != N)
+					p = ctx->lson[p];
 				else
 					break;
 			}
 			for (i = 1; i <= F - 1; i++) {
-				cmp = key[i] - text_buf[p + i];
-				if (key[i] != text_buf[p + i])
+				cmp = key[i] - ctx->text_buf[p + i];
+				if (key[i] != ctx->text_buf[p + i])
 					break;
 			}
 			if (i > tmp)
@@ -53,147 +64,366 @@ static void lazy_match(int r) {
 					break;
 		}
 	}
-	if (tmp > match_length)
-		match_length = 0;
+	if (tmp > ctx->match_length)
+		ctx->match_length = 0;
 }
 
-static void InsertNode(int r) {
-	unsigned char *key = &text_buf[r];
+static void InsertNode(struct lzhs_ctx *ctx, int r) {
+	unsigned char *key = &ctx->text_buf[r];
 	int tmp, p, i, cmp = 1;
 
-	p = text_buf[r] + N + 1;
-	lson[r] = rson[r] = N;
+	p = ctx->text_buf[r] + N + 1;
+	ctx->lson[r] = ctx->rson[r] = N;
 
-	match_length = 0;
+	ctx->match_length = 0;
 	while (1) {
 		if (cmp < 0) {
-			if (lson[p] == N) {
-				lson[p] = r;
-				dad[r] = p;
-				return lazy_match(r);
+			if (ctx->lson[p] == N) {
+				ctx->lson[p] = r;
+				ctx->dad[r] = p;
+				return lazy_match(ctx, r);
 			}
-			p = lson[p];
+			p = ctx->lson[p];
 		} else {
-			if (rson[p] == N) {
-				rson[p] = r;
-				dad[r] = p;
-				return lazy_match(r);
+			if (ctx->rson[p] == N) {
+				ctx->rson[p] = r;
+				ctx->dad[r] = p;
+				return lazy_match(ctx, r);
 			}
-			p = rson[p];
+			p = ctx->rson[p];
 		}
 		for (i = 1;; ++i) {
 			if (i < F) {
-				cmp = key[i] - text_buf[p + i];
-				if (key[i] == text_buf[p + i])
+				cmp = key[i] - ctx->text_buf[p + i];
+				if (key[i] == ctx->text_buf[p + i])
 					continue;
 			}
 			break;
 		}
-		if (i >= match_length) {
+		if (i >= ctx->match_length) {
 			if (r < p)
 				tmp = r - p + N;
 			else
 				tmp = r - p;
 		}
-		if (i >= match_length) {
-			if (i == match_length) {
-				if (tmp < match_position)
-					match_position = tmp;
+		if (i >= ctx->match_length) {
+			if (i == ctx->match_length) {
+				if (tmp < ctx->match_position)
+					ctx->match_position = tmp;
 			} else
-				match_position = tmp;
-			if ((match_length = i) > F - 1)
+				ctx->match_position = tmp;
+			if ((ctx->match_length = i) > F - 1)
 				break;
 		}
 	}
-	dad[r] = dad[p];
-	lson[r] = lson[p];
-	rson[r] = rson[p];
-	dad[lson[p]] = dad[rson[p]] = r;
-	if (rson[dad[p]] == p)
-		rson[dad[p]] = r;
+	ctx->dad[r] = ctx->dad[p];
+	ctx->lson[r] = ctx->lson[p];
+	ctx->rson[r] = ctx->rson[p];
+	ctx->dad[ctx->lson[p]] = ctx->dad[ctx->rson[p]] = r;
+	if (ctx->rson[ctx->dad[p]] == p)
+		ctx->rson[ctx->dad[p]] = r;
 	else
-		lson[dad[p]] = r;
-	dad[p] = N;
+		ctx->lson[ctx->dad[p]] = r;
+	ctx->dad[p] = N;
 }
 
-static void DeleteNode(int p) {
+static void DeleteNode(struct lzhs_ctx *ctx, int p) {
 	int q;
-	if (dad[p] == N)
+	if (ctx->dad[p] == N)
 		return;
-	if (rson[p] == N)
-		q = lson[p];
-	else if (lson[p] == N)
-		q = rson[p];
+	if (ctx->rson[p] == N)
+		q = ctx->lson[p];
+	else if (ctx->lson[p] == N)
+		q = ctx->rson[p];
 	else {
-		q = lson[p];
-		if (rson[q] != N) {
+		q = ctx->lson[p];
+		if (ctx->rson[q] != N) {
 			do {
-				q = rson[q];
-			} while (rson[q] != N);
-			rson[dad[q]] = lson[q];
-			dad[lson[q]] = dad[q];
-			lson[q] = lson[p];
-			dad[lson[p]] = q;
+				q = ctx->rson[q];
+			} while (ctx->rson[q] != N);
+			ctx->rson[ctx->dad[q]] = ctx->lson[q];
+			ctx->dad[ctx->lson[q]] = ctx->dad[q];
+			ctx->lson[q] = ctx->lson[p];
+			ctx->dad[ctx->lson[p]] = q;
 		}
-		rson[q] = rson[p];
-		dad[rson[p]] = q;
+		ctx->rson[q] = ctx->rson[p];
+		ctx->dad[ctx->rson[p]] = q;
 	}
-	dad[q] = dad[p];
-	if (rson[dad[p]] == p)
-		rson[dad[p]] = q;
+	ctx->dad[q] = ctx->dad[p];
+	if (ctx->rson[ctx->dad[p]] == p)
+		ctx->rson[ctx->dad[p]] = q;
 	else
-		lson[dad[p]] = q;
-	dad[p] = N;
+		ctx->lson[ctx->dad[p]] = q;
+	ctx->dad[p] = N;
 }
 
 ///////////// HUFFMAN ALGO /////////////
-static void InitHuffman(void) {
-	code = len = 0;
-	preno = precode = 0;
-	// Clear the huffman code buffer
-	memset(&code_buf, 0x00, sizeof(code_buf));
-	// Initial bit no (to fetch next byte at first iteration)
-	bitno = 8;
+static void huff_lut_fill(uint16_t *lut, uint32_t lut_bits, t_code *code, uint16_t sym) {
+	uint32_t shift = lut_bits - code->len;
+	uint32_t first = code->code << shift;
+	uint32_t k;
+	for (k = 0; k < (1U << shift); k++)
+		lut[first + k] = (sym << 4) | code->len;
+}
+
+static void huff_lut_init(void) {
+	uint32_t i;
+	// symbols 0-255 are literals, 256-287 are match lengths
+	for (i = 0; i < 256; i++)
+		huff_lut_fill(huff_char_lut, LZHS_CHAR_BITS, huff_char[i], i);
+	for (i = 0; i < 32; i++)
+		huff_lut_fill(huff_char_lut, LZHS_CHAR_BITS, huff_len[i], 256 + i);
+	for (i = 0; i < 32; i++)
+		huff_lut_fill(huff_pos_lut, LZHS_POS_BITS, huff_pos[i], i);
+}
+
+static inline void huff_refill(struct huff_bits *bits) {
+	cursor_t *in = bits->in;
+	while (bits->avail <= 56 && in->offset < in->size) {
+		bits->buf |= (uint64_t)in->ptr[in->offset++] << (56 - bits->avail);
+		bits->avail += 8;
+	}
+}
+
+static inline uint32_t huff_peek(struct huff_bits *bits, uint32_t nbits) {
+	return (uint32_t)(bits->buf >> (64 - nbits));
+}
+
+static inline void huff_skip(struct huff_bits *bits, uint32_t nbits) {
+	bits->buf <<= nbits;
+	bits->avail -= nbits;
+}
+
+/*
+ * Converts Thumb BL pairs back to ARM from pos, while 4 complete bytes are
+ * available before end, adding every byte left behind to the checksum
+ * Returns the new position
+ */
+static size_t thumb_step(uint8_t *data, size_t pos, size_t end, uint8_t *checksum) {
+	uint8_t sum = *checksum;
+	while (pos + 4 <= end) {
+		if ((data[pos + 1] & 0xF8) == 0xF0 && (data[pos + 3] & 0xF8) == 0xF8) {
+			uint32_t src = ((data[pos + 1] & 0x7) << 19) | (data[pos + 0] << 11) | ((data[pos + 3] & 0x7) << 8) | (data[pos + 2]);
+			uint32_t dest = ((src << 1) - (pos + 4)) >> 1;
+			data[pos + 1] = 0xF0 | ((dest >> 19) & 0x7);
+			data[pos + 0] = (dest >> 11);
+			data[pos + 3] = 0xF8 | ((dest >> 8) & 0x7);
+			data[pos + 2] = (dest);
+			sum += data[pos] + data[pos + 1] + data[pos + 2] + data[pos + 3];
+			pos += 4;
+		} else {
+			sum += data[pos] + data[pos + 1];
+			pos += 2;
+		}
+	}
+	*checksum = sum;
+	return pos;
+}
+
+/*
+ * Copies a group of decoded tokens to the output, truncating at its end
+ * Returns -1 if the output is full
+ */
+static int huff_flush(uint8_t *buf, uint32_t size, cursor_t *out) {
+	size_t room = (out->offset < out->size) ? out->size - out->offset : 0;
+	if (size > room) {
+		memcpy(out->ptr + out->offset, buf, room);
+		out->offset += room;
+		return -1;
+	}
+	memcpy(out->ptr + out->offset, buf, size);
+	out->offset += size;
+	return 0;
+}
+
+/*
+ * Copies an LZSS match of len bytes to dst[o], reading it back from the output
+ * written so far. A distance of 0 refers to N bytes back, like the ring buffer
+ * did, and bytes from before the start of the output read as zeroes
+ * len must fit in the room bytes of the output
+ */
+static inline void lzss_copy_match(uint8_t *dst, size_t o, size_t room, uint32_t dist, uint32_t len) {
+	uint8_t *d = dst + o;
+	const uint8_t *s;
+	uint32_t k;
+
+	if (dist == 0)
+		dist = N;
+
+	if (dist > o) {
+		// only the first window of the output can get here
+		for (k = 0; k < len; k++)
+			d[k] = (o + k >= dist) ? dst[o + k - dist] : 0;
+		return;
+	}
+
+	s = d - dist;
+	if (room - o >= len + 15 && dist >= 16) {
+		// whole chunks may overshoot the match, the excess is overwritten later
+		for (k = 0; k < len; k += 16)
+			memcpy(d + k, s + k, 16);
+	} else if (room - o >= len + 7 && dist >= 8) {
+		for (k = 0; k < len; k += 8)
+			memcpy(d + k, s + k, 8);
+	} else if (dist >= len) {
+		memcpy(d, s, len);
+	} else {
+		// short overlapping match (a run), byte by byte
+		for (k = 0; k < len; k++)
+			d[k] = s[k];
+	}
+}
+
+/*
+ * Clears what the last wide match copy may have left past the end of a
+ * truncated stream
+ */
+static inline void lzss_clear_overshoot(uint8_t *dst, size_t o, size_t room) {
+	if (o < room)
+		memset(dst + o, 0x00, (room - o < 15) ? room - o : 15);
 }
 
-static void putChar(uint32_t code, uint32_t no, FILE *out) {
+static void putChar(struct lzhs_ctx *ctx, uint32_t code, uint32_t no, FILE *out) {
 	uint32_t tmpno, tmpcode;
-	if (preno + no > 7) {
+	if (ctx->preno + no > 7) {
 		do {
-			no -= tmpno = 8 - preno;
+			no -= tmpno = 8 - ctx->preno;
 			tmpcode = code >> no;
-			fputc(tmpcode | (precode << tmpno), out);
+			fputc(tmpcode | (ctx->precode << tmpno), out);
 			code -= tmpcode << no;
-			preno = precode = 0;
+			ctx->preno = ctx->precode = 0;
 		} while (no > 7);
-		preno = no;
-		precode = code;
+		ctx->preno = no;
+		ctx->precode = code;
 	} else {
-		preno += no;
-		precode = code | (precode << no);
+		ctx->preno += no;
+		ctx->precode = code | (ctx->precode << no);
+	}
+}
+
+///////////// HASH CHAIN ENCODER /////////////
+/* per level match finder settings */
+static const struct {
+	uint16_t chain; // candidates to try per position
+	uint8_t nice; // stop searching at this length
+	uint8_t lazy; // look for a longer match at the next position
+} lzhs_levels[LZHS_LEVEL_MAX + 1] = {
+	{ 0, 0, 0 }, // binary tree encoder, see lzss_ctx
+	{ 2, 8, 0 },
+	{ 4, 16, 0 },
+	{ 8, F, 0 },
+	{ 16, F, 1 },
+	{ 32, F, 1 },
+	{ 64, F, 1 },
+	{ 256, F, 1 },
+	{ 1024, F, 1 },
+	{ 4096, F, 1 }
+};
+
+/* MSB-first bit packer over a memory buffer */
+struct huff_sink {
+	uint8_t *ptr;
+	size_t size, offset;
+	uint64_t buf;
+	uint32_t bits;
+};
+
+static inline void huff_put(struct huff_sink *sink, uint32_t code, uint32_t nbits) {
+	sink->buf = (sink->buf << nbits) | (code & ((1 << nbits) - 1));
+	sink->bits += nbits;
+	while (sink->bits >= 8) {
+		sink->bits -= 8;
+		if (sink->offset < sink->size)
+			sink->ptr[sink->offset] = sink->buf >> sink->bits;
+		sink->offset++;
 	}
 }
 
-static int getData(cursor_t *in) {
-	if (bitno > 7) {
-		bitno = 0;
-		if((c = cgetc(in)) == EOF){
-			return 0;
+static inline uint32_t lzhs_hash(const uint8_t *p) {
+	uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+	return (v * 2654435761U) >> (32 - LZHS_HASH_BITS);
+}
+
+/*
+ * Adds the positions up to end to the hash chains, starting from *next
+ */
+static inline void lzhs_hash_insert(struct lzhs_ctx *ctx, const uint8_t *src, size_t size, size_t *next, size_t end) {
+	size_t pos;
+	for (pos = *next; pos < end && pos + 3 <= size; pos++) {
+		uint32_t h = lzhs_hash(&src[pos]);
+		ctx->hash_prev[pos & (N - 1)] = ctx->hash_head[h];
+		ctx->hash_head[h] = pos;
+	}
+	if (end > *next)
+		*next = end;
+}
+
+/*
+ * Finds the longest match for pos within the last N bytes, walking at most
+ * chain candidates. Only the positions before pos must be in the chains
+ * Returns the match length (0 if none is usable) and its distance
+ */
+static uint32_t lzhs_find_match(struct lzhs_ctx *ctx, const uint8_t *src, size_t size, size_t pos, uint32_t chain, uint32_t nice, uint32_t *dist) {
+	uint32_t limit = (size - pos < F) ? size - pos : F;
+	uint32_t best = THRESHOLD, len;
+	int32_t cand, next;
+
+	if (limit <= THRESHOLD)
+		return 0;
+	if (nice > limit)
+		nice = limit;
+
+	cand = ctx->hash_head[lzhs_hash(&src[pos])];
+	while (cand >= 0 && pos - cand <= N && chain-- > 0) {
+		const uint8_t *a = &src[cand], *b = &src[pos];
+		if (a[best] == b[best] && a[0] == b[0]) {
+			for (len = 1; len < limit && a[len] == b[len]; len++) ;
+			if (len > best) {
+				best = len;
+				*dist = pos - cand;
+				if (len >= nice)
+					break;
+			}
 		}
+		next = ctx->hash_prev[cand & (N - 1)];
+		if (next >= cand)
+			break;
+		cand = next;
 	}
-	code = (code << 1) | ((c >> (7 - bitno++)) & 1);	// get bit msb - index
-	len++;
-	return 1;
+	return (best > THRESHOLD) ? best : 0;
+}
+
+/*
+ * Cost in bits of a match, and of the literals it would replace
+ */
+static inline uint32_t lzhs_match_cost(uint32_t len, uint32_t dist) {
+	dist &= (N - 1);
+	return huff_len[len - THRESHOLD - 1]->len + huff_pos[dist >> 7]->len + 7;
+}
+
+static inline uint32_t lzhs_literal_cost(const uint8_t *p, uint32_t len) {
+	uint32_t i, cost = 0;
+	for (i = 0; i < len; i++)
+		cost += huff_char[p[i]]->len;
+	return cost;
 }
 
 ///////////// EXPORTS /////////////
 
+struct lzhs_ctx *lzhs_ctx_new(void) {
+	return calloc(1, sizeof(struct lzhs_ctx));
+}
+
+void lzhs_ctx_free(struct lzhs_ctx *ctx) {
+	free(ctx);
+}
+
 /*
  * Huffman encodes the specified stream
  */
-void huff(FILE * in, FILE * out, unsigned long int *p_textsize, unsigned long int *p_codesize) {
-	textsize = codesize;
-	codesize = 0;
+void huff_ctx(struct lzhs_ctx *ctx, FILE * in, FILE * out, unsigned long int *p_textsize, unsigned long int *p_codesize) {
+	ctx->textsize = ctx->codesize = 0;
+	ctx->preno = ctx->precode = 0;
 	int c, i, j, k, m, flags = 0;
 	while (1) {
 		if (((flags >>= 1) & 256) == 0) {
@@ -204,7 +434,7 @@ void huff(FILE * in, FILE * out, unsigned long int *p_textsize, unsigned long in
 		if (flags & 1) {
 			if ((c = getc(in)) == EOF)
 				break;
-			putChar(huff_char[c]->code, huff_char[c]->len, out);	// lookup in char table
+			putChar(ctx, huff_char[c]->code, huff_char[c]->len, out);	// lookup in char table
 		} else {
 			if ((j = getc(in)) == EOF)
 				break;			// match length
@@ -212,167 +442,341 @@ void huff(FILE * in, FILE * out, unsigned long int *p_textsize, unsigned long in
 				break;			// byte1 of match position
 			if ((m = getc(in)) == EOF)
 				break;			// byte0 of match position
-			putChar(huff_len[j]->code, huff_len[j]->len, out);	// lookup in len table
+			putChar(ctx, huff_len[j]->code, huff_len[j]->len, out);	// lookup in len table
 			i = m | (i << 8);
-			putChar(huff_pos[(i >> 7)]->code, huff_pos[(i >> 7)]->len, out);	// lookup in pos table
-			putChar(i - (i >> 7 << 7), 7, out);
+			putChar(ctx, huff_pos[(i >> 7)]->code, huff_pos[(i >> 7)]->len, out);	// lookup in pos table
+			putChar(ctx, i - (i >> 7 << 7), 7, out);
 		}
 	}
-	putc(precode << (8 - preno), out);
-	codesize = ftell(out) - sizeof(struct lzhs_header);
+	putc(ctx->precode << (8 - ctx->preno), out);
+	ctx->textsize = ftell(in);
+	ctx->codesize = ftell(out) - sizeof(struct lzhs_header);
 	if(p_textsize)
-		*p_textsize = textsize;
+		*p_textsize = ctx->textsize;
 	if(p_codesize)
-		*p_codesize = codesize;
-	printf("LZHS Out(%ld)/In(%ld): %.4f\n", codesize, textsize, (double)codesize / textsize);
+		*p_codesize = ctx->codesize;
+	printf("LZHS Out(%ld)/In(%ld): %.4f\n", ctx->codesize, ctx->textsize, (double)ctx->codesize / ctx->textsize);
 }
 
 /*
  * Huffman decodes the specified stream
+ * Every symbol is resolved with a single lookup table probe
  */
 void unhuff(cursor_t *in, cursor_t *out) {
-	InitHuffman();
+	struct huff_bits bits = {
+		.in = in,
+		.buf = 0,
+		.avail = 0
+	};
+	uint8_t code_buf[32], mask = 1;
+	uint32_t code_buf_ptr = 1;
+	uint32_t sym, len;
+	uint16_t entry;
+
+	pthread_once(&huff_lut_once, huff_lut_init);
 	code_buf[0] = 0;
-	code_buf_ptr = mask = 1;
 
 	while (1) {
-		if (!getData(in))
-			goto flush_ret;
-		if (len < 4)
-			continue; // len in code_len table should be min 4
-		for (i = 0; i < 288; i++) {
-			if (huff_char[i]->len == len &&
-				huff_char[i]->code == code
-			){
-				if (i > 255) {
-					code_buf[code_buf_ptr++] = i - 256;
-					code = len = 0;
-					while (1) {
-						if (!getData(in))
-							goto flush_ret;
-						if (len < 2)
-							continue;	// len in pos table should be min 2
-						for (j = 0; j < 32; j++) {
-							if (huff_pos[j]->len == len &&
-								huff_pos[j]->code == code
-							){
-								code_buf[code_buf_ptr++] = j >> 1;
-								k = -1;
-								break;
-							}
-						}
-						if (k == -1)
-							break;
-					}
-					code = 0;
-					for (k = 0; k < 7; k++)
-						if (!getData(in))
-							goto flush_ret;
-					code_buf[code_buf_ptr++] = code | (j << 7);
-					code = len = 0;
-				} else {
-					code_buf[0] |= mask;
-					code_buf[code_buf_ptr++] = i;
-					code = len = 0;
-				}
-				if ((mask <<= 1) == 0) {
-					for (j = 0; j < code_buf_ptr; j++){
-						if(cputc(code_buf[j], out) == EOF)
-							return;
-					}
-					code_buf[0] = 0;
-					code_buf_ptr = mask = 1;
-				}
+		// one refill covers the longest token (13 + 6 + 7 bits)
+		huff_refill(&bits);
+
+		entry = huff_char_lut[huff_peek(&bits, LZHS_CHAR_BITS)];
+		sym = entry >> 4;
+		len = entry & 0xF;
+		if (len > bits.avail)
+			break;
+		huff_skip(&bits, len);
+
+		if (sym > 255) {
+			code_buf[code_buf_ptr++] = sym - 256; // match length
+
+			entry = huff_pos_lut[huff_peek(&bits, LZHS_POS_BITS)];
+			sym = entry >> 4;
+			len = entry & 0xF;
+			if (len > bits.avail)
 				break;
-			}
+			huff_skip(&bits, len);
+			code_buf[code_buf_ptr++] = sym >> 1; // byte1 of match position
+
+			if (bits.avail < 7)
+				break;
+			code_buf[code_buf_ptr++] = huff_peek(&bits, 7) | (sym << 7); // byte0 of match position
+			huff_skip(&bits, 7);
+		} else {
+			code_buf[0] |= mask;
+			code_buf[code_buf_ptr++] = sym;
+		}
+
+		if ((mask <<= 1) == 0) {
+			if (huff_flush(code_buf, code_buf_ptr, out) < 0)
+				return;
+			code_buf[0] = 0;
+			code_buf_ptr = mask = 1;
 		}
 	}
-	
-	flush_ret:
+
 	if (code_buf_ptr > 1)	// flushing buffer
-		for (i = 0; i < code_buf_ptr; i++){
-			if(cputc(code_buf[i], out) == EOF)
-				return;
+		huff_flush(code_buf, code_buf_ptr, out);
+}
+
+/*
+ * Decodes a Huffman + LZSS stream in a single pass, using the output buffer as
+ * the LZSS window. The output is converted from Thumb to ARM and checksummed
+ * once it falls out of the window
+ * Returns the number of decoded bytes
+ */
+size_t unlzhs_ctx(struct lzhs_ctx *ctx, cursor_t *in, cursor_t *out, uint8_t *out_checksum) {
+	struct huff_bits bits = {
+		.in = in,
+		.buf = 0,
+		.avail = 0
+	};
+	uint8_t *dst = out->ptr + out->offset;
+	size_t room = (out->offset < out->size) ? out->size - out->offset : 0;
+	size_t o = 0, thumb_pos = 0;
+	uint32_t sym, len, dist;
+	uint16_t entry;
+	uint8_t checksum = 0;
+
+	(void)ctx; // the window is the output itself
+	pthread_once(&huff_lut_once, huff_lut_init);
+
+	while (o < room) {
+		// one refill covers the longest token (13 + 6 + 7 bits)
+		huff_refill(&bits);
+
+		entry = huff_char_lut[huff_peek(&bits, LZHS_CHAR_BITS)];
+		sym = entry >> 4;
+		len = entry & 0xF;
+		if (len > bits.avail)
+			break;
+		huff_skip(&bits, len);
+
+		if (sym < 256) {
+			dst[o++] = sym;
+		} else {
+			entry = huff_pos_lut[huff_peek(&bits, LZHS_POS_BITS)];
+			dist = entry >> 4;
+			len = entry & 0xF;
+			if (len + 7 > bits.avail)
+				break;
+			huff_skip(&bits, len);
+			dist = (dist << 7) | huff_peek(&bits, 7);
+			huff_skip(&bits, 7);
+
+			len = sym - 256 + THRESHOLD + 1;
+			if (len > room - o)
+				len = room - o;
+			lzss_copy_match(dst, o, room, dist, len);
+			o += len;
 		}
-	return;
+
+		// matches still read the last N bytes, so only convert what's behind them
+		if (o >= thumb_pos + N + 64)
+			thumb_pos = thumb_step(dst, thumb_pos, o - N, &checksum);
+	}
+	lzss_clear_overshoot(dst, o, room);
+	out->offset += o;
+
+	// the conversion and checksum cover the whole output buffer
+	thumb_pos = thumb_step(dst, thumb_pos, room, &checksum);
+	for (; thumb_pos < room; thumb_pos++)
+		checksum += dst[thumb_pos];
+
+	if (out_checksum != NULL)
+		*out_checksum = checksum;
+	return o;
 }
 
 /*
  * LZSS encodes the specified stream
  */
-void lzss(FILE * infile, FILE * outfile, unsigned long int *p_textsize, unsigned long int *p_codesize) {
+void lzss_ctx(struct lzhs_ctx *ctx, FILE * infile, FILE * outfile, unsigned long int *p_textsize, unsigned long int *p_codesize) {
 	int c, i, len, r, s, last_match_length, code_buf_ptr;
 	unsigned char code_buf[32], mask;
 
-	InitTree();
+	InitTree(ctx);
+	memset(ctx->text_buf, 0x00, sizeof(ctx->text_buf));
 	code_buf[0] = 0;
 	code_buf_ptr = mask = 1;
-	s = codesize = 0;
+	s = ctx->codesize = 0;
 	r = N - F;
 
 	for (len = 0; len < F && (c = getc(infile)) != EOF; len++)
-		text_buf[r + len] = c;
-	if ((textsize = len) == 0)
+		ctx->text_buf[r + len] = c;
+	if ((ctx->textsize = len) == 0)
 		return;
 
-	InsertNode(r);
+	InsertNode(ctx, r);
 	do {
-		if (match_length > len)
-			match_length = len;
-		if (match_length <= THRESHOLD) {
-			match_length = 1;
+		if (ctx->match_length > len)
+			ctx->match_length = len;
+		if (ctx->match_length <= THRESHOLD) {
+			ctx->match_length = 1;
 			code_buf[0] |= mask;
-			code_buf[code_buf_ptr++] = text_buf[r];
+			code_buf[code_buf_ptr++] = ctx->text_buf[r];
 		} else {
-			code_buf[code_buf_ptr++] = match_length - THRESHOLD - 1;
-			code_buf[code_buf_ptr++] = (match_position >> 8) & 0xff;
-			code_buf[code_buf_ptr++] = match_position;
+			code_buf[code_buf_ptr++] = ctx->match_length - THRESHOLD - 1;
+			code_buf[code_buf_ptr++] = (ctx->match_position >> 8) & 0xff;
+			code_buf[code_buf_ptr++] = ctx->match_position;
 		}
 		if ((mask <<= 1) == 0) {
 			for (i = 0; i < code_buf_ptr; i++) {
 				putc(code_buf[i], outfile);
-				codesize++;
+				ctx->codesize++;
 			}
 			code_buf[0] = 0;
 			code_buf_ptr = mask = 1;
 		}
-		last_match_length = match_length;
+		last_match_length = ctx->match_length;
 		for (i = 0; i < last_match_length && (c = getc(infile)) != EOF; i++) {
-			DeleteNode(s);
-			text_buf[s] = c;
+			DeleteNode(ctx, s);
+			ctx->text_buf[s] = c;
 			if (s < F - 1)
-				text_buf[s + N] = c;
+				ctx->text_buf[s + N] = c;
 			s = (s + 1) & (N - 1);
 			r = (r + 1) & (N - 1);
-			InsertNode(r);
+			InsertNode(ctx, r);
 		}
-		textsize += i;
+		ctx->textsize += i;
 		while (i++ < last_match_length) {
-			DeleteNode(s);
+			DeleteNode(ctx, s);
 			s = (s + 1) & (N - 1);
 			r = (r + 1) & (N - 1);
 			if (--len)
-				InsertNode(r);
+				InsertNode(ctx, r);
 		}
 	} while (len > 0);
 	if (code_buf_ptr > 1) {
 		for (i = 0; i < code_buf_ptr; i++) {
 			putc(code_buf[i], outfile);
-			codesize++;
+			ctx->codesize++;
 		}
 	}
 	if(p_textsize)
-		*p_textsize = textsize;
+		*p_textsize = ctx->textsize;
 	if(p_codesize)
-		*p_codesize = codesize;
-	printf("LZSS Out(%ld)/In(%ld): %.3f\n", codesize, textsize, (double)codesize / textsize);
+		*p_codesize = ctx->codesize;
+	printf("LZSS Out(%ld)/In(%ld): %.3f\n", ctx->codesize, ctx->textsize, (double)ctx->codesize / ctx->textsize);
+}
+
+/*
+ * LZHS encodes size bytes of src into dst in a single pass, finding LZSS
+ * matches with hash chains and packing their Huffman codes directly.
+ * level trades speed (LZHS_LEVEL_MIN) for ratio (LZHS_LEVEL_MAX)
+ * Returns the size of the encoded stream, or 0 if dst is too small
+ */
+size_t lzhs_pack_ctx(struct lzhs_ctx *ctx, const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size, int level) {
+	struct huff_sink sink = {
+		.ptr = dst,
+		.size = dst_size,
+		.offset = 0,
+		.buf = 0,
+		.bits = 0
+	};
+	size_t pos = 0, inserted = 0, next_pos = 0;
+	uint32_t len, dist = 0, next_len = 0, next_dist = 0;
+	uint32_t chain, nice, lazy;
+
+	if (level < LZHS_LEVEL_MIN)
+		level = LZHS_LEVEL_MIN;
+	if (level > LZHS_LEVEL_MAX)
+		level = LZHS_LEVEL_MAX;
+	chain = lzhs_levels[level].chain;
+	nice = lzhs_levels[level].nice;
+	lazy = lzhs_levels[level].lazy;
+
+	memset(ctx->hash_head, 0xFF, sizeof(ctx->hash_head));
+
+	while (pos < size) {
+		if (next_pos == pos && pos > 0) {
+			// already searched by the lazy check
+			len = next_len;
+			dist = next_dist;
+		} else {
+			lzhs_hash_insert(ctx, src, size, &inserted, pos);
+			len = lzhs_find_match(ctx, src, size, pos, chain, nice, &dist);
+		}
+
+		// defer to a literal if the next position has a longer match
+		if (len > 0 && lazy && len < nice) {
+			lzhs_hash_insert(ctx, src, size, &inserted, pos + 1);
+			next_len = lzhs_find_match(ctx, src, size, pos + 1, chain, nice, &next_dist);
+			next_pos = pos + 1;
+			if (next_len > len)
+				len = 0;
+		}
+
+		// the tables are fixed, so a short far match may cost more than its literals
+		if (len > 0 && lzhs_match_cost(len, dist) < lzhs_literal_cost(&src[pos], len)) {
+			huff_put(&sink, huff_len[len - THRESHOLD - 1]->code, huff_len[len - THRESHOLD - 1]->len);
+			dist &= (N - 1); // a distance of N is stored as 0
+			huff_put(&sink, huff_pos[dist >> 7]->code, huff_pos[dist >> 7]->len);
+			huff_put(&sink, dist & 0x7F, 7);
+			pos += len;
+		} else {
+			huff_put(&sink, huff_char[src[pos]]->code, huff_char[src[pos]]->len);
+			pos++;
+		}
+	}
+
+	// like huff_ctx, always close with a (possibly empty) partial byte
+	huff_put(&sink, 0, 8 - sink.bits);
+
+	if (sink.offset > sink.size)
+		return 0;
+	return sink.offset;
+}
+
+/*
+ * LZSS decodes the specified stream into a contiguous output, reading matches
+ * back from the output instead of a ring buffer
+ * Returns the number of decoded bytes
+ */
+size_t unlzss_mem(cursor_t *in, cursor_t *out) {
+	const uint8_t *src = in->ptr;
+	size_t ip = in->offset, isize = in->size;
+	uint8_t *dst = out->ptr + out->offset;
+	size_t room = (out->offset < out->size) ? out->size - out->offset : 0;
+	size_t o = 0;
+	uint32_t flags = 0, len, dist;
+
+	while (o < room) {
+		if (((flags >>= 1) & 256) == 0) {
+			if (ip >= isize)
+				break;
+			flags = src[ip++] | 0xff00;
+		}
+		if (flags & 1) {
+			if (ip >= isize)
+				break;
+			dst[o++] = src[ip++];
+		} else {
+			// match length, byte1 and byte0 of match position
+			if (ip + 3 > isize)
+				break;
+			len = src[ip] + THRESHOLD + 1;
+			dist = ((src[ip + 1] << 8) | src[ip + 2]) & (N - 1);
+			ip += 3;
+
+			if (len > room - o)
+				len = room - o;
+			lzss_copy_match(dst, o, room, dist, len);
+			o += len;
+		}
+	}
+	lzss_clear_overshoot(dst, o, room);
+	in->offset = ip;
+	out->offset += o;
+	return o;
 }
 
 /*
  * LZSS decodes the specified stream
  */
-void unlzss(cursor_t *in, cursor_t *out) {
+void unlzss_ctx(struct lzhs_ctx *ctx, cursor_t *in, cursor_t *out) {
 	int c, i, j, k, m, r = 0, flags = 0;
+	memset(ctx->text_buf, 0x00, sizeof(ctx->text_buf));
 	while (1) {
 		if (((flags >>= 1) & 256) == 0) {
 			if ((c = cgetc(in)) == EOF)
@@ -383,7 +787,7 @@ void unlzss(cursor_t *in, cursor_t *out) {
 			if((c = cgetc(in)) == EOF)
 				break;
 			
-			if(cputc(text_buf[r++] = c, out) == EOF)
+			if(cputc(ctx->text_buf[r++] = c, out) == EOF)
 				return;
 			r &= (N - 1);
 		} else {
@@ -396,11 +800,28 @@ void unlzss(cursor_t *in, cursor_t *out) {
 
 			i = (i << 8) | m;
 			for (k = 0; k <= j + THRESHOLD; k++) {
-				m = text_buf[(r - i) & (N - 1)];				
-				if(cputc((text_buf[r++] = m), out) == EOF)
+				m = ctx->text_buf[(r - i) & (N - 1)];				
+				if(cputc((ctx->text_buf[r++] = m), out) == EOF)
 					return;
 				r &= (N - 1);
 			}
 		}
 	}
-}
\ No newline at end of file
+}
+void lzss(FILE * infile, FILE * outfile, unsigned long int *p_textsize, unsigned long int *p_codesize) {
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	lzss_ctx(ctx, infile, outfile, p_textsize, p_codesize);
+	lzhs_ctx_free(ctx);
+}
+
+void huff(FILE * in, FILE * out, unsigned long int *p_textsize, unsigned long int *p_codesize) {
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	huff_ctx(ctx, in, out, p_textsize, p_codesize);
+	lzhs_ctx_free(ctx);
+}
+
+void unlzss(cursor_t *in, cursor_t *out) {
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	unlzss_ctx(ctx, in, out);
+	lzhs_ctx_free(ctx);
+}
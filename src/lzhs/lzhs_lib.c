@@ -2,13 +2,17 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <libgen.h>
 
 #include "config.h"
 #include "mfile.h"
 #include "lzhs/lzhs.h"
 #include "mediatek.h"
+#include "hisense.h"
+#include "thpool.h"
 #include "util.h"
+#include "trace.h"
 
 #define LZHS_SIZE_THRESHOLD (20 * 1024 * 1024) //20 MB (a random sane value)
 
@@ -117,7 +121,7 @@ unsigned char lzhs_calc_checksum(unsigned char *buf, int fsize) {
 	return checksum;
 }
 
-void lzhs_encode(const char *infile, const char *outfile) {
+void lzhs_encode_ctx(struct lzhs_ctx *ctx, const char *infile, const char *outfile) {
 	struct lzhs_header header;
 	FILE *in, *out;
 	unsigned char *buf;
@@ -179,7 +183,7 @@ void lzhs_encode(const char *infile, const char *outfile) {
 	freopen(outpath, "wb", out);
 
 	printf("[LZHS] Encoding with LZSS...\n");
-	lzss(in, out, &textsize, &codesize);
+	lzss_ctx(ctx, in, out, &textsize, &codesize);
 	if (!out) {
 		err_exit("Cannot open tmp.lzs\n");
 	}
@@ -200,7 +204,7 @@ void lzhs_encode(const char *infile, const char *outfile) {
 	
 	printf("[LZHS] Encoding with Huffman...\n");
 
-	huff(in, out, &textsize, &codesize); 
+	huff_ctx(ctx, in, out, &textsize, &codesize);
 	header.compressedSize = codesize;
 	printf("[LZHS] Writing Header...\n");
 	rewind(out);
@@ -213,20 +217,293 @@ void lzhs_encode(const char *infile, const char *outfile) {
 	fclose(out);
 }
 
-cursor_t *lzhs_decode(MFILE *in_file, off_t offset, const char *out_path, uint8_t *out_checksum){
+void lzhs_encode(const char *infile, const char *outfile) {
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	lzhs_encode_ctx(ctx, infile, outfile);
+	lzhs_ctx_free(ctx);
+}
+
+/*
+ * LZHS encodes size bytes of data into out (header included), with the same
+ * padding, checksum and ARM to Thumb conversion as lzhs_encode
+ * out should hold LZHS_ENCODE_BOUND(size) bytes
+ * Returns the number of bytes written, or 0 if out is too small
+ */
+size_t lzhs_encode_mem(struct lzhs_ctx *ctx, const uint8_t *data, size_t size, uint8_t *out, size_t out_size, int level){
+	struct lzhs_header *header = (struct lzhs_header *)out;
+	if(out_size < sizeof(*header))
+		return 0;
+
+	// lzhs_pad_file rounds a trailing partial 512 byte block up to 8 bytes, unless it's 16 aligned
+	size_t tail = size % 0x200;
+	size_t padded = size + ((tail % 16) ? (-tail & 7) : 0);
+
+	uint8_t *buf = malloc(padded);
+	if(buf == NULL)
+		return 0;
+	memcpy(buf, data, size);
+	memset(buf + size, 0xFF, padded - size);
+
+	memset(header, 0x00, sizeof(*header));
+	header->uncompressedSize = padded;
+	header->checksum = lzhs_calc_checksum(buf, padded);
+	ARMThumb_Convert(buf, padded, 0, 1);
+
+	size_t stream_size = lzhs_pack_ctx(ctx, buf, padded, out + sizeof(*header), out_size - sizeof(*header), level);
+	free(buf);
+
+	if(stream_size == 0)
+		return 0;
+	header->compressedSize = stream_size;
+	return sizeof(*header) + stream_size;
+}
+
+/*
+ * LZHS encodes infile into outfile in memory, without intermediate files
+ * Returns 0 on success
+ */
+int lzhs_encode_file(const char *infile, const char *outfile, int level){
+	MFILE *in_file = mopen(infile, O_RDONLY);
+	if(in_file == NULL){
+		err_exit("Cannot open file %s\n", infile);
+	}
+	size_t in_size = msize(in_file);
+	if(in_size == 0){
+		printf("[LZHS] %s is empty\n", infile);
+		mclose(in_file);
+		return -1;
+	}
+
+	size_t out_cap = LZHS_ENCODE_BOUND(in_size);
+	uint8_t *out_bytes = malloc(out_cap);
+	if(out_bytes == NULL){
+		err_exit("Cannot allocate %zu bytes\n", out_cap);
+	}
+
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	printf("[LZHS] Encoding (level %d)...\n", level);
+	size_t out_size = lzhs_encode_mem(ctx, mdata(in_file, uint8_t), in_size, out_bytes, out_cap, level);
+	lzhs_ctx_free(ctx);
+	mclose(in_file);
+
+	int result = -1;
+	if(out_size == 0){
+		printf("[LZHS] Encoding failed\n");
+		goto exit;
+	}
+
+	struct lzhs_header *header = (struct lzhs_header *)out_bytes;
+	printf("Checksum = %x\n", header->checksum);
+	printf("LZHS Out(%u)/In(%u): %.4f\n", header->compressedSize, header->uncompressedSize,
+		(double)header->compressedSize / header->uncompressedSize);
+
+	FILE *out = fopen(outfile, "wb");
+	if(out == NULL){
+		err_exit("Cannot open file %s\n", outfile);
+	}
+	if(fwrite(out_bytes, 1, out_size, out) == out_size){
+		result = 0;
+	}
+	fclose(out);
+	printf("[LZHS] Done!\n");
+
+	exit:
+		free(out_bytes);
+		return result;
+}
+
+/*
+ * Chunked ext4 layout read by extract_ext4_lzhs (see hisense.c)
+ */
+struct ext4_lzhs_pack_chunk {
+	const uint8_t *data;
+	size_t size;
+	uint8_t *packed; //inner LZHS header + stream
+	size_t packed_size;
+};
+
+struct ext4_lzhs_pack_job {
+	struct ext4_lzhs_pack_chunk *chunks;
+	struct lzhs_ctx **ctx;
+	uint8_t **scratch;
+	size_t scratch_size;
+	unsigned int count;
+	int level;
+	int failed;
+};
+
+static void ext4_lzhs_pack_chunk(void *arg, unsigned int worker, unsigned int index){
+	struct ext4_lzhs_pack_job *job = (struct ext4_lzhs_pack_job *)arg;
+	struct ext4_lzhs_pack_chunk *chunk = &job->chunks[index];
+
+	size_t packed_size = lzhs_encode_mem(job->ctx[worker], chunk->data, chunk->size, job->scratch[worker], job->scratch_size, job->level);
+	if(packed_size == 0 || (chunk->packed = malloc(packed_size)) == NULL){
+		printf("[LZHS] WARNING: segment #%u failed to encode!!\n", index + 1);
+		job->failed = 1;
+		return;
+	}
+	memcpy(chunk->packed, job->scratch[worker], packed_size);
+	chunk->packed_size = packed_size;
+
+	printf(" segment #%u/%u (uncompressed='%zu bytes', compressed='%zu bytes')\n",
+		index + 1, job->count, chunk->size, packed_size - sizeof(struct lzhs_header));
+}
+
+/*
+ * Splits an ext4 image in chunks of chunk_size bytes, LZHS encodes them in parallel
+ * and writes them with the double header layout that extract_ext4_lzhs expects
+ * Returns 0 on success
+ */
+int lzhs_encode_ext4(const char *infile, const char *outfile, int level, size_t chunk_size){
+	MFILE *in_file = mopen(infile, O_RDONLY);
+	if(in_file == NULL){
+		err_exit("Cannot open file %s\n", infile);
+	}
+	size_t in_size = msize(in_file);
+	if(in_size == 0){
+		printf("[LZHS] %s is empty\n", infile);
+		mclose(in_file);
+		return -1;
+	}
+
+	// the chunk count is stored in an 8 bit checksum field
+	size_t min_chunk = (in_size + LZHS_EXT4_MAX_CHUNKS - 1) / LZHS_EXT4_MAX_CHUNKS;
+	if(chunk_size < min_chunk){
+		chunk_size = (min_chunk + 0xFFF) & ~0xFFF;
+		printf("[LZHS] Chunk size raised to 0x%zx bytes\n", chunk_size);
+	}
+	if(chunk_size == 0 || chunk_size > LZHS_SIZE_THRESHOLD){
+		printf("[LZHS] %s is too big for %u chunks\n", infile, LZHS_EXT4_MAX_CHUNKS);
+		mclose(in_file);
+		return -1;
+	}
+
+	unsigned int count = (in_size + chunk_size - 1) / chunk_size;
+	unsigned int nthreads = thpool_ncpus();
+	if(nthreads > count)
+		nthreads = count;
+
+	struct ext4_lzhs_pack_job job = {
+		.chunks = calloc(count, sizeof(struct ext4_lzhs_pack_chunk)),
+		.ctx = calloc(nthreads, sizeof(struct lzhs_ctx *)),
+		.scratch = calloc(nthreads, sizeof(uint8_t *)),
+		.scratch_size = LZHS_ENCODE_BOUND(chunk_size),
+		.count = count,
+		.level = level,
+		.failed = 0
+	};
+
+	unsigned int i;
+	for(i=0; i<count; i++){
+		job.chunks[i].data = mdata(in_file, uint8_t) + (size_t)i * chunk_size;
+		job.chunks[i].size = (i == count - 1) ? in_size - (size_t)i * chunk_size : chunk_size;
+	}
+	for(i=0; i<nthreads; i++){
+		job.ctx[i] = lzhs_ctx_new();
+		job.scratch[i] = malloc(job.scratch_size);
+		if(job.scratch[i] == NULL){
+			err_exit("Cannot allocate %zu bytes\n", job.scratch_size);
+		}
+	}
+
+	printf("[LZHS] Encoding %u segments (level %d) on %u threads\n", count, level, nthreads);
+	thpool_for(count, nthreads, ext4_lzhs_pack_chunk, &job);
+
+	for(i=0; i<nthreads; i++){
+		lzhs_ctx_free(job.ctx[i]);
+		free(job.scratch[i]);
+	}
+	free(job.ctx);
+	free(job.scratch);
+
+	int result = -1;
+	if(job.failed)
+		goto exit;
+
+	// outer header + inner header + stream, aligned the way extract_ext4_lzhs skips it
+	size_t out_size = HISENSE_EXT_LZHS_OFFSET;
+	for(i=0; i<count; i++){
+		size_t stream_size = job.chunks[i].packed_size - sizeof(struct lzhs_header);
+		out_size += sizeof(struct lzhs_header) + job.chunks[i].packed_size + 16 - (stream_size % 16);
+	}
+
+	MFILE *out_file = mfopen(outfile, "w+");
+	if(out_file == NULL){
+		err_exit("Cannot open file %s for writing\n", outfile);
+	}
+	if(mfile_map(out_file, out_size) == NULL){
+		err_exit("Cannot map %s for writing\n", outfile);
+	}
+
+	uint8_t *out = mdata(out_file, uint8_t) + HISENSE_EXT_LZHS_OFFSET;
+	for(i=0; i<count; i++){
+		struct ext4_lzhs_pack_chunk *chunk = &job.chunks[i];
+		struct lzhs_header *main_hdr = (struct lzhs_header *)out;
+		struct lzhs_header *seg_hdr = (struct lzhs_header *)(out + sizeof(*main_hdr));
+
+		memcpy(seg_hdr, chunk->packed, chunk->packed_size);
+		// the first inner header holds the number of chunks instead of its checksum
+		if(i == 0)
+			seg_hdr->checksum = count;
+
+		memset(main_hdr, 0x00, sizeof(*main_hdr));
+		main_hdr->uncompressedSize = seg_hdr->uncompressedSize;
+		main_hdr->compressedSize = seg_hdr->compressedSize + sizeof(*seg_hdr);
+		main_hdr->checksum = i + 1;
+
+		out += sizeof(*main_hdr) + chunk->packed_size + 16 - (seg_hdr->compressedSize % 16);
+	}
+	mclose(out_file);
+
+	printf("LZHS Out(%zu)/In(%zu): %.4f\n", out_size, in_size, (double)out_size / in_size);
+	printf("[LZHS] Done!\n");
+	result = 0;
+
+	exit:
+		for(i=0; i<count; i++){
+			free(job.chunks[i].packed);
+		}
+		free(job.chunks);
+		mclose(in_file);
+		return result;
+}
+
+/*
+ * Decodes the LZHS stream at header (in_size bytes available, header included)
+ * into out_bytes, which must be able to hold header->uncompressedSize bytes
+ * Returns the number of decoded bytes
+ */
+size_t lzhs_decode_mem(struct lzhs_ctx *ctx, struct lzhs_header *header, size_t in_size, uint8_t *out_bytes, uint8_t *out_checksum){
+	/* Input stream */
+	cursor_t in_cur = {
+		.ptr = (uint8_t *)header + sizeof(*header),
+		.size = in_size - sizeof(*header),
+		.offset = 0
+	};
+	if(in_cur.size > header->compressedSize)
+		in_cur.size = header->compressedSize;
+
+	/* Output buffer */
+	cursor_t out_cur = {
+		.ptr = out_bytes,
+		.size = header->uncompressedSize,
+		.offset = 0
+	};
+
+	struct trace_span span;
+	trace_begin(&span, TRACE_LZHS, NULL);
+	size_t out_size = unlzhs_ctx(ctx, &in_cur, &out_cur, out_checksum);
+	trace_end(&span, in_cur.size, out_size);
+	return out_size;
+}
+
+cursor_t *lzhs_decode_ctx(struct lzhs_ctx *ctx, MFILE *in_file, off_t offset, const char *out_path, uint8_t *out_checksum){
 	struct lzhs_header *header = (struct lzhs_header *)(mdata(in_file, uint8_t) + offset);
 	printf("\n---LZHS details---\n");
 	printf("Compressed:\t%d\n", header->compressedSize);
 	printf("Uncompressed:\t%d\n", header->uncompressedSize);
 	printf("Checksum:\t0x%x\n\n", header->checksum);
 
-	void *tmp = MFILE_ANON(header->uncompressedSize);
-	if(tmp == MAP_FAILED){
-		perror("mmap tmp for lzhs\n");
-		return (cursor_t *)-1;
-	}
-	memset(tmp, 0x00, header->uncompressedSize);
-	
 	MFILE *out_file = NULL;
 	uint8_t *out_bytes = NULL;
 
@@ -242,67 +519,46 @@ cursor_t *lzhs_decode(MFILE *in_file, off_t offset, const char *out_path, uint8_
 			fprintf(stderr, "Cannot open output file %s\n", out_path);
 			return (cursor_t *)-1;
 		}
-		mfile_map(out_file, header->uncompressedSize);
+		if(mfile_map(out_file, header->uncompressedSize) == NULL){
+			fprintf(stderr, "Cannot allocate output file %s (%s)\n", out_path, strerror(errno));
+			mclose(out_file);
+			return (cursor_t *)-1;
+		}
 		out_bytes = mdata(out_file, uint8_t);
 	}
 
-	uint8_t *in_bytes = mdata(in_file, uint8_t);
-
-	/* Input file */
-	cursor_t in_cur = {
-		.ptr = in_bytes,
-		.size = msize(in_file),
-		.offset = (off_t)sizeof(*header)
-	};
-	
-	/* Temp memory */
-	cursor_t out_cur = {
-		.ptr = tmp,
-		.size = header->uncompressedSize,
-		.offset = 0
-	};
+	printf("[LZHS] Decoding...\n");
+	uint8_t checksum;
+	size_t out_size = lzhs_decode_mem(ctx, header, msize(in_file) - offset, out_bytes, &checksum);
 
-	printf("[LZHS] Decoding Huffman...\n");
-	// Input file -> Temp memory
-	unhuff(&in_cur, &out_cur);
-	
-	printf("[LZHS] Decoding LZSS...\n");
-	
-	// Rewind the huffman cursor and change ends
-	out_cur.offset = 0;
-	memcpy((void *)&in_cur, (void *)&out_cur, sizeof(cursor_t));
-	out_cur.ptr = out_bytes;
-	// Temp memory -> Output file
-	unlzss(&in_cur, &out_cur);
-
-	// We don't need the temp memory anymore
-	munmap(tmp, header->uncompressedSize);	
-	
-	printf("[LZHS] Converting Thumb => ARM...\n");
-	ARMThumb_Convert(out_bytes, out_cur.size, 0, 0);
-	
-	printf("[LZHS] Calculating checksum...\n");
-	uint8_t checksum = lzhs_calc_checksum(out_bytes, out_cur.size);
 	if(out_checksum != NULL){
 		*out_checksum = checksum;
 	}
 	printf("Calculated checksum = 0x%x\n", checksum);
 	if (checksum != header->checksum)
 		printf("[LZHS] WARNING: Checksum mismatch (got 0x%x, expected 0x%x)!!\n", checksum, header->checksum);
-	if (out_cur.size != header->uncompressedSize)
-		printf("[LZHS] WARNING: Size mismatch (got %zu, expected %d)!!\n", out_cur.size, header->uncompressedSize);	
-	
+	if (out_size != header->uncompressedSize)
+		printf("[LZHS] WARNING: Size mismatch (got %zu, expected %d)!!\n", out_size, header->uncompressedSize);
+
 	if(out_file != NULL){
 		mclose(out_file);
 		return NULL;
 	} else {
-		cursor_t *cpy = calloc(1, sizeof(out_cur));
-		memcpy(cpy, &out_cur, sizeof(out_cur));
+		cursor_t *cpy = calloc(1, sizeof(cursor_t));
+		cpy->ptr = out_bytes;
+		cpy->size = header->uncompressedSize;
 		return cpy;
 	}
 }
 
-int process_segment(MFILE *in_file, off_t offset, const char *name){
+cursor_t *lzhs_decode(MFILE *in_file, off_t offset, const char *out_path, uint8_t *out_checksum){
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	cursor_t *ret = lzhs_decode_ctx(ctx, in_file, offset, out_path, out_checksum);
+	lzhs_ctx_free(ctx);
+	return ret;
+}
+
+static int process_segment(struct lzhs_ctx *ctx, MFILE *in_file, off_t offset, const char *name){
 	int r = 0;
 	char *file_dir = my_dirname(in_file->path);
 	
@@ -321,9 +577,14 @@ int process_segment(MFILE *in_file, off_t offset, const char *name){
 	struct lzhs_header *lzhs_hdr = (struct lzhs_header *)bytes;
 	
 	/* Allocate file */
-	mfile_map(out_file,
+	if(mfile_map(out_file,
 		sizeof(*lzhs_hdr) +	lzhs_hdr->compressedSize
-	);
+	) == NULL){
+		fprintf(stderr, "Cannot allocate file %s (%s)\n", out_path, strerror(errno));
+		mclose(out_file);
+		r = -1;
+		goto exit;
+	}
 	
 	/* Copy compressed file */
 	memcpy(
@@ -337,7 +598,7 @@ int process_segment(MFILE *in_file, off_t offset, const char *name){
 	asprintf(&out_path, "%s/%s.unlzhs", file_dir, name);
 	
 	// Decode the file we just wrote
-	lzhs_decode(out_file, 0, out_path, NULL);
+	lzhs_decode_ctx(ctx, out_file, 0, out_path, NULL);
 	mclose(out_file);
 	
 	exit:
@@ -347,13 +608,14 @@ int process_segment(MFILE *in_file, off_t offset, const char *name){
 }
 
 int extract_lzhs(MFILE *in_file) {
-	int r;
-	if(is_lzhs_mem(in_file, MTK_LOADER_OFF) && (r=process_segment(in_file, MTK_LOADER_OFF, "mtkloader")) < 0)
-		return r;
-	if(is_lzhs_mem(in_file, MTK_UBOOT_OFF) && (r=process_segment(in_file, MTK_UBOOT_OFF, "uboot")) < 0)
-		return r;
-	if(is_lzhs_mem(in_file, MTK_HISENSE_UBOOT_OFF) && (r=process_segment(in_file, MTK_HISENSE_UBOOT_OFF, "uboot")) < 0)
-		return r;	
+	int r = 0;
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	if(is_lzhs_mem(in_file, MTK_LOADER_OFF) && (r=process_segment(ctx, in_file, MTK_LOADER_OFF, "mtkloader")) < 0)
+		goto exit;
+	if(is_lzhs_mem(in_file, MTK_UBOOT_OFF) && (r=process_segment(ctx, in_file, MTK_UBOOT_OFF, "uboot")) < 0)
+		goto exit;
+	if(is_lzhs_mem(in_file, MTK_HISENSE_UBOOT_OFF) && (r=process_segment(ctx, in_file, MTK_HISENSE_UBOOT_OFF, "uboot")) < 0)
+		goto exit;
 		
 	struct lzhs_header *uboot_hdr = (struct lzhs_header *)(&(mdata(in_file, uint8_t))[MTK_UBOOT_OFF]);
 	off_t mtk_tz = (
@@ -371,10 +633,11 @@ int extract_lzhs(MFILE *in_file) {
 	
 	/* Do we have the TZ segment? (mtk5369 only) */
 	if(mtk_tz < msize(in_file)){
-		if(is_lzhs_mem(in_file, mtk_tz) && (r=process_segment(in_file, mtk_tz, "boot_tz")) < 0)
-			return r;
+		if(is_lzhs_mem(in_file, mtk_tz) && (r=process_segment(ctx, in_file, mtk_tz, "boot_tz")) < 0)
+			goto exit;
 	}
-	
-	mclose(in_file);
-	return 0;
+
+	exit:
+		lzhs_ctx_free(ctx);
+		return (r < 0) ? r : 0;
 }
@@ -46,6 +46,11 @@
 #define WANT_LZO_WILDARGV 1
 #include "lzo/portab.h"
 
+#include "mfile.h"
+#include "lzo/lzo.h"
+#include "util.h"
+#include "trace.h"
+
 static unsigned long total_in = 0;
 static unsigned long total_out = 0;
 static lzo_bool opt_debug = 0;
@@ -67,11 +72,11 @@ lzo_uint xread(FILE * fp, lzo_voidp buf, lzo_uint len, lzo_bool allow_eof) {
 	l = (lzo_uint) lzo_fread(fp, buf, len);
 	if (l > len) {
 		fprintf(stderr, "\nsomething's wrong with your C library !!!\n");
-		exit(1);
+		job_exit(1);
 	}
 	if (l != len && !allow_eof) {
 		fprintf(stderr, "\nread error - premature end of file\n");
-		exit(1);
+		job_exit(1);
 	}
 	total_in += (unsigned long)l;
 	return l;
@@ -80,7 +85,7 @@ lzo_uint xread(FILE * fp, lzo_voidp buf, lzo_uint len, lzo_bool allow_eof) {
 lzo_uint xwrite(FILE * fp, const lzo_voidp buf, lzo_uint len) {
 	if (fp != NULL && lzo_fwrite(fp, buf, len) != len) {
 		fprintf(stderr, "\nwrite error  (disk full ?)\n");
-		exit(1);
+		job_exit(1);
 	}
 	total_out += (unsigned long)len;
 	return len;
@@ -377,7 +382,7 @@ static FILE *xopen_fi(const char *name) {
 	fp = fopen(name, "rb");
 	if (fp == NULL) {
 		printf("cannot open input file %s\n", name);
-		exit(1);
+		job_exit(1);
 	} else {
 		struct stat st;
 		int is_regular = 1;
@@ -389,7 +394,7 @@ static FILE *xopen_fi(const char *name) {
 			printf("%s is not a regular file\n", name);
 			fclose(fp);
 			fp = NULL;
-			exit(1);
+			job_exit(1);
 		}
 	}
 
@@ -407,13 +412,13 @@ static FILE *xopen_fo(const char *name) {
 		printf("%s: file %s already exists -- not overwritten\n", progname, name);
 		fclose(fp);
 		fp = NULL;
-		exit(1);
+		job_exit(1);
 	}
 #endif
 	fp = fopen(name, "wb");
 	if (fp == NULL) {
 		printf("cannot open output file %s\n", name);
-		exit(1);
+		job_exit(1);
 	}
 	return fp;
 }
@@ -427,11 +432,15 @@ static void xclose(FILE * fp) {
 			err = 1;
 		if (err) {
 			printf("error while closing file\n");
-			exit(1);
+			job_exit(1);
 		}
 	}
 }
 
+int check_lzo_header_mem(MFILE *file) {
+	return msize(file) >= sizeof(magic) && !memcmp(mdata(file, uint8_t), magic, sizeof(magic));
+}
+
 int check_lzo_header(const char *name) {
 
 	FILE *fi = xopen_fi(name);
@@ -455,6 +464,7 @@ int __lzo_cdecl_main lzo_unpack(const char *in_name, const char *out_name) {
 	FILE *fi = NULL;
 	FILE *fo = NULL;
 	lzo_uint opt_block_size;
+	struct trace_span span;
 
 	/*
 	 * Step 1: initialize the LZO library
@@ -462,7 +472,7 @@ int __lzo_cdecl_main lzo_unpack(const char *in_name, const char *out_name) {
 	if (lzo_init() != LZO_E_OK) {
 		printf("internal error - lzo_init() failed !!!\n");
 		printf("(this usually indicates a compiler bug - try recompiling\nwithout optimizations, and enable `-DLZO_DEBUG' for diagnostics)\n");
-		exit(1);
+		job_exit(1);
 	}
 
 	/*
@@ -481,7 +491,9 @@ int __lzo_cdecl_main lzo_unpack(const char *in_name, const char *out_name) {
 	 */
 	fi = xopen_fi(in_name);
 	fo = xopen_fo(out_name);
+	trace_begin(&span, TRACE_LZO, in_name);
 	r = do_decompress(fi, fo);
+	trace_end(&span, ftello(fi), ftello(fo));
 //  if (r == 0) printf("decompressed %lu into %lu bytes\n", total_in, total_out);
 	xclose(fi);
 	fi = NULL;
@@ -490,6 +502,109 @@ int __lzo_cdecl_main lzo_unpack(const char *in_name, const char *out_name) {
 	return r;
 }
 
+/*************************************************************************
+ // decompress in memory, for --verify
+ **************************************************************************/
+
+static lzo_uint32 mread32(const unsigned char *b) {
+	return (lzo_uint32) b[0] << 24 | (lzo_uint32) b[1] << 16 | (lzo_uint32) b[2] << 8 | (lzo_uint32) b[3];
+}
+
+/*
+ * Same checks as do_decompress, on a buffer: *out receives the malloc'ed data
+ * Returns 0 on success, the do_decompress error codes otherwise (8 = truncated)
+ */
+int lzo_unpack_mem(const unsigned char *in, size_t in_size, unsigned char **out, size_t *out_size) {
+	size_t pos = sizeof(magic) + 4 + 4 + 2 + 4;
+	unsigned char *buf = NULL;
+	size_t len = 0, cap;
+	lzo_uint32 flags, checksum;
+	lzo_uint block_size;
+	int r;
+
+	if (lzo_init() != LZO_E_OK)
+		return 4;
+	if (in_size < pos || memcmp(in, magic, sizeof(magic)) != 0)
+		return 1;
+	flags = mread32(&in[12]);
+	if (in[16] != 1)
+		return 2;
+	block_size = mread32(&in[18]);
+	if (block_size < 1024 || block_size > 8 * 1024 * 1024L)
+		return 3;
+
+	/* the header holds the unpacked size, but grow past it if it lies */
+	cap = mread32(&in[8]);
+	if (cap == 0)
+		cap = block_size;
+	buf = malloc(cap);
+	if (buf == NULL)
+		return 4;
+	checksum = lzo_adler32(0, NULL, 0);
+
+	for (;;) {
+		lzo_uint in_len, out_len;
+
+		r = 8;
+		if (pos + 4 > in_size)
+			goto err;
+		out_len = mread32(&in[pos]);
+		pos += 4;
+		if (out_len == 0)
+			break;
+		if (pos + 4 > in_size)
+			goto err;
+		in_len = mread32(&in[pos]);
+		pos += 4;
+
+		if (in_len > block_size || out_len > block_size || in_len == 0 || in_len > out_len) {
+			r = 5;
+			goto err;
+		}
+		if (pos + in_len > in_size)
+			goto err;
+		if (len + out_len > cap) {
+			unsigned char *grown;
+			cap = (cap * 2 > len + out_len) ? cap * 2 : len + out_len;
+			grown = realloc(buf, cap);
+			if (grown == NULL) {
+				r = 4;
+				goto err;
+			}
+			buf = grown;
+		}
+
+		if (in_len < out_len) {
+			lzo_uint new_len = out_len;
+			if (lzo1x_decompress_safe(&in[pos], in_len, &buf[len], &new_len, NULL) != LZO_E_OK || new_len != out_len) {
+				r = 6;
+				goto err;
+			}
+		} else {
+			memcpy(&buf[len], &in[pos], in_len);
+		}
+		if (flags & 1)
+			checksum = lzo_adler32(checksum, &buf[len], out_len);
+		len += out_len;
+		pos += in_len;
+	}
+
+	if (flags & 1) {
+		if (pos + 4 > in_size)
+			goto err;
+		if (mread32(&in[pos]) != checksum) {
+			r = 7;
+			goto err;
+		}
+	}
+
+	*out = buf;
+	*out_size = len;
+	return 0;
+ err:free(buf);
+	return r;
+}
+
 /*
  vi:ts=4:et
  */
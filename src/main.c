@@ -15,29 +15,22 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #ifdef __CYGWIN__
 #    include <sys/cygwin.h>
 #endif
 
 #include "config.h"
-#include "mfile.h"
-
-#include "epk1.h"		/* EPK v1 */
-#include "epk2.h"		/* EPK v2 and v3 */
-#include "hisense.h"	/* Hisense DTV */
-#include "cramfs/cramfs.h"	/* CRAMFS */
-#include "cramfs/cramfsswap.h"
-#include "lz4/lz4.h"	/* LZ4 */
-#include "lzo/lzo.h"	/* LZO */
-#include "lzhs/lzhs.h"	/* LZHS */
-#include "jffs2/jffs2.h"	/* JFFS2 */
-#include "squashfs/unsquashfs.h"	/* SQUASHFS */
-#include "minigzip.h"	/* GZIP */
-#include "symfile.h"	/* SYM */
-#include "tsfile.h"		/* STR and PIF */
-#include "mediatek.h"	/* MTK Boot */
-#include "u-boot/partinfo.h"	/* PARTINFO */
+#include "epk2extract.h"
 #include "util.h"
+#include "thpool.h"
+#include "keyring.h"
+#include "trace.h"
 
 #ifdef __APPLE__
 #include <mach-o/dyld.h>
@@ -45,148 +38,210 @@
 
 struct config_opts_t config_opts;
 
-int handle_file(char *file, struct config_opts_t *config_opts) {
-	char *dest_dir = config_opts->dest_dir;
-	char *file_name = my_basename(file);
-	
-	char *file_base = remove_ext(file_name);
-	//const char *file_ext = get_ext(strdup(file_name));
-	char *dest_file = NULL;
+/*
+ * Extracts one input file with the library, and says how it went
+ */
+static int extract_input(struct epk2extract *ctx, const char *input_file, int verify) {
+	int result = epk2extract_file(ctx, input_file);
+	if (result == EPK2EXTRACT_UNSUPPORTED)
+		err_ret("Unsupported input file format: %s\n\n", input_file);
+	else if (result == EPK2EXTRACT_OK && !verify)
+		err_ret("\nExtraction is finished.\n\n");
+	return result;
+}
+
+/* An input file of --batch, and how its extraction went */
+struct batch_input {
+	char *file;
+	char *dest_dir;
+	char *log; // the output of its extraction, with --isolate
+	int status; // what epk2extract_file() returned, with --isolate the exit status of the child (128 + signal if it was killed)
+	struct timespec start;
+	double seconds;
+};
+
+struct batch {
+	struct batch_input *inputs;
+	unsigned int count;
+	struct epk2extract *ctx;
+	int verify;
+	int isolate; // each input in a child process
+};
+
+static void batch_add(struct batch *batch, const char *file) {
+	batch->inputs = realloc(batch->inputs, (batch->count + 1) * sizeof(*batch->inputs));
+	struct batch_input *input = &batch->inputs[batch->count++];
+	memset(input, 0x00, sizeof(*input));
+	input->file = strdup(file);
+}
+
+static int batch_input_cmp(const void *a, const void *b) {
+	return strcmp(((const struct batch_input *)a)->file, ((const struct batch_input *)b)->file);
+}
+
+/*
+ * Adds the regular files of a directory (not its subdirectories), sorted by name
+ */
+static void batch_add_dir(struct batch *batch, const char *dir) {
+	unsigned int first = batch->count;
+	DIR *dp = opendir(dir);
+	if (dp == NULL) {
+		printf("Cannot read directory %s (%s)\n", dir, strerror(errno));
+		return;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(dp)) != NULL) {
+		char *path;
+		struct stat st;
+		asprintf(&path, "%s/%s", dir, ent->d_name);
+		// symlinks are not followed
+		if (lstat(path, &st) == 0 && S_ISREG(st.st_mode))
+			batch_add(batch, path);
+		free(path);
+	}
+	closedir(dp);
+	qsort(&batch->inputs[first], batch->count - first, sizeof(*batch->inputs), batch_input_cmp);
+}
+
+/*
+ * Adds the files listed in a manifest, one path per line
+ * Empty lines and lines starting with # are skipped
+ */
+static void batch_add_manifest(struct batch *batch, FILE *fp) {
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	while ((len = getline(&line, &size, fp)) >= 0) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		batch_add(batch, line);
+	}
+	free(line);
+}
 
-	int result = EXIT_SUCCESS;
+/*
+ * Records how an input of the batch went, on the thread that extracted it
+ */
+static void batch_input_done(void *arg, const char *file, int status) {
+	struct batch_input *input = (struct batch_input *)arg;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	input->status = status;
+	input->seconds = (end.tv_sec - input->start.tv_sec) + (end.tv_nsec - input->start.tv_nsec) / 1e9;
+	printf("[%s] %s (%.1fs)\n", epk2extract_strerror(status), file, input->seconds);
+}
 
-	MFILE *mf = NULL;
-	if (isFileEPK1(file)) {
-		extract_epk1_file(file, config_opts);
-	} else if (isFileEPK2(file)) {
-		extractEPK2file(file, config_opts);
-	} else if(isFileEPK3(file)) {
-		extractEPK3file(file, config_opts);
-	} else if((mf=is_hisense(file))){
-		extract_hisense(mf, config_opts);
-	} else if((mf=is_ext4_lzhs(file))){
-		asprintf(&dest_file, "%s/%s.ext4", dest_dir, file_name);
-		extract_ext4_lzhs(mf, dest_file);
-	/* LZ4 */
-	} else if ((mf=is_lz4(file))) {
-		asprintf(&dest_file, "%s/%s.unlz4", dest_dir, file_name);
-		printf("UnLZ4 file to: %s\n", dest_file);
-		if (!LZ4_decode_file(file, dest_file))
-			handle_file(dest_file, config_opts);
-	/* LZO */
-	} else if (check_lzo_header(file)) {
-		if (!strcmp(file_name, "logo.pak"))
-			asprintf(&dest_file, "%s/%s.bmp", dest_dir, file_name);
-		else
-			asprintf(&dest_file, "%s/%s.unlzo", dest_dir, file_name);
-		printf("UnLZO file to: %s\n", dest_file);
-		if (!lzo_unpack(file, dest_file))
-			handle_file(dest_file, config_opts);
-	/* NFSB */
-	} else if ((mf=is_nfsb(file))) {
-		asprintf(&dest_file, "%s/%s.unnfsb", dest_dir, file_name);
-		printf("UnNFSB file to: %s\n", dest_file);
-		unnfsb(file, dest_file);
-		handle_file(dest_file, config_opts);
-	/* SQUASHFS */
-	} else if (is_squashfs(file)) {
-		asprintf(&dest_file, "%s/%s.unsquashfs", dest_dir, file_name);
-		printf("UnSQUASHFS file to: %s\n", dest_file);
-		rmrf(dest_file);
-		unsquashfs(file, dest_file);
-	/* GZIP */
-	} else if (is_gzip(file)) {
-		asprintf(&dest_file, "%s/", dest_dir);
-		printf("UnGZIP %s to folder %s\n", file, dest_file);
-		strcpy(dest_file, file_uncompress_origname(file, dest_file));
-		handle_file(dest_file, config_opts);
-	/* MTK boot partition */
-	} else if ((mf=is_mtk_boot(file))) {
-		asprintf(&dest_file, "%s/mtk_1bl.bin", dest_dir);
+/*
+ * --isolate: extracts one input of the batch in a child process, so that a
+ * crash only fails its own line of the summary
+ */
+static void batch_run_input(void *arg, unsigned int worker, unsigned int index) {
+	struct batch *batch = (struct batch *)arg;
+	struct batch_input *input = &batch->inputs[index];
+	clock_gettime(CLOCK_MONOTONIC, &input->start);
 
-		printf("[MTK] Extracting 1BL to mtk_1bl.bin...\n");
-		extract_mtk_1bl(mf, dest_file);
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid == 0) {
+		int fd = open(input->log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		printf("Input file: %s\n", input->file);
+		printf("Destination directory: %s\n", input->dest_dir);
+		int result = extract_input(batch->ctx, input->file, batch->verify);
+		fflush(NULL);
+		trace_flush();
+		_exit(result);
+	}
 
-		printf("[MTK] Extracting embedded LZHS files...\n");
-		extract_lzhs(mf);
-	/* CRAMFS Big Endian */
-	} else if (is_cramfs_image(file, "be")) {
-		asprintf(&dest_file, "%s/%s.cramswap", dest_dir, file_name);
-		printf("Swapping cramfs endian for file %s\n", file);
-		cramswap(file, dest_file);
-		handle_file(dest_file, config_opts);
-	/* CRAMFS Little Endian */
-	} else if (is_cramfs_image(file, "le")) {
-		asprintf(&dest_file, "%s/%s.uncramfs", dest_dir, file_name);
-		printf("UnCRAMFS %s to folder %s\n", file, dest_file);
-		rmrf(dest_file);
-		uncramfs(dest_file, file);
-	/* Kernel uImage */
-	} else if (is_kernel(file)) {
-		asprintf(&dest_file, "%s/%s.unpaked", dest_dir, file_name);
-		printf("Extracting boot image (kernel) to: %s\n", dest_file);
-		extract_kernel(file, dest_file);
-		handle_file(dest_file, config_opts);
-	/* Partition Table (partinfo) */
-	} else if (isPartPakfile(file)) {
-		asprintf(&dest_file, "%s/%s.txt", dest_dir, file_base);
-		printf("Saving partition info to: %s\n", dest_file);
-		dump_partinfo(file, dest_file);
-	/* JFFS2 */
-	} else if (is_jffs2(file)) {
-		asprintf(&dest_file, "%s/%s.unjffs2", dest_dir, file_name);
-		printf("UnJFFS2 file %s to folder %s\n", file, dest_file);
-		rmrf(dest_file);
-		jffs2extract(file, dest_file, "1234");
-	/* PVR STR (ts/m2ts video) */
-	} else if (isSTRfile(file)) {
-		asprintf(&dest_file, "%s/%s.ts", dest_dir, file_name);
-		setKey();
-		printf("\nConverting %s file to TS: %s\n", file, dest_file);
-		convertSTR2TS(file, dest_file, 0);
-	/* PVR PIF (Program Information File) */ 
-	} else if (!memcmp(&file[strlen(file) - 3], "PIF", 3)) {
-		asprintf(&dest_file, "%s/%s.ts", dest_dir, file_name);
-		setKey();
-		printf("\nProcessing PIF file: %s\n", file);
-		processPIF(file, dest_file);
-	/* SYM File (Debugging information) */
-	} else if (symfile_load(file) == 0) {
-		asprintf(&dest_file, "%s/%s.idc", dest_dir, file_name);
-		printf("Converting SYM file to IDC script: %s\n", dest_file);
-		symfile_write_idc(dest_file);
-	/* MTK LZHS (Modified LZSS + Huffman) */
-	} else if ((mf=is_lzhs(file))) {
-		asprintf(&dest_file, "%s/%s.unlzhs", dest_dir, file_name);
-		printf("UnLZHS %s to %s\n", file, dest_file);
-		lzhs_decode(mf, 0, dest_file, NULL);
-	/* MTK TZFW (TrustZone Firmware) */
-	} else if (!strcmp(file_name, "tzfw.pak") && (mf=is_elf(file))) {
-		printf("Splitting mtk tzfw...\n");
-		split_mtk_tz(mf, dest_dir);
+	int status;
+	if (pid < 0) {
+		printf("Cannot fork (%s), skipping %s\n", strerror(errno), input->file);
+		status = EPK2EXTRACT_FAILED;
+	} else if (waitpid(pid, &status, 0) < 0) {
+		status = EPK2EXTRACT_FAILED;
+	} else if (WIFSIGNALED(status)) {
+		status = 128 + WTERMSIG(status);
 	} else {
-		result = EXIT_FAILURE;
+		status = WEXITSTATUS(status);
 	}
-	
-	if(mf != NULL)
-		mclose(mf);
+	batch_input_done(input, input->file, status);
+}
 
-	free(file_name);
-	free(file_base);
-	
-	if(dest_file != NULL)
-		free(dest_file);
-	
-	return result;
+/*
+ * Extracts all the inputs of the batch, jobs at a time, then writes a summary:
+ * a tab separated line per input with its status, exit code, time, file and log
+ * The inputs and the files nested in them share the threads of the context,
+ * with --isolate each input is extracted by a child process instead
+ */
+static int batch_run(struct batch *batch, int jobs, const char *summary_file) {
+	unsigned int i, nfailed = 0;
+
+	// loaded once here, the inputs (or the children) get the parsed keys
+	keyring_get(config_opts.config_dir);
+
+	printf("Extracting %u files, %d at a time\n", batch->count, jobs);
+	if (batch->isolate) {
+		thpool_for(batch->count, jobs, batch_run_input, batch);
+	} else {
+		for (i = 0; i < batch->count; i++) {
+			clock_gettime(CLOCK_MONOTONIC, &batch->inputs[i].start);
+			epk2extract_submit(batch->ctx, batch->inputs[i].file, batch_input_done, &batch->inputs[i]);
+		}
+		epk2extract_wait(batch->ctx);
+	}
+
+	FILE *summary = stdout;
+	if (summary_file != NULL && strcmp(summary_file, "-") != 0) {
+		summary = fopen(summary_file, "w");
+		if (summary == NULL) {
+			printf("Cannot open %s for writing (%s)\n", summary_file, strerror(errno));
+			summary = stdout;
+		}
+	}
+	if (summary == stdout)
+		printf("\n");
+	fprintf(summary, "#status\texit\tseconds\tfile\tlog\n");
+	for (i = 0; i < batch->count; i++) {
+		struct batch_input *input = &batch->inputs[i];
+		fprintf(summary, "%s\t%d\t%.3f\t%s\t%s\n", epk2extract_strerror(input->status), input->status, input->seconds, input->file, (input->log != NULL) ? input->log : "-");
+		if (input->status != EPK2EXTRACT_OK)
+			nfailed++;
+	}
+	if (summary != stdout)
+		fclose(summary);
+
+	printf("\n%u of %u files extracted\n\n", batch->count - nfailed, batch->count);
+	return (nfailed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[]) {
 	printf("\nLG Electronics digital TV firmware package (EPK) extractor version 4.4 by sirius (http://openlgtv.org.ru)\n\n");
 	if (argc < 2) {
 		printf("Thanks to xeros, tbage, jenya, Arno1, rtokarev, cronix, lprot, Smx and all other guys from openlgtv project for their kind assistance.\n\n");
-		printf("Usage: epk2extract [-options] FILENAME\n\n");
+		printf("Usage: epk2extract [-options] FILENAME\n");
+		printf("       epk2extract --batch [-options] FILENAME|DIRECTORY|- ...\n");
+		printf("FILENAME can be - (stdin) or a FIFO to extract an EPK2/EPK3 while it downloads\n");
+		printf("With --batch, - reads a list of files from stdin, one per line\n\n");
 		printf("Options:\n");
-		printf("  -c : extract to current directory instead of source file directory\n\n");
+		printf("  -c : extract to current directory instead of source file directory\n");
+		printf("  -j N : extract nested files on N threads (0 = number of CPUs)\n");
+		printf("  -m N : map EPK files N MiB at a time instead of as a whole (for >2GB images on 32-bit hosts)\n");
+		printf("  --verify : check the signatures, CRCs and checksums of every layer in memory, without extracting\n");
+		printf("  --only PAK[,PAK...] : extract only these PAKs of an EPK (e.g. --only rootfs,lgapp)\n");
+		printf("  --skip PAK[,PAK...] : extract all the PAKs of an EPK but these\n");
+		printf("  --extract GLOB : extract only the matching files of the PAK's filesystem (e.g. --extract 'rootfs/**/lib*.so')\n");
+		printf("  --keep-intermediates : also write the PAKs and the decompressed files that get extracted further\n");
+		printf("  --cache DIR : keep the trees extracted from PAKs and images in DIR, and link them when the same file is met again\n");
+		printf("  --trace FILE : write the time spent in each stage to FILE (Chrome trace JSON, for chrome://tracing or ui.perfetto.dev) and print a summary\n");
+		printf("  --batch : extract several files (and the files in directories), -j N of them at a time on shared threads\n");
+		printf("  --isolate : with --batch, extract each file in its own process, logged to FILENAME.log, so that a crash only fails that file\n");
+		printf("  --summary FILE : write the tab separated results of --batch to FILE instead of stdout\n\n");
 		return err_ret("");
 	}
 
@@ -211,13 +266,88 @@ int main(int argc, char *argv[]) {
 	config_opts.config_dir = my_dirname(exe_dir);
 	config_opts.dest_dir = calloc(1, PATH_MAX);
 
+	static const struct option long_options[] = {
+		{ "verify", no_argument, NULL, 'V' },
+		{ "only", required_argument, NULL, 'O' },
+		{ "skip", required_argument, NULL, 'S' },
+		{ "extract", required_argument, NULL, 'X' },
+		{ "keep-intermediates", no_argument, NULL, 'K' },
+		{ "cache", required_argument, NULL, 'C' },
+		{ "trace", required_argument, NULL, 'T' },
+		{ "batch", no_argument, NULL, 'B' },
+		{ "isolate", no_argument, NULL, 'I' },
+		{ "summary", required_argument, NULL, 'R' },
+		{ NULL, 0, NULL, 0 }
+	};
 	int opt;
-	while ((opt = getopt(argc, argv, "c")) != -1) {
+	int jobs = 1;
+	int verify = 0;
+	int batch_mode = 0;
+	int isolate = 0;
+	const char *summary_file = NULL;
+	unsigned int i;
+	while ((opt = getopt_long(argc, argv, "cj:m:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'c':{
 				strcpy(config_opts.dest_dir, current_dir);
 				break;
 			}
+		case 'j':{
+				jobs = atoi(optarg);
+				if (jobs <= 0)
+					jobs = thpool_ncpus();
+				break;
+			}
+		case 'm':{
+				config_opts.mmap_window = strtoul(optarg, NULL, 0) * 1024 * 1024;
+				break;
+			}
+		case 'V':{
+				verify = 1;
+				break;
+			}
+		case 'O':{
+				config_opts.pak_only = optarg;
+				break;
+			}
+		case 'S':{
+				config_opts.pak_skip = optarg;
+				break;
+			}
+		case 'X':{
+				config_opts.extract_path = optarg;
+				break;
+			}
+		case 'K':{
+				config_opts.keep_intermediates = 1;
+				break;
+			}
+		case 'C':{
+				// kept absolute, as the entries it prints are
+				createFolder(optarg);
+				config_opts.cache_dir = realpath(optarg, NULL);
+				if (config_opts.cache_dir == NULL)
+					err_exit("Cannot use %s as the cache (%s)\n", optarg, strerror(errno));
+				break;
+			}
+		case 'T':{
+				// the trace is finished, and the summary printed, at exit
+				if (trace_open(optarg) < 0)
+					return EXIT_FAILURE;
+				break;
+			}
+		case 'B':{
+				batch_mode = 1;
+				break;
+			}
+		case 'I':{
+				isolate = 1;
+				break;
+			}
+		case 'R':{
+				summary_file = optarg;
+				break;
+			}
 		case ':':{
 				printf("Option `%c' needs a value\n\n", optopt);
 				exit(1);
@@ -230,6 +360,50 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	// --verify uses all the CPUs unless -j says otherwise
+	struct epk2extract_settings settings = {
+		.jobs = jobs,
+		.verify_threads = verify ? ((jobs > 1) ? (unsigned int)jobs : thpool_ncpus()) : 0,
+	};
+
+	if (batch_mode) {
+		struct batch batch = { NULL, 0, NULL, verify, isolate };
+		for (; optind < argc; optind++) {
+			struct stat st;
+			if (!strcmp(argv[optind], "-"))
+				batch_add_manifest(&batch, stdin);
+			else if (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode))
+				batch_add_dir(&batch, argv[optind]);
+			else
+				batch_add(&batch, argv[optind]);
+		}
+		if (batch.count == 0)
+			return err_ret("No input files\n\n");
+		if (isolate) {
+			for (i = 0; i < batch.count; i++) {
+				struct batch_input *input = &batch.inputs[i];
+				char *file_name = my_basename(input->file);
+				input->dest_dir = strlen(config_opts.dest_dir) ? strdup(config_opts.dest_dir) : my_dirname(input->file);
+				asprintf(&input->log, "%s/%s.log", input->dest_dir, file_name);
+				free(file_name);
+			}
+		}
+		free(exe_dir);
+		free(current_dir);
+
+		// each input is checked on the thread it runs on; the children of
+		// --isolate extract on a single thread, the -j are taken by them
+		settings.verify_threads = verify ? 1 : 0;
+		if (isolate)
+			settings.jobs = 1;
+		if (!strlen(config_opts.dest_dir)) {
+			free(config_opts.dest_dir);
+			config_opts.dest_dir = NULL;
+		}
+		batch.ctx = epk2extract_new(&config_opts, &settings);
+		return batch_run(&batch, jobs, summary_file);
+	}
+
 #ifdef __CYGWIN__
 	char posix[PATH_MAX];
 	cygwin_conv_path(CCP_WIN_A_TO_POSIX, argv[optind], posix, PATH_MAX);
@@ -253,10 +427,8 @@ int main(int argc, char *argv[]) {
 	free(exe_dir);
 	free(current_dir);
 
-	int exit_code = handle_file(input_file, &config_opts);
-	
-	if (exit_code == EXIT_FAILURE)
-		return err_ret("Unsupported input file format: %s\n\n", input_file);
-
-	return !err_ret("\nExtraction is finished.\n\n");
+	struct epk2extract *ctx = epk2extract_new(&config_opts, &settings);
+	int result = extract_input(ctx, input_file, verify);
+	epk2extract_free(ctx);
+	return (result == EPK2EXTRACT_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
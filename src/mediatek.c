@@ -32,7 +32,8 @@ void extract_mtk_1bl(MFILE *in, const char *outname) {
 
 	printf("[MTK] PBL Size: 0x%08X\n", pbl_size);
 
-	mfile_map(out, pbl_size);
+	if(mfile_map(out, pbl_size) == NULL)
+		err_exit("Cannot allocate %s (%s)\n", outname, strerror(errno));
 	memcpy(
 		mdata(out, uint8_t),
 		mdata(in, uint8_t),
@@ -40,7 +41,6 @@ void extract_mtk_1bl(MFILE *in, const char *outname) {
 	);
 
 	mclose(out);
-	mclose(in);
 }
 
 void split_mtk_tz(MFILE *tz, const char *destdir) {
@@ -60,7 +60,8 @@ void split_mtk_tz(MFILE *tz, const char *destdir) {
 	uint8_t *data = mdata(tz, uint8_t);
 
 
-	mfile_map(out, MTK_ENV_SIZE);
+	if(mfile_map(out, MTK_ENV_SIZE) == NULL)
+		err_exit("Cannot allocate %s (%s)\n", dest, strerror(errno));
 	memcpy(mdata(out, void), data, MTK_ENV_SIZE);
 
 	free(dest);
@@ -72,23 +73,18 @@ void split_mtk_tz(MFILE *tz, const char *destdir) {
 	if (out == NULL)
 		err_exit("Can't open file %s for writing\n", dest);
 
-	mfile_map(out, tz_size);
+	if(mfile_map(out, tz_size) == NULL)
+		err_exit("Cannot allocate %s (%s)\n", dest, strerror(errno));
 
 	printf("Extracting tz.bin... (%zu bytes)\n", tz_size);
 	memcpy(mdata(out, void), data + MTK_ENV_SIZE, tz_size);
 
 	free(dest);
 	mclose(out);
-
-	mclose(tz);
 }
 
-MFILE *is_mtk_boot(const char *filename) {
-	MFILE *file = mopen(filename, O_RDONLY);
+int is_mtk_boot_mem(MFILE *file) {
 	uint8_t *data = mdata(file, uint8_t);
-	if (file == NULL) {
-		err_exit("Can't open file %s\n", filename);
-	}
 	if (
 		(msize(file) >= MTK_PBL_SIZE) &&
 		(memcmp(data + 0x100, MTK_PBL_MAGIC, strlen(MTK_PBL_MAGIC)) == 0)
@@ -100,12 +96,21 @@ MFILE *is_mtk_boot(const char *filename) {
 	){
 		printf("Found valid PBL/ROM magic: "MTK_ROM_MAGIC"\n");
 	} else {
-		mclose(file);
-		return NULL;
+		return 0;
 	}
-	
-	
-	return file;
+	return 1;
+}
+
+MFILE *is_mtk_boot(const char *filename) {
+	MFILE *file = mopen(filename, O_RDONLY);
+	if (file == NULL) {
+		err_exit("Can't open file %s\n", filename);
+	}
+	if (is_mtk_boot_mem(file))
+		return file;
+
+	mclose(file);
+	return NULL;
 }
 
 int is_elf_mem(Elf32_Ehdr * header) {
@@ -120,8 +125,7 @@ MFILE *is_elf(const char *filename) {
 		err_exit("Can't open file %s\n", filename);
 	}
 	
-	Elf32_Ehdr *elfHdr = mdata(file, Elf32_Ehdr);
-	if (!memcmp(&(elfHdr->e_ident), ELFMAG, 4))
+	if (msize(file) >= sizeof(Elf32_Ehdr) && is_elf_mem(mdata(file, Elf32_Ehdr)))
 		return file;
 	
 	mclose(file);
@@ -42,20 +42,36 @@ int _mfile_update_info(MFILE *file, const char *path){
  */
 void *_mfile_map(MFILE *file, size_t mapSize, int mapFlags){
 	if(msize(file) < mapSize){
-		lseek(file->fd, mapSize-1, SEEK_SET);
-		uint8_t buf = 0x00;
-		write(file->fd, &buf, 1);
-		lseek(file->fd, 0, SEEK_SET);
+		// grow the file once, the mapping is then written in place
+#ifdef __linux__
+		/*
+		 * with the blocks reserved, a full disk (or tmpfs, for a memfd) fails here
+		 * instead of raising SIGBUS on a write to the mapping
+		 */
+		int err = posix_fallocate(file->fd, 0, mapSize);
+		if(err != 0){
+			errno = err;
+			return NULL;
+		}
+#else
+		if(ftruncate(file->fd, mapSize) < 0)
+			return NULL;
+#endif
 		_mfile_update_info(file, NULL);
 	}
 	if(file->pMem){
-
+		munmap(file->pMem, file->size);
+		file->pMem = NULL;
+		file->size = 0;
 	}
 	file->pMem = mmap(0, mapSize, file->prot, mapFlags, file->fd, 0);
 	if(file->pMem == MAP_FAILED){
 		//err_exit("mmap failed: %s\n", strerror(errno));
+		file->pMem = NULL;
 		return NULL;
 	}
+	file->size = mapSize;
+	file->pOff = 0;
 	
 	return file->pMem;
 }
@@ -91,7 +107,7 @@ MFILE *_mopen(const char *path, int oflags, int mapFlags){
 
 	size_t fileSz = msize(file);
 	if(fileSz > 0){
-		if(_mfile_map(file, fileSz, mapFlags) == MAP_FAILED){
+		if(_mfile_map(file, fileSz, mapFlags) == NULL){
 			goto e1_ret;
 		}
 	}
@@ -114,6 +130,68 @@ inline MFILE *mopen_private(const char *path, int oflags){
 	return _mopen(path, oflags, MAP_PRIVATE);
 }
 
+/*
+ * Opens a file without mapping it, the data is then accessed through mfile_window
+ * At least window bytes are mapped at a time, so that reading nearby data doesn't remap
+ * A window of 0 maps the whole file, like mopen
+ */
+MFILE *mopen_window(const char *path, int oflags, size_t window){
+	if(window == 0)
+		return mopen(path, oflags);
+
+	MFILE *file = mfile_new();
+	file->fd = open(path, oflags, PERMS_DEFAULT);
+	if(file->fd < 0){
+		free(file);
+		return NULL;
+	}
+	if(_mfile_update_info(file, path) < 0){
+		close(file->fd);
+		free(file->path);
+		free(file);
+		return NULL;
+	}
+	// windows are read only
+	file->prot = PROT_READ;
+	file->window = window;
+	return file;
+}
+
+/*
+ * Gets size bytes at offset, moving the window there if needed
+ * Pointers from a previous call are invalidated when the window moves
+ * Files mapped as a whole just get the pointer
+ */
+void *mfile_window(MFILE *file, off_t offset, size_t size){
+	if(offset < 0 || offset + size > msize(file))
+		return NULL;
+	if(file->pMem && offset >= file->pOff && offset + size <= file->pOff + file->size)
+		return &(mdata(file, uint8_t))[offset - file->pOff];
+
+	off_t start = offset - (offset % sysconf(_SC_PAGESIZE));
+	size_t mapSize = (offset - start) + size;
+	if(mapSize < file->window)
+		mapSize = file->window;
+	if(start + mapSize > msize(file))
+		mapSize = msize(file) - start;
+	if(mapSize == 0)
+		return NULL;
+
+	if(file->pMem){
+		munmap(file->pMem, file->size);
+		file->pMem = NULL;
+		file->size = 0;
+	}
+	file->pMem = mmap(0, mapSize, file->prot, MAP_SHARED, file->fd, start);
+	if(file->pMem == MAP_FAILED){
+		file->pMem = NULL;
+		return NULL;
+	}
+	file->pOff = start;
+	file->size = mapSize;
+	return &(mdata(file, uint8_t))[offset - start];
+}
+
 int mgetc(MFILE *stream){
 	if(stream->offset >= msize(stream))
 		return EOF;
@@ -146,18 +224,22 @@ int cputc(int c, cursor_t *stream){
 }
 
 /*
- * Closes an opened file and frees the structure
+ * Unmaps and closes an opened file and frees the structure
+ * Empty files have no mapping, but still need to be closed
  */
 int mclose(MFILE *mfile){
-	if(!mfile || mfile->fd < 0 || !mfile->pMem || mfile->size <= 0)
+	int result = 0;
+	if(!mfile)
 		return -1;
-	if(munmap(mfile->pMem, mfile->size) < 0)
-		return -2;
+	if(mfile->pMem && munmap(mfile->pMem, mfile->size) < 0)
+		result = -2;
+	if(mfile->fh)
+		fclose(mfile->fh);
+	else if(mfile->fd >= 0)
+		close(mfile->fd);
 	free(mfile->path);
-	close(mfile->fd);
 	free(mfile);
-	mfile = NULL;
-	return 0;
+	return result;
 }
 
 /*
@@ -184,7 +266,7 @@ MFILE *_mfopen(const char *path, const char *mode, int mapFlags){
 
 	size_t fileSz = msize(file);
 	if(fileSz > 0){
-		if(_mfile_map(file, fileSz, mapFlags) == MAP_FAILED){
+		if(_mfile_map(file, fileSz, mapFlags) == NULL){
 			goto e1_ret;
 		}
 	}
@@ -194,6 +276,8 @@ MFILE *_mfopen(const char *path, const char *mode, int mapFlags){
 	e1_ret:
 		fclose(file->fh);
 	e0_ret:
+		if(file->path)
+			free(file->path);
 		free(file);
 		return NULL;
 }
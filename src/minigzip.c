@@ -16,6 +16,9 @@
 /* @(#) $Id$ */
 
 #include <minigzip.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "trace.h"
 
 char *prog;
 
@@ -24,7 +27,7 @@ char *prog;
  */
 void error(const char *msg) {
 	fprintf(stderr, "%s: %s\n", prog, msg);
-	exit(1);
+	job_exit(1);
 }
 
 /* ===========================================================================
@@ -47,7 +50,7 @@ void gz_compress(FILE * in, gzFile out) {
 		len = fread(buf, 1, sizeof(buf), in);
 		if (ferror(in)) {
 			perror("fread");
-			exit(1);
+			job_exit(1);
 		}
 		if (len == 0)
 			break;
@@ -140,12 +143,12 @@ void file_compress(char *file, char *mode) {
 	in = fopen(file, "rb");
 	if (in == NULL) {
 		perror(file);
-		exit(1);
+		job_exit(1);
 	}
 	out = gzopen(outfile, mode);
 	if (out == NULL) {
 		fprintf(stderr, "%s: can't gzopen %s\n", prog, outfile);
-		exit(1);
+		job_exit(1);
 	}
 	gz_compress(in, out);
 
@@ -156,69 +159,76 @@ void file_compress(char *file, char *mode) {
  * Uncompress the given file and remove the original.
  */
 void file_uncompress(char *infile, char *outfile) {
-	local char buf[MAX_NAME_LEN];
-	FILE *in, *out;
+	FILE *out;
 	gzFile gzin;
+	struct trace_span span;
+	struct stat st_in, st_out;
 
 	gzin = gzopen(infile, "rb");
-	if (in == NULL) {
+	if (gzin == NULL) {
 		fprintf(stderr, "%s: can't gzopen %s\n", prog, infile);
-		exit(1);
+		job_exit(1);
 	}
 	out = fopen(outfile, "wb");
 	if (out == NULL) {
 		perror(infile);
-		exit(1);
+		job_exit(1);
 	}
 
+	trace_begin(&span, TRACE_GZIP, infile);
 	gz_uncompress(gzin, out);
+	if (span.start != 0 && stat(infile, &st_in) == 0 && stat(outfile, &st_out) == 0)
+		trace_end(&span, st_in.st_size, st_out.st_size);
 	//unlink(infile);
 }
 
-char *file_uncompress_origname(char *infile, char *path) {
-	local char buf[MAX_NAME_LEN];
-	FILE *in, *out;
-	gzFile gzin;
-
-	char *filename;
-	int len = 0, i;
+/* ===========================================================================
+ * Returns path followed by the original name stored in the gzip header,
+ * or NULL if the header has none
+ */
+char *gz_origname(char *infile, char *path) {
+	FILE *in;
+	unsigned char header[10];
 	in = fopen(infile, "rb");
 	if (in == NULL) {
 		printf("Can't open %s\n", infile);
-		exit(1);
+		job_exit(1);
+	}
+	// FNAME comes after the FEXTRA field, if any
+	if (fread(header, 1, sizeof(header), in) != sizeof(header) || !(header[3] & 0x08)) {
+		fclose(in);
+		return NULL;
+	}
+	if (header[3] & 0x04) {
+		int xlen = getc(in);
+		xlen |= getc(in) << 8;
+		fseek(in, xlen, SEEK_CUR);
 	}
-	fseek(in, 10, SEEK_SET);
-	char c;
+	long start = ftell(in);
+	int c, len = 0;
 	do {
 		c = getc(in);
 		len++;
-	} while (c != '\x00');		//calculate string length
-	char *dest = malloc(len + strlen(path));	//allocate space for path+name
-	memset(dest, 0x0, strlen(dest));
-	filename = malloc(len);		//allocate space for name
-	fseek(in, 10, SEEK_SET);
-	fread(filename, 1, len, in);	//read filename
+	} while (c != '\x00' && c != EOF);		//calculate string length
+	char *dest = calloc(1, len + strlen(path));	//allocate space for path+name
+	char *filename = calloc(1, len);		//allocate space for name
+	fseek(in, start, SEEK_SET);
+	fread(filename, 1, len - 1, in);	//read filename
 	printf("Ungzipping file: %s\n", filename);
 	fclose(in);
 
 	strcat(dest, path);
 	strcat(dest, filename);
-
-	gzin = gzopen(infile, "rb");
-	if (in == NULL) {
-		fprintf(stderr, "%s: can't gzopen %s\n", prog, infile);
-		exit(1);
-	}
-	out = fopen(dest, "wb");
-	if (out == NULL) {
-		perror(infile);
-		exit(1);
-	}
-
-	gz_uncompress(gzin, out);
-	//unlink(infile);
+	free(filename);
 	return dest;
+}
 
+char *file_uncompress_origname(char *infile, char *path) {
+	char *dest = gz_origname(infile, path);
+	if (dest == NULL)
+		asprintf(&dest, "%s%s.ungz", path, basename(infile));
+	file_uncompress(infile, dest);
+	return dest;
 }
 
 /* ===========================================================================
@@ -18,14 +18,15 @@
 
 extern int errno;
 
-FILE *destfile;
-part_struct_type part_type;
-char *modelname;
+// per thread, so that several dumps can run side by side
+__thread FILE *destfile;
+extern __thread part_struct_type part_type; // set by detect_partpak_model, in util.c
+extern __thread char *modelname;
 
 //structs
-struct m_partmap_info m_partinfo;
-struct p1_partmap_info p1_partinfo;
-struct p2_partmap_info p2_partinfo;
+__thread struct m_partmap_info m_partinfo;
+__thread struct p1_partmap_info p1_partinfo;
+__thread struct p2_partmap_info p2_partinfo;
 
 const char *m_menu_partition_str[] = {
 	"MTD Partition Information ---------------------------------------------------------------------------------",
@@ -0,0 +1,201 @@
+/*
+	Forward-only reader for pipes and stdin, read ahead on its own thread
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "pipe_reader.h"
+
+struct pipe_reader {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* read ahead ring, written by the thread */
+	unsigned char *ring;
+	off_t head; // bytes read from fd
+	off_t tail; // bytes handed to the consumer
+	int eof;
+	int closing;
+
+	/* the consumer's current range, [buf_off, buf_off + buf_len) */
+	unsigned char *buf;
+	off_t buf_off;
+	size_t buf_len;
+	size_t buf_cap;
+};
+
+/*
+ * Tells if path is read as a stream: "-" for stdin, or a FIFO
+ */
+int is_pipe(const char *path){
+	struct stat st;
+	if(!strcmp(path, "-"))
+		return 1;
+	return stat(path, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static void *pipe_reader_thread(void *arg){
+	struct pipe_reader *r = (struct pipe_reader *)arg;
+
+	// only a blocked read can be cancelled, never with the lock held
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&r->lock);
+	while(!r->closing){
+		size_t used = r->head - r->tail;
+		if(used == PIPE_READER_AHEAD){
+			pthread_cond_wait(&r->cond, &r->lock);
+			continue;
+		}
+		size_t pos = r->head % PIPE_READER_AHEAD;
+		size_t space = PIPE_READER_AHEAD - used;
+		if(space > PIPE_READER_AHEAD - pos)
+			space = PIPE_READER_AHEAD - pos;
+
+		// the consumer only reads below head, the ring can be filled unlocked
+		pthread_mutex_unlock(&r->lock);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ssize_t n = read(r->fd, &r->ring[pos], space);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_mutex_lock(&r->lock);
+
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0){
+			if(n < 0)
+				fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+			r->eof = 1;
+			pthread_cond_broadcast(&r->cond);
+			break;
+		}
+		r->head += n;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+struct pipe_reader *pipe_reader_open(const char *path){
+	struct pipe_reader *r = calloc(1, sizeof(*r));
+	if(!strcmp(path, "-"))
+		r->fd = STDIN_FILENO;
+	else
+		r->fd = open(path, O_RDONLY);
+	if(r->fd < 0){
+		free(r);
+		return NULL;
+	}
+
+	r->ring = malloc(PIPE_READER_AHEAD);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if(r->ring == NULL || pthread_create(&r->thread, NULL, pipe_reader_thread, r) != 0){
+		if(r->fd != STDIN_FILENO)
+			close(r->fd);
+		free(r->ring);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+/*
+ * Moves up to size bytes from the ring to dst, waiting for them
+ * dst NULL skips them. Returns the number of bytes moved, less at end of input
+ */
+static size_t pipe_reader_take(struct pipe_reader *r, unsigned char *dst, size_t size){
+	size_t done = 0;
+	pthread_mutex_lock(&r->lock);
+	while(done < size){
+		size_t avail = r->head - r->tail;
+		if(avail == 0){
+			if(r->eof)
+				break;
+			pthread_cond_wait(&r->cond, &r->lock);
+			continue;
+		}
+		size_t pos = r->tail % PIPE_READER_AHEAD;
+		size_t n = size - done;
+		if(n > avail)
+			n = avail;
+		if(n > PIPE_READER_AHEAD - pos)
+			n = PIPE_READER_AHEAD - pos;
+		if(dst != NULL)
+			memcpy(&dst[done], &r->ring[pos], n);
+		done += n;
+		r->tail += n;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return done;
+}
+
+/*
+ * Gets size bytes at offset. Data before offset is dropped, so offsets must not go backwards
+ * Returns NULL if the input ends before offset + size
+ */
+void *pipe_reader_data(struct pipe_reader *r, off_t offset, size_t size){
+	if(offset < r->buf_off)
+		return NULL;
+
+	off_t buf_end = r->buf_off + r->buf_len;
+	if(offset >= buf_end){
+		// skip the gap
+		off_t gap = offset - buf_end;
+		if(pipe_reader_take(r, NULL, gap) != (size_t)gap)
+			return NULL;
+		r->buf_len = 0;
+	} else {
+		size_t drop = offset - r->buf_off;
+		memmove(r->buf, &r->buf[drop], r->buf_len - drop);
+		r->buf_len -= drop;
+	}
+	r->buf_off = offset;
+
+	if(r->buf_len >= size)
+		return r->buf;
+
+	if(size > r->buf_cap){
+		unsigned char *buf = realloc(r->buf, size);
+		if(buf == NULL)
+			return NULL;
+		r->buf = buf;
+		r->buf_cap = size;
+	}
+	r->buf_len += pipe_reader_take(r, &r->buf[r->buf_len], size - r->buf_len);
+	if(r->buf_len < size)
+		return NULL;
+	return r->buf;
+}
+
+/*
+ * Gets the offset of the data read so far, the input size once it ended
+ */
+off_t pipe_reader_offset(struct pipe_reader *r){
+	return r->buf_off + r->buf_len;
+}
+
+void pipe_reader_close(struct pipe_reader *r){
+	pthread_mutex_lock(&r->lock);
+	r->closing = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	// the writer may still be sending data nobody needs
+	pthread_cancel(r->thread);
+	pthread_join(r->thread, NULL);
+	if(r->fd != STDIN_FILENO)
+		close(r->fd);
+
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r->ring);
+	free(r->buf);
+	free(r);
+}
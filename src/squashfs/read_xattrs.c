@@ -23,7 +23,7 @@
  */
 
 /*
- * Common xattr read code shared between mksquashfs and unsquashfs
+ * Xattr read code of unsquashfs, the tables read are those of uctx
  */
 
 #define TRUE 1
@@ -43,21 +43,15 @@
 #include "squashfs_swap.h"
 #include "xattr.h"
 #include "error.h"
+#include "unsquashfs.h"
 
 #include <stdlib.h>
 
-extern int read_fs_bytes(int, long long, int, void *);
-extern int read_block(int, long long, long long *, int, void *);
-
-static struct hash_entry {
+struct hash_entry {
 	long long start;
 	unsigned int offset;
 	struct hash_entry *next;
-} *hash_table[65536];
-
-static struct squashfs_xattr_id *xattr_ids;
-static void *xattrs = NULL;
-static long long xattr_table_start;
+};
 
 /*
  * Prefix lookup table, storing mapping to/from prefix string and prefix id
@@ -84,8 +78,8 @@ static void save_xattr_block(long long start, int offset) {
 
 	hash_entry->start = start;
 	hash_entry->offset = offset;
-	hash_entry->next = hash_table[hash];
-	hash_table[hash] = hash_entry;
+	hash_entry->next = uctx->xattr_hash_table[hash];
+	uctx->xattr_hash_table[hash] = hash_entry;
 }
 
 /*
@@ -94,7 +88,7 @@ static void save_xattr_block(long long start, int offset) {
  */
 static int get_xattr_block(long long start) {
 	int hash = start & 0xffff;
-	struct hash_entry *hash_entry = hash_table[hash];
+	struct hash_entry *hash_entry = uctx->xattr_hash_table[hash];
 
 	for (; hash_entry; hash_entry = hash_entry->next)
 		if (hash_entry->start == start)
@@ -165,7 +159,7 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk) {
 	 * blocks
 	 */
 	ids = id_table.xattr_ids;
-	xattr_table_start = id_table.xattr_table_start;
+	uctx->xattr_table_start = id_table.xattr_table_start;
 	index_bytes = SQUASHFS_XATTR_BLOCK_BYTES(ids);
 	indexes = SQUASHFS_XATTR_BLOCKS(ids);
 	index = malloc(index_bytes);
@@ -183,14 +177,14 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk) {
 	 * read and decompress it
 	 */
 	bytes = SQUASHFS_XATTR_BYTES(ids);
-	xattr_ids = malloc(bytes);
-	if (xattr_ids == NULL)
+	uctx->xattr_ids = malloc(bytes);
+	if (uctx->xattr_ids == NULL)
 		MEM_ERROR();
 
 	for (i = 0; i < indexes; i++) {
 		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE : bytes & (SQUASHFS_METADATA_SIZE - 1);
 		int length = read_block(fd, index[i], NULL, expected,
-								((unsigned char *)xattr_ids) + (i * SQUASHFS_METADATA_SIZE));
+								((unsigned char *)uctx->xattr_ids) + (i * SQUASHFS_METADATA_SIZE));
 		TRACE("Read xattr id table block %d, from 0x%llx, length " "%d\n", i, index[i], length);
 		if (length == 0) {
 			ERROR("Failed to read xattr id table block %d, " "from 0x%llx, length %d\n", i, index[i], length);
@@ -205,19 +199,19 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk) {
 	 * the last xattr metadata block, so we can use index[0] to work out
 	 * the end of the xattr metadata
 	 */
-	start = xattr_table_start;
+	start = uctx->xattr_table_start;
 	end = index[0];
 	for (i = 0; start < end; i++) {
 		int length;
-		xattrs = realloc(xattrs, (i + 1) * SQUASHFS_METADATA_SIZE);
-		if (xattrs == NULL)
+		uctx->xattrs = realloc(uctx->xattrs, (i + 1) * SQUASHFS_METADATA_SIZE);
+		if (uctx->xattrs == NULL)
 			MEM_ERROR();
 
 		/* store mapping from location of compressed block in fs ->
 		 * location of uncompressed block in memory */
 		save_xattr_block(start, i * SQUASHFS_METADATA_SIZE);
 
-		length = read_block(fd, start, &start, 0, ((unsigned char *)xattrs) + (i * SQUASHFS_METADATA_SIZE));
+		length = read_block(fd, start, &start, 0, ((unsigned char *)uctx->xattrs) + (i * SQUASHFS_METADATA_SIZE));
 		TRACE("Read xattr block %d, length %d\n", i, length);
 		if (length == 0) {
 			ERROR("Failed to read xattr block %d\n", i);
@@ -239,22 +233,41 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk) {
 
 	/* swap if necessary the xattr id entries */
 	for (i = 0; i < ids; i++)
-		SQUASHFS_INSWAP_XATTR_ID(&xattr_ids[i]);
+		SQUASHFS_INSWAP_XATTR_ID(&uctx->xattr_ids[i]);
 
 	free(index);
 
 	return ids;
 
  failed3:
-	free(xattrs);
+	free(uctx->xattrs);
+	uctx->xattrs = NULL;
  failed2:
-	free(xattr_ids);
+	free(uctx->xattr_ids);
+	uctx->xattr_ids = NULL;
  failed1:
 	free(index);
 
 	return 0;
 }
 
+void free_xattrs() {
+	struct hash_entry *hash_entry, *next;
+	int i;
+
+	for (i = 0; i < 65536; i++) {
+		for (hash_entry = uctx->xattr_hash_table[i]; hash_entry; hash_entry = next) {
+			next = hash_entry->next;
+			free(hash_entry);
+		}
+		uctx->xattr_hash_table[i] = NULL;
+	}
+	free(uctx->xattr_ids);
+	uctx->xattr_ids = NULL;
+	free(uctx->xattrs);
+	uctx->xattrs = NULL;
+}
+
 void free_xattr(struct xattr_list *xattr_list, int count) {
 	int i;
 
@@ -294,10 +307,10 @@ struct xattr_list *get_xattr(int i, unsigned int *count, int ignore) {
 
 	TRACE("get_xattr\n");
 
-	*count = xattr_ids[i].count;
-	start = SQUASHFS_XATTR_BLK(xattr_ids[i].xattr) + xattr_table_start;
-	offset = SQUASHFS_XATTR_OFFSET(xattr_ids[i].xattr);
-	xptr = xattrs + get_xattr_block(start) + offset;
+	*count = uctx->xattr_ids[i].count;
+	start = SQUASHFS_XATTR_BLK(uctx->xattr_ids[i].xattr) + uctx->xattr_table_start;
+	offset = SQUASHFS_XATTR_OFFSET(uctx->xattr_ids[i].xattr);
+	xptr = uctx->xattrs + get_xattr_block(start) + offset;
 
 	TRACE("get_xattr: xattr_id %d, count %d, start %lld, offset %d\n", i, *count, start, offset);
 
@@ -335,9 +348,9 @@ struct xattr_list *get_xattr(int i, unsigned int *count, int ignore) {
 			xptr += sizeof(val);
 			SQUASHFS_SWAP_LONG_LONGS(xptr, &xattr, 1);
 			xptr += sizeof(xattr);
-			start = SQUASHFS_XATTR_BLK(xattr) + xattr_table_start;
+			start = SQUASHFS_XATTR_BLK(xattr) + uctx->xattr_table_start;
 			offset = SQUASHFS_XATTR_OFFSET(xattr);
-			ool_xptr = xattrs + get_xattr_block(start) + offset;
+			ool_xptr = uctx->xattrs + get_xattr_block(start) + offset;
 			SQUASHFS_SWAP_XATTR_VAL(ool_xptr, &val);
 			xattr_list[j].value = ool_xptr + sizeof(val);
 		} else {
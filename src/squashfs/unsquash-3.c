@@ -25,36 +25,35 @@
 #include "unsquashfs.h"
 #include "squashfs_compat.h"
 
-static squashfs_fragment_entry_3 *fragment_table;
-
 int read_fragment_table_3(long long *directory_table_end) {
+	squashfs_fragment_entry_3 *fragment_table;
 	int res, i;
-	int bytes = SQUASHFS_FRAGMENT_BYTES_3(sBlk.s.fragments);
-	int indexes = SQUASHFS_FRAGMENT_INDEXES_3(sBlk.s.fragments);
+	int bytes = SQUASHFS_FRAGMENT_BYTES_3(uctx->sBlk.s.fragments);
+	int indexes = SQUASHFS_FRAGMENT_INDEXES_3(uctx->sBlk.s.fragments);
 	long long fragment_table_index[indexes];
 
-	TRACE("read_fragment_table: %d fragments, reading %d fragment indexes " "from 0x%llx\n", sBlk.s.fragments, indexes, sBlk.s.fragment_table_start);
+	TRACE("read_fragment_table: %d fragments, reading %d fragment indexes " "from 0x%llx\n", uctx->sBlk.s.fragments, indexes, uctx->sBlk.s.fragment_table_start);
 
-	if (sBlk.s.fragments == 0) {
-		*directory_table_end = sBlk.s.fragment_table_start;
+	if (uctx->sBlk.s.fragments == 0) {
+		*directory_table_end = uctx->sBlk.s.fragment_table_start;
 		return TRUE;
 	}
 
-	fragment_table = malloc(bytes);
+	uctx->fragment_table = fragment_table = malloc(bytes);
 	if (fragment_table == NULL)
 		EXIT_UNSQUASH("read_fragment_table: failed to allocate " "fragment table\n");
 
-	if (swap) {
+	if (uctx->swap) {
 		long long sfragment_table_index[indexes];
 
-		res = read_fs_bytes(fd, sBlk.s.fragment_table_start, SQUASHFS_FRAGMENT_INDEX_BYTES_3(sBlk.s.fragments), sfragment_table_index);
+		res = read_fs_bytes(uctx->fd, uctx->sBlk.s.fragment_table_start, SQUASHFS_FRAGMENT_INDEX_BYTES_3(uctx->sBlk.s.fragments), sfragment_table_index);
 		if (res == FALSE) {
 			ERROR("read_fragment_table: failed to read fragment " "table index\n");
 			return FALSE;
 		}
 		SQUASHFS_SWAP_FRAGMENT_INDEXES_3(fragment_table_index, sfragment_table_index, indexes);
 	} else {
-		res = read_fs_bytes(fd, sBlk.s.fragment_table_start, SQUASHFS_FRAGMENT_INDEX_BYTES_3(sBlk.s.fragments), fragment_table_index);
+		res = read_fs_bytes(uctx->fd, uctx->sBlk.s.fragment_table_start, SQUASHFS_FRAGMENT_INDEX_BYTES_3(uctx->sBlk.s.fragments), fragment_table_index);
 		if (res == FALSE) {
 			ERROR("read_fragment_table: failed to read fragment " "table index\n");
 			return FALSE;
@@ -63,7 +62,7 @@ int read_fragment_table_3(long long *directory_table_end) {
 
 	for (i = 0; i < indexes; i++) {
 		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE : bytes & (SQUASHFS_METADATA_SIZE - 1);
-		int length = read_block(fd, fragment_table_index[i], NULL,
+		int length = read_block(uctx->fd, fragment_table_index[i], NULL,
 								expected, ((char *)fragment_table) + (i * SQUASHFS_METADATA_SIZE));
 		TRACE("Read fragment table block %d, from 0x%llx, length %d\n", i, fragment_table_index[i], length);
 		if (length == FALSE) {
@@ -72,9 +71,9 @@ int read_fragment_table_3(long long *directory_table_end) {
 		}
 	}
 
-	if (swap) {
+	if (uctx->swap) {
 		squashfs_fragment_entry_3 sfragment;
-		for (i = 0; i < sBlk.s.fragments; i++) {
+		for (i = 0; i < uctx->sBlk.s.fragments; i++) {
 			SQUASHFS_SWAP_FRAGMENT_ENTRY_3((&sfragment), (&fragment_table[i]));
 			memcpy((char *)&fragment_table[i], (char *)&sfragment, sizeof(squashfs_fragment_entry_3));
 		}
@@ -85,6 +84,7 @@ int read_fragment_table_3(long long *directory_table_end) {
 }
 
 void read_fragment_3(unsigned int fragment, long long *start_block, int *size) {
+	squashfs_fragment_entry_3 *fragment_table = uctx->fragment_table;
 	TRACE("read_fragment: reading fragment %d\n", fragment);
 
 	squashfs_fragment_entry_3 *fragment_entry = &fragment_table[fragment];
@@ -93,143 +93,143 @@ void read_fragment_3(unsigned int fragment, long long *start_block, int *size) {
 }
 
 struct inode *read_inode_3(unsigned int start_block, unsigned int offset) {
-	static union squashfs_inode_header_3 header;
-	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
-	char *block_ptr = inode_table + bytes + offset;
-	static struct inode i;
+	union squashfs_inode_header_3 header;
+	long long start = uctx->sBlk.s.inode_table_start + start_block;
+	int bytes = lookup_entry(uctx->inode_table_hash, start);
+	char *block_ptr = uctx->inode_table + bytes + offset;
+	struct inode *i = &uctx->inode;
 
 	TRACE("read_inode: reading inode [%d:%d]\n", start_block, offset);
 
 	if (bytes == -1)
 		EXIT_UNSQUASH("read_inode: inode table block %lld not found\n", start);
 
-	if (swap) {
+	if (uctx->swap) {
 		squashfs_base_inode_header_3 sinode;
 		memcpy(&sinode, block_ptr, sizeof(header.base));
 		SQUASHFS_SWAP_BASE_INODE_HEADER_3(&header.base, &sinode, sizeof(squashfs_base_inode_header_3));
 	} else
 		memcpy(&header.base, block_ptr, sizeof(header.base));
 
-	i.xattr = SQUASHFS_INVALID_XATTR;
-	i.uid = (uid_t) uid_table[header.base.uid];
-	i.gid = header.base.guid == SQUASHFS_GUIDS ? i.uid : (uid_t) guid_table[header.base.guid];
-	i.mode = lookup_type[header.base.inode_type] | header.base.mode;
-	i.type = header.base.inode_type;
-	i.time = header.base.mtime;
-	i.inode_number = header.base.inode_number;
+	i->xattr = SQUASHFS_INVALID_XATTR;
+	i->uid = (uid_t) uctx->uid_table[header.base.uid];
+	i->gid = header.base.guid == SQUASHFS_GUIDS ? i->uid : (uid_t) uctx->guid_table[header.base.guid];
+	i->mode = lookup_type[header.base.inode_type] | header.base.mode;
+	i->type = header.base.inode_type;
+	i->time = header.base.mtime;
+	i->inode_number = header.base.inode_number;
 
 	switch (header.base.inode_type) {
 	case SQUASHFS_DIR_TYPE:{
 			squashfs_dir_inode_header_3 *inode = &header.dir;
 
-			if (swap) {
+			if (uctx->swap) {
 				squashfs_dir_inode_header_3 sinode;
 				memcpy(&sinode, block_ptr, sizeof(header.dir));
 				SQUASHFS_SWAP_DIR_INODE_HEADER_3(&header.dir, &sinode);
 			} else
 				memcpy(&header.dir, block_ptr, sizeof(header.dir));
 
-			i.data = inode->file_size;
-			i.offset = inode->offset;
-			i.start = inode->start_block;
+			i->data = inode->file_size;
+			i->offset = inode->offset;
+			i->start = inode->start_block;
 			break;
 		}
 	case SQUASHFS_LDIR_TYPE:{
 			squashfs_ldir_inode_header_3 *inode = &header.ldir;
 
-			if (swap) {
+			if (uctx->swap) {
 				squashfs_ldir_inode_header_3 sinode;
 				memcpy(&sinode, block_ptr, sizeof(header.ldir));
 				SQUASHFS_SWAP_LDIR_INODE_HEADER_3(&header.ldir, &sinode);
 			} else
 				memcpy(&header.ldir, block_ptr, sizeof(header.ldir));
 
-			i.data = inode->file_size;
-			i.offset = inode->offset;
-			i.start = inode->start_block;
+			i->data = inode->file_size;
+			i->offset = inode->offset;
+			i->start = inode->start_block;
 			break;
 		}
 	case SQUASHFS_FILE_TYPE:{
 			squashfs_reg_inode_header_3 *inode = &header.reg;
 
-			if (swap) {
+			if (uctx->swap) {
 				squashfs_reg_inode_header_3 sinode;
 				memcpy(&sinode, block_ptr, sizeof(sinode));
 				SQUASHFS_SWAP_REG_INODE_HEADER_3(inode, &sinode);
 			} else
 				memcpy(inode, block_ptr, sizeof(*inode));
 
-			i.data = inode->file_size;
-			i.frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG ? 0 : inode->file_size % sBlk.s.block_size;
-			i.fragment = inode->fragment;
-			i.offset = inode->offset;
-			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (i.data + sBlk.s.block_size - 1) >> sBlk.s.block_log : i.data >> sBlk.s.block_log;
-			i.start = inode->start_block;
-			i.sparse = 1;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i->data = inode->file_size;
+			i->frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG ? 0 : inode->file_size % uctx->sBlk.s.block_size;
+			i->fragment = inode->fragment;
+			i->offset = inode->offset;
+			i->blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (i->data + uctx->sBlk.s.block_size - 1) >> uctx->sBlk.s.block_log : i->data >> uctx->sBlk.s.block_log;
+			i->start = inode->start_block;
+			i->sparse = 1;
+			i->block_ptr = block_ptr + sizeof(*inode);
 			break;
 		}
 	case SQUASHFS_LREG_TYPE:{
 			squashfs_lreg_inode_header_3 *inode = &header.lreg;
 
-			if (swap) {
+			if (uctx->swap) {
 				squashfs_lreg_inode_header_3 sinode;
 				memcpy(&sinode, block_ptr, sizeof(sinode));
 				SQUASHFS_SWAP_LREG_INODE_HEADER_3(inode, &sinode);
 			} else
 				memcpy(inode, block_ptr, sizeof(*inode));
 
-			i.data = inode->file_size;
-			i.frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG ? 0 : inode->file_size % sBlk.s.block_size;
-			i.fragment = inode->fragment;
-			i.offset = inode->offset;
-			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (inode->file_size + sBlk.s.block_size - 1) >> sBlk.s.block_log : inode->file_size >> sBlk.s.block_log;
-			i.start = inode->start_block;
-			i.sparse = 1;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i->data = inode->file_size;
+			i->frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG ? 0 : inode->file_size % uctx->sBlk.s.block_size;
+			i->fragment = inode->fragment;
+			i->offset = inode->offset;
+			i->blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (inode->file_size + uctx->sBlk.s.block_size - 1) >> uctx->sBlk.s.block_log : inode->file_size >> uctx->sBlk.s.block_log;
+			i->start = inode->start_block;
+			i->sparse = 1;
+			i->block_ptr = block_ptr + sizeof(*inode);
 			break;
 		}
 	case SQUASHFS_SYMLINK_TYPE:{
 			squashfs_symlink_inode_header_3 *inodep = &header.symlink;
 
-			if (swap) {
+			if (uctx->swap) {
 				squashfs_symlink_inode_header_3 sinodep;
 				memcpy(&sinodep, block_ptr, sizeof(sinodep));
 				SQUASHFS_SWAP_SYMLINK_INODE_HEADER_3(inodep, &sinodep);
 			} else
 				memcpy(inodep, block_ptr, sizeof(*inodep));
 
-			i.symlink = malloc(inodep->symlink_size + 1);
-			if (i.symlink == NULL)
+			i->symlink = malloc(inodep->symlink_size + 1);
+			if (i->symlink == NULL)
 				EXIT_UNSQUASH("read_inode: failed to malloc " "symlink data\n");
-			strncpy(i.symlink, block_ptr + sizeof(squashfs_symlink_inode_header_3), inodep->symlink_size);
-			i.symlink[inodep->symlink_size] = '\0';
-			i.data = inodep->symlink_size;
+			strncpy(i->symlink, block_ptr + sizeof(squashfs_symlink_inode_header_3), inodep->symlink_size);
+			i->symlink[inodep->symlink_size] = '\0';
+			i->data = inodep->symlink_size;
 			break;
 		}
 	case SQUASHFS_BLKDEV_TYPE:
 	case SQUASHFS_CHRDEV_TYPE:{
 			squashfs_dev_inode_header_3 *inodep = &header.dev;
 
-			if (swap) {
+			if (uctx->swap) {
 				squashfs_dev_inode_header_3 sinodep;
 				memcpy(&sinodep, block_ptr, sizeof(sinodep));
 				SQUASHFS_SWAP_DEV_INODE_HEADER_3(inodep, &sinodep);
 			} else
 				memcpy(inodep, block_ptr, sizeof(*inodep));
 
-			i.data = inodep->rdev;
+			i->data = inodep->rdev;
 			break;
 		}
 	case SQUASHFS_FIFO_TYPE:
 	case SQUASHFS_SOCKET_TYPE:
-		i.data = 0;
+		i->data = 0;
 		break;
 	default:
 		EXIT_UNSQUASH("Unknown inode type %d in read_inode!\n", header.base.inode_type);
 	}
-	return &i;
+	return i;
 }
 
 struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset, struct inode **i) {
@@ -245,7 +245,7 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset, st
 
 	TRACE("squashfs_opendir: inode start block %d, offset %d\n", block_start, offset);
 
-	*i = s_ops.read_inode(block_start, offset);
+	*i = uctx->s_ops.read_inode(block_start, offset);
 
 	dir = malloc(sizeof(struct dir));
 	if (dir == NULL)
@@ -269,8 +269,8 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset, st
 		 */
 		return dir;
 
-	start = sBlk.s.directory_table_start + (*i)->start;
-	bytes = lookup_entry(directory_table_hash, start);
+	start = uctx->sBlk.s.directory_table_start + (*i)->start;
+	bytes = lookup_entry(uctx->directory_table_hash, start);
 
 	if (bytes == -1)
 		EXIT_UNSQUASH("squashfs_opendir: directory block %d not " "found!\n", block_start);
@@ -279,12 +279,12 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset, st
 	size = (*i)->data + bytes - 3;
 
 	while (bytes < size) {
-		if (swap) {
+		if (uctx->swap) {
 			squashfs_dir_header_3 sdirh;
-			memcpy(&sdirh, directory_table + bytes, sizeof(sdirh));
+			memcpy(&sdirh, uctx->directory_table + bytes, sizeof(sdirh));
 			SQUASHFS_SWAP_DIR_HEADER_3(&dirh, &sdirh);
 		} else
-			memcpy(&dirh, directory_table + bytes, sizeof(dirh));
+			memcpy(&dirh, uctx->directory_table + bytes, sizeof(dirh));
 
 		dir_count = dirh.count + 1;
 		TRACE("squashfs_opendir: Read directory header @ byte position " "%d, %d directory entries\n", bytes, dir_count);
@@ -295,19 +295,19 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset, st
 			goto corrupted;
 
 		while (dir_count--) {
-			if (swap) {
+			if (uctx->swap) {
 				squashfs_dir_entry_3 sdire;
-				memcpy(&sdire, directory_table + bytes, sizeof(sdire));
+				memcpy(&sdire, uctx->directory_table + bytes, sizeof(sdire));
 				SQUASHFS_SWAP_DIR_ENTRY_3(dire, &sdire);
 			} else
-				memcpy(dire, directory_table + bytes, sizeof(*dire));
+				memcpy(dire, uctx->directory_table + bytes, sizeof(*dire));
 			bytes += sizeof(*dire);
 
 			/* size should never be larger than SQUASHFS_NAME_LEN */
 			if (dire->size > SQUASHFS_NAME_LEN)
 				goto corrupted;
 
-			memcpy(dire->name, directory_table + bytes, dire->size + 1);
+			memcpy(dire->name, uctx->directory_table + bytes, dire->size + 1);
 			dire->name[dire->size + 1] = '\0';
 			TRACE("squashfs_opendir: directory entry %s, inode " "%d:%d, type %d\n", dire->name, dirh.start_block, dire->offset, dire->type);
 			if ((dir->dir_count % DIR_ENT_SIZE) == 0) {
@@ -25,27 +25,25 @@
 #include "unsquashfs.h"
 #include "squashfs_swap.h"
 
-static struct squashfs_fragment_entry *fragment_table;
-static unsigned int *id_table;
-
 int read_fragment_table_4(long long *directory_table_end) {
+	struct squashfs_fragment_entry *fragment_table;
 	int res, i;
-	int bytes = SQUASHFS_FRAGMENT_BYTES(sBlk.s.fragments);
-	int indexes = SQUASHFS_FRAGMENT_INDEXES(sBlk.s.fragments);
+	int bytes = SQUASHFS_FRAGMENT_BYTES(uctx->sBlk.s.fragments);
+	int indexes = SQUASHFS_FRAGMENT_INDEXES(uctx->sBlk.s.fragments);
 	long long fragment_table_index[indexes];
 
-	TRACE("read_fragment_table: %d fragments, reading %d fragment indexes " "from 0x%llx\n", sBlk.s.fragments, indexes, sBlk.s.fragment_table_start);
+	TRACE("read_fragment_table: %d fragments, reading %d fragment indexes " "from 0x%llx\n", uctx->sBlk.s.fragments, indexes, uctx->sBlk.s.fragment_table_start);
 
-	if (sBlk.s.fragments == 0) {
-		*directory_table_end = sBlk.s.fragment_table_start;
+	if (uctx->sBlk.s.fragments == 0) {
+		*directory_table_end = uctx->sBlk.s.fragment_table_start;
 		return TRUE;
 	}
 
-	fragment_table = malloc(bytes);
+	uctx->fragment_table = fragment_table = malloc(bytes);
 	if (fragment_table == NULL)
 		EXIT_UNSQUASH("read_fragment_table: failed to allocate " "fragment table\n");
 
-	res = read_fs_bytes(fd, sBlk.s.fragment_table_start, SQUASHFS_FRAGMENT_INDEX_BYTES(sBlk.s.fragments), fragment_table_index);
+	res = read_fs_bytes(uctx->fd, uctx->sBlk.s.fragment_table_start, SQUASHFS_FRAGMENT_INDEX_BYTES(uctx->sBlk.s.fragments), fragment_table_index);
 	if (res == FALSE) {
 		ERROR("read_fragment_table: failed to read fragment table " "index\n");
 		return FALSE;
@@ -54,7 +52,7 @@ int read_fragment_table_4(long long *directory_table_end) {
 
 	for (i = 0; i < indexes; i++) {
 		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE : bytes & (SQUASHFS_METADATA_SIZE - 1);
-		int length = read_block(fd, fragment_table_index[i], NULL,
+		int length = read_block(uctx->fd, fragment_table_index[i], NULL,
 								expected, ((char *)fragment_table) + (i * SQUASHFS_METADATA_SIZE));
 		TRACE("Read fragment table block %d, from 0x%llx, length %d\n", i, fragment_table_index[i], length);
 		if (length == FALSE) {
@@ -63,7 +61,7 @@ int read_fragment_table_4(long long *directory_table_end) {
 		}
 	}
 
-	for (i = 0; i < sBlk.s.fragments; i++)
+	for (i = 0; i < uctx->sBlk.s.fragments; i++)
 		SQUASHFS_INSWAP_FRAGMENT_ENTRY(&fragment_table[i]);
 
 	*directory_table_end = fragment_table_index[0];
@@ -71,6 +69,7 @@ int read_fragment_table_4(long long *directory_table_end) {
 }
 
 void read_fragment_4(unsigned int fragment, long long *start_block, int *size) {
+	struct squashfs_fragment_entry *fragment_table = uctx->fragment_table;
 	TRACE("read_fragment: reading fragment %d\n", fragment);
 
 	struct squashfs_fragment_entry *fragment_entry;
@@ -81,11 +80,11 @@ void read_fragment_4(unsigned int fragment, long long *start_block, int *size) {
 }
 
 struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
-	static union squashfs_inode_header header;
-	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
-	char *block_ptr = inode_table + bytes + offset;
-	static struct inode i;
+	union squashfs_inode_header header;
+	long long start = uctx->sBlk.s.inode_table_start + start_block;
+	int bytes = lookup_entry(uctx->inode_table_hash, start);
+	char *block_ptr = uctx->inode_table + bytes + offset;
+	struct inode *i = &uctx->inode;
 
 	TRACE("read_inode: reading inode [%d:%d]\n", start_block, offset);
 
@@ -94,12 +93,12 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 	SQUASHFS_SWAP_BASE_INODE_HEADER(block_ptr, &header.base);
 
-	i.uid = (uid_t) id_table[header.base.uid];
-	i.gid = (uid_t) id_table[header.base.guid];
-	i.mode = lookup_type[header.base.inode_type] | header.base.mode;
-	i.type = header.base.inode_type;
-	i.time = header.base.mtime;
-	i.inode_number = header.base.inode_number;
+	i->uid = (uid_t) uctx->id_table[header.base.uid];
+	i->gid = (uid_t) uctx->id_table[header.base.guid];
+	i->mode = lookup_type[header.base.inode_type] | header.base.mode;
+	i->type = header.base.inode_type;
+	i->time = header.base.mtime;
+	i->inode_number = header.base.inode_number;
 
 	switch (header.base.inode_type) {
 	case SQUASHFS_DIR_TYPE:{
@@ -107,10 +106,10 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 			SQUASHFS_SWAP_DIR_INODE_HEADER(block_ptr, inode);
 
-			i.data = inode->file_size;
-			i.offset = inode->offset;
-			i.start = inode->start_block;
-			i.xattr = SQUASHFS_INVALID_XATTR;
+			i->data = inode->file_size;
+			i->offset = inode->offset;
+			i->start = inode->start_block;
+			i->xattr = SQUASHFS_INVALID_XATTR;
 			break;
 		}
 	case SQUASHFS_LDIR_TYPE:{
@@ -118,10 +117,10 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 			SQUASHFS_SWAP_LDIR_INODE_HEADER(block_ptr, inode);
 
-			i.data = inode->file_size;
-			i.offset = inode->offset;
-			i.start = inode->start_block;
-			i.xattr = inode->xattr;
+			i->data = inode->file_size;
+			i->offset = inode->offset;
+			i->start = inode->start_block;
+			i->xattr = inode->xattr;
 			break;
 		}
 	case SQUASHFS_FILE_TYPE:{
@@ -129,15 +128,15 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 			SQUASHFS_SWAP_REG_INODE_HEADER(block_ptr, inode);
 
-			i.data = inode->file_size;
-			i.frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG ? 0 : inode->file_size % sBlk.s.block_size;
-			i.fragment = inode->fragment;
-			i.offset = inode->offset;
-			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (i.data + sBlk.s.block_size - 1) >> sBlk.s.block_log : i.data >> sBlk.s.block_log;
-			i.start = inode->start_block;
-			i.sparse = 0;
-			i.block_ptr = block_ptr + sizeof(*inode);
-			i.xattr = SQUASHFS_INVALID_XATTR;
+			i->data = inode->file_size;
+			i->frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG ? 0 : inode->file_size % uctx->sBlk.s.block_size;
+			i->fragment = inode->fragment;
+			i->offset = inode->offset;
+			i->blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (i->data + uctx->sBlk.s.block_size - 1) >> uctx->sBlk.s.block_log : i->data >> uctx->sBlk.s.block_log;
+			i->start = inode->start_block;
+			i->sparse = 0;
+			i->block_ptr = block_ptr + sizeof(*inode);
+			i->xattr = SQUASHFS_INVALID_XATTR;
 			break;
 		}
 	case SQUASHFS_LREG_TYPE:{
@@ -145,15 +144,15 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 			SQUASHFS_SWAP_LREG_INODE_HEADER(block_ptr, inode);
 
-			i.data = inode->file_size;
-			i.frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG ? 0 : inode->file_size % sBlk.s.block_size;
-			i.fragment = inode->fragment;
-			i.offset = inode->offset;
-			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (inode->file_size + sBlk.s.block_size - 1) >> sBlk.s.block_log : inode->file_size >> sBlk.s.block_log;
-			i.start = inode->start_block;
-			i.sparse = inode->sparse != 0;
-			i.block_ptr = block_ptr + sizeof(*inode);
-			i.xattr = inode->xattr;
+			i->data = inode->file_size;
+			i->frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG ? 0 : inode->file_size % uctx->sBlk.s.block_size;
+			i->fragment = inode->fragment;
+			i->offset = inode->offset;
+			i->blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (inode->file_size + uctx->sBlk.s.block_size - 1) >> uctx->sBlk.s.block_log : inode->file_size >> uctx->sBlk.s.block_log;
+			i->start = inode->start_block;
+			i->sparse = inode->sparse != 0;
+			i->block_ptr = block_ptr + sizeof(*inode);
+			i->xattr = inode->xattr;
 			break;
 		}
 	case SQUASHFS_SYMLINK_TYPE:
@@ -162,17 +161,17 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 			SQUASHFS_SWAP_SYMLINK_INODE_HEADER(block_ptr, inode);
 
-			i.symlink = malloc(inode->symlink_size + 1);
-			if (i.symlink == NULL)
+			i->symlink = malloc(inode->symlink_size + 1);
+			if (i->symlink == NULL)
 				EXIT_UNSQUASH("read_inode: failed to malloc " "symlink data\n");
-			strncpy(i.symlink, block_ptr + sizeof(struct squashfs_symlink_inode_header), inode->symlink_size);
-			i.symlink[inode->symlink_size] = '\0';
-			i.data = inode->symlink_size;
+			strncpy(i->symlink, block_ptr + sizeof(struct squashfs_symlink_inode_header), inode->symlink_size);
+			i->symlink[inode->symlink_size] = '\0';
+			i->data = inode->symlink_size;
 
 			if (header.base.inode_type == SQUASHFS_LSYMLINK_TYPE)
-				SQUASHFS_SWAP_INTS(block_ptr + sizeof(struct squashfs_symlink_inode_header) + inode->symlink_size, &i.xattr, 1);
+				SQUASHFS_SWAP_INTS(block_ptr + sizeof(struct squashfs_symlink_inode_header) + inode->symlink_size, &i->xattr, 1);
 			else
-				i.xattr = SQUASHFS_INVALID_XATTR;
+				i->xattr = SQUASHFS_INVALID_XATTR;
 			break;
 		}
 	case SQUASHFS_BLKDEV_TYPE:
@@ -181,8 +180,8 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 			SQUASHFS_SWAP_DEV_INODE_HEADER(block_ptr, inode);
 
-			i.data = inode->rdev;
-			i.xattr = SQUASHFS_INVALID_XATTR;
+			i->data = inode->rdev;
+			i->xattr = SQUASHFS_INVALID_XATTR;
 			break;
 		}
 	case SQUASHFS_LBLKDEV_TYPE:
@@ -191,14 +190,14 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 			SQUASHFS_SWAP_LDEV_INODE_HEADER(block_ptr, inode);
 
-			i.data = inode->rdev;
-			i.xattr = inode->xattr;
+			i->data = inode->rdev;
+			i->xattr = inode->xattr;
 			break;
 		}
 	case SQUASHFS_FIFO_TYPE:
 	case SQUASHFS_SOCKET_TYPE:
-		i.data = 0;
-		i.xattr = SQUASHFS_INVALID_XATTR;
+		i->data = 0;
+		i->xattr = SQUASHFS_INVALID_XATTR;
 		break;
 	case SQUASHFS_LFIFO_TYPE:
 	case SQUASHFS_LSOCKET_TYPE:{
@@ -206,14 +205,14 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset) {
 
 			SQUASHFS_SWAP_LIPC_INODE_HEADER(block_ptr, inode);
 
-			i.data = 0;
-			i.xattr = inode->xattr;
+			i->data = 0;
+			i->xattr = inode->xattr;
 			break;
 		}
 	default:
 		EXIT_UNSQUASH("Unknown inode type %d in read_inode!\n", header.base.inode_type);
 	}
-	return &i;
+	return i;
 }
 
 struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset, struct inode **i) {
@@ -229,7 +228,7 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset, st
 
 	TRACE("squashfs_opendir: inode start block %d, offset %d\n", block_start, offset);
 
-	*i = s_ops.read_inode(block_start, offset);
+	*i = uctx->s_ops.read_inode(block_start, offset);
 
 	dir = malloc(sizeof(struct dir));
 	if (dir == NULL)
@@ -253,8 +252,8 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset, st
 		 */
 		return dir;
 
-	start = sBlk.s.directory_table_start + (*i)->start;
-	bytes = lookup_entry(directory_table_hash, start);
+	start = uctx->sBlk.s.directory_table_start + (*i)->start;
+	bytes = lookup_entry(uctx->directory_table_hash, start);
 
 	if (bytes == -1)
 		EXIT_UNSQUASH("squashfs_opendir: directory block %d not " "found!\n", block_start);
@@ -263,7 +262,7 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset, st
 	size = (*i)->data + bytes - 3;
 
 	while (bytes < size) {
-		SQUASHFS_SWAP_DIR_HEADER(directory_table + bytes, &dirh);
+		SQUASHFS_SWAP_DIR_HEADER(uctx->directory_table + bytes, &dirh);
 
 		dir_count = dirh.count + 1;
 		TRACE("squashfs_opendir: Read directory header @ byte position " "%d, %d directory entries\n", bytes, dir_count);
@@ -274,7 +273,7 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset, st
 			goto corrupted;
 
 		while (dir_count--) {
-			SQUASHFS_SWAP_DIR_ENTRY(directory_table + bytes, dire);
+			SQUASHFS_SWAP_DIR_ENTRY(uctx->directory_table + bytes, dire);
 
 			bytes += sizeof(*dire);
 
@@ -282,7 +281,7 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset, st
 			if (dire->size > SQUASHFS_NAME_LEN)
 				goto corrupted;
 
-			memcpy(dire->name, directory_table + bytes, dire->size + 1);
+			memcpy(dire->name, uctx->directory_table + bytes, dire->size + 1);
 			dire->name[dire->size + 1] = '\0';
 			TRACE("squashfs_opendir: directory entry %s, inode " "%d:%d, type %d\n", dire->name, dirh.start_block, dire->offset, dire->type);
 			if ((dir->dir_count % DIR_ENT_SIZE) == 0) {
@@ -310,19 +309,19 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset, st
 
 int read_uids_guids_4() {
 	int res, i;
-	int bytes = SQUASHFS_ID_BYTES(sBlk.s.no_ids);
-	int indexes = SQUASHFS_ID_BLOCKS(sBlk.s.no_ids);
+	int bytes = SQUASHFS_ID_BYTES(uctx->sBlk.s.no_ids);
+	int indexes = SQUASHFS_ID_BLOCKS(uctx->sBlk.s.no_ids);
 	long long id_index_table[indexes];
 
-	TRACE("read_uids_guids: no_ids %d\n", sBlk.s.no_ids);
+	TRACE("read_uids_guids: no_ids %d\n", uctx->sBlk.s.no_ids);
 
-	id_table = malloc(bytes);
-	if (id_table == NULL) {
+	uctx->id_table = malloc(bytes);
+	if (uctx->id_table == NULL) {
 		ERROR("read_uids_guids: failed to allocate id table\n");
 		return FALSE;
 	}
 
-	res = read_fs_bytes(fd, sBlk.s.id_table_start, SQUASHFS_ID_BLOCK_BYTES(sBlk.s.no_ids), id_index_table);
+	res = read_fs_bytes(uctx->fd, uctx->sBlk.s.id_table_start, SQUASHFS_ID_BLOCK_BYTES(uctx->sBlk.s.no_ids), id_index_table);
 	if (res == FALSE) {
 		ERROR("read_uids_guids: failed to read id index table\n");
 		return FALSE;
@@ -331,14 +330,14 @@ int read_uids_guids_4() {
 
 	for (i = 0; i < indexes; i++) {
 		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE : bytes & (SQUASHFS_METADATA_SIZE - 1);
-		res = read_block(fd, id_index_table[i], NULL, expected, ((char *)id_table) + i * SQUASHFS_METADATA_SIZE);
+		res = read_block(uctx->fd, id_index_table[i], NULL, expected, ((char *)uctx->id_table) + i * SQUASHFS_METADATA_SIZE);
 		if (res == FALSE) {
 			ERROR("read_uids_guids: failed to read id table block" "\n");
 			return FALSE;
 		}
 	}
 
-	SQUASHFS_INSWAP_INTS(id_table, sBlk.s.no_ids);
+	SQUASHFS_INSWAP_INTS(uctx->id_table, uctx->sBlk.s.no_ids);
 
 	return TRUE;
 }
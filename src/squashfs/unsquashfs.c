@@ -30,6 +30,8 @@
 #include "xattr.h"
 #include "unsquashfs_info.h"
 #include "stdarg.h"
+#include "trace.h"
+#include "util.h"
 
 #ifdef __APPLE__
 #    include <sys/sysctl.h>
@@ -44,43 +46,17 @@
 #include <limits.h>
 #include <ctype.h>
 
-struct cache *fragment_cache, *data_cache;
-struct queue *to_reader, *to_inflate, *to_writer, *from_writer;
-pthread_t *thread, *inflator_thread;
-pthread_mutex_t fragment_mutex;
-
 /* user options that control parallelisation */
 int processors = -1;
 
-struct super_block sBlk;
-squashfs_operations s_ops;
-struct compressor *comp;
-
-int bytes = 0, swap, file_count = 0, dir_count = 0, sym_count = 0, dev_count = 0, fifo_count = 0;
-char *inode_table = NULL, *directory_table = NULL;
-struct hash_table_entry *inode_table_hash[65536], *directory_table_hash[65536];
-int fd;
-unsigned int *uid_table, *guid_table;
-unsigned int cached_frag = SQUASHFS_INVALID_FRAG;
-char *fragment_data;
-char *file_data;
-char *data;
-unsigned int block_size;
-unsigned int block_log;
 int lsonly = FALSE, info = FALSE, force = FALSE, short_ls = TRUE;
 int use_regex = FALSE;
-char **created_inode;
-int root_process;
-int columns;
-int rotate = 0;
-pthread_mutex_t screen_mutex;
-int progress = TRUE, progress_enabled = FALSE;
-unsigned int total_blocks = 0, total_files = 0, total_inodes = 0;
-unsigned int cur_blocks = 0;
-int inode_number = 1;
+int progress = TRUE;
 int no_xattrs = XATTR_DEF;
 int user_xattrs = FALSE;
 
+__thread struct unsquashfs_ctx *uctx;
+
 int lookup_type[] = {
 	0,
 	S_IFDIR,
@@ -131,19 +107,16 @@ void progress_bar(long long current, long long max, int columns);
 void prep_exit() {
 }
 
-void sigwinch_handler() {
+/*
+ * Gets the terminal width for the progress bar, polled by the progress thread
+ * as SIGWINCH belongs to the whole process
+ */
+static int terminal_columns(void) {
 	struct winsize winsize;
 
-	if (ioctl(1, TIOCGWINSZ, &winsize) == -1) {
-		if (isatty(STDOUT_FILENO))
-			ERROR("TIOCGWINSZ ioctl failed, defaulting to 80 " "columns\n");
-		columns = 80;
-	} else
-		columns = winsize.ws_col;
-}
-
-void sigalrm_handler() {
-	rotate = (rotate + 1) % 4;
+	if (ioctl(1, TIOCGWINSZ, &winsize) == -1)
+		return 80;
+	return winsize.ws_col;
 }
 
 int add_overflow(int a, int b) {
@@ -158,6 +131,32 @@ int multiply_overflow(int a, int multiplier) {
 	return (INT_MAX / multiplier) < a;
 }
 
+/*
+ * The threads only act on stop_threads() while they wait, so that they are
+ * never stopped holding a lock or halfway through a block
+ */
+static void unlock_mutex(void *mutex) {
+	pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
+
+static void cancellable_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	int state;
+
+	if (!uctx->failed) {
+		pthread_cleanup_push(unlock_mutex, mutex);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+		pthread_cond_wait(cond, mutex);
+		pthread_setcancelstate(state, NULL);
+		pthread_cleanup_pop(0);
+	}
+
+	// a helper thread gave up, see helper_failed(), nothing will come
+	if (uctx->failed) {
+		pthread_mutex_unlock(mutex);
+		job_exit(1);
+	}
+}
+
 struct queue *queue_init(int size) {
 	struct queue *queue = malloc(sizeof(struct queue));
 
@@ -186,7 +185,7 @@ void queue_put(struct queue *queue, void *data) {
 	pthread_mutex_lock(&queue->mutex);
 
 	while ((nextp = (queue->writep + 1) % queue->size) == queue->readp)
-		pthread_cond_wait(&queue->full, &queue->mutex);
+		cancellable_wait(&queue->full, &queue->mutex);
 
 	queue->data[queue->writep] = data;
 	queue->writep = nextp;
@@ -199,7 +198,7 @@ void *queue_get(struct queue *queue) {
 	pthread_mutex_lock(&queue->mutex);
 
 	while (queue->readp == queue->writep)
-		pthread_cond_wait(&queue->empty, &queue->mutex);
+		cancellable_wait(&queue->empty, &queue->mutex);
 
 	data = queue->data[queue->readp];
 	queue->readp = (queue->readp + 1) % queue->size;
@@ -209,6 +208,15 @@ void *queue_get(struct queue *queue) {
 	return data;
 }
 
+/* once no thread waits on it, the entries still queued are dropped */
+void queue_free(struct queue *queue) {
+	pthread_mutex_destroy(&queue->mutex);
+	pthread_cond_destroy(&queue->empty);
+	pthread_cond_destroy(&queue->full);
+	free(queue->data);
+	free(queue);
+}
+
 void dump_queue(struct queue *queue) {
 	pthread_mutex_lock(&queue->mutex);
 
@@ -343,7 +351,7 @@ struct cache_entry *cache_get(struct cache *cache, long long block, int size) {
 			 */
 			while (cache->free_list == NULL) {
 				cache->wait_free = TRUE;
-				pthread_cond_wait(&cache->wait_for_free, &cache->mutex);
+				cancellable_wait(&cache->wait_for_free, &cache->mutex);
 			}
 			entry = cache->free_list;
 			remove_free_list(cache, entry);
@@ -370,7 +378,7 @@ struct cache_entry *cache_get(struct cache *cache, long long block, int size) {
 		 * decompress threads) decompress the buffer
 		 */
 		pthread_mutex_unlock(&cache->mutex);
-		queue_put(to_reader, entry);
+		queue_put(uctx->to_reader, entry);
 	}
 
 	return entry;
@@ -408,7 +416,7 @@ void cache_block_wait(struct cache_entry *entry) {
 
 	while (entry->pending) {
 		entry->cache->wait_pending = TRUE;
-		pthread_cond_wait(&entry->cache->wait_for_pending, &entry->cache->mutex);
+		cancellable_wait(&entry->cache->wait_for_pending, &entry->cache->mutex);
 	}
 
 	pthread_mutex_unlock(&entry->cache->mutex);
@@ -441,6 +449,24 @@ void cache_block_put(struct cache_entry *entry) {
 	pthread_mutex_unlock(&entry->cache->mutex);
 }
 
+/* once no thread waits on it, every entry allocated is in the hash table */
+void cache_free(struct cache *cache) {
+	struct cache_entry *entry, *next;
+	int i;
+
+	for (i = 0; i < 65536; i++) {
+		for (entry = cache->hash_table[i]; entry; entry = next) {
+			next = entry->hash_next;
+			free(entry->data);
+			free(entry);
+		}
+	}
+	pthread_mutex_destroy(&cache->mutex);
+	pthread_cond_destroy(&cache->wait_for_free);
+	pthread_cond_destroy(&cache->wait_for_pending);
+	free(cache);
+}
+
 void dump_cache(struct cache *cache) {
 	pthread_mutex_lock(&cache->mutex);
 
@@ -593,7 +619,7 @@ int read_block(int fd, long long start, long long *next, int expected, void *blo
 	int offset = 2, res, compressed;
 	int outlen = expected ? expected : SQUASHFS_METADATA_SIZE;
 
-	if (swap) {
+	if (uctx->swap) {
 		if (read_fs_bytes(fd, start, 2, &c_byte) == FALSE)
 			goto failed;
 		c_byte = (c_byte >> 8) | ((c_byte & 0xff) << 8);
@@ -602,7 +628,7 @@ int read_block(int fd, long long start, long long *next, int expected, void *blo
 
 	TRACE("read_block: block @0x%llx, %d %s bytes\n", start, SQUASHFS_COMPRESSED_SIZE(c_byte), SQUASHFS_COMPRESSED(c_byte) ? "compressed" : "uncompressed");
 
-	if (SQUASHFS_CHECK_DATA(sBlk.s.flags))
+	if (SQUASHFS_CHECK_DATA(uctx->sBlk.s.flags))
 		offset = 3;
 
 	compressed = SQUASHFS_COMPRESSED(c_byte);
@@ -624,10 +650,10 @@ int read_block(int fd, long long start, long long *next, int expected, void *blo
 		if (res == FALSE)
 			goto failed;
 
-		res = compressor_uncompress(comp, block, buffer, c_byte, outlen, &error);
+		res = compressor_uncompress(uctx->comp, block, buffer, c_byte, outlen, &error);
 
 		if (res == -1) {
-			ERROR("%s uncompress failed with error code %d\n", comp->name, error);
+			ERROR("%s uncompress failed with error code %d\n", uctx->comp->name, error);
 			goto failed;
 		}
 	} else {
@@ -654,36 +680,6 @@ int read_block(int fd, long long start, long long *next, int expected, void *blo
 	return FALSE;
 }
 
-int read_data_block(long long start, unsigned int size, char *block) {
-	int error, res;
-	int c_byte = SQUASHFS_COMPRESSED_SIZE_BLOCK(size);
-
-	TRACE("read_data_block: block @0x%llx, %d %s bytes\n", start, c_byte, SQUASHFS_COMPRESSED_BLOCK(size) ? "compressed" : "uncompressed");
-
-	if (SQUASHFS_COMPRESSED_BLOCK(size)) {
-		if (read_fs_bytes(fd, start, c_byte, data) == FALSE)
-			goto failed;
-
-		res = compressor_uncompress(comp, block, data, c_byte, block_size, &error);
-
-		if (res == -1) {
-			ERROR("%s uncompress failed with error code %d\n", comp->name, error);
-			goto failed;
-		}
-
-		return res;
-	} else {
-		if (read_fs_bytes(fd, start, c_byte, block) == FALSE)
-			goto failed;
-
-		return c_byte;
-	}
-
- failed:
-	ERROR("read_data_block: failed to read block @0x%llx, size %d\n", start, c_byte);
-	return FALSE;
-}
-
 int read_inode_table(long long start, long long end) {
 	int size = 0, bytes = 0, res;
 
@@ -691,16 +687,16 @@ int read_inode_table(long long start, long long end) {
 
 	while (start < end) {
 		if (size - bytes < SQUASHFS_METADATA_SIZE) {
-			inode_table = realloc(inode_table, size += SQUASHFS_METADATA_SIZE);
-			if (inode_table == NULL) {
+			uctx->inode_table = realloc(uctx->inode_table, size += SQUASHFS_METADATA_SIZE);
+			if (uctx->inode_table == NULL) {
 				ERROR("Out of memory in read_inode_table");
 				goto failed;
 			}
 		}
 
-		add_entry(inode_table_hash, start, bytes);
+		add_entry(uctx->inode_table_hash, start, bytes);
 
-		res = read_block(fd, start, &start, 0, inode_table + bytes);
+		res = read_block(uctx->fd, start, &start, 0, uctx->inode_table + bytes);
 		if (res == 0) {
 			ERROR("read_inode_table: failed to read block\n");
 			goto failed;
@@ -724,7 +720,9 @@ int read_inode_table(long long start, long long end) {
 	return TRUE;
 
  failed:
-	free(inode_table);
+	// the next image reallocates it
+	free(uctx->inode_table);
+	uctx->inode_table = NULL;
 	return FALSE;
 }
 
@@ -738,7 +736,7 @@ int set_attributes(char *pathname, int mode, uid_t uid, gid_t guid, time_t time,
 		return FALSE;
 	}
 
-	if (root_process) {
+	if (uctx->root_process) {
 		if (chown(pathname, uid, guid) == -1) {
 			ERROR("set_attributes: failed to change uid and gids " "on %s, because %s\n", pathname, strerror(errno));
 			return FALSE;
@@ -771,32 +769,29 @@ int write_bytes(int fd, char *buff, int bytes) {
 	return 0;
 }
 
-int lseek_broken = FALSE;
-char *zero_data = NULL;
-
 int write_block(int file_fd, char *buffer, int size, long long hole, int sparse) {
 	off_t off = hole;
 
 	if (hole) {
-		if (sparse && lseek_broken == FALSE) {
+		if (sparse && uctx->lseek_broken == FALSE) {
 			int error = lseek(file_fd, off, SEEK_CUR);
 			if (error == -1)
 				/* failed to seek beyond end of file */
-				lseek_broken = TRUE;
+				uctx->lseek_broken = TRUE;
 		}
 
-		if ((sparse == FALSE || lseek_broken) && zero_data == NULL) {
-			if ((zero_data = malloc(block_size)) == NULL)
+		if ((sparse == FALSE || uctx->lseek_broken) && uctx->zero_data == NULL) {
+			if ((uctx->zero_data = malloc(uctx->block_size)) == NULL)
 				EXIT_UNSQUASH("write_block: failed to alloc " "zero data block\n");
-			memset(zero_data, 0, block_size);
+			memset(uctx->zero_data, 0, uctx->block_size);
 		}
 
-		if (sparse == FALSE || lseek_broken) {
-			int blocks = (hole + block_size - 1) / block_size;
+		if (sparse == FALSE || uctx->lseek_broken) {
+			int blocks = (hole + uctx->block_size - 1) / uctx->block_size;
 			int avail_bytes, i;
 			for (i = 0; i < blocks; i++, hole -= avail_bytes) {
-				avail_bytes = hole > block_size ? block_size : hole;
-				if (write_bytes(file_fd, zero_data, avail_bytes)
+				avail_bytes = hole > uctx->block_size ? uctx->block_size : hole;
+				if (write_bytes(file_fd, uctx->zero_data, avail_bytes)
 					== -1)
 					goto failure;
 			}
@@ -812,22 +807,18 @@ int write_block(int file_fd, char *buffer, int size, long long hole, int sparse)
 	return FALSE;
 }
 
-pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t open_empty = PTHREAD_COND_INITIALIZER;
-int open_unlimited, open_count;
-
 void open_init(int count) {
-	open_count = count;
-	open_unlimited = count == -1;
+	uctx->open_count = count;
+	uctx->open_unlimited = count == -1;
 }
 
 int open_wait(char *pathname, int flags, mode_t mode) {
-	if (!open_unlimited) {
-		pthread_mutex_lock(&open_mutex);
-		while (open_count == 0)
-			pthread_cond_wait(&open_empty, &open_mutex);
-		open_count--;
-		pthread_mutex_unlock(&open_mutex);
+	if (!uctx->open_unlimited) {
+		pthread_mutex_lock(&uctx->open_mutex);
+		while (uctx->open_count == 0)
+			cancellable_wait(&uctx->open_empty, &uctx->open_mutex);
+		uctx->open_count--;
+		pthread_mutex_unlock(&uctx->open_mutex);
 	}
 
 	return open(pathname, flags, mode);
@@ -836,11 +827,11 @@ int open_wait(char *pathname, int flags, mode_t mode) {
 void close_wake(int fd) {
 	close(fd);
 
-	if (!open_unlimited) {
-		pthread_mutex_lock(&open_mutex);
-		open_count++;
-		pthread_cond_signal(&open_empty);
-		pthread_mutex_unlock(&open_mutex);
+	if (!uctx->open_unlimited) {
+		pthread_mutex_lock(&uctx->open_mutex);
+		uctx->open_count++;
+		pthread_cond_signal(&uctx->open_empty);
+		pthread_mutex_unlock(&uctx->open_mutex);
 	}
 }
 
@@ -859,7 +850,7 @@ void queue_file(char *pathname, int file_fd, struct inode *inode) {
 	file->blocks = inode->blocks + (inode->frag_bytes > 0);
 	file->sparse = inode->sparse;
 	file->xattr = inode->xattr;
-	queue_put(to_writer, file);
+	queue_put(uctx->to_writer, file);
 }
 
 void queue_dir(char *pathname, struct dir *dir) {
@@ -874,13 +865,13 @@ void queue_dir(char *pathname, struct dir *dir) {
 	file->time = dir->mtime;
 	file->pathname = strdup(pathname);
 	file->xattr = dir->xattr;
-	queue_put(to_writer, file);
+	queue_put(uctx->to_writer, file);
 }
 
 int write_file(struct inode *inode, char *pathname) {
 	unsigned int file_fd, i;
 	unsigned int *block_list;
-	int file_end = inode->data / block_size;
+	int file_end = inode->data / uctx->block_size;
 	long long start = inode->start;
 
 	TRACE("write_file: regular file, blocks %d\n", inode->blocks);
@@ -895,7 +886,7 @@ int write_file(struct inode *inode, char *pathname) {
 	if (block_list == NULL)
 		EXIT_UNSQUASH("write_file: unable to malloc block list\n");
 
-	s_ops.read_block_list(block_list, inode->block_ptr, inode->blocks);
+	uctx->s_ops.read_block_list(block_list, inode->block_ptr, inode->blocks);
 
 	/*
 	 * the writer thread is queued a squashfs_file structure describing the
@@ -911,14 +902,14 @@ int write_file(struct inode *inode, char *pathname) {
 		if (block == NULL)
 			EXIT_UNSQUASH("write_file: unable to malloc file\n");
 		block->offset = 0;
-		block->size = i == file_end ? inode->data & (block_size - 1) : block_size;
+		block->size = i == file_end ? inode->data & (uctx->block_size - 1) : uctx->block_size;
 		if (block_list[i] == 0)	/* sparse block */
 			block->buffer = NULL;
 		else {
-			block->buffer = cache_get(data_cache, start, block_list[i]);
+			block->buffer = cache_get(uctx->data_cache, start, block_list[i]);
 			start += c_byte;
 		}
-		queue_put(to_writer, block);
+		queue_put(uctx->to_writer, block);
 	}
 
 	if (inode->frag_bytes) {
@@ -928,11 +919,11 @@ int write_file(struct inode *inode, char *pathname) {
 
 		if (block == NULL)
 			EXIT_UNSQUASH("write_file: unable to malloc file\n");
-		s_ops.read_fragment(inode->fragment, &start, &size);
-		block->buffer = cache_get(fragment_cache, start, size);
+		uctx->s_ops.read_fragment(inode->fragment, &start, &size);
+		block->buffer = cache_get(uctx->fragment_cache, start, size);
 		block->offset = inode->offset;
 		block->size = inode->frag_bytes;
-		queue_put(to_writer, block);
+		queue_put(uctx->to_writer, block);
 	}
 
 	free(block_list);
@@ -942,12 +933,12 @@ int write_file(struct inode *inode, char *pathname) {
 int create_inode(char *pathname, struct inode *i) {
 	TRACE("create_inode: pathname %s\n", pathname);
 
-	if (created_inode[i->inode_number - 1]) {
+	if (uctx->created_inode[i->inode_number - 1]) {
 		TRACE("create_inode: hard link\n");
 		if (force)
 			unlink(pathname);
 
-		if (link(created_inode[i->inode_number - 1], pathname) == -1) {
+		if (link(uctx->created_inode[i->inode_number - 1], pathname) == -1) {
 			ERROR("create_inode: failed to create hardlink, " "because %s\n", strerror(errno));
 			return FALSE;
 		}
@@ -961,7 +952,7 @@ int create_inode(char *pathname, struct inode *i) {
 		TRACE("create_inode: regular file, file_size %lld, " "blocks %d\n", i->data, i->blocks);
 
 		if (write_file(i, pathname))
-			file_count++;
+			uctx->file_count++;
 		break;
 	case SQUASHFS_SYMLINK_TYPE:
 	case SQUASHFS_LSYMLINK_TYPE:
@@ -977,12 +968,12 @@ int create_inode(char *pathname, struct inode *i) {
 
 		write_xattr(pathname, i->xattr);
 
-		if (root_process) {
+		if (uctx->root_process) {
 			if (lchown(pathname, i->uid, i->gid) == -1)
 				ERROR("create_inode: failed to change " "uid and gids on %s, because " "%s\n", pathname, strerror(errno));
 		}
 
-		sym_count++;
+		uctx->sym_count++;
 		break;
 	case SQUASHFS_BLKDEV_TYPE:
 	case SQUASHFS_CHRDEV_TYPE:
@@ -991,7 +982,7 @@ int create_inode(char *pathname, struct inode *i) {
 			int chrdev = i->type == SQUASHFS_CHRDEV_TYPE;
 			TRACE("create_inode: dev, rdev 0x%llx\n", i->data);
 
-			if (root_process) {
+			if (uctx->root_process) {
 				if (force)
 					unlink(pathname);
 
@@ -1000,7 +991,7 @@ int create_inode(char *pathname, struct inode *i) {
 					break;
 				}
 				set_attributes(pathname, i->mode, i->uid, i->gid, i->time, i->xattr, TRUE);
-				dev_count++;
+				uctx->dev_count++;
 			} else
 				ERROR("create_inode: could not create %s " "device %s, because you're not " "superuser!\n", chrdev ? "character" : "block", pathname);
 			break;
@@ -1017,7 +1008,7 @@ int create_inode(char *pathname, struct inode *i) {
 			break;
 		}
 		set_attributes(pathname, i->mode, i->uid, i->gid, i->time, i->xattr, TRUE);
-		fifo_count++;
+		uctx->fifo_count++;
 		break;
 	case SQUASHFS_SOCKET_TYPE:
 	case SQUASHFS_LSOCKET_TYPE:
@@ -1029,7 +1020,7 @@ int create_inode(char *pathname, struct inode *i) {
 		return FALSE;
 	}
 
-	created_inode[i->inode_number - 1] = strdup(pathname);
+	uctx->created_inode[i->inode_number - 1] = strdup(pathname);
 
 	return TRUE;
 }
@@ -1041,16 +1032,16 @@ int read_directory_table(long long start, long long end) {
 
 	while (start < end) {
 		if (size - bytes < SQUASHFS_METADATA_SIZE) {
-			directory_table = realloc(directory_table, size += SQUASHFS_METADATA_SIZE);
-			if (directory_table == NULL) {
+			uctx->directory_table = realloc(uctx->directory_table, size += SQUASHFS_METADATA_SIZE);
+			if (uctx->directory_table == NULL) {
 				ERROR("Out of memory in " "read_directory_table\n");
 				goto failed;
 			}
 		}
 
-		add_entry(directory_table_hash, start, bytes);
+		add_entry(uctx->directory_table_hash, start, bytes);
 
-		res = read_block(fd, start, &start, 0, directory_table + bytes);
+		res = read_block(uctx->fd, start, &start, 0, uctx->directory_table + bytes);
 		if (res == 0) {
 			ERROR("read_directory_table: failed to read block\n");
 			goto failed;
@@ -1074,7 +1065,9 @@ int read_directory_table(long long start, long long end) {
 	return TRUE;
 
  failed:
-	free(directory_table);
+	// the next image reallocates it
+	free(uctx->directory_table);
+	uctx->directory_table = NULL;
 	return FALSE;
 }
 
@@ -1239,8 +1232,52 @@ void free_subdir(struct pathnames *paths) {
 	free(paths);
 }
 
+/*
+ * Matches name against the components of one level of the search set,
+ * returns TRUE on a leaf match
+ */
+static int matches_path(struct pathname *path, char *name, struct pathnames **new) {
+	int i;
+
+	for (i = 0; i < path->names; i++) {
+		if (!use_regex && strcmp(path->name[i].name, "**") == 0) {
+			/*
+			 * "**" matches any number of directories: a leaf
+			 * one matches everything, otherwise it stays in
+			 * the search set of the subdirectories, and the
+			 * components following it are tried on this name
+			 */
+			if (path->name[i].paths == NULL)
+				return TRUE;
+			*new = add_subdir(*new, path);
+			if (matches_path(path->name[i].paths, name, new))
+				return TRUE;
+			continue;
+		}
+
+		int match = use_regex ? regexec(path->name[i].preg, name, (size_t) 0,
+										NULL, 0) == 0 : fnmatch(path->name[i].name,
+																name, FNM_PATHNAME | FNM_PERIOD | FNM_EXTMATCH) == 0;
+		if (match && path->name[i].paths == NULL)
+			/*
+			 * match on a leaf component, any subdirectories
+			 * will implicitly match
+			 */
+			return TRUE;
+
+		if (match)
+			/*
+			 * match on a non-leaf component, add any
+			 * subdirectories to the new set of
+			 * subdirectories to scan for this name
+			 */
+			*new = add_subdir(*new, path->name[i].paths);
+	}
+	return FALSE;
+}
+
 int matches(struct pathnames *paths, char *name, struct pathnames **new) {
-	int i, n;
+	int n;
 
 	if (paths == NULL) {
 		*new = NULL;
@@ -1250,27 +1287,13 @@ int matches(struct pathnames *paths, char *name, struct pathnames **new) {
 	*new = init_subdir();
 
 	for (n = 0; n < paths->count; n++) {
-		struct pathname *path = paths->path[n];
-		for (i = 0; i < path->names; i++) {
-			int match = use_regex ? regexec(path->name[i].preg, name, (size_t) 0,
-											NULL, 0) == 0 : fnmatch(path->name[i].name,
-																	name, FNM_PATHNAME | FNM_PERIOD | FNM_EXTMATCH) == 0;
-			if (match && path->name[i].paths == NULL)
-				/*
-				 * match on a leaf component, any subdirectories
-				 * will implicitly match, therefore return an
-				 * empty new search set
-				 */
-				goto empty_set;
-
-			if (match)
-				/*
-				 * match on a non-leaf component, add any
-				 * subdirectories to the new set of
-				 * subdirectories to scan for this name
-				 */
-				*new = add_subdir(*new, path->name[i].paths);
-		}
+		if (matches_path(paths->path[n], name, new))
+			/*
+			 * match on a leaf component, any subdirectories
+			 * will implicitly match, therefore return an
+			 * empty new search set
+			 */
+			goto empty_set;
 	}
 
 	if ((*new)->count == 0) {
@@ -1303,7 +1326,7 @@ void pre_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 	char *name;
 	struct pathnames *new;
 	struct inode *i;
-	struct dir *dir = s_ops.squashfs_opendir(start_block, offset, &i);
+	struct dir *dir = uctx->s_ops.squashfs_opendir(start_block, offset, &i);
 
 	if (dir == NULL)
 		return;
@@ -1326,14 +1349,14 @@ void pre_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 			pre_scan(parent_name, start_block, offset, new);
 		else if (new == NULL) {
 			if (type == SQUASHFS_FILE_TYPE || type == SQUASHFS_LREG_TYPE) {
-				i = s_ops.read_inode(start_block, offset);
-				if (created_inode[i->inode_number - 1] == NULL) {
-					created_inode[i->inode_number - 1] = (char *)i;
-					total_blocks += (i->data + (block_size - 1)) >> block_log;
+				i = uctx->s_ops.read_inode(start_block, offset);
+				if (uctx->created_inode[i->inode_number - 1] == NULL) {
+					uctx->created_inode[i->inode_number - 1] = (char *)i;
+					uctx->total_blocks += (i->data + (uctx->block_size - 1)) >> uctx->block_log;
 				}
-				total_files++;
+				uctx->total_files++;
 			}
-			total_inodes++;
+			uctx->total_inodes++;
 		}
 
 		free_subdir(new);
@@ -1348,7 +1371,7 @@ void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 	char *name;
 	struct pathnames *new;
 	struct inode *i;
-	struct dir *dir = s_ops.squashfs_opendir(start_block, offset, &i);
+	struct dir *dir = uctx->s_ops.squashfs_opendir(start_block, offset, &i);
 
 	if (dir == NULL) {
 		ERROR("dir_scan: failed to read directory %s, skipping\n", parent_name);
@@ -1406,7 +1429,7 @@ void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 		} else if (new == NULL) {
 			update_info(pathname);
 
-			i = s_ops.read_inode(start_block, offset);
+			i = uctx->s_ops.read_inode(start_block, offset);
 
 			if (lsonly || info)
 				print_filename(pathname, i);
@@ -1426,95 +1449,95 @@ void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 		queue_dir(parent_name, dir);
 
 	squashfs_closedir(dir);
-	dir_count++;
+	uctx->dir_count++;
 }
 
 void squashfs_stat(char *source) {
-	time_t mkfs_time = (time_t) sBlk.s.mkfs_time;
+	time_t mkfs_time = (time_t) uctx->sBlk.s.mkfs_time;
 	char *mkfs_str = ctime(&mkfs_time);
 
 #if __BYTE_ORDER == __BIG_ENDIAN
-	printf("Found a valid %sSQUASHFS %d:%d superblock on %s.\n", sBlk.s.s_major == 4 ? "" : swap ? "little endian " : "big endian ", sBlk.s.s_major, sBlk.s.s_minor, source);
+	printf("Found a valid %sSQUASHFS %d:%d superblock on %s.\n", uctx->sBlk.s.s_major == 4 ? "" : uctx->swap ? "little endian " : "big endian ", uctx->sBlk.s.s_major, uctx->sBlk.s.s_minor, source);
 #else
-	printf("Found a valid %sSQUASHFS %d:%d superblock on %s.\n", sBlk.s.s_major == 4 ? "" : swap ? "big endian " : "little endian ", sBlk.s.s_major, sBlk.s.s_minor, source);
+	printf("Found a valid %sSQUASHFS %d:%d superblock on %s.\n", uctx->sBlk.s.s_major == 4 ? "" : uctx->swap ? "big endian " : "little endian ", uctx->sBlk.s.s_major, uctx->sBlk.s.s_minor, source);
 #endif
 
 	printf("Creation or last append time %s", mkfs_str ? mkfs_str : "failed to get time\n");
-	printf("Filesystem size %.2f Kbytes (%.2f Mbytes)\n", sBlk.s.bytes_used / 1024.0, sBlk.s.bytes_used / (1024.0 * 1024.0));
+	printf("Filesystem size %.2f Kbytes (%.2f Mbytes)\n", uctx->sBlk.s.bytes_used / 1024.0, uctx->sBlk.s.bytes_used / (1024.0 * 1024.0));
 
-	if (sBlk.s.s_major == 4) {
-		printf("Compression %s\n", comp->name);
+	if (uctx->sBlk.s.s_major == 4) {
+		printf("Compression %s\n", uctx->comp->name);
 
-		if (SQUASHFS_COMP_OPTS(sBlk.s.flags)) {
+		if (SQUASHFS_COMP_OPTS(uctx->sBlk.s.flags)) {
 			char buffer[SQUASHFS_METADATA_SIZE] __attribute__ ((aligned));
 			int bytes;
 
-			bytes = read_block(fd, sizeof(sBlk.s), NULL, 0, buffer);
+			bytes = read_block(uctx->fd, sizeof(uctx->sBlk.s), NULL, 0, buffer);
 			if (bytes == 0) {
 				ERROR("Failed to read compressor options\n");
 				return;
 			}
 
-			compressor_display_options(comp, buffer, bytes);
+			compressor_display_options(uctx->comp, buffer, bytes);
 		}
 	}
 
-	printf("Block size %d\n", sBlk.s.block_size);
-	printf("Filesystem is %sexportable via NFS\n", SQUASHFS_EXPORTABLE(sBlk.s.flags) ? "" : "not ");
-	printf("Inodes are %scompressed\n", SQUASHFS_UNCOMPRESSED_INODES(sBlk.s.flags) ? "un" : "");
-	printf("Data is %scompressed\n", SQUASHFS_UNCOMPRESSED_DATA(sBlk.s.flags) ? "un" : "");
+	printf("Block size %d\n", uctx->sBlk.s.block_size);
+	printf("Filesystem is %sexportable via NFS\n", SQUASHFS_EXPORTABLE(uctx->sBlk.s.flags) ? "" : "not ");
+	printf("Inodes are %scompressed\n", SQUASHFS_UNCOMPRESSED_INODES(uctx->sBlk.s.flags) ? "un" : "");
+	printf("Data is %scompressed\n", SQUASHFS_UNCOMPRESSED_DATA(uctx->sBlk.s.flags) ? "un" : "");
 
-	if (sBlk.s.s_major > 1) {
-		if (SQUASHFS_NO_FRAGMENTS(sBlk.s.flags))
+	if (uctx->sBlk.s.s_major > 1) {
+		if (SQUASHFS_NO_FRAGMENTS(uctx->sBlk.s.flags))
 			printf("Fragments are not stored\n");
 		else {
-			printf("Fragments are %scompressed\n", SQUASHFS_UNCOMPRESSED_FRAGMENTS(sBlk.s.flags) ? "un" : "");
-			printf("Always-use-fragments option is %sspecified\n", SQUASHFS_ALWAYS_FRAGMENTS(sBlk.s.flags) ? "" : "not ");
+			printf("Fragments are %scompressed\n", SQUASHFS_UNCOMPRESSED_FRAGMENTS(uctx->sBlk.s.flags) ? "un" : "");
+			printf("Always-use-fragments option is %sspecified\n", SQUASHFS_ALWAYS_FRAGMENTS(uctx->sBlk.s.flags) ? "" : "not ");
 		}
 	}
 
-	if (sBlk.s.s_major == 4) {
-		if (SQUASHFS_NO_XATTRS(sBlk.s.flags))
+	if (uctx->sBlk.s.s_major == 4) {
+		if (SQUASHFS_NO_XATTRS(uctx->sBlk.s.flags))
 			printf("Xattrs are not stored\n");
 		else
-			printf("Xattrs are %scompressed\n", SQUASHFS_UNCOMPRESSED_XATTRS(sBlk.s.flags) ? "un" : "");
+			printf("Xattrs are %scompressed\n", SQUASHFS_UNCOMPRESSED_XATTRS(uctx->sBlk.s.flags) ? "un" : "");
 	}
 
-	if (sBlk.s.s_major < 4)
-		printf("Check data is %spresent in the filesystem\n", SQUASHFS_CHECK_DATA(sBlk.s.flags) ? "" : "not ");
+	if (uctx->sBlk.s.s_major < 4)
+		printf("Check data is %spresent in the filesystem\n", SQUASHFS_CHECK_DATA(uctx->sBlk.s.flags) ? "" : "not ");
 
-	if (sBlk.s.s_major > 1)
-		printf("Duplicates are %sremoved\n", SQUASHFS_DUPLICATES(sBlk.s.flags) ? "" : "not ");
+	if (uctx->sBlk.s.s_major > 1)
+		printf("Duplicates are %sremoved\n", SQUASHFS_DUPLICATES(uctx->sBlk.s.flags) ? "" : "not ");
 	else
 		printf("Duplicates are removed\n");
 
-	if (sBlk.s.s_major > 1)
-		printf("Number of fragments %d\n", sBlk.s.fragments);
+	if (uctx->sBlk.s.s_major > 1)
+		printf("Number of fragments %d\n", uctx->sBlk.s.fragments);
 
-	printf("Number of inodes %d\n", sBlk.s.inodes);
+	printf("Number of inodes %d\n", uctx->sBlk.s.inodes);
 
-	if (sBlk.s.s_major == 4)
-		printf("Number of ids %d\n", sBlk.s.no_ids);
+	if (uctx->sBlk.s.s_major == 4)
+		printf("Number of ids %d\n", uctx->sBlk.s.no_ids);
 	else {
-		printf("Number of uids %d\n", sBlk.no_uids);
-		printf("Number of gids %d\n", sBlk.no_guids);
+		printf("Number of uids %d\n", uctx->sBlk.no_uids);
+		printf("Number of gids %d\n", uctx->sBlk.no_guids);
 	}
 
-	TRACE("sBlk.s.inode_table_start 0x%llx\n", sBlk.s.inode_table_start);
-	TRACE("sBlk.s.directory_table_start 0x%llx\n", sBlk.s.directory_table_start);
+	TRACE("sBlk.s.inode_table_start 0x%llx\n", uctx->sBlk.s.inode_table_start);
+	TRACE("sBlk.s.directory_table_start 0x%llx\n", uctx->sBlk.s.directory_table_start);
 
-	if (sBlk.s.s_major > 1)
-		TRACE("sBlk.s.fragment_table_start 0x%llx\n\n", sBlk.s.fragment_table_start);
+	if (uctx->sBlk.s.s_major > 1)
+		TRACE("sBlk.s.fragment_table_start 0x%llx\n\n", uctx->sBlk.s.fragment_table_start);
 
-	if (sBlk.s.s_major > 2)
-		TRACE("sBlk.s.lookup_table_start 0x%llx\n\n", sBlk.s.lookup_table_start);
+	if (uctx->sBlk.s.s_major > 2)
+		TRACE("sBlk.s.lookup_table_start 0x%llx\n\n", uctx->sBlk.s.lookup_table_start);
 
-	if (sBlk.s.s_major == 4) {
-		TRACE("sBlk.s.id_table_start 0x%llx\n", sBlk.s.id_table_start);
-		TRACE("sBlk.s.xattr_id_table_start 0x%llx\n", sBlk.s.xattr_id_table_start);
+	if (uctx->sBlk.s.s_major == 4) {
+		TRACE("sBlk.s.id_table_start 0x%llx\n", uctx->sBlk.s.id_table_start);
+		TRACE("sBlk.s.xattr_id_table_start 0x%llx\n", uctx->sBlk.s.xattr_id_table_start);
 	} else {
-		TRACE("sBlk.uid_start 0x%llx\n", sBlk.uid_start);
-		TRACE("sBlk.guid_start 0x%llx\n", sBlk.guid_start);
+		TRACE("sBlk.uid_start 0x%llx\n", uctx->sBlk.uid_start);
+		TRACE("sBlk.guid_start 0x%llx\n", uctx->sBlk.guid_start);
 	}
 }
 
@@ -1538,15 +1561,15 @@ int check_compression(struct compressor *comp) {
 	 * compressor because some compression options may be mandatory
 	 * for some compressors.
 	 */
-	if (SQUASHFS_COMP_OPTS(sBlk.s.flags)) {
-		bytes = read_block(fd, sizeof(sBlk.s), NULL, 0, buffer);
+	if (SQUASHFS_COMP_OPTS(uctx->sBlk.s.flags)) {
+		bytes = read_block(uctx->fd, sizeof(uctx->sBlk.s), NULL, 0, buffer);
 		if (bytes == 0) {
 			ERROR("Failed to read compressor options\n");
 			return 0;
 		}
 	}
 
-	res = compressor_check_options(comp, sBlk.s.block_size, buffer, bytes);
+	res = compressor_check_options(comp, uctx->sBlk.s.block_size, buffer, bytes);
 
 	return res != -1;
 }
@@ -1558,23 +1581,23 @@ int read_super(char *source) {
 	/*
 	 * Try to read a Squashfs 4 superblock
 	 */
-	read_fs_bytes(fd, SQUASHFS_START, sizeof(struct squashfs_super_block), &sBlk_4);
-	swap = sBlk_4.s_magic != SQUASHFS_MAGIC;
+	read_fs_bytes(uctx->fd, SQUASHFS_START, sizeof(struct squashfs_super_block), &sBlk_4);
+	uctx->swap = sBlk_4.s_magic != SQUASHFS_MAGIC;
 	SQUASHFS_INSWAP_SUPER_BLOCK(&sBlk_4);
 
 	if (sBlk_4.s_magic == SQUASHFS_MAGIC && sBlk_4.s_major == 4 && sBlk_4.s_minor == 0) {
-		s_ops.squashfs_opendir = squashfs_opendir_4;
-		s_ops.read_fragment = read_fragment_4;
-		s_ops.read_fragment_table = read_fragment_table_4;
-		s_ops.read_block_list = read_block_list_2;
-		s_ops.read_inode = read_inode_4;
-		s_ops.read_uids_guids = read_uids_guids_4;
-		memcpy(&sBlk, &sBlk_4, sizeof(sBlk_4));
+		uctx->s_ops.squashfs_opendir = squashfs_opendir_4;
+		uctx->s_ops.read_fragment = read_fragment_4;
+		uctx->s_ops.read_fragment_table = read_fragment_table_4;
+		uctx->s_ops.read_block_list = read_block_list_2;
+		uctx->s_ops.read_inode = read_inode_4;
+		uctx->s_ops.read_uids_guids = read_uids_guids_4;
+		memcpy(&uctx->sBlk, &sBlk_4, sizeof(sBlk_4));
 
 		/*
 		 * Check the compression type
 		 */
-		comp = lookup_compressor_id(sBlk.s.compression);
+		uctx->comp = lookup_compressor_id(uctx->sBlk.s.compression);
 		return TRUE;
 	}
 
@@ -1582,80 +1605,80 @@ int read_super(char *source) {
 	 * Not a Squashfs 4 superblock, try to read a squashfs 3 superblock
 	 * (compatible with 1 and 2 filesystems)
 	 */
-	read_fs_bytes(fd, SQUASHFS_START, sizeof(squashfs_super_block_3), &sBlk_3);
+	read_fs_bytes(uctx->fd, SQUASHFS_START, sizeof(squashfs_super_block_3), &sBlk_3);
 
 	/*
 	 * Check it is a SQUASHFS superblock
 	 */
-	swap = 0;
+	uctx->swap = 0;
 	if (sBlk_3.s_magic != SQUASHFS_MAGIC) {
 		if (sBlk_3.s_magic == SQUASHFS_MAGIC_SWAP) {
 			squashfs_super_block_3 sblk;
 			ERROR("Reading a different endian SQUASHFS filesystem " "on %s\n", source);
 			SQUASHFS_SWAP_SUPER_BLOCK_3(&sblk, &sBlk_3);
 			memcpy(&sBlk_3, &sblk, sizeof(squashfs_super_block_3));
-			swap = 1;
+			uctx->swap = 1;
 		} else {
 			//ERROR("Can't find a SQUASHFS superblock on %s\n", source);
 			goto failed_mount;
 		}
 	}
 
-	sBlk.s.s_magic = sBlk_3.s_magic;
-	sBlk.s.inodes = sBlk_3.inodes;
-	sBlk.s.mkfs_time = sBlk_3.mkfs_time;
-	sBlk.s.block_size = sBlk_3.block_size;
-	sBlk.s.fragments = sBlk_3.fragments;
-	sBlk.s.block_log = sBlk_3.block_log;
-	sBlk.s.flags = sBlk_3.flags;
-	sBlk.s.s_major = sBlk_3.s_major;
-	sBlk.s.s_minor = sBlk_3.s_minor;
-	sBlk.s.root_inode = sBlk_3.root_inode;
-	sBlk.s.bytes_used = sBlk_3.bytes_used;
-	sBlk.s.inode_table_start = sBlk_3.inode_table_start;
-	sBlk.s.directory_table_start = sBlk_3.directory_table_start;
-	sBlk.s.fragment_table_start = sBlk_3.fragment_table_start;
-	sBlk.s.lookup_table_start = sBlk_3.lookup_table_start;
-	sBlk.no_uids = sBlk_3.no_uids;
-	sBlk.no_guids = sBlk_3.no_guids;
-	sBlk.uid_start = sBlk_3.uid_start;
-	sBlk.guid_start = sBlk_3.guid_start;
-	sBlk.s.xattr_id_table_start = SQUASHFS_INVALID_BLK;
+	uctx->sBlk.s.s_magic = sBlk_3.s_magic;
+	uctx->sBlk.s.inodes = sBlk_3.inodes;
+	uctx->sBlk.s.mkfs_time = sBlk_3.mkfs_time;
+	uctx->sBlk.s.block_size = sBlk_3.block_size;
+	uctx->sBlk.s.fragments = sBlk_3.fragments;
+	uctx->sBlk.s.block_log = sBlk_3.block_log;
+	uctx->sBlk.s.flags = sBlk_3.flags;
+	uctx->sBlk.s.s_major = sBlk_3.s_major;
+	uctx->sBlk.s.s_minor = sBlk_3.s_minor;
+	uctx->sBlk.s.root_inode = sBlk_3.root_inode;
+	uctx->sBlk.s.bytes_used = sBlk_3.bytes_used;
+	uctx->sBlk.s.inode_table_start = sBlk_3.inode_table_start;
+	uctx->sBlk.s.directory_table_start = sBlk_3.directory_table_start;
+	uctx->sBlk.s.fragment_table_start = sBlk_3.fragment_table_start;
+	uctx->sBlk.s.lookup_table_start = sBlk_3.lookup_table_start;
+	uctx->sBlk.no_uids = sBlk_3.no_uids;
+	uctx->sBlk.no_guids = sBlk_3.no_guids;
+	uctx->sBlk.uid_start = sBlk_3.uid_start;
+	uctx->sBlk.guid_start = sBlk_3.guid_start;
+	uctx->sBlk.s.xattr_id_table_start = SQUASHFS_INVALID_BLK;
 
 	/* Check the MAJOR & MINOR versions */
-	if (sBlk.s.s_major == 1 || sBlk.s.s_major == 2) {
-		sBlk.s.bytes_used = sBlk_3.bytes_used_2;
-		sBlk.uid_start = sBlk_3.uid_start_2;
-		sBlk.guid_start = sBlk_3.guid_start_2;
-		sBlk.s.inode_table_start = sBlk_3.inode_table_start_2;
-		sBlk.s.directory_table_start = sBlk_3.directory_table_start_2;
-
-		if (sBlk.s.s_major == 1) {
-			sBlk.s.block_size = sBlk_3.block_size_1;
-			sBlk.s.fragment_table_start = sBlk.uid_start;
-			s_ops.squashfs_opendir = squashfs_opendir_1;
-			s_ops.read_fragment_table = read_fragment_table_1;
-			s_ops.read_block_list = read_block_list_1;
-			s_ops.read_inode = read_inode_1;
-			s_ops.read_uids_guids = read_uids_guids_1;
+	if (uctx->sBlk.s.s_major == 1 || uctx->sBlk.s.s_major == 2) {
+		uctx->sBlk.s.bytes_used = sBlk_3.bytes_used_2;
+		uctx->sBlk.uid_start = sBlk_3.uid_start_2;
+		uctx->sBlk.guid_start = sBlk_3.guid_start_2;
+		uctx->sBlk.s.inode_table_start = sBlk_3.inode_table_start_2;
+		uctx->sBlk.s.directory_table_start = sBlk_3.directory_table_start_2;
+
+		if (uctx->sBlk.s.s_major == 1) {
+			uctx->sBlk.s.block_size = sBlk_3.block_size_1;
+			uctx->sBlk.s.fragment_table_start = uctx->sBlk.uid_start;
+			uctx->s_ops.squashfs_opendir = squashfs_opendir_1;
+			uctx->s_ops.read_fragment_table = read_fragment_table_1;
+			uctx->s_ops.read_block_list = read_block_list_1;
+			uctx->s_ops.read_inode = read_inode_1;
+			uctx->s_ops.read_uids_guids = read_uids_guids_1;
 		} else {
-			sBlk.s.fragment_table_start = sBlk_3.fragment_table_start_2;
-			s_ops.squashfs_opendir = squashfs_opendir_1;
-			s_ops.read_fragment = read_fragment_2;
-			s_ops.read_fragment_table = read_fragment_table_2;
-			s_ops.read_block_list = read_block_list_2;
-			s_ops.read_inode = read_inode_2;
-			s_ops.read_uids_guids = read_uids_guids_1;
+			uctx->sBlk.s.fragment_table_start = sBlk_3.fragment_table_start_2;
+			uctx->s_ops.squashfs_opendir = squashfs_opendir_1;
+			uctx->s_ops.read_fragment = read_fragment_2;
+			uctx->s_ops.read_fragment_table = read_fragment_table_2;
+			uctx->s_ops.read_block_list = read_block_list_2;
+			uctx->s_ops.read_inode = read_inode_2;
+			uctx->s_ops.read_uids_guids = read_uids_guids_1;
 		}
-	} else if (sBlk.s.s_major == 3) {
-		s_ops.squashfs_opendir = squashfs_opendir_3;
-		s_ops.read_fragment = read_fragment_3;
-		s_ops.read_fragment_table = read_fragment_table_3;
-		s_ops.read_block_list = read_block_list_2;
-		s_ops.read_inode = read_inode_3;
-		s_ops.read_uids_guids = read_uids_guids_1;
+	} else if (uctx->sBlk.s.s_major == 3) {
+		uctx->s_ops.squashfs_opendir = squashfs_opendir_3;
+		uctx->s_ops.read_fragment = read_fragment_3;
+		uctx->s_ops.read_fragment_table = read_fragment_table_3;
+		uctx->s_ops.read_block_list = read_block_list_2;
+		uctx->s_ops.read_inode = read_inode_3;
+		uctx->s_ops.read_uids_guids = read_uids_guids_1;
 	} else {
-		ERROR("Filesystem on %s is (%d:%d), ", source, sBlk.s.s_major, sBlk.s.s_minor);
+		ERROR("Filesystem on %s is (%d:%d), ", source, uctx->sBlk.s.s_major, uctx->sBlk.s.s_minor);
 		ERROR("which is a later filesystem version than I support!\n");
 		goto failed_mount;
 	}
@@ -1663,7 +1686,7 @@ int read_super(char *source) {
 	/*
 	 * 1.x, 2.x and 3.x filesystems use gzip compression.
 	 */
-	comp = lookup_compressor("gzip");
+	uctx->comp = lookup_compressor("gzip");
 	return TRUE;
 
  failed_mount:
@@ -1721,14 +1744,61 @@ struct pathname *process_extract_files(struct pathname *path, char *filename) {
 	return path;
 }
 
+static void wake_queue(struct queue *queue) {
+	pthread_mutex_lock(&queue->mutex);
+	pthread_cond_broadcast(&queue->empty);
+	pthread_cond_broadcast(&queue->full);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+static void wake_cache(struct cache *cache) {
+	pthread_mutex_lock(&cache->mutex);
+	pthread_cond_broadcast(&cache->wait_for_free);
+	pthread_cond_broadcast(&cache->wait_for_pending);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ * Runs the calling helper thread for ctx. If it gives up (job_exit()), it
+ * goes back to jmp and returns helper_failed() instead of ending the process
+ */
+static void helper_start(struct unsquashfs_ctx *ctx, jmp_buf *jmp) {
+	uctx = ctx;
+	job_catch(jmp);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+}
+
+/*
+ * A helper thread gave up: the threads waiting on the queues and caches wake
+ * up and give up too, and unsquashfs() fails on its thread
+ */
+static void *helper_failed(void) {
+	uctx->failed = TRUE;
+	wake_queue(uctx->to_reader);
+	wake_queue(uctx->to_inflate);
+	wake_queue(uctx->to_writer);
+	wake_queue(uctx->from_writer);
+	wake_cache(uctx->data_cache);
+	wake_cache(uctx->fragment_cache);
+	pthread_mutex_lock(&uctx->open_mutex);
+	pthread_cond_broadcast(&uctx->open_empty);
+	pthread_mutex_unlock(&uctx->open_mutex);
+	return NULL;
+}
+
 /*
  * reader thread.  This thread processes read requests queued by the
  * cache_get() routine.
  */
 void *reader(void *arg) {
+	jmp_buf jmp;
+
+	if (setjmp(jmp) != 0)
+		return helper_failed();
+	helper_start(arg, &jmp);
 	while (1) {
-		struct cache_entry *entry = queue_get(to_reader);
-		int res = read_fs_bytes(fd, entry->block,
+		struct cache_entry *entry = queue_get(uctx->to_reader);
+		int res = read_fs_bytes(uctx->fd, entry->block,
 								SQUASHFS_COMPRESSED_SIZE_BLOCK(entry->size),
 								entry->data);
 
@@ -1737,7 +1807,7 @@ void *reader(void *arg) {
 			 * queue successfully read block to the inflate
 			 * thread(s) for further processing
 			 */
-			queue_put(to_inflate, entry);
+			queue_put(uctx->to_inflate, entry);
 		else
 			/*
 			 * block has either been successfully read and is
@@ -1755,16 +1825,21 @@ void *reader(void *arg) {
  */
 void *writer(void *arg) {
 	int i;
+	jmp_buf jmp;
 
+	if (setjmp(jmp) != 0)
+		return helper_failed();
+	helper_start(arg, &jmp);
 	while (1) {
-		struct squashfs_file *file = queue_get(to_writer);
+		struct squashfs_file *file = queue_get(uctx->to_writer);
 		int file_fd;
 		long long hole = 0;
 		int failed = FALSE;
 		int error;
+		struct trace_span span;
 
 		if (file == NULL) {
-			queue_put(from_writer, NULL);
+			queue_put(uctx->from_writer, NULL);
 			continue;
 		} else if (file->fd == -1) {
 			/* write attributes for directory file->pathname */
@@ -1777,9 +1852,10 @@ void *writer(void *arg) {
 		TRACE("writer: regular file, blocks %d\n", file->blocks);
 
 		file_fd = file->fd;
+		trace_begin(&span, TRACE_SQUASHFS_WRITE, file->pathname);
 
-		for (i = 0; i < file->blocks; i++, cur_blocks++) {
-			struct file_entry *block = queue_get(to_writer);
+		for (i = 0; i < file->blocks; i++, uctx->cur_blocks++) {
+			struct file_entry *block = queue_get(uctx->to_writer);
 
 			if (block->buffer == 0) {	/* sparse file */
 				hole += block->size;
@@ -1830,9 +1906,11 @@ void *writer(void *arg) {
 		}
 
 		close_wake(file_fd);
-		if (failed == FALSE)
-			set_attributes(file->pathname, file->mode, file->uid, file->gid, file->time, file->xattr, force);
-		else {
+		trace_end(&span, 0, failed ? 0 : file->file_size);
+		if (failed == FALSE) {
+			uctx->total_bytes_written += file->file_size;
+			set_attributes(file->pathname, file->mode, file->uid, file->gid, file->time, file->xattr, TRUE);
+		} else {
 			ERROR("Failed to write %s, skipping\n", file->pathname);
 			unlink(file->pathname);
 		}
@@ -1846,16 +1924,24 @@ void *writer(void *arg) {
  * decompress thread.  This decompresses buffers queued by the read thread
  */
 void *inflator(void *arg) {
-	char tmp[block_size];
+	struct unsquashfs_ctx *ctx = arg;
+	char tmp[ctx->block_size];
+	jmp_buf jmp;
 
+	if (setjmp(jmp) != 0)
+		return helper_failed();
+	helper_start(ctx, &jmp);
 	while (1) {
-		struct cache_entry *entry = queue_get(to_inflate);
+		struct cache_entry *entry = queue_get(uctx->to_inflate);
 		int error, res;
+		struct trace_span span;
 
-		res = compressor_uncompress(comp, tmp, entry->data, SQUASHFS_COMPRESSED_SIZE_BLOCK(entry->size), block_size, &error);
+		trace_begin(&span, TRACE_SQUASHFS_INFLATE, NULL);
+		res = compressor_uncompress(uctx->comp, tmp, entry->data, SQUASHFS_COMPRESSED_SIZE_BLOCK(entry->size), uctx->block_size, &error);
+		trace_end(&span, SQUASHFS_COMPRESSED_SIZE_BLOCK(entry->size), (res == -1) ? 0 : res);
 
 		if (res == -1)
-			ERROR("%s uncompress failed with error code %d\n", comp->name, error);
+			ERROR("%s uncompress failed with error code %d\n", uctx->comp->name, error);
 		else
 			memcpy(entry->data, tmp, res);
 
@@ -1868,55 +1954,59 @@ void *inflator(void *arg) {
 	}
 }
 
+/*
+ * progress thread. Redraws the bar and turns the spinner every 250ms, and
+ * follows the terminal width, without the signals the whole process shares
+ */
 void *progress_thread(void *arg) {
 	struct timespec requested_time, remaining;
-	struct itimerval itimerval;
-	struct winsize winsize;
-
-	if (ioctl(1, TIOCGWINSZ, &winsize) == -1) {
-		if (isatty(STDOUT_FILENO))
-			ERROR("TIOCGWINSZ ioctl failed, defaulting to 80 " "columns\n");
-		columns = 80;
-	} else
-		columns = winsize.ws_col;
-	signal(SIGWINCH, sigwinch_handler);
-	signal(SIGALRM, sigalrm_handler);
-
-	itimerval.it_value.tv_sec = 0;
-	itimerval.it_value.tv_usec = 250000;
-	itimerval.it_interval.tv_sec = 0;
-	itimerval.it_interval.tv_usec = 250000;
-	setitimer(ITIMER_REAL, &itimerval, NULL);
+	jmp_buf jmp;
 
+	if (setjmp(jmp) != 0)
+		return helper_failed();
+	helper_start(arg, &jmp);
 	requested_time.tv_sec = 0;
 	requested_time.tv_nsec = 250000000;
 
 	while (1) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 		int res = nanosleep(&requested_time, &remaining);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
 		if (res == -1 && errno != EINTR)
 			EXIT_UNSQUASH("nanosleep failed in progress thread\n");
 
-		if (progress_enabled) {
-			pthread_mutex_lock(&screen_mutex);
-			progress_bar(sym_count + dev_count + fifo_count + cur_blocks, total_inodes - total_files + total_blocks, columns);
-			pthread_mutex_unlock(&screen_mutex);
-		}
+		pthread_mutex_lock(&uctx->screen_mutex);
+		uctx->columns = terminal_columns();
+		uctx->rotate = (uctx->rotate + 1) % 4;
+		if (uctx->progress_enabled)
+			progress_bar(uctx->sym_count + uctx->dev_count + uctx->fifo_count + uctx->cur_blocks, uctx->total_inodes - uctx->total_files + uctx->total_blocks, uctx->columns);
+		pthread_mutex_unlock(&uctx->screen_mutex);
 	}
 }
 
+/*
+ * Stops the threads of initialise_threads(), once the image is written or
+ * when its extraction gives up, so that none is left on the next image
+ */
+static void stop_threads(void) {
+	int i;
+
+	for (i = 0; i < uctx->nthreads; i++)
+		pthread_cancel(uctx->thread[i]);
+	for (i = 0; i < uctx->nthreads; i++)
+		pthread_join(uctx->thread[i], NULL);
+	uctx->nthreads = 0;
+	free(uctx->thread);
+	uctx->thread = NULL;
+}
+
 void initialise_threads(int fragment_buffer_size, int data_buffer_size) {
 	struct rlimit rlim;
 	int i, max_files, res;
+	int inflators = processors;
 	sigset_t sigmask, old_mask;
 
-	/* block SIGQUIT and SIGHUP, these are handled by the info thread */
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, SIGQUIT);
-	sigaddset(&sigmask, SIGHUP);
-	if (pthread_sigmask(SIG_BLOCK, &sigmask, NULL) == -1)
-		EXIT_UNSQUASH("Failed to set signal mask in initialise_threads" "\n");
-
 	/*
 	 * temporarily block these signals so the created sub-threads will
 	 * ignore them, ensuring the main thread handles them
@@ -1927,10 +2017,10 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size) {
 	if (pthread_sigmask(SIG_BLOCK, &sigmask, &old_mask) == -1)
 		EXIT_UNSQUASH("Failed to set signal mask in initialise_threads" "\n");
 
-	if (processors == -1) {
+	if (inflators == -1) {
 #if !defined(linux) && !defined(__CYGWIN__)
 		int mib[2];
-		size_t len = sizeof(processors);
+		size_t len = sizeof(inflators);
 
 		mib[0] = CTL_HW;
 #    ifdef HW_AVAILCPU
@@ -1939,22 +2029,21 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size) {
 		mib[1] = HW_NCPU;
 #    endif
 
-		if (sysctl(mib, 2, &processors, &len, NULL, 0) == -1) {
+		if (sysctl(mib, 2, &inflators, &len, NULL, 0) == -1) {
 			ERROR("Failed to get number of available processors.  " "Defaulting to 1\n");
-			processors = 1;
+			inflators = 1;
 		}
 #else
-		processors = sysconf(_SC_NPROCESSORS_ONLN);
+		inflators = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
 	}
 
-	if (add_overflow(processors, 3) || multiply_overflow(processors + 3, sizeof(pthread_t)))
+	if (add_overflow(inflators, 3) || multiply_overflow(inflators + 3, sizeof(pthread_t)))
 		EXIT_UNSQUASH("Processors too large\n");
 
-	thread = malloc((3 + processors) * sizeof(pthread_t));
-	if (thread == NULL)
+	uctx->thread = malloc((3 + inflators) * sizeof(pthread_t));
+	if (uctx->thread == NULL)
 		EXIT_UNSQUASH("Out of memory allocating thread descriptors\n");
-	inflator_thread = &thread[3];
 
 	/*
 	 * dimensioning the to_reader and to_inflate queues.  The size of
@@ -2055,9 +2144,9 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size) {
 		if (add_overflow(data_buffer_size, max_files) || add_overflow(data_buffer_size, max_files * 2))
 			EXIT_UNSQUASH("Data queue size is too large\n");
 
-		to_reader = queue_init(max_files + data_buffer_size);
-		to_inflate = queue_init(max_files + data_buffer_size);
-		to_writer = queue_init(max_files * 2 + data_buffer_size);
+		uctx->to_reader = queue_init(max_files + data_buffer_size);
+		uctx->to_inflate = queue_init(max_files + data_buffer_size);
+		uctx->to_writer = queue_init(max_files * 2 + data_buffer_size);
 	} else {
 		int all_buffers_size;
 
@@ -2069,82 +2158,91 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size) {
 		if (add_overflow(all_buffers_size, all_buffers_size))
 			EXIT_UNSQUASH("Data and fragment queues combined are" " too large\n");
 
-		to_reader = queue_init(all_buffers_size);
-		to_inflate = queue_init(all_buffers_size);
-		to_writer = queue_init(all_buffers_size * 2);
+		uctx->to_reader = queue_init(all_buffers_size);
+		uctx->to_inflate = queue_init(all_buffers_size);
+		uctx->to_writer = queue_init(all_buffers_size * 2);
 	}
 
-	from_writer = queue_init(1);
+	uctx->from_writer = queue_init(1);
 
-	fragment_cache = cache_init(block_size, fragment_buffer_size);
-	data_cache = cache_init(block_size, data_buffer_size);
-	pthread_create(&thread[0], NULL, reader, NULL);
-	pthread_create(&thread[1], NULL, writer, NULL);
-	pthread_create(&thread[2], NULL, progress_thread, NULL);
-	init_info();
-	pthread_mutex_init(&fragment_mutex, NULL);
+	uctx->fragment_cache = cache_init(uctx->block_size, fragment_buffer_size);
+	uctx->data_cache = cache_init(uctx->block_size, data_buffer_size);
+	if (pthread_create(&uctx->thread[0], NULL, reader, uctx) != 0)
+		EXIT_UNSQUASH("Failed to create thread\n");
+	uctx->nthreads = 1;
+	if (pthread_create(&uctx->thread[1], NULL, writer, uctx) != 0)
+		EXIT_UNSQUASH("Failed to create thread\n");
+	uctx->nthreads = 2;
+	if (pthread_create(&uctx->thread[2], NULL, progress_thread, uctx) != 0)
+		EXIT_UNSQUASH("Failed to create thread\n");
+	uctx->nthreads = 3;
 
-	for (i = 0; i < processors; i++) {
-		if (pthread_create(&inflator_thread[i], NULL, inflator, NULL) != 0)
+	for (i = 0; i < inflators; i++) {
+		if (pthread_create(&uctx->thread[3 + i], NULL, inflator, uctx) != 0)
 			EXIT_UNSQUASH("Failed to create thread\n");
+		uctx->nthreads++;
 	}
 
-	printf("Parallel unsquashfs: Using %d processor%s\n", processors, processors == 1 ? "" : "s");
+	printf("Parallel unsquashfs: Using %d processor%s\n", inflators, inflators == 1 ? "" : "s");
 
 	if (pthread_sigmask(SIG_SETMASK, &old_mask, NULL) == -1)
 		EXIT_UNSQUASH("Failed to set signal mask in initialise_threads" "\n");
 }
 
 void enable_progress_bar() {
-	pthread_mutex_lock(&screen_mutex);
-	progress_enabled = progress;
-	pthread_mutex_unlock(&screen_mutex);
+	pthread_mutex_lock(&uctx->screen_mutex);
+	uctx->progress_enabled = progress;
+	pthread_mutex_unlock(&uctx->screen_mutex);
 }
 
 void disable_progress_bar() {
-	pthread_mutex_lock(&screen_mutex);
-	if (progress_enabled) {
-		progress_bar(sym_count + dev_count + fifo_count + cur_blocks, total_inodes - total_files + total_blocks, columns);
+	pthread_mutex_lock(&uctx->screen_mutex);
+	if (uctx->progress_enabled) {
+		progress_bar(uctx->sym_count + uctx->dev_count + uctx->fifo_count + uctx->cur_blocks, uctx->total_inodes - uctx->total_files + uctx->total_blocks, uctx->columns);
 		printf("\n");
 	}
-	progress_enabled = FALSE;
-	pthread_mutex_unlock(&screen_mutex);
+	uctx->progress_enabled = FALSE;
+	pthread_mutex_unlock(&uctx->screen_mutex);
 }
 
+/* outside unsquashfs(), e.g. from is_squashfs(), there's no bar to break */
 void progressbar_error(char *fmt, ...) {
 	va_list ap;
 
-	pthread_mutex_lock(&screen_mutex);
-
-	if (progress_enabled)
-		fprintf(stderr, "\n");
+	if (uctx) {
+		pthread_mutex_lock(&uctx->screen_mutex);
+		if (uctx->progress_enabled)
+			fprintf(stderr, "\n");
+	}
 
 	va_start(ap, fmt);
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
 
-	pthread_mutex_unlock(&screen_mutex);
+	if (uctx)
+		pthread_mutex_unlock(&uctx->screen_mutex);
 }
 
 void progressbar_info(char *fmt, ...) {
 	va_list ap;
 
-	pthread_mutex_lock(&screen_mutex);
-
-	if (progress_enabled)
-		printf("\n");
+	if (uctx) {
+		pthread_mutex_lock(&uctx->screen_mutex);
+		if (uctx->progress_enabled)
+			printf("\n");
+	}
 
 	va_start(ap, fmt);
 	vprintf(fmt, ap);
 	va_end(ap);
 
-	pthread_mutex_unlock(&screen_mutex);
+	if (uctx)
+		pthread_mutex_unlock(&uctx->screen_mutex);
 }
 
 void progress_bar(long long current, long long max, int columns) {
 	char rotate_list[] = { '|', '/', '-', '\\' };
 	int max_digits, used, hashes, spaces;
-	static int tty = -1;
 
 	if (max == 0)
 		return;
@@ -2157,11 +2255,9 @@ void progress_bar(long long current, long long max, int columns) {
 	if ((current > max) || (columns - used < 0))
 		return;
 
-	if (tty == -1)
-		tty = isatty(STDOUT_FILENO);
-	if (!tty) {
-		static long long previous = -1;
-
+	if (uctx->tty == -1)
+		uctx->tty = isatty(STDOUT_FILENO);
+	if (!uctx->tty) {
 		/*
 		 * Updating much more frequently than this results in huge
 		 * log files.
@@ -2169,9 +2265,9 @@ void progress_bar(long long current, long long max, int columns) {
 		if ((current % 100) != 0 && current != max)
 			return;
 		/* Don't update just to rotate the spinner. */
-		if (current == previous)
+		if (current == uctx->previous)
 			return;
-		previous = current;
+		uctx->previous = current;
 	}
 
 	printf("\r[");
@@ -2179,7 +2275,7 @@ void progress_bar(long long current, long long max, int columns) {
 	while (hashes--)
 		putchar('=');
 
-	putchar(rotate_list[rotate]);
+	putchar(rotate_list[uctx->rotate]);
 
 	while (spaces--)
 		putchar(' ');
@@ -2238,33 +2334,147 @@ int parse_number(char *arg, int *res) {
 		"\n");\
 	printf("GNU General Public License for more details.\n");
 
-int is_squashfs(char *filename) {
-	if ((fd = open(filename, O_RDONLY)) == -1) {
-		ERROR("Could not open %s, because %s\n", filename, strerror(errno));
+/*
+ * Checks the superblock of a mapped file, as read_super() would accept it
+ * Nothing is read from the file nor stored in the globals, so probes can run side by side
+ */
+int is_squashfs_mem(MFILE *file) {
+	uint8_t *data = mdata(file, uint8_t);
+	uint32_t magic;
+	unsigned int major, minor;
+	if (msize(file) < 0x67 || !memcmp(&data[0x64], "cdx", 3))
 		return FALSE;
+	memcpy(&magic, &data[SQUASHFS_START], sizeof(magic));
+
+	// s_major and s_minor are at the same offset in the 1.x-3.x and 4.0 superblocks
+	if (magic == SQUASHFS_MAGIC) {
+		major = data[SQUASHFS_START + 28] | data[SQUASHFS_START + 29] << 8;
+		minor = data[SQUASHFS_START + 30] | data[SQUASHFS_START + 31] << 8;
+		return (major == 4 && minor == 0) || (major >= 1 && major <= 3);
+	} else if (magic == SQUASHFS_MAGIC_SWAP) {
+		// other endian, only 1.x-3.x
+		major = data[SQUASHFS_START + 28] << 8 | data[SQUASHFS_START + 29];
+		return major >= 1 && major <= 3;
 	}
-	char *buffer = (char *)malloc(sizeof(char) * 0x67);
-	if (buffer == NULL) {
-		printf("Memory allocation error!\n");
-		return FALSE;
+	return FALSE;
+}
+
+/* allocates the state of one image, see unsquashfs_ctx_free() */
+static struct unsquashfs_ctx *unsquashfs_ctx_new(void) {
+	struct unsquashfs_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+
+	ctx->fd = -1;
+	ctx->inode_number = 1;
+	ctx->tty = -1;
+	ctx->previous = -1;
+	ctx->columns = 80;
+	pthread_mutex_init(&ctx->screen_mutex, NULL);
+	pthread_mutex_init(&ctx->open_mutex, NULL);
+	pthread_cond_init(&ctx->open_empty, NULL);
+	return ctx;
+}
+
+static void free_hash_table(struct hash_table_entry *hash_table[]) {
+	struct hash_table_entry *entry, *next;
+	int i;
+
+	for (i = 0; i < 65536; i++) {
+		for (entry = hash_table[i]; entry; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
 	}
-	int result = read(fd, buffer, 0x67);
-	if (result != 0x67) {
-		printf("File reading error!\n");
+}
+
+/* frees what the image read, once no thread of it runs, with uctx still ctx */
+static void unsquashfs_ctx_free(struct unsquashfs_ctx *ctx) {
+	unsigned int i;
+
+	if (ctx->fd != -1)
+		close(ctx->fd);
+
+	if (ctx->created_inode) {
+		// pre_scan() only marks the inodes, with the inode being read
+		for (i = 0; i < ctx->sBlk.s.inodes; i++) {
+			if (ctx->created_inode[i] != (char *)&ctx->inode)
+				free(ctx->created_inode[i]);
+		}
+		free(ctx->created_inode);
+	}
+
+	if (ctx->fragment_cache)
+		cache_free(ctx->fragment_cache);
+	if (ctx->data_cache)
+		cache_free(ctx->data_cache);
+	if (ctx->to_reader)
+		queue_free(ctx->to_reader);
+	if (ctx->to_inflate)
+		queue_free(ctx->to_inflate);
+	if (ctx->to_writer)
+		queue_free(ctx->to_writer);
+	if (ctx->from_writer)
+		queue_free(ctx->from_writer);
+
+	free_hash_table(ctx->inode_table_hash);
+	free_hash_table(ctx->directory_table_hash);
+	free(ctx->inode_table);
+	free(ctx->directory_table);
+	free(ctx->uid_table);	// guid_table points into it
+	free(ctx->id_table);
+	free(ctx->fragment_table);
+	free(ctx->zero_data);
+	free(ctx->pathname);
+	free_xattrs();
+
+	pthread_mutex_destroy(&ctx->screen_mutex);
+	pthread_mutex_destroy(&ctx->open_mutex);
+	pthread_cond_destroy(&ctx->open_empty);
+	free(ctx);
+}
+
+int is_squashfs(char *filename) {
+	struct unsquashfs_ctx *ctx, *prev = uctx;
+	char buffer[0x67];
+	int result;
+
+	if ((ctx = unsquashfs_ctx_new()) == NULL) {
+		printf("Memory allocation error!\n");
 		return FALSE;
 	}
-	result = memcmp(&buffer[0x64], "cdx", 3);
-	free(buffer);
+	uctx = ctx;
 
-	if (!result)
-		return FALSE;
+	if ((ctx->fd = open(filename, O_RDONLY)) == -1) {
+		ERROR("Could not open %s, because %s\n", filename, strerror(errno));
+		result = FALSE;
+	} else if (read(ctx->fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+		printf("File reading error!\n");
+		result = FALSE;
+	} else if (!memcmp(&buffer[0x64], "cdx", 3))
+		result = FALSE;
+	else
+		result = read_super(filename);
 
-	result = read_super(filename);
-	close(fd);
+	unsquashfs_ctx_free(ctx);
+	uctx = prev;
 	return result;
 }
 
-int unsquashfs(char *squashfs, char *dest) {
+/* stops the threads before anything they use goes */
+static void unsquashfs_cleanup(void *arg) {
+	struct unsquashfs_ctx *prev = arg;
+
+	stop_threads();
+	unsquashfs_ctx_free(uctx);
+	uctx = prev;
+}
+
+/*
+ * Extracts a squashfs image to dest
+ * Only the files matching extract (see matches()) are written, all of them if it's NULL
+ */
+int unsquashfs(char *squashfs, char *dest, const char *extract) {
 	int i, stat_sys = FALSE, version = FALSE;
 	int n;
 	struct pathnames *paths = NULL;
@@ -2272,11 +2482,23 @@ int unsquashfs(char *squashfs, char *dest) {
 	long long directory_table_end;
 	int fragment_buffer_size = FRAGMENT_BUFFER_DEFAULT;
 	int data_buffer_size = DATA_BUFFER_DEFAULT;
+	struct trace_span span;
+	struct job_cleanup cleanup;
+	struct unsquashfs_ctx *ctx, *prev = uctx;
 
-	pthread_mutex_init(&screen_mutex, NULL);
-	root_process = geteuid() == 0;
-	if (root_process)
-		umask(0);
+	if ((ctx = unsquashfs_ctx_new()) == NULL) {
+		ERROR("Out of memory allocating the unsquashfs state\n");
+		job_exit(1);
+	}
+	uctx = ctx;
+	// if the extraction gives up, its threads are stopped before the caller goes on
+	job_push_cleanup(&cleanup, unsquashfs_cleanup, prev);
+
+	/*
+	 * No umask(0), which is the whole process's: every file written gets
+	 * its mode set explicitly by set_attributes()
+	 */
+	uctx->root_process = geteuid() == 0;
 
 #ifdef SQUASHFS_TRACE
 	/*
@@ -2287,37 +2509,38 @@ int unsquashfs(char *squashfs, char *dest) {
 	progress = FALSE;
 #endif
 
-	if ((fd = open(squashfs, O_RDONLY)) == -1) {
+	if ((uctx->fd = open(squashfs, O_RDONLY)) == -1) {
 		ERROR("Could not open %s, because %s\n", squashfs, strerror(errno));
-		exit(1);
+		job_exit(1);
 	}
 
 	if (read_super(squashfs) == FALSE)
-		exit(1);
+		job_exit(1);
+	trace_begin(&span, TRACE_SQUASHFS, squashfs);
 
 	if (stat_sys) {
 		squashfs_stat(squashfs);
 		exit(0);
 	}
 
-	if (!check_compression(comp))
-		exit(1);
+	if (!check_compression(uctx->comp))
+		job_exit(1);
 
-	block_size = sBlk.s.block_size;
-	block_log = sBlk.s.block_log;
+	uctx->block_size = uctx->sBlk.s.block_size;
+	uctx->block_log = uctx->sBlk.s.block_log;
 
 	/*
 	 * Sanity check block size and block log.
 	 *
 	 * Check they're within correct limits
 	 */
-	if (block_size > SQUASHFS_FILE_MAX_SIZE || block_log > SQUASHFS_FILE_MAX_LOG)
+	if (uctx->block_size > SQUASHFS_FILE_MAX_SIZE || uctx->block_log > SQUASHFS_FILE_MAX_LOG)
 		EXIT_UNSQUASH("Block size or block_log too large." "  File system is corrupt.\n");
 
 	/*
 	 * Check block_size and block_log match
 	 */
-	if (block_size != (1 << block_log))
+	if (uctx->block_size != (1 << uctx->block_log))
 		EXIT_UNSQUASH("Block size and block_log do not match." "  File system is corrupt.\n");
 
 	/*
@@ -2327,83 +2550,81 @@ int unsquashfs(char *squashfs, char *dest) {
 	 * In doing so, check that the user supplied values do not
 	 * overflow a signed int
 	 */
-	if (shift_overflow(fragment_buffer_size, 20 - block_log))
+	if (shift_overflow(fragment_buffer_size, 20 - uctx->block_log))
 		EXIT_UNSQUASH("Fragment queue size is too large\n");
 	else
-		fragment_buffer_size <<= 20 - block_log;
+		fragment_buffer_size <<= 20 - uctx->block_log;
 
-	if (shift_overflow(data_buffer_size, 20 - block_log))
+	if (shift_overflow(data_buffer_size, 20 - uctx->block_log))
 		EXIT_UNSQUASH("Data queue size is too large\n");
 	else
-		data_buffer_size <<= 20 - block_log;
+		data_buffer_size <<= 20 - uctx->block_log;
 
 	initialise_threads(fragment_buffer_size, data_buffer_size);
 
-	fragment_data = malloc(block_size);
-	if (fragment_data == NULL)
-		EXIT_UNSQUASH("failed to allocate fragment_data\n");
-
-	file_data = malloc(block_size);
-	if (file_data == NULL)
-		EXIT_UNSQUASH("failed to allocate file_data");
-
-	data = malloc(block_size);
-	if (data == NULL)
-		EXIT_UNSQUASH("failed to allocate data\n");
-
-	created_inode = malloc(sBlk.s.inodes * sizeof(char *));
-	if (created_inode == NULL)
+	uctx->created_inode = malloc(uctx->sBlk.s.inodes * sizeof(char *));
+	if (uctx->created_inode == NULL)
 		EXIT_UNSQUASH("failed to allocate created_inode\n");
 
-	memset(created_inode, 0, sBlk.s.inodes * sizeof(char *));
+	memset(uctx->created_inode, 0, uctx->sBlk.s.inodes * sizeof(char *));
 
-	if (s_ops.read_uids_guids() == FALSE)
+	if (uctx->s_ops.read_uids_guids() == FALSE)
 		EXIT_UNSQUASH("failed to uid/gid table\n");
 
-	if (s_ops.read_fragment_table(&directory_table_end) == FALSE)
+	if (uctx->s_ops.read_fragment_table(&directory_table_end) == FALSE)
 		EXIT_UNSQUASH("failed to read fragment table\n");
 
-	if (read_inode_table(sBlk.s.inode_table_start, sBlk.s.directory_table_start) == FALSE)
+	if (read_inode_table(uctx->sBlk.s.inode_table_start, uctx->sBlk.s.directory_table_start) == FALSE)
 		EXIT_UNSQUASH("failed to read inode table\n");
 
-	if (read_directory_table(sBlk.s.directory_table_start, directory_table_end) == FALSE)
+	if (read_directory_table(uctx->sBlk.s.directory_table_start, directory_table_end) == FALSE)
 		EXIT_UNSQUASH("failed to read directory table\n");
 
 	if (no_xattrs)
-		sBlk.s.xattr_id_table_start = SQUASHFS_INVALID_BLK;
+		uctx->sBlk.s.xattr_id_table_start = SQUASHFS_INVALID_BLK;
 
-	if (read_xattrs_from_disk(fd, &sBlk.s) == 0)
+	if (read_xattrs_from_disk(uctx->fd, &uctx->sBlk.s) == 0)
 		EXIT_UNSQUASH("failed to read the xattr table\n");
 
+	if (extract != NULL) {
+		char *target = strdup(extract);
+		path = add_path(path, target, target);
+		free(target);
+	}
+
 	if (path) {
 		paths = init_subdir();
 		paths = add_subdir(paths, path);
 	}
 
-	pre_scan(dest, SQUASHFS_INODE_BLK(sBlk.s.root_inode), SQUASHFS_INODE_OFFSET(sBlk.s.root_inode), paths);
+	pre_scan(dest, SQUASHFS_INODE_BLK(uctx->sBlk.s.root_inode), SQUASHFS_INODE_OFFSET(uctx->sBlk.s.root_inode), paths);
 
-	memset(created_inode, 0, sBlk.s.inodes * sizeof(char *));
-	inode_number = 1;
+	memset(uctx->created_inode, 0, uctx->sBlk.s.inodes * sizeof(char *));
+	uctx->inode_number = 1;
 
-	printf("%d inodes (%d blocks) to write\n\n", total_inodes, total_inodes - total_files + total_blocks);
+	printf("%d inodes (%d blocks) to write\n\n", uctx->total_inodes, uctx->total_inodes - uctx->total_files + uctx->total_blocks);
 
 	enable_progress_bar();
 
-	dir_scan(dest, SQUASHFS_INODE_BLK(sBlk.s.root_inode), SQUASHFS_INODE_OFFSET(sBlk.s.root_inode), paths);
-
-	queue_put(to_writer, NULL);
-	queue_get(from_writer);
+	dir_scan(dest, SQUASHFS_INODE_BLK(uctx->sBlk.s.root_inode), SQUASHFS_INODE_OFFSET(uctx->sBlk.s.root_inode), paths);
 
+	queue_put(uctx->to_writer, NULL);
+	queue_get(uctx->from_writer);
+	if (uctx->failed)
+		EXIT_UNSQUASH("a worker thread failed\n");
+	trace_end(&span, uctx->sBlk.s.bytes_used, uctx->total_bytes_written);
 	disable_progress_bar();
 
 	if (!lsonly) {
 		printf("\n");
-		printf("created %d files\n", file_count);
-		printf("created %d directories\n", dir_count);
-		printf("created %d symlinks\n", sym_count);
-		printf("created %d devices\n", dev_count);
-		printf("created %d fifos\n", fifo_count);
+		printf("created %d files\n", uctx->file_count);
+		printf("created %d directories\n", uctx->dir_count);
+		printf("created %d symlinks\n", uctx->sym_count);
+		printf("created %d devices\n", uctx->dev_count);
+		printf("created %d fifos\n", uctx->fifo_count);
 	}
 
+	job_pop_cleanup(&cleanup);
+	unsquashfs_cleanup(prev);
 	return 0;
 }
@@ -22,118 +22,26 @@
  * unsquashfs_info.c
  */
 
-#include <pthread.h>
-#include <sys/ioctl.h>
-#include <unistd.h>
-#include <signal.h>
-#include <sys/time.h>
-#include <stdio.h>
-#include <math.h>
-#include <stdarg.h>
-#include <errno.h>
 #include <stdlib.h>
-#include <dirent.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <string.h>
 
 #include "squashfs_fs.h"
 #include "unsquashfs.h"
 #include "error.h"
 
-#if defined(__CYGWIN__) || defined(__APPLE__)
-#	define sigtimedwait(a,b,c) sigwaitinfo(a,b)
-#endif
-
-#ifdef __APPLE__
-#	define sigwaitinfo(a,b) sigwait(a, b)
-#endif
-
-static int silent = 0;
-char *pathname = NULL;
-
-pthread_t info_thread;
-
+/*
+ * The file being written, uctx's. There's no SIGQUIT/SIGHUP thread to print
+ * it: signals are the whole process's, and several images may be extracted
+ */
 void disable_info() {
-	if (pathname)
-		free(pathname);
+	if (uctx->pathname)
+		free(uctx->pathname);
 
-	pathname = NULL;
+	uctx->pathname = NULL;
 }
 
 void update_info(char *name) {
-	if (pathname)
-		free(pathname);
-
-	pathname = name;
-}
-
-void dump_state() {
-	disable_progress_bar();
-
-	printf("Queue and cache status dump\n");
-	printf("===========================\n");
-
-	printf("file buffer read queue (main thread -> reader thread)\n");
-	dump_queue(to_reader);
-
-	printf("file buffer decompress queue (reader thread -> inflate" " thread(s))\n");
-	dump_queue(to_inflate);
-
-	printf("file buffer write queue (main thread -> writer thread)\n");
-	dump_queue(to_writer);
-
-	printf("\nbuffer cache (uncompressed blocks and compressed blocks " "'in flight')\n");
-	dump_cache(data_cache);
-
-	printf("fragment buffer cache (uncompressed frags and compressed" " frags 'in flight')\n");
-	dump_cache(fragment_cache);
-
-	enable_progress_bar();
-}
-
-void *info_thrd(void *arg) {
-	sigset_t sigmask;
-	struct timespec timespec = {.tv_sec = 1,.tv_nsec = 0 };
-	int sig, waiting = 0;
-
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, SIGQUIT);
-	sigaddset(&sigmask, SIGHUP);
-
-	while (1) {
-		if (waiting)
-			sig = sigtimedwait(&sigmask, NULL, &timespec);
-		else
-			sig = sigwaitinfo(&sigmask, NULL);
-
-		if (sig == -1) {
-			switch (errno) {
-			case EAGAIN:
-				/* interval timed out */
-				waiting = 0;
-				/* FALLTHROUGH */
-			case EINTR:
-				/* if waiting, the wait will be longer, but
-				   that's OK */
-				continue;
-			default:
-				BAD_ERROR("sigtimedwait/sigwaitinfo failed " "because %s\n", strerror(errno));
-			}
-		}
-
-		if (sig == SIGQUIT && !waiting) {
-			if (pathname)
-				INFO("%s\n", pathname);
-
-			/* set one second interval period, if ^\ received
-			   within then, dump queue and cache status */
-			waiting = 1;
-		} else
-			dump_state();
-	}
-}
+	if (uctx->pathname)
+		free(uctx->pathname);
 
-void init_info() {
-	pthread_create(&info_thread, NULL, info_thrd, NULL);
+	uctx->pathname = name;
 }
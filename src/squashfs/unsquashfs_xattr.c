@@ -29,18 +29,14 @@
 
 #define NOSPACE_MAX 10
 
-extern int root_process;
 extern int user_xattrs;
 
 void write_xattr(char *pathname, unsigned int xattr) {
 	unsigned int count;
 	struct xattr_list *xattr_list;
 	int i;
-	static int nonsuper_error = FALSE;
-	static int ignore_xattrs = FALSE;
-	static int nospace_error = 0;
 
-	if (ignore_xattrs || xattr == SQUASHFS_INVALID_XATTR || sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
+	if (uctx->ignore_xattrs || xattr == SQUASHFS_INVALID_XATTR || uctx->sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
 		return;
 
 	xattr_list = get_xattr(xattr, &count, 1);
@@ -55,7 +51,7 @@ void write_xattr(char *pathname, unsigned int xattr) {
 		if (user_xattrs && prefix != SQUASHFS_XATTR_USER)
 			continue;
 
-		if (root_process || prefix == SQUASHFS_XATTR_USER) {
+		if (uctx->root_process || prefix == SQUASHFS_XATTR_USER) {
 			int res = lsetxattr(pathname, xattr_list[i].full_name,
 								xattr_list[i].value, xattr_list[i].vsize, 0);
 
@@ -72,9 +68,9 @@ void write_xattr(char *pathname, unsigned int xattr) {
 					ERROR("write_xattr: failed to write " "xattr %s for file %s because " "extended attributes are not " "supported by the destination " "filesystem\n", xattr_list[i].full_name, pathname);
 					ERROR("Ignoring xattrs in " "filesystem\n");
 					ERROR("To avoid this error message, " "specify -no-xattrs\n");
-					ignore_xattrs = TRUE;
+					uctx->ignore_xattrs = TRUE;
 				} else if ((errno == ENOSPC || errno == EDQUOT)
-						   && nospace_error < NOSPACE_MAX) {
+						   && uctx->nospace_error < NOSPACE_MAX) {
 					/*
 					 * Many filesystems like ext2/3/4 have
 					 * limits on the amount of xattr
@@ -86,12 +82,12 @@ void write_xattr(char *pathname, unsigned int xattr) {
 					 * then suppress the error messsage
 					 */
 					ERROR("write_xattr: failed to write " "xattr %s for file %s because " "no extended attribute space " "remaining (per file or " "filesystem limit)\n", xattr_list[i].full_name, pathname);
-					if (++nospace_error == NOSPACE_MAX)
+					if (++uctx->nospace_error == NOSPACE_MAX)
 						ERROR("%d of these errors " "printed, further error " "messages of this type " "are suppressed!\n", NOSPACE_MAX);
 				} else
 					ERROR("write_xattr: failed to write " "xattr %s for file %s because " "%s\n", xattr_list[i].full_name, pathname, strerror(errno));
 			}
-		} else if (nonsuper_error == FALSE) {
+		} else if (uctx->nonsuper_error == FALSE) {
 			/*
 			 * if extract user xattrs only then
 			 * error message is suppressed, if not
@@ -102,7 +98,7 @@ void write_xattr(char *pathname, unsigned int xattr) {
 			ERROR("write_xattr: could not write xattr %s " "for file %s because you're not " "superuser!\n", xattr_list[i].full_name, pathname);
 			ERROR("write_xattr: to avoid this error message, either" " specify -user-xattrs, -no-xattrs, or run as " "superuser!\n");
 			ERROR("Further error messages of this type are " "suppressed!\n");
-			nonsuper_error = TRUE;
+			uctx->nonsuper_error = TRUE;
 		}
 	}
 
@@ -4,9 +4,11 @@
 #include <string.h>
 #include <inttypes.h>
 #include <openssl/aes.h>
+#include "mfile.h"
+#include "util.h"
 
 #define TS_PACKET_SIZE 192
-AES_KEY AESkey;
+__thread AES_KEY AESkey; // set by setKey() for the conversion that follows on the same thread
 
 void setKey() {
 	FILE *keyFile = fopen("dvr", "r");
@@ -259,20 +261,17 @@ void convertSTR2TS(char *inFilename, char *outFilename, int notOverwrite) {
 */
 
 void processPIF(const char *filename, char *dest_file) {
-	FILE *file = fopen(filename, "r");
+	MFILE *file = mopen(filename, O_RDONLY);
 	if (file == NULL) {
 		printf("Can't open file %s\n", filename);
-		exit(1);
+		job_exit(1);
 	}
-	fseek(file, 0, SEEK_END);
-	int filesize = ftell(file);
-	rewind(file);
+	off_t filesize = msize(file);
 
 	int append = 0;
-	char *buffer = malloc(filesize);
-	int read = fread(buffer, 1, filesize, file);
-	if (read == filesize) {
-		int i;
+	char *buffer = mdata(file, char);
+	if (buffer != NULL) {
+		off_t i;
 		for (i = 0; i < (filesize - 5); i++) {
 			if (!memcmp(&buffer[i], "/mnt/", 5) && !memcmp(&buffer[i + strlen(&buffer[i]) - 3], "STR", 3)) {
 				printf("Converting file: %s\n", strrchr(&buffer[i], '/') + 1);
@@ -281,6 +280,5 @@ void processPIF(const char *filename, char *dest_file) {
 			}
 		}
 	}
-	fclose(file);
-	free(buffer);
+	mclose(file);
 }
@@ -48,7 +48,8 @@ struct symfile_header {
 	uint32_t tail_size;
 }__attribute__((packed));
 
-struct sym_table sym_table = {
+// per thread, symfile_write_idc runs on the thread that loaded it
+__thread struct sym_table sym_table = {
 	.n_symbols = 0,
 	.sym_entry = NULL,
 	.hash = NULL,
@@ -58,6 +59,18 @@ struct sym_table sym_table = {
 	.sym_name = NULL
 };
 
+/*
+ * Checks the header and size of a mapped SYM file
+ */
+int is_symfile_mem(MFILE *file) {
+	struct symfile_header *header = mdata(file, struct symfile_header);
+	return (
+		msize(file) >= sizeof(*header) &&
+		header->magic == MAGIC &&
+		(header->size + sizeof(*header)) == (uint32_t) msize(file)
+	);
+}
+
 int symfile_load(const char *fname) {
 	int fd = -1;
 	struct stat st_buf;
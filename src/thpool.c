@@ -0,0 +1,385 @@
+/*
+	A minimal pthread work distributor
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "thpool.h"
+#include "util.h"
+
+struct thpool_job {
+	thpool_work_t work;
+	void *arg;
+	unsigned int count;
+	unsigned int next;
+	int failed; // an item gave up, the caller gives up too
+	pthread_mutex_t lock;
+};
+
+struct thpool_worker {
+	struct thpool_job *job;
+	unsigned int id;
+};
+
+/*
+ * Gets the number of online CPUs (at least 1)
+ */
+unsigned int thpool_ncpus(void){
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n < 1) ? 1 : (unsigned int)n;
+}
+
+static void *thpool_thread(void *param){
+	struct thpool_worker *self = (struct thpool_worker *)param;
+	struct thpool_job *job = self->job;
+	unsigned int index;
+	jmp_buf jmp;
+	jmp_buf *prev = job_catch(&jmp);
+
+	if(setjmp(jmp) != 0){
+		// the item gave up (job_exit()), the others aren't started
+		pthread_mutex_lock(&job->lock);
+		job->failed = 1;
+		job->next = job->count;
+		pthread_mutex_unlock(&job->lock);
+		job_catch(prev);
+		return NULL;
+	}
+
+	while(1){
+		pthread_mutex_lock(&job->lock);
+		index = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		if(index >= job->count)
+			break;
+		job->work(job->arg, self->id, index);
+	}
+	job_catch(prev);
+	return NULL;
+}
+
+/*
+ * Calls work() for every index in [0, count) using up to nthreads threads
+ * Items are handed out in order, but may complete in any order
+ * If an item gives up (job_exit()), the calling thread gives up in turn once
+ * the threads are done, so that no thread ends the process
+ */
+int thpool_for(unsigned int count, unsigned int nthreads, thpool_work_t work, void *arg){
+	unsigned int i, started = 0;
+
+	if(nthreads > count)
+		nthreads = count;
+	if(nthreads < 1)
+		nthreads = 1;
+
+	struct thpool_job job = {
+		.work = work,
+		.arg = arg,
+		.count = count,
+		.next = 0,
+		.failed = 0
+	};
+	pthread_mutex_init(&job.lock, NULL);
+
+	struct thpool_worker *workers = calloc(nthreads, sizeof(*workers));
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	if(workers == NULL || threads == NULL){
+		free(workers);
+		free(threads);
+		pthread_mutex_destroy(&job.lock);
+		return -1;
+	}
+
+	for(i=0; i<nthreads; i++){
+		workers[i].job = &job;
+		workers[i].id = i;
+		// the calling thread is worker #0
+		if(i > 0 && pthread_create(&threads[i], NULL, thpool_thread, &workers[i]) != 0)
+			break;
+		started++;
+	}
+
+	thpool_thread(&workers[0]);
+
+	for(i=1; i<started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&job.lock);
+	free(workers);
+	free(threads);
+	if(job.failed)
+		job_exit(EXIT_FAILURE);
+	return 0;
+}
+
+/*
+ * Work-stealing pool: every worker owns a deque of tasks.
+ * A worker runs its newest task first (depth first, so nested work finishes early)
+ * and steals the oldest task of another worker when it runs dry.
+ */
+struct thpool_task {
+	thpool_task_t task;
+	void *arg;
+};
+
+struct thpool_deque {
+	struct thpool_task *tasks;
+	unsigned int head, tail, cap;
+	pthread_mutex_t lock;
+};
+
+struct thpool_member {
+	struct thpool *pool;
+	unsigned int id;
+};
+
+struct thpool {
+	unsigned int nthreads;
+	unsigned int started;
+	struct thpool_deque *queues;
+	pthread_t *threads;
+	struct thpool_member *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond; // signaled when a task is queued
+	pthread_cond_t idle_cond; // signaled when the last pending task completes
+	unsigned int queued; // submitted, not yet taken
+	unsigned int pending; // submitted, not yet completed
+	unsigned int next; // round robin target for submissions from outside the pool
+	int quit;
+};
+
+// the pool and worker the current thread belongs to, if any
+static __thread struct thpool *thpool_self;
+static __thread unsigned int thpool_self_id;
+
+static int thpool_push(struct thpool_deque *q, thpool_task_t task, void *arg){
+	pthread_mutex_lock(&q->lock);
+	if(q->tail == q->cap){
+		if(q->head > 0){
+			memmove(q->tasks, &q->tasks[q->head], (q->tail - q->head) * sizeof(*q->tasks));
+			q->tail -= q->head;
+			q->head = 0;
+		} else {
+			unsigned int cap = (q->cap > 0) ? q->cap * 2 : 16;
+			struct thpool_task *tasks = realloc(q->tasks, cap * sizeof(*tasks));
+			if(tasks == NULL){
+				pthread_mutex_unlock(&q->lock);
+				return -1;
+			}
+			q->tasks = tasks;
+			q->cap = cap;
+		}
+	}
+	q->tasks[q->tail].task = task;
+	q->tasks[q->tail].arg = arg;
+	q->tail++;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/*
+ * Takes a task from the back (owner) or the front (thief) of a deque
+ */
+static int thpool_take(struct thpool_deque *q, int steal, struct thpool_task *out){
+	int found = 0;
+	pthread_mutex_lock(&q->lock);
+	if(q->head < q->tail){
+		if(steal)
+			*out = q->tasks[q->head++];
+		else
+			*out = q->tasks[--q->tail];
+		if(q->head == q->tail)
+			q->head = q->tail = 0;
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static int thpool_next_task(struct thpool *pool, unsigned int id, struct thpool_task *out){
+	unsigned int i;
+	if(thpool_take(&pool->queues[id], 0, out))
+		return 1;
+	for(i=1; i<pool->nthreads; i++){
+		if(thpool_take(&pool->queues[(id + i) % pool->nthreads], 1, out))
+			return 1;
+	}
+	return 0;
+}
+
+static void thpool_run(struct thpool *pool, struct thpool_task *t){
+	pthread_mutex_lock(&pool->lock);
+	pool->queued--;
+	pthread_mutex_unlock(&pool->lock);
+
+	t->task(t->arg);
+
+	pthread_mutex_lock(&pool->lock);
+	if(--pool->pending == 0)
+		pthread_cond_broadcast(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *thpool_pool_thread(void *param){
+	struct thpool_member *self = (struct thpool_member *)param;
+	struct thpool *pool = self->pool;
+	struct thpool_task t;
+
+	thpool_self = pool;
+	thpool_self_id = self->id;
+
+	while(1){
+		if(thpool_next_task(pool, self->id, &t)){
+			thpool_run(pool, &t);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while(pool->queued == 0 && !pool->quit)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if(pool->queued == 0 && pool->quit){
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Starts a pool of nthreads workers (at least 1)
+ */
+struct thpool *thpool_new(unsigned int nthreads){
+	unsigned int i;
+
+	if(nthreads < 1)
+		nthreads = 1;
+
+	struct thpool *pool = calloc(1, sizeof(*pool));
+	if(pool == NULL)
+		return NULL;
+
+	pool->nthreads = nthreads;
+	pool->queues = calloc(nthreads, sizeof(*pool->queues));
+	pool->threads = calloc(nthreads, sizeof(*pool->threads));
+	pool->workers = calloc(nthreads, sizeof(*pool->workers));
+	if(pool->queues == NULL || pool->threads == NULL || pool->workers == NULL){
+		free(pool->queues);
+		free(pool->threads);
+		free(pool->workers);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->idle_cond, NULL);
+	for(i=0; i<nthreads; i++)
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+	for(i=0; i<nthreads; i++){
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		if(pthread_create(&pool->threads[i], NULL, thpool_pool_thread, &pool->workers[i]) != 0)
+			break;
+		pool->started++;
+	}
+	// tasks queued for a worker that didn't start get stolen by the others
+	if(pool->started == 0){
+		thpool_free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+/*
+ * Queues task(arg). From a worker the task goes on that worker's own deque,
+ * otherwise the deques are filled in turn
+ */
+int thpool_submit(struct thpool *pool, thpool_task_t task, void *arg){
+	unsigned int id;
+
+	pthread_mutex_lock(&pool->lock);
+	if(thpool_self == pool)
+		id = thpool_self_id;
+	else
+		id = pool->next++ % pool->nthreads;
+	pool->queued++;
+	pool->pending++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if(thpool_push(&pool->queues[id], task, arg) < 0){
+		pthread_mutex_lock(&pool->lock);
+		pool->queued--;
+		if(--pool->pending == 0)
+			pthread_cond_broadcast(&pool->idle_cond);
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/*
+ * Waits until every submitted task, including the ones they submitted, has completed
+ * Must not be called from a task
+ */
+void thpool_wait(struct thpool *pool){
+	pthread_mutex_lock(&pool->lock);
+	while(pool->pending > 0)
+		pthread_cond_wait(&pool->idle_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * For a task waiting on other tasks of its pool: runs one queued task on the
+ * calling worker rather than leaving it blocked
+ * Returns 0 if nothing was queued, or if the caller isn't a worker of the pool
+ */
+int thpool_help(struct thpool *pool){
+	struct thpool_task t;
+
+	if(pool == NULL || thpool_self != pool)
+		return 0;
+	if(!thpool_next_task(pool, thpool_self_id, &t))
+		return 0;
+	thpool_run(pool, &t);
+	return 1;
+}
+
+/*
+ * Runs the remaining tasks, then stops the workers and frees the pool
+ */
+void thpool_free(struct thpool *pool){
+	unsigned int i;
+
+	if(pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(i=0; i<pool->started; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	for(i=0; i<pool->nthreads; i++){
+		pthread_mutex_destroy(&pool->queues[i].lock);
+		free(pool->queues[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->idle_cond);
+	free(pool->queues);
+	free(pool->threads);
+	free(pool->workers);
+	free(pool);
+}
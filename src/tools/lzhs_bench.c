@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "mfile.h"
+#include "lzhs/lzhs.h"
+
+#define NBLOOPS 5
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double mbps(size_t bytes, double secs) {
+	return (secs > 0) ? bytes / secs / (1024 * 1024) : 0;
+}
+
+/*
+ * Times the ring buffer LZSS decoder against the output-window one over the
+ * LZSS stream of an LZHS file, plus the whole fused decode for reference
+ * Returns 0 if both decoders agree
+ */
+static int bench_lzhs(const char *filename) {
+	MFILE *file = mopen(filename, O_RDONLY);
+	if (file == NULL) {
+		printf("Can't open file %s\n", filename);
+		return -1;
+	}
+
+	struct lzhs_header *header = mdata(file, struct lzhs_header);
+	if (msize(file) < sizeof(*header) || !_is_lzhs_mem(header)) {
+		printf("%s is not an LZHS file\n", filename);
+		mclose(file);
+		return -1;
+	}
+
+	size_t out_size = header->uncompressedSize;
+	// worst case, one flag byte per 8 literals
+	size_t lzs_cap = out_size + out_size / 8 + 16;
+	uint8_t *lzs = calloc(1, lzs_cap);
+	uint8_t *ring_out = calloc(1, out_size + 1);
+	uint8_t *flat_out = calloc(1, out_size + 1);
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	int result = -1;
+
+	cursor_t in = {
+		.ptr = (uint8_t *)header + sizeof(*header),
+		.size = msize(file) - sizeof(*header),
+		.offset = 0
+	};
+	if (in.size > header->compressedSize)
+		in.size = header->compressedSize;
+
+	cursor_t lzs_cur = {
+		.ptr = lzs,
+		.size = lzs_cap,
+		.offset = 0
+	};
+	unhuff(&in, &lzs_cur);
+	size_t lzs_size = lzs_cur.offset;
+
+	printf("%s: %zu bytes, LZSS stream %zu bytes\n", filename, out_size, lzs_size);
+
+	double best_ring = 0, best_flat = 0, best_fused = 0;
+	size_t ring_len = 0, flat_len = 0;
+	uint8_t checksum = 0;
+	int i;
+	for (i = 0; i < NBLOOPS; i++) {
+		cursor_t src = { .ptr = lzs, .size = lzs_size, .offset = 0 };
+		cursor_t dst = { .ptr = ring_out, .size = out_size, .offset = 0 };
+		double t = now();
+		unlzss_ctx(ctx, &src, &dst);
+		t = now() - t;
+		ring_len = dst.offset;
+		if (i == 0 || t < best_ring)
+			best_ring = t;
+
+		src.offset = 0;
+		dst.ptr = flat_out;
+		dst.offset = 0;
+		t = now();
+		flat_len = unlzss_mem(&src, &dst);
+		t = now() - t;
+		if (i == 0 || t < best_flat)
+			best_flat = t;
+
+		t = now();
+		lzhs_decode_mem(ctx, header, msize(file), flat_out, &checksum);
+		t = now() - t;
+		if (i == 0 || t < best_fused)
+			best_fused = t;
+	}
+
+	// the fused decode above leaves converted output behind, redo the plain one
+	{
+		cursor_t src = { .ptr = lzs, .size = lzs_size, .offset = 0 };
+		cursor_t dst = { .ptr = flat_out, .size = out_size, .offset = 0 };
+		flat_len = unlzss_mem(&src, &dst);
+	}
+
+	printf("  unlzss (ring)     : %8.2f MB/s\n", mbps(ring_len, best_ring));
+	printf("  unlzss_mem (flat) : %8.2f MB/s (x%.2f)\n", mbps(flat_len, best_flat), (best_flat > 0) ? best_ring / best_flat : 0);
+	printf("  lzhs_decode_mem   : %8.2f MB/s (Huffman + LZSS + ARM)\n", mbps(out_size, best_fused));
+
+	if (checksum != header->checksum)
+		printf("  WARNING: Checksum mismatch (got 0x%x, expected 0x%x)\n", checksum, header->checksum);
+
+	if (ring_len != flat_len || memcmp(ring_out, flat_out, flat_len) != 0) {
+		printf("  MISMATCH between decoders (%zu vs %zu bytes)\n", ring_len, flat_len);
+	} else {
+		result = 0;
+	}
+
+	lzhs_ctx_free(ctx);
+	free(flat_out);
+	free(ring_out);
+	free(lzs);
+	mclose(file);
+	return result;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s [file.lzhs]...\n", argv[0]);
+		printf("Use 'lzhs_scanner [in] 1' on an MTK boot.pak to get the mtkloader/uboot LZHS files\n");
+		return 1;
+	}
+	int i, ret = 0;
+	for (i = 1; i < argc; i++) {
+		if (bench_lzhs(argv[i]) != 0)
+			ret = 1;
+	}
+	return ret;
+}
@@ -7,86 +7,254 @@
 #include "mfile.h"
 #include "lzhs/lzhs.h"
 #include "mediatek.h"
+#include "thpool.h"
 #include "util.h"
 
-void scan_lzhs(const char *filename, int extract) {
-	int fsize, pos;
-	
-	struct lzhs_header *header = NULL;
+#define SCAN_RANGE_SIZE (1024 * 1024) // bytes scanned per task
+
+enum scan_status {
+	SCAN_VALID = 0,
+	SCAN_BAD_CHECKSUM,
+	SCAN_BAD_SIZE,
+	SCAN_TRUNCATED
+};
+
+static const char *scan_status_str[] = {
+	[SCAN_VALID] = "valid",
+	[SCAN_BAD_CHECKSUM] = "bad_checksum",
+	[SCAN_BAD_SIZE] = "bad_size",
+	[SCAN_TRUNCATED] = "truncated"
+};
+
+struct scan_hit {
+	struct lzhs_header *header;
+	off_t offset;
+	int status;
+	uint8_t checksum; // of the trial decode
+	unsigned int number; // 1-based, in file order
+};
+
+struct scan_range {
+	struct scan_hit *hits;
+	unsigned int count;
+};
+
+struct scan_job {
+	MFILE *file;
+	struct scan_range *ranges;
+	struct scan_hit **extract; // hits to extract, for the second pass
+	struct lzhs_ctx **ctx;
+	uint8_t **scratch; // per thread trial decode buffer
+	size_t *scratch_size;
+	char *dirn, *filen;
+};
+
+/*
+ * Trial decodes a candidate in memory, checking its size and checksum
+ */
+static void scan_check(struct scan_job *job, unsigned int worker, struct scan_hit *hit) {
+	struct lzhs_header *header = hit->header;
+	size_t avail = msize(job->file) - hit->offset;
+
+	if (sizeof(*header) + header->compressedSize > avail) {
+		hit->status = SCAN_TRUNCATED;
+		return;
+	}
+
+	if (job->scratch_size[worker] < header->uncompressedSize) {
+		free(job->scratch[worker]);
+		job->scratch[worker] = malloc(header->uncompressedSize);
+		if (job->scratch[worker] == NULL)
+			err_exit("Cannot allocate %u bytes\n", header->uncompressedSize);
+		job->scratch_size[worker] = header->uncompressedSize;
+	}
+
+	size_t out_size = lzhs_decode_mem(job->ctx[worker], header, avail, job->scratch[worker], &hit->checksum);
+	if (out_size != header->uncompressedSize)
+		hit->status = SCAN_BAD_SIZE;
+	else if (hit->checksum != header->checksum)
+		hit->status = SCAN_BAD_CHECKSUM;
+	else
+		hit->status = SCAN_VALID;
+}
+
+static void scan_range(void *arg, unsigned int worker, unsigned int index) {
+	struct scan_job *job = (struct scan_job *)arg;
+	struct scan_range *range = &job->ranges[index];
+	uint8_t *data = mdata(job->file, uint8_t);
+	off_t off = (off_t)index * SCAN_RANGE_SIZE;
+	off_t end = off + SCAN_RANGE_SIZE;
+
+	for (; off < end && off + sizeof(struct lzhs_header) <= msize(job->file); off += sizeof(struct lzhs_header)) {
+		struct lzhs_header *header = (struct lzhs_header *)&data[off];
+		if (!_is_lzhs_mem(header))
+			continue;
+
+		range->hits = realloc(range->hits, (range->count + 1) * sizeof(*range->hits));
+		struct scan_hit *hit = &range->hits[range->count++];
+		memset(hit, 0x00, sizeof(*hit));
+		hit->header = header;
+		hit->offset = off;
+		scan_check(job, worker, hit);
+	}
+}
+
+/*
+ * Writes a confirmed stream and its decoded contents, straight from the mapped input
+ */
+static void scan_extract(void *arg, unsigned int worker, unsigned int index) {
+	struct scan_job *job = (struct scan_job *)arg;
+	struct scan_hit *hit = job->extract[index];
+	struct lzhs_header *header = hit->header;
 	char *outname, *outdecode;
 
+	asprintf(&outname, "%s/%s_file%u.lzhs", job->dirn, job->filen, hit->number);
+	asprintf(&outdecode, "%s/%s_file%u.unlzhs", job->dirn, job->filen, hit->number);
+	printf("Extracting 0x%08jX to %s\n", (intmax_t)hit->offset, outname);
+
+	MFILE *out = mfopen(outname, "w+");
+	if (out == NULL || mfile_map(out, sizeof(*header) + header->compressedSize) == NULL) {
+		err_exit("Cannot open file %s for writing\n", outname);
+	}
+	memcpy(mdata(out, void), header, sizeof(*header) + header->compressedSize);
+	mclose(out);
+
+	out = mfopen(outdecode, "w+");
+	if (out == NULL || mfile_map(out, header->uncompressedSize) == NULL) {
+		err_exit("Cannot open file %s for writing\n", outdecode);
+	}
+	lzhs_decode_mem(job->ctx[worker], header, msize(job->file) - hit->offset, mdata(out, uint8_t), NULL);
+	mclose(out);
+
+	free(outname);
+	free(outdecode);
+}
+
+/*
+ * Scans a file for LZHS streams on nthreads threads, validating every candidate by decoding it
+ * extract: 0 = scan only, 1 = extract all complete streams, 2 = extract valid streams only
+ * list_path, if not NULL, receives a tab separated list of the candidates
+ */
+void scan_lzhs(const char *filename, int extract, unsigned int nthreads, const char *list_path) {
 	MFILE *file = mopen(filename, O_RDONLY);
 	if (file == NULL) {
 		printf("Can't open file %s\n", filename);
 		exit(1);
 	}
+	if (nthreads < 1)
+		nthreads = 1;
+
+	unsigned int nranges = (msize(file) + SCAN_RANGE_SIZE - 1) / SCAN_RANGE_SIZE;
+	struct scan_job job = {
+		.file = file,
+		.ranges = calloc(nranges, sizeof(struct scan_range)),
+		.extract = NULL,
+		.ctx = calloc(nthreads, sizeof(struct lzhs_ctx *)),
+		.scratch = calloc(nthreads, sizeof(uint8_t *)),
+		.scratch_size = calloc(nthreads, sizeof(size_t)),
+		.dirn = my_dirname(filename),
+		.filen = my_basename(filename)
+	};
+	unsigned int i, j, t;
+	for (t = 0; t < nthreads; t++)
+		job.ctx[t] = lzhs_ctx_new();
+
+	printf("Scanning %s (%jd bytes) on %u threads\n", filename, (intmax_t)msize(file), nthreads);
+	thpool_for(nranges, nthreads, scan_range, &job);
+
+	for (t = 0; t < nthreads; t++)
+		free(job.scratch[t]);
+
+	FILE *list = NULL;
+	if (list_path != NULL) {
+		list = fopen(list_path, "w");
+		if (list == NULL)
+			err_exit("Cannot open file %s for writing\n", list_path);
+		fprintf(list, "# offset\tcompressed\tuncompressed\tchecksum\tstatus\n");
+	}
+
+	unsigned int count = 0, nvalid = 0, nextract = 0;
+	for (i = 0; i < nranges; i++) {
+		for (j = 0; j < job.ranges[i].count; j++) {
+			struct scan_hit *hit = &job.ranges[i].hits[j];
+			struct lzhs_header *header = hit->header;
+			hit->number = ++count;
 
-	int i, count = 0;
-	for (i = 0; i<msize(file); i += sizeof(*header)) {
-		header = (struct lzhs_header *)(mdata(file, uint8_t) + i);
-		if (_is_lzhs_mem(header)) {
-			count++;
-			off_t fileOff = moff(file, header);
 			char *fstring;
-			if(!(fileOff % MTK_LOADER_OFF)){
-				fstring="mtk loader";
-			} else if(!(fileOff % MTK_UBOOT_OFF)){
-				fstring="mtk uboot";
+			if (!(hit->offset % MTK_LOADER_OFF)) {
+				fstring = "mtk loader";
+			} else if (!(hit->offset % MTK_UBOOT_OFF)) {
+				fstring = "mtk uboot";
 			} else {
-				fstring="LZHS header";
+				fstring = "LZHS header";
 			}
 
-			printf("Found possible %-12s at offset @0x%08X (Checksum: 0x%02X, compressedSize: 0x%08X, uncompressedSize: 0x%08X)\n",
-				fstring, fileOff, header->checksum, header->compressedSize, header->uncompressedSize
+			printf("Found possible %-12s at offset @0x%08jX (Checksum: 0x%02X, compressedSize: 0x%08X, uncompressedSize: 0x%08X): %s\n",
+				fstring, (intmax_t)hit->offset, header->checksum, header->compressedSize, header->uncompressedSize,
+				scan_status_str[hit->status]
 			);
-
-			if (extract) {
-				char *dirn = my_dirname(filename);
-				char *filen = my_basename(filename);
-				asprintf(&outname, "%s/%s_file%d.lzhs", dirn, filen, count);
-								
-				printf("Extracting to %s\n", outname);
-				
-				MFILE *out = mfopen(outname, "w+");
-				if (out == NULL) {
-					err_exit("Cannot open file %s for writing\n", outname);
-				}
-				
-				mfile_map(out, sizeof(*header) + header->compressedSize);
-				
-				memcpy(
-					mdata(out, void),
-					(uint8_t *)header,
-					sizeof(*header) + header->compressedSize
+			if (list != NULL) {
+				fprintf(list, "0x%08jX\t%u\t%u\t0x%02X\t%s\n",
+					(intmax_t)hit->offset, header->compressedSize, header->uncompressedSize, header->checksum,
+					scan_status_str[hit->status]
 				);
-				
-				uint8_t out_checksum;
-				asprintf(&outdecode, "%s/%s_file%d.unlzhs", dirn, filen, count);
-				lzhs_decode(out, outdecode, &out_checksum);
-				if(extract == 2 && out_checksum != header->checksum){
-					printf("Checksum Mismatch, Skipping\n");
-					unlink(outname);
-					unlink(outdecode);
-				}
-				printf("\n");
-				
-				mclose(out);
-				free(outname); free(outdecode);
-				free(dirn); free(filen);
+			}
+
+			if (hit->status == SCAN_VALID)
+				nvalid++;
+			if ((extract == 1 && hit->status != SCAN_TRUNCATED) || (extract == 2 && hit->status == SCAN_VALID)) {
+				job.extract = realloc(job.extract, (nextract + 1) * sizeof(*job.extract));
+				job.extract[nextract++] = hit;
 			}
 		}
 	}
+	printf("%u candidates, %u valid\n", count, nvalid);
+	if (list != NULL)
+		fclose(list);
+
+	if (nextract > 0)
+		thpool_for(nextract, nthreads, scan_extract, &job);
+
+	for (t = 0; t < nthreads; t++)
+		lzhs_ctx_free(job.ctx[t]);
+	for (i = 0; i < nranges; i++)
+		free(job.ranges[i].hits);
+	free(job.ranges);
+	free(job.extract);
+	free(job.ctx);
+	free(job.scratch);
+	free(job.scratch_size);
+	free(job.dirn);
+	free(job.filen);
 	mclose(file);
 }
 
 int main(int argc, char *argv[]) {
-	if (argc < 3) {
+	int opt;
+	unsigned int nthreads = thpool_ncpus();
+	const char *list_path = NULL;
+
+	while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			list_path = optarg;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if (argc - optind < 2) {
 		printf("Usage: \n");
-		printf("'%s [in] 0' scan\n", argv[0]);
-		printf("'%s [in] 1' scan and extract\n", argv[0]);
-		printf("'%s [in] 2' scan and extract chunks with valid checksum only\n", argv[0]);
+		printf("'%s [-j threads] [-o list.tsv] [in] 0' scan\n", argv[0]);
+		printf("'%s [-j threads] [-o list.tsv] [in] 1' scan and extract\n", argv[0]);
+		printf("'%s [-j threads] [-o list.tsv] [in] 2' scan and extract chunks with valid checksum only\n", argv[0]);
+		printf("Every candidate is checked by decoding it in memory, -o writes them to a tab separated list\n");
 		return 1;
 	}
-	scan_lzhs(argv[1], atoi(argv[2]));
+	scan_lzhs(argv[optind], atoi(argv[optind + 1]), nthreads, list_path);
 	return 0;
 }
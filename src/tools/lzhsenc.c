@@ -1,12 +1,51 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "lzhs/lzhs.h"
 
+static void usage(const char *name) {
+	printf("Usage: %s [-l level] [-e [-s chunk_size]] [in] [out.lzhs]\n", name);
+	printf("  -l level: %d (fastest) to %d (smallest), default %d\n", LZHS_LEVEL_MIN, LZHS_LEVEL_MAX, LZHS_LEVEL_DEFAULT);
+	printf("            0 uses the original (slow) binary tree encoder\n");
+	printf("  -e      : pack an ext4 image in LZHS chunks, on all cores\n");
+	printf("  -s size : ext4 chunk size, default 0x%x\n", LZHS_EXT4_CHUNK_DEFAULT);
+}
+
 int main(int argc, char *argv[]) {
-	if (argc < 3) {
-		printf("Usage: %s [in] [out.lzhs]\n", argv[0]);
+	int opt, level = LZHS_LEVEL_DEFAULT, ext4 = 0;
+	size_t chunk_size = LZHS_EXT4_CHUNK_DEFAULT;
+
+	while ((opt = getopt(argc, argv, "l:es:")) != -1) {
+		switch (opt) {
+		case 'l':
+			level = atoi(optarg);
+			break;
+		case 'e':
+			ext4 = 1;
+			break;
+		case 's':
+			chunk_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind < 2) {
+		usage(argv[0]);
 		return 1;
 	}
-	printf("LZHS Encoding %s => %s...\n", argv[1], argv[2]);
-	lzhs_encode(argv[1], argv[2]);
-	return 0;
+
+	const char *in = argv[optind], *out = argv[optind + 1];
+	if (ext4) {
+		printf("LZHS Encoding ext4 image %s => %s...\n", in, out);
+		return (lzhs_encode_ext4(in, out, (level > 0) ? level : LZHS_LEVEL_DEFAULT, chunk_size) == 0) ? 0 : 1;
+	}
+
+	printf("LZHS Encoding %s => %s...\n", in, out);
+	if (level == 0) {
+		lzhs_encode(in, out);
+		return 0;
+	}
+	return (lzhs_encode_file(in, out, level) == 0) ? 0 : 1;
 }
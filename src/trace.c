@@ -0,0 +1,325 @@
+/*
+	--trace: spans of the extraction stages, written as a Chrome trace
+	Each thread formats its spans in a buffer of its own, which is appended
+	to the trace file when full, when the thread ends, and before a fork.
+	Forked extractors append to the same file, and add to the same totals
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "trace.h"
+
+#define TRACE_BUF_SIZE (64 * 1024)
+#define TRACE_EVENT_MAX 1024
+
+struct trace_buf {
+	struct trace_buf *next;
+	pthread_mutex_t lock;
+	long tid;
+	size_t used;
+	char data[TRACE_BUF_SIZE];
+};
+
+struct trace_stats {
+	uint64_t spans;
+	uint64_t ns;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+
+static const char *trace_stage_names[TRACE_STAGES] = {
+	[TRACE_PROBE] = "probe",
+	[TRACE_VERIFY] = "verify",
+	[TRACE_DECRYPT] = "decrypt",
+	[TRACE_LZHS] = "lzhs",
+	[TRACE_LZO] = "lzo",
+	[TRACE_LZ4] = "lz4",
+	[TRACE_GZIP] = "gzip",
+	[TRACE_SQUASHFS] = "squashfs",
+	[TRACE_SQUASHFS_INFLATE] = "squashfs inflate",
+	[TRACE_SQUASHFS_WRITE] = "squashfs write",
+	[TRACE_CRAMFS] = "cramfs",
+	[TRACE_JFFS2] = "jffs2",
+	[TRACE_WRITE] = "write",
+};
+
+int trace_enabled = 0;
+static int trace_fd = -1;
+static pid_t trace_owner, trace_pid;
+static struct trace_stats *trace_stats; // shared with the forked processes
+static uint64_t trace_start;
+
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *trace_bufs;
+static __thread struct trace_buf *trace_buf;
+
+static uint64_t trace_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the thread id shown in the trace, elsewhere than Linux a number per thread */
+static long trace_tid(void){
+#ifdef __linux__
+	return syscall(SYS_gettid);
+#else
+	static long trace_tids;
+	return __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/* the trace file is opened with O_APPEND, a buffer is appended in one write */
+static void trace_buf_flush(struct trace_buf *buf){
+	size_t done = 0;
+	while(done < buf->used){
+		ssize_t n = write(trace_fd, buf->data + done, buf->used - done);
+		if(n <= 0)
+			break;
+		done += n;
+	}
+	buf->used = 0;
+}
+
+/* runs when a thread that traced spans ends */
+static void trace_buf_free(void *arg){
+	struct trace_buf *buf = (struct trace_buf *)arg;
+	struct trace_buf **p;
+
+	pthread_mutex_lock(&trace_bufs_lock);
+	for(p = &trace_bufs; *p != NULL; p = &(*p)->next){
+		if(*p == buf){
+			*p = buf->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&trace_bufs_lock);
+
+	pthread_mutex_lock(&buf->lock);
+	trace_buf_flush(buf);
+	pthread_mutex_unlock(&buf->lock);
+	pthread_mutex_destroy(&buf->lock);
+	free(buf);
+}
+
+static struct trace_buf *trace_buf_get(void){
+	if(trace_buf != NULL)
+		return trace_buf;
+
+	struct trace_buf *buf = calloc(1, sizeof(*buf));
+	if(buf == NULL)
+		return NULL;
+	pthread_mutex_init(&buf->lock, NULL);
+	buf->tid = trace_tid();
+
+	pthread_mutex_lock(&trace_bufs_lock);
+	buf->next = trace_bufs;
+	trace_bufs = buf;
+	pthread_mutex_unlock(&trace_bufs_lock);
+
+	pthread_setspecific(trace_key, buf);
+	trace_buf = buf;
+	return buf;
+}
+
+/*
+ * Before a fork, everything buffered is written, so the child doesn't write
+ * it again. The buffers stay locked so that none is copied half written
+ */
+static void trace_fork_prepare(void){
+	struct trace_buf *buf;
+	pthread_mutex_lock(&trace_bufs_lock);
+	for(buf = trace_bufs; buf != NULL; buf = buf->next){
+		pthread_mutex_lock(&buf->lock);
+		trace_buf_flush(buf);
+	}
+}
+
+static void trace_fork_parent(void){
+	struct trace_buf *buf;
+	for(buf = trace_bufs; buf != NULL; buf = buf->next)
+		pthread_mutex_unlock(&buf->lock);
+	pthread_mutex_unlock(&trace_bufs_lock);
+}
+
+static void trace_fork_child(void){
+	trace_fork_parent();
+	trace_pid = getpid();
+#ifdef __linux__
+	// the forking thread has a new id in the child, a numbered one is kept
+	if(trace_buf != NULL)
+		trace_buf->tid = trace_tid();
+#endif
+}
+
+static void trace_atexit(void){
+	if(getpid() == trace_owner)
+		trace_close();
+	else
+		trace_flush();
+}
+
+/*
+ * Starts tracing to file, which is finished by trace_close() at exit
+ */
+int trace_open(const char *file){
+	trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(trace_fd < 0){
+		printf("Cannot open trace file %s (%s)\n", file, strerror(errno));
+		return -1;
+	}
+	trace_stats = mmap(NULL, sizeof(struct trace_stats) * TRACE_STAGES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(trace_stats == MAP_FAILED){
+		close(trace_fd);
+		trace_fd = -1;
+		return -1;
+	}
+
+	// the JSON array format, the events end with a comma until trace_close() closes the array
+	const char *head = "[\n";
+	if(write(trace_fd, head, strlen(head)) < 0){
+		printf("Cannot write trace file %s (%s)\n", file, strerror(errno));
+	}
+
+	pthread_key_create(&trace_key, trace_buf_free);
+	pthread_atfork(trace_fork_prepare, trace_fork_parent, trace_fork_child);
+	trace_owner = trace_pid = getpid();
+	trace_start = trace_now();
+	trace_enabled = 1;
+	atexit(trace_atexit);
+	return 0;
+}
+
+/*
+ * Writes the spans of all threads of this process
+ */
+void trace_flush(void){
+	struct trace_buf *buf;
+	if(!trace_enabled)
+		return;
+	pthread_mutex_lock(&trace_bufs_lock);
+	for(buf = trace_bufs; buf != NULL; buf = buf->next){
+		pthread_mutex_lock(&buf->lock);
+		trace_buf_flush(buf);
+		pthread_mutex_unlock(&buf->lock);
+	}
+	pthread_mutex_unlock(&trace_bufs_lock);
+}
+
+void trace_span_begin(struct trace_span *span, enum trace_stage stage, const char *name){
+	span->stage = stage;
+	span->name = name;
+	span->start = trace_now();
+}
+
+/* an artifact kept in memory is named after its memfd, "/memfd:NAME (deleted)" */
+static const char *trace_file_name(const char *name, char *link, size_t size){
+	if(strncmp(name, "/proc/self/fd/", 14) != 0)
+		return name;
+	ssize_t len = readlink(name, link, size - 1);
+	if(len < 0)
+		return name;
+	link[len] = '\0';
+	char *deleted = strstr(link, " (deleted)");
+	if(deleted != NULL)
+		*deleted = '\0';
+	return (strncmp(link, "/memfd:", 7) == 0) ? link + 7 : link;
+}
+
+/* copies str into a JSON string, without the quotes */
+static size_t trace_escape(char *out, size_t size, const char *str){
+	size_t len = 0;
+	for(; *str != '\0' && len + 7 < size; str++){
+		unsigned char c = (unsigned char)*str;
+		if(c == '"' || c == '\\'){
+			out[len++] = '\\';
+			out[len++] = c;
+		} else if(c < 0x20){
+			len += sprintf(&out[len], "\\u%04x", c);
+		} else {
+			out[len++] = c;
+		}
+	}
+	out[len] = '\0';
+	return len;
+}
+
+void trace_span_end(struct trace_span *span, uint64_t bytes_in, uint64_t bytes_out){
+	// a span may still end after trace_close(), from the other atexit handlers
+	if(!trace_enabled)
+		return;
+	uint64_t end = trace_now();
+	uint64_t dur = end - span->start;
+	struct trace_stats *stats = &trace_stats[span->stage];
+	const char *stage = trace_stage_names[span->stage];
+
+	__atomic_add_fetch(&stats->spans, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->ns, dur, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->bytes_in, bytes_in, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->bytes_out, bytes_out, __ATOMIC_RELAXED);
+
+	struct trace_buf *buf = trace_buf_get();
+	if(buf == NULL)
+		return;
+
+	char name[TRACE_EVENT_MAX / 2], link[TRACE_EVENT_MAX / 2];
+	trace_escape(name, sizeof(name), (span->name != NULL) ? trace_file_name(span->name, link, sizeof(link)) : stage);
+
+	pthread_mutex_lock(&buf->lock);
+	if(buf->used + TRACE_EVENT_MAX > TRACE_BUF_SIZE)
+		trace_buf_flush(buf);
+	// in microseconds since the start of the run
+	buf->used += snprintf(buf->data + buf->used, TRACE_EVENT_MAX,
+		"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,"
+		"\"args\":{\"bytes_in\":%llu,\"bytes_out\":%llu}},\n",
+		name, stage, (span->start - trace_start) / 1000.0, dur / 1000.0, (int)trace_pid, buf->tid,
+		(unsigned long long)bytes_in, (unsigned long long)bytes_out);
+	pthread_mutex_unlock(&buf->lock);
+}
+
+static double trace_mib(uint64_t bytes){
+	return bytes / (1024.0 * 1024.0);
+}
+
+/*
+ * Finishes the trace file and prints the totals of each stage
+ * The time of a stage is the sum of its spans, over all threads and processes
+ */
+void trace_close(void){
+	int i;
+	if(!trace_enabled || getpid() != trace_owner)
+		return;
+	trace_flush();
+	trace_enabled = 0;
+
+	char tail[128];
+	int len = snprintf(tail, sizeof(tail), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"epk2extract\"}}\n]\n", (int)trace_owner);
+	if(write(trace_fd, tail, len) < 0)
+		printf("Cannot write the trace file (%s)\n", strerror(errno));
+	close(trace_fd);
+	trace_fd = -1;
+
+	printf("\n%-17s %8s %10s %12s %12s %10s %10s\n", "Stage", "Spans", "Seconds", "In MiB", "Out MiB", "In MiB/s", "Out MiB/s");
+	for(i = 0; i < TRACE_STAGES; i++){
+		struct trace_stats *stats = &trace_stats[i];
+		if(stats->spans == 0)
+			continue;
+		double secs = stats->ns / 1e9;
+		printf("%-17s %8llu %10.3f %12.2f %12.2f %10.1f %10.1f\n",
+			trace_stage_names[i], (unsigned long long)stats->spans, secs,
+			trace_mib(stats->bytes_in), trace_mib(stats->bytes_out),
+			(secs > 0) ? trace_mib(stats->bytes_in) / secs : 0,
+			(secs > 0) ? trace_mib(stats->bytes_out) / secs : 0);
+	}
+}
@@ -13,6 +13,8 @@
 #include <inttypes.h>
 #include <libgen.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <setjmp.h>
 
 #include "mfile.h"
 #include "util.h"
@@ -20,9 +22,9 @@
 //partinfo
 #include <time.h>
 #include "partinfo.h"
-char *modelname;
-char *mtdname;
-part_struct_type part_type;
+__thread char *modelname;
+__thread char *mtdname;
+__thread part_struct_type part_type;
 
 //jffs2
 #include "jffs2/jffs2.h"
@@ -178,43 +180,217 @@ int err_ret(const char *format, ...) {
 	return EXIT_FAILURE;
 }
 
+/* The job_catch() frame of this thread, NULL to exit the process */
+static __thread jmp_buf *job_jmp = NULL;
+/* The cleanups of this thread, the latest first */
+static __thread struct job_cleanup *job_cleanups = NULL;
+
+/*
+ * Makes job_exit() on this thread return to jmp (setjmp() != 0 there)
+ * Returns the previous frame, to restore when the job is done
+ */
+jmp_buf *job_catch(jmp_buf *jmp) {
+	jmp_buf *prev = job_jmp;
+	job_jmp = jmp;
+	return prev;
+}
+
+/*
+ * Has run(arg) called if the job gives up before job_pop_cleanup(cleanup)
+ */
+void job_push_cleanup(struct job_cleanup *cleanup, void (*run)(void *arg), void *arg) {
+	cleanup->run = run;
+	cleanup->arg = arg;
+	cleanup->jmp = job_jmp;
+	cleanup->next = job_cleanups;
+	job_cleanups = cleanup;
+}
+
+/*
+ * Removes the latest cleanup, once what it releases is released the normal way
+ */
+void job_pop_cleanup(struct job_cleanup *cleanup) {
+	if (job_cleanups == cleanup)
+		job_cleanups = cleanup->next;
+}
+
+/*
+ * Gives up on the current job. Outside of a job_catch() frame, exits the process:
+ * only the tool itself gets there, the library's jobs and helper threads all
+ * install a frame
+ * The cleanups pushed under the frame run first, the latest first. Memory and
+ * files the job didn't push a cleanup for are not released
+ */
+void job_exit(int status) {
+	// an outer frame runs its own when the job is given up there too
+	while (job_cleanups != NULL && job_cleanups->jmp == job_jmp) {
+		struct job_cleanup *cleanup = job_cleanups;
+		job_cleanups = cleanup->next;
+		cleanup->run(cleanup->arg);
+	}
+	if (job_jmp != NULL)
+		longjmp(*job_jmp, (status != EXIT_SUCCESS) ? status : EXIT_FAILURE);
+	exit(status);
+}
+
 void createFolder(const char *directory) {
 	struct stat st;
 	if (stat(directory, &st) != 0) {
-		if (mkdir((const char *)directory, 0744) != 0){
+		// another input of the batch may have just created it
+		if (mkdir((const char *)directory, 0744) != 0 && errno != EEXIST){
 			err_exit("FATAL: Can't create directory '%s' (%s)\n\n", directory, strerror(errno));
 		}
 	}
 }
 
-MFILE *is_lz4(const char *lz4file) {
-	MFILE *file = mopen(lz4file, O_RDONLY);
-	if (!file){
-		err_exit("Can't open file %s\n\n", lz4file);
+/*
+ * Matches the components of a path against the components of a glob
+ */
+static int path_glob_components(const char *pattern, const char *path) {
+	while (*pattern == '/')
+		pattern++;
+	while (*path == '/')
+		path++;
+	if (*pattern == '\0')
+		return PATH_GLOB_MATCH;
+
+	size_t pattern_len = strcspn(pattern, "/");
+	size_t path_len = strcspn(path, "/");
+	if (pattern_len == 2 && !memcmp(pattern, "**", 2)) {
+		// no directory at all, or one more and try again
+		int result = path_glob_components(pattern + 2, path);
+		if (result != PATH_GLOB_MATCH && *path != '\0') {
+			int deeper = path_glob_components(pattern, path + path_len);
+			if (deeper > result)
+				result = deeper;
+		}
+		return result;
 	}
-	if(!memcmp(mdata(file, uint8_t), "LZ4P", 4))
-		return file;
+	if (*path == '\0')
+		return PATH_GLOB_PARENT;
+
+	char pattern_component[pattern_len + 1], path_component[path_len + 1];
+	memcpy(pattern_component, pattern, pattern_len);
+	pattern_component[pattern_len] = '\0';
+	memcpy(path_component, path, path_len);
+	path_component[path_len] = '\0';
+	if (fnmatch(pattern_component, path_component, FNM_PERIOD) != 0)
+		return PATH_GLOB_NONE;
+	return path_glob_components(pattern + pattern_len, path + path_len);
+}
 
-	mclose(file);
-	return NULL;
+/*
+ * Matches a path against a glob of fnmatch() components, where "**" stands for any number of directories
+ * Returns PATH_GLOB_MATCH if the path, or one of its parents, matches the whole glob,
+ * PATH_GLOB_PARENT if only files below the path can match, PATH_GLOB_NONE otherwise
+ */
+int path_glob_match(const char *pattern, const char *path) {
+	if (pattern == NULL)
+		return PATH_GLOB_MATCH;
+	return path_glob_components(pattern, path);
 }
 
-MFILE *is_nfsb(const char *filename) {
+/*
+ * Checks if name is in a comma separated list
+ * Names longer than the size of the PAK name field match on its first characters,
+ * so "rootfs" also picks an EPK2's "root"
+ */
+static int pak_name_in_list(const char *list, const unsigned char *name, size_t size) {
+	size_t name_len = strnlen((const char *)name, size);
+	while (*list != '\0') {
+		size_t len = strcspn(list, ",");
+		size_t cmp_len = (len > size) ? size : len;
+		if (cmp_len == name_len && !memcmp(list, name, name_len))
+			return 1;
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+	return 0;
+}
+
+/*
+ * Checks the first component of the --extract glob against a PAK name
+ */
+static int pak_name_matches(const char *pattern, const unsigned char *name, size_t size) {
+	size_t len = strcspn(pattern, "/");
+	char component[len + 1], pak_name[size + 1];
+	memcpy(component, pattern, len);
+	component[len] = '\0';
+	memcpy(pak_name, name, size);
+	pak_name[strnlen((const char *)name, size)] = '\0';
+	return !strcmp(component, "**") || fnmatch(component, pak_name, 0) == 0 || pak_name_in_list(component, name, size);
+}
+
+/*
+ * Returns 1 if the PAK is to be extracted according to --only, --skip and --extract
+ */
+int pak_selected(struct config_opts_t *config_opts, const unsigned char *name, size_t size) {
+	if (config_opts->pak_only != NULL && !pak_name_in_list(config_opts->pak_only, name, size))
+		return 0;
+	if (config_opts->pak_skip != NULL && pak_name_in_list(config_opts->pak_skip, name, size))
+		return 0;
+	if (config_opts->extract_path != NULL && !pak_name_matches(config_opts->extract_path, name, size))
+		return 0;
+	return 1;
+}
+
+/*
+ * Gets the --extract glob for the files inside a PAK, NULL for all of them
+ * The first component picked the PAK, unless it's "**"
+ */
+const char *pak_extract_path(const char *pattern) {
+	if (pattern == NULL)
+		return NULL;
+	size_t len = strcspn(pattern, "/");
+	if (len == 2 && !memcmp(pattern, "**", 2))
+		return pattern;
+	pattern += len;
+	while (*pattern == '/')
+		pattern++;
+	return (*pattern != '\0') ? pattern : NULL;
+}
+
+/*
+ * Opens a file for one of the path based probes below
+ */
+static MFILE *probe_open(const char *filename) {
 	MFILE *file = mopen(filename, O_RDONLY);
 	if (!file){
 		err_exit("Can't open file %s\n\n", filename);
 	}
+	return file;
+}
 
+int is_lz4_mem(MFILE *file) {
+	return msize(file) >= 4 && !memcmp(mdata(file, uint8_t), "LZ4P", 4);
+}
+
+MFILE *is_lz4(const char *lz4file) {
+	MFILE *file = probe_open(lz4file);
+	if(is_lz4_mem(file))
+		return file;
+
+	mclose(file);
+	return NULL;
+}
+
+int is_nfsb_mem(MFILE *file) {
 	uint8_t *data = mdata(file, uint8_t);
-	if (
+	return (
+		msize(file) >= 0x1A + 3 &&
 		!memcmp(data, "NFSB", 4) &&
 		(
 			(!memcmp(data + 0xE, "md5", 3)) ||
 			(!memcmp(data + 0x1A, "md5", 3))
 		)
-	){
+	);
+}
+
+MFILE *is_nfsb(const char *filename) {
+	MFILE *file = probe_open(filename);
+	if (is_nfsb_mem(file))
 		return file;
-	}
 
 	mclose(file);
 	return NULL;
@@ -266,55 +442,49 @@ void unnfsb(const char *filename, const char *extractedFile) {
 	close(fdin);
 }
 
+int is_gzip_mem(MFILE *file) {
+	return msize(file) >= 3 && !memcmp(mdata(file, uint8_t), "\x1F\x8B\x08", 3);	//gzip magic check
+}
+
 int is_gzip(const char *filename) {
-	FILE *file = fopen(filename, "rb");
-	if (file == NULL) {
-		err_exit("Can't open file %s\n", filename);
-	}
-	size_t headerSize = 0x3;
-	unsigned char buffer[sizeof(char) * headerSize];
-	int read = fread(buffer, 1, headerSize, file);
-	int result = 0;
-	if (read == headerSize) {
-		result = !memcmp(&buffer[0x0], "\x1F\x8B\x08", 3);	//gzip magic check
-	}
-	fclose(file);
+	MFILE *file = probe_open(filename);
+	int result = is_gzip_mem(file);
+	mclose(file);
 	return result;
 }
 
-int is_jffs2(const char *filename) {
-	FILE *file = fopen(filename, "rb");
-	if (file == NULL) {
-		err_exit("Can't open file %s\n", filename);
-	}
-	size_t headerSize = 0x2;
+int is_jffs2_mem(MFILE *file) {
 	unsigned short magic = JFFS2_MAGIC_BITMASK;
-	unsigned char buffer[headerSize];
-	int read = fread(&buffer, 1, headerSize, file);
-	int result = 0;
-	if (read == headerSize) {
+	uint8_t *buffer = mdata(file, uint8_t);
+	if (msize(file) < 2)
+		return 0;
+	int result = !memcmp(&buffer[0x0], &magic, 2);
+	if (!result) {
+		magic = JFFS2_OLD_MAGIC_BITMASK;
 		result = !memcmp(&buffer[0x0], &magic, 2);
-		if (!result) {
-			magic = JFFS2_OLD_MAGIC_BITMASK;
-			result = !memcmp(&buffer[0x0], &magic, 2);
-		}
 	}
-	fclose(file);
 	return result;
 }
 
+int is_jffs2(const char *filename) {
+	MFILE *file = probe_open(filename);
+	int result = is_jffs2_mem(file);
+	mclose(file);
+	return result;
+}
+
+int isSTRfile_mem(MFILE *file) {
+	uint8_t *buffer = mdata(file, uint8_t);
+	return (
+		msize(file) >= 0xC0 * 4 &&
+		buffer[4] == 0x47 && buffer[0xC0 + 4] == 0x47 && buffer[0xC0 * 2 + 4] == 0x47 && buffer[0xC0 * 3 + 4] == 0x47
+	);
+}
+
 int isSTRfile(const char *filename) {
-	FILE *file = fopen(filename, "rb");
-	if (file == NULL) {
-		err_exit("Can't open file %s\n", filename);
-	}
-	size_t headerSize = 0xC0 * 4;
-	unsigned char buffer[headerSize];
-	int read = fread(&buffer, 1, headerSize, file);
-	int result = 0;
-	if (read == headerSize && buffer[4] == 0x47 && buffer[0xC0 + 4] == 0x47 && buffer[0xC0 * 2 + 4] == 0x47 && buffer[0xC0 * 3 + 4] == 0x47)
-		result = 1;
-	fclose(file);
+	MFILE *file = probe_open(filename);
+	int result = isSTRfile_mem(file);
+	mclose(file);
 	return result;
 }
 
@@ -333,46 +503,51 @@ int isdatetime(char *datetime) {
 	}
 }
 
-/* detect_model - detect model and corresponding part struct */
-part_struct_type detect_model(struct p2_device_info * pid) {
-	part_struct_type retval;
-	char *model;
-	part_type = STRUCT_INVALID;
-	int ismtk1 = !strcmp("mtk3569-emmc", pid->name);  //match mtk2012
-	int ismtk2 = !strcmp("mtk3598-emmc", pid->name);  //match mtk2013
-	int is1152 = !strcmp("l9_emmc", pid->name);       //match 1152
-	int is1154 = !strcmp("h13_emmc", pid->name);      //match 1154/lg1311
-	int isbcm1 = !strcmp("bcm35xx_map0", pid->name);  //match broadcom
-	int isbcm2 = !strcmp("bcm35230_map0", pid->name); //match broadcom
-	int ismstar = !strcmp("mstar_map0", pid->name);   //match mstar
-	int islm14 = !strcmp("mstar-emmc", pid->name);    //match lm14
+/* model_lookup - model and part struct of a device name, leaves the globals alone */
+static part_struct_type model_lookup(const char *name, char **model) {
+	int ismtk1 = !strcmp("mtk3569-emmc", name);  //match mtk2012
+	int ismtk2 = !strcmp("mtk3598-emmc", name);  //match mtk2013
+	int is1152 = !strcmp("l9_emmc", name);       //match 1152
+	int is1154 = !strcmp("h13_emmc", name);      //match 1154/lg1311
+	int isbcm1 = !strcmp("bcm35xx_map0", name);  //match broadcom
+	int isbcm2 = !strcmp("bcm35230_map0", name); //match broadcom
+	int ismstar = !strcmp("mstar_map0", name);   //match mstar
+	int islm14 = !strcmp("mstar-emmc", name);    //match lm14
 
 	if (ismtk1)
-		model = "Mtk 2012 - MTK5369 (Cortex-A9 single-core)";
+		*model = "Mtk 2012 - MTK5369 (Cortex-A9 single-core)";
 	else if (ismtk2)
-		model = "Mtk 2013 - MTK5398 (Cobra Cortex-A9 dual-core)";
+		*model = "Mtk 2013 - MTK5398 (Cobra Cortex-A9 dual-core)";
 	else if (is1152)
-		model = "LG1152 (L9)";
+		*model = "LG1152 (L9)";
 	else if (is1154)
-		model = "LG1154 (H13) / LG1311 (M14)";
+		*model = "LG1154 (H13) / LG1311 (M14)";
 	else if (isbcm1)
-		model = "BCM 2010 - BCM35XX";
+		*model = "BCM 2010 - BCM35XX";
 	else if (isbcm2)
-		model = "BCM 2011 - BCM35230";
+		*model = "BCM 2011 - BCM35230";
 	else if (ismstar)
-		model = "Mstar Saturn6 / Saturn7 / M1 / M1a / LM1";
+		*model = "Mstar Saturn6 / Saturn7 / M1 / M1a / LM1";
 	else if (islm14)
-		model = "Mstar LM14";
+		*model = "Mstar LM14";
 	else
-		return part_type;
+		return STRUCT_INVALID;
 
 	if (ismtk2 || is1154 || islm14) {
-		part_type = STRUCT_PARTINFOv2;
+		return STRUCT_PARTINFOv2;
 	} else if (ismtk1 || is1152) {
-		part_type = STRUCT_PARTINFOv1;	//partinfo v1
+		return STRUCT_PARTINFOv1;	//partinfo v1
 	} else {
-		part_type = STRUCT_MTDINFO;	//mtdinfo
+		return STRUCT_MTDINFO;	//mtdinfo
 	}
+}
+
+/* detect_model - detect model and corresponding part struct */
+part_struct_type detect_model(struct p2_device_info * pid) {
+	char *model;
+	part_type = model_lookup(pid->name, &model);
+	if (part_type == STRUCT_INVALID)
+		return part_type;
 
 	mtdname = pid->name;
 	modelname = model;
@@ -382,15 +557,22 @@ part_struct_type detect_model(struct p2_device_info * pid) {
 	return part_type;
 }
 
-int isPartPakfile(const char *filename) {
-	FILE *file = fopen(filename, "rb");
-	if (file == NULL)
-		err_exit("Can't open file %s\n", filename);
+/*
+ * Probes run concurrently: the header is checked in a local copy,
+ * the model globals are only set by detect_partpak_model
+ */
+int isPartPakfile_mem(MFILE *file) {
+	if (msize(file) < sizeof(struct p2_partmap_info))
+		return 0;
 
 	struct p2_partmap_info partinfo;
+	memcpy(&partinfo, mdata(file, void), sizeof(partinfo));
+	partinfo.dev.name[sizeof(partinfo.dev.name) - 1] = '\0';
 
-	size_t size = sizeof(struct p2_partmap_info);
-	fread(&partinfo, 1, size, file);
+	// the device name is cheaper to check than the date
+	char *model;
+	if (model_lookup(partinfo.dev.name, &model) == STRUCT_INVALID)
+		return 0;
 
 	char *cmagic;
 	asprintf(&cmagic, "%x", partinfo.magic);
@@ -399,55 +581,57 @@ int isPartPakfile(const char *filename) {
 	free(cmagic);
 
 	if (r) {
-		printf("Found valid partpak magic 0x%x in %s\n", partinfo.magic, filename);
-	} else {
-		return 0;
+		printf("Found valid partpak magic 0x%x in %s\n", partinfo.magic, file->path);
 	}
+	return r;
+}
 
-	detect_model(&(partinfo.dev));
-	fclose(file);
-	if (part_type == STRUCT_INVALID)
+/*
+ * Sets the model globals dump_partinfo uses, from a file isPartPakfile_mem accepted
+ * They are per thread, dump_partinfo must run on the same one
+ */
+int detect_partpak_model(MFILE *file) {
+	// copied, detect_model keeps a pointer to the device name
+	static __thread struct p2_partmap_info partinfo;
+	if (msize(file) < sizeof(partinfo))
 		return 0;
-	else
-		return 1;
+	memcpy(&partinfo, mdata(file, void), sizeof(partinfo));
+	partinfo.dev.name[sizeof(partinfo.dev.name) - 1] = '\0';
+	return detect_model(&(partinfo.dev)) != STRUCT_INVALID;
 }
 
-int is_kernel(const char *image_file) {
-	FILE *file = fopen(image_file, "rb");
-	if (file == NULL)
-		err_exit("Can't open file %s", image_file);
+int isPartPakfile(const char *filename) {
+	MFILE *file = probe_open(filename);
+	int result = isPartPakfile_mem(file);
+	mclose(file);
+	return result;
+}
 
-	size_t header_size = sizeof(struct image_header);
-	unsigned char buffer[header_size];
-	int read = fread(&buffer, 1, header_size, file);
-	if (read != header_size)
+int is_kernel_mem(MFILE *file) {
+	if (msize(file) < sizeof(struct image_header))
 		return 0;
-	fclose(file);
-	struct image_header *image_header = (struct image_header *)(&buffer);
-	int result = image_header->ih_magic == ntohl(IH_MAGIC);
+	struct image_header *image_header = mdata(file, struct image_header);
+	return image_header->ih_magic == ntohl(IH_MAGIC);
+}
+
+int is_kernel(const char *image_file) {
+	MFILE *file = probe_open(image_file);
+	int result = is_kernel_mem(file);
+	mclose(file);
 	return result;
 }
 
 void extract_kernel(const char *image_file, const char *destination_file) {
-	FILE *file = fopen(image_file, "rb");
+	MFILE *file = mopen(image_file, O_RDONLY);
 	if (file == NULL)
 		err_exit("Can't open file %s", image_file);
 
-	fseek(file, 0, SEEK_END);
-	int fileLength = ftell(file);
-	rewind(file);
-	unsigned char *buffer = malloc(fileLength);
-	int read = fread(buffer, 1, fileLength, file);
-	if (read != fileLength) {
-		err_exit("Error reading file. read %d bytes from %d.\n", read, fileLength);
-		free(buffer);
-	}
-	fclose(file);
+	size_t header_size = sizeof(struct image_header);
+	if (msize(file) < header_size)
+		err_exit("Error reading file. read %jd bytes from %zu.\n", (intmax_t)msize(file), header_size);
 
-	struct image_header *image_header = (struct image_header *)(&buffer);
 	FILE *out = fopen(destination_file, "wb");
-	int header_size = sizeof(struct image_header);
-	fwrite(buffer + header_size, 1, read - header_size, out);
-	free(buffer);
+	fwrite(mdata(file, uint8_t) + header_size, 1, msize(file) - header_size, out);
 	fclose(out);
+	mclose(file);
 }
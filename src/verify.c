@@ -0,0 +1,670 @@
+/*
+	--verify: integrity checks of every container layer, done in memory
+	without writing anything
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <byteswap.h>
+#include <zlib.h>
+
+#include "mfile.h"
+#include "verify.h"
+#include "thpool.h"
+#include "util.h"
+#include "trace.h"
+#include "epk2.h"
+#include "lzhs/lzhs.h"
+#include "lzo/lzo.h"
+#include "cramfs/cramfs.h"
+#include "jffs2/jffs2.h"
+#include "squashfs/unsquashfs.h"
+#include "squashfs/compressor.h"
+#include "u-boot/image.h"
+
+/* cramfs.h has the original superblock, since version 2 its fsid starts with a CRC32 */
+#define CRAMFS_FLAG_FSID_VERSION_2 0x00000001
+
+struct verify_job {
+	struct thpool *pool;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // signaled whenever layer memory is released
+	size_t pool_size;
+	size_t pool_used;
+	unsigned int nchecks;
+	unsigned int nfailed;
+};
+
+/* A layer queued for checking, its data is released afterwards */
+struct verify_task {
+	struct verify_job *job;
+	char *name;
+	uint8_t *data;
+	size_t size;
+};
+
+static void verify_data(struct verify_job *job, const char *name, uint8_t *data, size_t size, int depth);
+
+struct verify_job *verify_new(unsigned int nthreads, size_t pool_size) {
+	struct verify_job *job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		err_exit("Cannot allocate the verify job\n");
+	job->pool_size = pool_size;
+	if (nthreads > 1)
+		job->pool = thpool_new(nthreads);
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+	return job;
+}
+
+void verify_report(struct verify_job *job, const char *name, int ok, const char *fmt, ...) {
+	char what[256];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(what, sizeof(what), fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(&job->lock);
+	job->nchecks++;
+	if (!ok)
+		job->nfailed++;
+	printf("[%s] %s: %s\n", (ok) ? "OK" : "FAILED", name, what);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void verify_skip(struct verify_job *job, const char *name, const char *why) {
+	pthread_mutex_lock(&job->lock);
+	printf("[--] %s: %s\n", name, why);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Gets memory for a layer, waiting while the pool is used up
+ * A layer larger than the whole pool still goes through, once it's alone
+ */
+uint8_t *verify_alloc(struct verify_job *job, size_t size) {
+	pthread_mutex_lock(&job->lock);
+	while (job->pool_used > 0 && job->pool_used + size > job->pool_size)
+		pthread_cond_wait(&job->cond, &job->lock);
+	job->pool_used += size;
+	pthread_mutex_unlock(&job->lock);
+
+	uint8_t *data = malloc((size > 0) ? size : 1);
+	if (data == NULL)
+		err_exit("Cannot allocate %zu bytes\n", size);
+	return data;
+}
+
+/*
+ * Accounts for memory of a nested layer, without waiting:
+ * the checks must always be able to finish and give their memory back
+ */
+static void verify_charge(struct verify_job *job, size_t size) {
+	pthread_mutex_lock(&job->lock);
+	job->pool_used += size;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/* Releases layer memory, got with verify_alloc or accounted with verify_charge */
+void verify_free(struct verify_job *job, uint8_t *data, size_t size) {
+	free(data);
+	pthread_mutex_lock(&job->lock);
+	job->pool_used -= size;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void verify_nested(struct verify_job *job, const char *name, const char *layer, uint8_t *data, size_t size, int depth) {
+	char *nested;
+	asprintf(&nested, "%s/%s", name, layer);
+	verify_data(job, nested, data, size, depth + 1);
+	free(nested);
+}
+
+static void verify_lzhs(struct verify_job *job, const char *name, uint8_t *data, size_t size, int depth) {
+	struct lzhs_header *header = (struct lzhs_header *)data;
+	if (sizeof(*header) + header->compressedSize > size) {
+		verify_report(job, name, 0, "LZHS stream truncated (%zu of %zu bytes)", size, sizeof(*header) + header->compressedSize);
+		return;
+	}
+
+	verify_charge(job, header->uncompressedSize);
+	uint8_t *out = malloc(header->uncompressedSize);
+	struct lzhs_ctx *ctx = lzhs_ctx_new();
+	if (out == NULL || ctx == NULL)
+		err_exit("Cannot allocate %u bytes\n", header->uncompressedSize);
+	uint8_t checksum = 0;
+	size_t out_size = lzhs_decode_mem(ctx, header, size, out, &checksum);
+	lzhs_ctx_free(ctx);
+
+	int ok = (out_size == header->uncompressedSize && checksum == header->checksum);
+	verify_report(job, name, ok, "LZHS checksum 0x%02X (expected 0x%02X), %zu of %u bytes", checksum, header->checksum, out_size, header->uncompressedSize);
+	if (ok)
+		verify_nested(job, name, "unlzhs", out, out_size, depth);
+	verify_free(job, out, header->uncompressedSize);
+}
+
+static void verify_lzo(struct verify_job *job, const char *name, uint8_t *data, size_t size, int depth) {
+	uint8_t *out = NULL;
+	size_t out_size = 0;
+	int r = lzo_unpack_mem(data, size, &out, &out_size);
+	verify_report(job, name, r == 0, (r == 0) ? "LZO adler32" : "LZO unpacking failed (error %d)", r);
+	if (r != 0)
+		return;
+
+	verify_charge(job, out_size);
+	verify_nested(job, name, "unlzo", out, out_size, depth);
+	verify_free(job, out, out_size);
+}
+
+static void verify_gzip(struct verify_job *job, const char *name, uint8_t *data, size_t size, int depth) {
+	// ISIZE, the unpacked size modulo 4 GiB, is the last field
+	size_t cap = 0;
+	if (size >= 18)
+		cap = data[size - 4] | data[size - 3] << 8 | data[size - 2] << 16 | (uint32_t)data[size - 1] << 24;
+	if (cap == 0)
+		cap = size * 4;
+
+	verify_charge(job, cap);
+	uint8_t *out = malloc(cap);
+	if (out == NULL)
+		err_exit("Cannot allocate %zu bytes\n", cap);
+
+	z_stream zs;
+	memset(&zs, 0x00, sizeof(zs));
+	int ret = inflateInit2(&zs, 16 + MAX_WBITS);
+	zs.next_in = data;
+	zs.avail_in = size;
+	while (ret == Z_OK) {
+		if (zs.total_out == cap) {
+			verify_charge(job, cap);
+			cap *= 2;
+			out = realloc(out, cap);
+			if (out == NULL)
+				err_exit("Cannot allocate %zu bytes\n", cap);
+		}
+		zs.next_out = out + zs.total_out;
+		zs.avail_out = cap - zs.total_out;
+		ret = inflate(&zs, Z_NO_FLUSH);
+	}
+
+	// inflate checks the CRC32 and the size in the trailer
+	int ok = (ret == Z_STREAM_END);
+	verify_report(job, name, ok, "GZIP CRC32%s%s", (ok) ? "" : ": ", (ok) ? "" : ((zs.msg != NULL) ? zs.msg : "truncated"));
+	size_t out_size = zs.total_out;
+	inflateEnd(&zs);
+	if (ok)
+		verify_nested(job, name, "ungzip", out, out_size, depth);
+	verify_free(job, out, cap);
+}
+
+static void verify_uimage(struct verify_job *job, const char *name, uint8_t *data, size_t size, int depth) {
+	image_header_t header;
+	memcpy(&header, data, sizeof(header));
+	uint32_t hcrc = ntohl(header.ih_hcrc);
+	header.ih_hcrc = 0;
+	verify_report(job, name, crc32(0, (Bytef *)&header, sizeof(header)) == hcrc, "uImage header CRC32");
+
+	size_t data_size = ntohl(header.ih_size);
+	if (sizeof(header) + data_size > size) {
+		verify_report(job, name, 0, "uImage data truncated (%zu of %zu bytes)", size - sizeof(header), data_size);
+		return;
+	}
+	int ok = (crc32(0, data + sizeof(header), data_size) == ntohl(header.ih_dcrc));
+	verify_report(job, name, ok, "uImage data CRC32");
+	if (ok)
+		verify_nested(job, name, "uImage", data + sizeof(header), data_size, depth);
+}
+
+static void verify_cramfs(struct verify_job *job, const char *name, uint8_t *data, size_t size, int swapped) {
+	struct cramfs_super *super = (struct cramfs_super *)data;
+	uint32_t flags = (swapped) ? bswap_32(super->flags) : super->flags;
+	uint32_t fs_size = (swapped) ? bswap_32(super->size) : super->size;
+	uint32_t fs_crc;
+	memcpy(&fs_crc, super->fsid, sizeof(fs_crc));
+	if (swapped)
+		fs_crc = bswap_32(fs_crc);
+
+	if (!(flags & CRAMFS_FLAG_FSID_VERSION_2)) {
+		verify_skip(job, name, "CRAMFS version 1, no CRC");
+		return;
+	}
+	if (fs_size > size || fs_size < sizeof(*super)) {
+		verify_report(job, name, 0, "CRAMFS truncated (%zu of %u bytes)", size, fs_size);
+		return;
+	}
+
+	// the CRC is computed with its own field zeroed
+	static const uint8_t zero[sizeof(fs_crc)];
+	size_t crc_off = offsetof(struct cramfs_super, fsid);
+	uLong crc = crc32(0, data, crc_off);
+	crc = crc32(crc, zero, sizeof(zero));
+	crc = crc32(crc, data + crc_off + sizeof(zero), fs_size - crc_off - sizeof(zero));
+	verify_report(job, name, crc == fs_crc, "CRAMFS CRC32");
+}
+
+/* JFFS2 CRCs are the zlib CRC32 without the initial and final inversions */
+static uint32_t jffs2_crc(const void *data, size_t len) {
+	return ~(uint32_t)crc32(0xFFFFFFFF, data, len);
+}
+
+static void verify_jffs2(struct verify_job *job, const char *name, uint8_t *data, size_t size) {
+	unsigned int nnodes = 0, nbad = 0;
+	size_t off = 0;
+	while (off + sizeof(struct jffs2_unknown_node) <= size) {
+		struct jffs2_unknown_node *node = (struct jffs2_unknown_node *)&data[off];
+		if (node->magic != JFFS2_MAGIC_BITMASK && node->magic != JFFS2_OLD_MAGIC_BITMASK) {
+			// padding or erased flash, nodes are 4 byte aligned
+			off += 4;
+			continue;
+		}
+		nnodes++;
+		if (jffs2_crc(node, sizeof(*node) - 4) != node->hdr_crc || node->totlen < sizeof(*node) || off + node->totlen > size) {
+			nbad++;
+			off += 4;
+			continue;
+		}
+
+		if (node->nodetype == JFFS2_NODETYPE_INODE && node->totlen >= sizeof(struct jffs2_raw_inode)) {
+			struct jffs2_raw_inode *inode = (struct jffs2_raw_inode *)node;
+			if (
+				jffs2_crc(inode, sizeof(*inode) - 8) != inode->node_crc ||
+				sizeof(*inode) + inode->csize > node->totlen ||
+				jffs2_crc(&data[off + sizeof(*inode)], inode->csize) != inode->data_crc
+			)
+				nbad++;
+		} else if (node->nodetype == JFFS2_NODETYPE_DIRENT && node->totlen >= sizeof(struct jffs2_raw_dirent)) {
+			struct jffs2_raw_dirent *dirent = (struct jffs2_raw_dirent *)node;
+			if (
+				jffs2_crc(dirent, sizeof(*dirent) - 8) != dirent->node_crc ||
+				sizeof(*dirent) + dirent->nsize > node->totlen ||
+				jffs2_crc(dirent->name, dirent->nsize) != dirent->name_crc
+			)
+				nbad++;
+		}
+		off += (node->totlen + 3) & ~3;
+	}
+	verify_report(job, name, nnodes > 0 && nbad == 0, "JFFS2 node CRCs, %u nodes, %u bad", nnodes, nbad);
+}
+
+/* A SQUASHFS 4.0 image being walked, counting the blocks that don't inflate */
+struct squashfs_check {
+	uint8_t *data;
+	size_t size;
+	struct compressor *comp;
+	unsigned int block_size;
+	uint8_t *scratch; // room for one data block
+	unsigned int nblocks;
+	unsigned int nbad;
+};
+
+/* Counts a block or a table that can't be read at all */
+static void squashfs_check_fail(struct squashfs_check *check) {
+	check->nblocks++;
+	check->nbad++;
+}
+
+/*
+ * Inflates the metadata block at *offset and moves past it,
+ * appending its content to *table if given. Returns 0 if it's bad
+ */
+static int squashfs_check_metadata(struct squashfs_check *check, long long *offset, uint8_t **table, size_t *table_size) {
+	uint16_t header;
+	if (*offset < 0 || *offset + (long long)sizeof(header) > (long long)check->size) {
+		squashfs_check_fail(check);
+		return 0;
+	}
+	memcpy(&header, &check->data[*offset], sizeof(header));
+	int csize = SQUASHFS_COMPRESSED_SIZE(header);
+	uint8_t *src = &check->data[*offset + sizeof(header)];
+	if (csize > SQUASHFS_METADATA_SIZE || *offset + (long long)sizeof(header) + csize > (long long)check->size) {
+		squashfs_check_fail(check);
+		return 0;
+	}
+	*offset += sizeof(header) + csize;
+
+	uint8_t block[SQUASHFS_METADATA_SIZE];
+	int len = csize, error;
+	if (SQUASHFS_COMPRESSED(header))
+		len = compressor_uncompress(check->comp, block, src, csize, sizeof(block), &error);
+	else
+		memcpy(block, src, csize);
+	check->nblocks++;
+	if (len <= 0) {
+		check->nbad++;
+		return 0;
+	}
+
+	if (table != NULL) {
+		uint8_t *grown = realloc(*table, *table_size + len);
+		if (grown == NULL)
+			err_exit("Cannot allocate %zu bytes\n", *table_size + len);
+		memcpy(grown + *table_size, block, len);
+		*table = grown;
+		*table_size += len;
+	}
+	return 1;
+}
+
+/* Inflates the metadata blocks of a table stored from start up to end */
+static void squashfs_check_run(struct squashfs_check *check, long long start, long long end, uint8_t **table, size_t *table_size) {
+	while (start < end && squashfs_check_metadata(check, &start, table, table_size));
+}
+
+/* Inflates the metadata blocks listed by the table index at start */
+static void squashfs_check_index(struct squashfs_check *check, long long start, unsigned int nindex, uint8_t **table, size_t *table_size) {
+	if (start < 0 || start + (long long)(nindex * sizeof(long long)) > (long long)check->size) {
+		squashfs_check_fail(check);
+		return;
+	}
+	for (unsigned int i = 0; i < nindex; i++) {
+		long long block;
+		memcpy(&block, &check->data[start + i * sizeof(block)], sizeof(block));
+		squashfs_check_metadata(check, &block, table, table_size);
+	}
+}
+
+/*
+ * Inflates the data block at offset, described by a block list or fragment entry word.
+ * expected is its unpacked size, 0 for fragment blocks which can be shorter
+ */
+static void squashfs_check_block(struct squashfs_check *check, long long offset, unsigned int word, unsigned int expected) {
+	unsigned int csize = SQUASHFS_COMPRESSED_SIZE_BLOCK(word);
+	check->nblocks++;
+	if (csize > check->block_size || offset < 0 || offset + csize > (long long)check->size) {
+		check->nbad++;
+		return;
+	}
+
+	int len = csize, error;
+	if (SQUASHFS_COMPRESSED_BLOCK(word))
+		len = compressor_uncompress(check->comp, check->scratch, &check->data[offset], csize, check->block_size, &error);
+	if (len <= 0 || (expected != 0 && (unsigned int)len != expected))
+		check->nbad++;
+}
+
+/* Inflates the data blocks of a file, the last one is short unless the tail is in a fragment */
+static void squashfs_check_file(struct squashfs_check *check, long long start, long long file_size, const uint8_t *list, size_t nwords) {
+	long long offset = start;
+	for (size_t i = 0; i < nwords; i++) {
+		unsigned int word;
+		memcpy(&word, &list[i * sizeof(word)], sizeof(word));
+		if (word == 0) // sparse
+			continue;
+		long long left = file_size - (long long)i * check->block_size;
+		squashfs_check_block(check, offset, word, (left < check->block_size) ? left : check->block_size);
+		offset += SQUASHFS_COMPRESSED_SIZE_BLOCK(word);
+	}
+}
+
+/* Walks the unpacked inode table, checking the data blocks of every file */
+static void squashfs_check_inodes(struct squashfs_check *check, const uint8_t *table, size_t table_size, unsigned int ninodes) {
+	size_t off = 0;
+	for (unsigned int i = 0; i < ninodes; i++) {
+		union squashfs_inode_header inode;
+		size_t len;
+		if (off + sizeof(inode.base) > table_size)
+			goto bad;
+		memcpy(&inode.base, &table[off], sizeof(inode.base));
+		switch (inode.base.inode_type) {
+			case SQUASHFS_DIR_TYPE: len = sizeof(inode.dir); break;
+			case SQUASHFS_LDIR_TYPE: len = sizeof(inode.ldir); break;
+			case SQUASHFS_FILE_TYPE: len = sizeof(inode.reg); break;
+			case SQUASHFS_LREG_TYPE: len = sizeof(inode.lreg); break;
+			case SQUASHFS_SYMLINK_TYPE:
+			case SQUASHFS_LSYMLINK_TYPE: len = sizeof(inode.symlink); break;
+			case SQUASHFS_BLKDEV_TYPE:
+			case SQUASHFS_CHRDEV_TYPE: len = sizeof(inode.dev); break;
+			case SQUASHFS_LBLKDEV_TYPE:
+			case SQUASHFS_LCHRDEV_TYPE: len = sizeof(inode.ldev); break;
+			case SQUASHFS_FIFO_TYPE:
+			case SQUASHFS_SOCKET_TYPE: len = sizeof(inode.ipc); break;
+			case SQUASHFS_LFIFO_TYPE:
+			case SQUASHFS_LSOCKET_TYPE: len = sizeof(inode.lipc); break;
+			default: goto bad;
+		}
+		if (off + len > table_size)
+			goto bad;
+		memcpy(&inode, &table[off], len);
+		off += len;
+
+		long long start, file_size;
+		unsigned int fragment;
+		switch (inode.base.inode_type) {
+			case SQUASHFS_LDIR_TYPE:
+				for (unsigned int j = 0; j < inode.ldir.i_count; j++) {
+					struct squashfs_dir_index index;
+					if (off + sizeof(index) > table_size)
+						goto bad;
+					memcpy(&index, &table[off], sizeof(index));
+					off += sizeof(index) + index.size + 1;
+				}
+				continue;
+			case SQUASHFS_SYMLINK_TYPE:
+				off += inode.symlink.symlink_size;
+				continue;
+			case SQUASHFS_LSYMLINK_TYPE:
+				off += inode.symlink.symlink_size + sizeof(unsigned int); // xattr
+				continue;
+			case SQUASHFS_FILE_TYPE:
+				start = inode.reg.start_block;
+				file_size = inode.reg.file_size;
+				fragment = inode.reg.fragment;
+				break;
+			case SQUASHFS_LREG_TYPE:
+				start = inode.lreg.start_block;
+				file_size = inode.lreg.file_size;
+				fragment = inode.lreg.fragment;
+				break;
+			default:
+				continue;
+		}
+
+		size_t nwords = file_size / check->block_size;
+		if (fragment == SQUASHFS_INVALID_FRAG && file_size % check->block_size != 0)
+			nwords++;
+		if (file_size < 0 || nwords > (table_size - off) / sizeof(unsigned int))
+			goto bad;
+		squashfs_check_file(check, start, file_size, &table[off], nwords);
+		off += nwords * sizeof(unsigned int);
+	}
+	return;
+
+bad:
+	// the inode table is unusable from here on
+	squashfs_check_fail(check);
+}
+
+static void verify_squashfs(struct verify_job *job, const char *name, uint8_t *data, size_t size) {
+	struct squashfs_super_block sb;
+	memcpy(&sb, &data[SQUASHFS_START], sizeof(sb));
+	if (sb.s_magic != SQUASHFS_MAGIC || sb.s_major != 4) {
+		verify_skip(job, name, "SQUASHFS before 4.0 or byte swapped, not checked");
+		return;
+	}
+	if (sb.bytes_used > (long long)size) {
+		verify_report(job, name, 0, "SQUASHFS truncated (%zu of %lld bytes)", size, sb.bytes_used);
+		return;
+	}
+	if (sb.block_log > 20 || sb.block_size != 1U << sb.block_log) {
+		verify_report(job, name, 0, "SQUASHFS block size %u is invalid", sb.block_size);
+		return;
+	}
+
+	struct squashfs_check check = {
+		.data = data,
+		.size = sb.bytes_used,
+		.comp = lookup_compressor_id(sb.compression),
+		.block_size = sb.block_size
+	};
+	if (!check.comp->supported) {
+		verify_skip(job, name, "SQUASHFS compressor not built in, not checked");
+		return;
+	}
+
+	/*
+	 * The format has no checksums, so every block is inflated instead.
+	 * The directory table ends where the next table's first block starts
+	 */
+	long long dir_end = sb.bytes_used, first;
+	if (sb.id_table_start >= 0 && sb.id_table_start + (long long)sizeof(first) <= sb.bytes_used) {
+		memcpy(&first, &data[sb.id_table_start], sizeof(first));
+		dir_end = (first < dir_end) ? first : dir_end;
+	}
+	if (sb.fragments > 0 && sb.fragment_table_start >= 0 && sb.fragment_table_start + (long long)sizeof(first) <= sb.bytes_used) {
+		memcpy(&first, &data[sb.fragment_table_start], sizeof(first));
+		dir_end = (first < dir_end) ? first : dir_end;
+	}
+	if (sb.lookup_table_start >= 0 && sb.lookup_table_start + (long long)sizeof(first) <= sb.bytes_used) {
+		memcpy(&first, &data[sb.lookup_table_start], sizeof(first));
+		dir_end = (first < dir_end) ? first : dir_end;
+	}
+
+	uint8_t *inodes = NULL, *fragments = NULL;
+	size_t inodes_size = 0, fragments_size = 0;
+	squashfs_check_run(&check, sb.inode_table_start, sb.directory_table_start, &inodes, &inodes_size);
+	squashfs_check_run(&check, sb.directory_table_start, dir_end, NULL, NULL);
+	squashfs_check_index(&check, sb.id_table_start, SQUASHFS_ID_BLOCKS(sb.no_ids), NULL, NULL);
+	if (sb.fragments > 0)
+		squashfs_check_index(&check, sb.fragment_table_start, SQUASHFS_FRAGMENT_INDEXES(sb.fragments), &fragments, &fragments_size);
+	if (sb.lookup_table_start != SQUASHFS_INVALID_BLK)
+		squashfs_check_index(&check, sb.lookup_table_start, SQUASHFS_LOOKUP_BLOCKS(sb.inodes), NULL, NULL);
+
+	check.scratch = malloc(check.block_size);
+	if (check.scratch == NULL)
+		err_exit("Cannot allocate %u bytes\n", check.block_size);
+	squashfs_check_inodes(&check, inodes, inodes_size, sb.inodes);
+	for (size_t i = 0; i + sizeof(struct squashfs_fragment_entry) <= fragments_size; i += sizeof(struct squashfs_fragment_entry)) {
+		struct squashfs_fragment_entry entry;
+		memcpy(&entry, &fragments[i], sizeof(entry));
+		squashfs_check_block(&check, entry.start_block, entry.size, 0);
+	}
+	free(check.scratch);
+	free(fragments);
+	free(inodes);
+
+	verify_report(job, name, check.nbad == 0, "SQUASHFS blocks inflate, %u blocks, %u bad (xattrs not checked)", check.nblocks, check.nbad);
+}
+
+/*
+ * An MFILE over a buffer, for the *_mem probes. Never mclose'd
+ */
+static void verify_mfile(MFILE *mf, uint8_t *data, size_t size) {
+	memset(mf, 0x00, sizeof(*mf));
+	mf->fd = -1;
+	mf->pMem = data;
+	mf->statBuf.st_size = size;
+}
+
+/*
+ * Identifies a layer with the extraction probes, checks it and
+ * the layers unpacked from it, in memory
+ */
+static void verify_data(struct verify_job *job, const char *name, uint8_t *data, size_t size, int depth) {
+	if (depth > VERIFY_MAX_DEPTH) {
+		verify_skip(job, name, "nested too deep, not checked");
+		return;
+	}
+
+	MFILE mf;
+	verify_mfile(&mf, data, size);
+	if (check_lzo_header_mem(&mf))
+		verify_lzo(job, name, data, size, depth);
+	else if (is_squashfs_mem(&mf))
+		verify_squashfs(job, name, data, size);
+	else if (is_gzip_mem(&mf))
+		verify_gzip(job, name, data, size, depth);
+	else if (is_cramfs_image_mem(&mf, "be"))
+		verify_cramfs(job, name, data, size, 1);
+	else if (is_cramfs_image_mem(&mf, "le"))
+		verify_cramfs(job, name, data, size, 0);
+	else if (is_kernel_mem(&mf))
+		verify_uimage(job, name, data, size, depth);
+	else if (is_jffs2_mem(&mf))
+		verify_jffs2(job, name, data, size);
+	else if (is_lzhs_mem(&mf, 0))
+		verify_lzhs(job, name, data, size, depth);
+	else
+		verify_skip(job, name, "no integrity data known for this content");
+}
+
+/*
+ * Checks a queued layer. If the check gives up (err_exit()), it counts as
+ * failed, on the pool thread as well as in place
+ */
+static void verify_task_run(void *arg) {
+	struct verify_task *task = (struct verify_task *)arg;
+	struct trace_span span;
+	jmp_buf jmp;
+	jmp_buf *prev = job_catch(&jmp);
+	trace_begin(&span, TRACE_VERIFY, task->name);
+	if (setjmp(jmp) == 0)
+		verify_data(task->job, task->name, task->data, task->size, 0);
+	else
+		verify_report(task->job, task->name, 0, "check gave up");
+	job_catch(prev);
+	trace_end(&span, task->size, 0);
+	verify_free(task->job, task->data, task->size);
+	free(task->name);
+	free(task);
+}
+
+/*
+ * Queues the checks of a layer got with verify_alloc, which is released when they're done
+ */
+void verify_submit(struct verify_job *job, const char *name, uint8_t *data, size_t size) {
+	struct verify_task *task = calloc(1, sizeof(*task));
+	if (task == NULL)
+		err_exit("Cannot allocate a verify task\n");
+	task->job = job;
+	task->name = strdup(name);
+	task->data = data;
+	task->size = size;
+	if (job->pool == NULL || thpool_submit(job->pool, verify_task_run, task) < 0)
+		verify_task_run(task);
+}
+
+/*
+ * Verifies a file: EPK2 and EPK3 through their extractors, which hand
+ * their PAKs over instead of writing them, anything else as one layer
+ */
+int verify_file(const char *path, struct config_opts_t *config_opts) {
+	MFILE *mf = mopen(path, O_RDONLY);
+	if (mf == NULL)
+		err_exit("Can't open file %s\n\n", path);
+
+	if (isFileEPK2_mem(mf)) {
+		mclose(mf);
+		extractEPK2file(path, config_opts);
+	} else if (isFileEPK3_mem(mf)) {
+		mclose(mf);
+		extractEPK3file(path, config_opts);
+	} else {
+		char *name = my_basename(path);
+		verify_data(config_opts->verify, name, mdata(mf, uint8_t), msize(mf), 0);
+		free(name);
+		mclose(mf);
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Waits for the queued checks, prints the summary
+ * Returns the number of failed checks
+ */
+unsigned int verify_finish(struct verify_job *job) {
+	if (job->pool != NULL) {
+		thpool_wait(job->pool);
+		thpool_free(job->pool);
+	}
+	unsigned int nfailed = job->nfailed;
+	printf("\nVerify: %u checks, %u failed\n", job->nchecks, nfailed);
+	pthread_cond_destroy(&job->cond);
+	pthread_mutex_destroy(&job->lock);
+	free(job);
+	return nfailed;
+}